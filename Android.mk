@@ -16,7 +16,7 @@
 
 ifeq ($(BOARD_USES_QCOM_HARDWARE),true)
 
-common_msm_dirs := liblights librpc dspcrashd
+common_msm_dirs := liblights libhaltrace librpc dspcrashd
 msm7k_dirs := $(common_msm_dirs) boot
 qsd8k_dirs := $(common_msm_dirs) libstagefrighthw
 msm7x30_dirs := $(common_msm_dirs) libcamera-msm7x30
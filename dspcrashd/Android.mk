@@ -5,7 +5,9 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES:= dspcrashd.c
 LOCAL_MODULE:= dspcrashd
 
-LOCAL_SHARED_LIBRARIES := libc libcutils
+LOCAL_C_INCLUDES := external/zlib
+
+LOCAL_SHARED_LIBRARIES := libc libcutils libz
 
 LOCAL_MODULE_TAGS := debug
 
@@ -27,17 +27,72 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <time.h>
+#include <dirent.h>
 #include <sys/klog.h>
+#include <sys/stat.h>
 
 #include <cutils/properties.h>
 
+#include <zlib.h>
+
 #define KLOG_BUF_SHIFT	17	/* CONFIG_LOG_BUF_SHIFT from our kernel */
 #define KLOG_BUF_LEN	(1 << KLOG_BUF_SHIFT)
 
+/*
+ * The DSP is held until the dump is on the card, so reading it from
+ * /dev/dsp_debug and compressing it to the card run on separate
+ * threads, connected by a fixed set of chunks.
+ */
+#define CHUNK_SIZE	(128 * 1024)
+#define CHUNK_COUNT	8
+#define OUT_BUF_SIZE	(256 * 1024)
+#define OUT_BUF_ALIGN	4096
+
+/*
+ * Dumps kept on the card, oldest deleted first. Once there are as many
+ * as allowed, the oldest file is renamed and overwritten in place, so a
+ * new dump mostly reuses clusters the card already allocated for it.
+ */
+#define DUMP_DIR		"/sdcard"
+#define DUMP_PREFIX		"dsp.crash."
+#define DEFAULT_MAX_DUMPS	"4"
+#define DEFAULT_MAX_KB		"65536"
+#define MAX_DUMPS_LIMIT		64
+
+struct dump_file {
+    char name[128];
+    off_t size;
+    time_t mtime;
+};
+
+struct chunk {
+    struct chunk *next;
+    size_t len;
+    char data[CHUNK_SIZE];
+};
+
+struct dump_stream {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct chunk *free;
+    struct chunk *head;     /* filled, waiting for the compressor */
+    struct chunk *tail;
+    struct chunk *cur;      /* being filled by the reader */
+    int done;
+    int fd;
+    int error;
+    off_t written;
+    unsigned char *out;
+    struct chunk chunks[CHUNK_COUNT];
+};
+
 char *props[] = {
     "ro.product.name",
     "ro.build.id",
@@ -49,81 +104,395 @@ char *props[] = {
 
 char *dashes = "---- ---- ---- ---- ---- ---- ---- ---- ---- ----\n";
 
-void dump_dmesg(int fd)
+static int write_all(int fd, const void *buf, size_t len)
 {
-    char buffer[KLOG_BUF_LEN + 1];
-    char *p = buffer;
+    const char *p = buf;
     ssize_t ret;
-    int n, op;
-
-    n = klogctl(KLOG_READ_ALL, buffer, KLOG_BUF_LEN);
-    if (n < 0)
-        return;
-    buffer[n] = '\0';
 
-    while((ret = write(fd, p, n))) {
+    while (len > 0) {
+        ret = write(fd, p, len);
         if (ret < 0) {
             if (errno == EINTR)
                 continue;
-            return;
+            return -1;
         }
         p += ret;
-        n -= ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int out_write(struct dump_stream *s, size_t len)
+{
+    if (write_all(s->fd, s->out, len) < 0)
+        return -1;
+    s->written += len;
+    return 0;
+}
+
+static struct chunk *get_chunk(struct dump_stream *s)
+{
+    struct chunk *c;
+
+    pthread_mutex_lock(&s->lock);
+    while (s->free == NULL)
+        pthread_cond_wait(&s->cond, &s->lock);
+    c = s->free;
+    s->free = c->next;
+    pthread_mutex_unlock(&s->lock);
+
+    c->next = NULL;
+    c->len = 0;
+    return c;
+}
+
+static void put_chunk(struct dump_stream *s, struct chunk *c)
+{
+    pthread_mutex_lock(&s->lock);
+    if (s->tail)
+        s->tail->next = c;
+    else
+        s->head = c;
+    s->tail = c;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void stream_flush(struct dump_stream *s)
+{
+    if (s->cur && s->cur->len) {
+        put_chunk(s, s->cur);
+        s->cur = NULL;
+    }
+}
+
+static void stream_write(struct dump_stream *s, const void *buf, size_t len)
+{
+    const char *p = buf;
+    size_t n;
+
+    while (len > 0) {
+        if (s->cur == NULL)
+            s->cur = get_chunk(s);
+        n = CHUNK_SIZE - s->cur->len;
+        if (n > len)
+            n = len;
+        memcpy(s->cur->data + s->cur->len, p, n);
+        s->cur->len += n;
+        p += n;
+        len -= n;
+        if (s->cur->len == CHUNK_SIZE)
+            stream_flush(s);
     }
+}
+
+/* compress what's in z, writing out whole buffers as they fill */
+static int deflate_out(struct dump_stream *s, z_stream *z, int flush)
+{
+    int ret;
+
+    do {
+        ret = deflate(z, flush);
+        if (ret == Z_STREAM_ERROR)
+            return -1;
+        if (z->avail_out == 0) {
+            if (out_write(s, OUT_BUF_SIZE) < 0)
+                return -1;
+            z->next_out = s->out;
+            z->avail_out = OUT_BUF_SIZE;
+        }
+    } while (z->avail_in > 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
 
     return 0;
 }
 
-void dump_info(int fd)
+static void *compress_thread(void *arg)
+{
+    struct dump_stream *s = arg;
+    struct chunk *c;
+    z_stream z;
+
+    memset(&z, 0, sizeof(z));
+    /* gzip wrapper, fastest level: the card is the bottleneck */
+    if (deflateInit2(&z, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        s->error = 1;
+    z.next_out = s->out;
+    z.avail_out = OUT_BUF_SIZE;
+
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (s->head == NULL && !s->done)
+            pthread_cond_wait(&s->cond, &s->lock);
+        c = s->head;
+        if (c) {
+            s->head = c->next;
+            if (s->head == NULL)
+                s->tail = NULL;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        if (c == NULL)
+            break;
+
+        /* keep taking chunks after an error so the reader isn't stuck */
+        if (!s->error) {
+            z.next_in = (Bytef *) c->data;
+            z.avail_in = c->len;
+            if (deflate_out(s, &z, Z_NO_FLUSH) < 0)
+                s->error = 1;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        c->next = s->free;
+        s->free = c;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    if (!s->error) {
+        z.next_in = NULL;
+        z.avail_in = 0;
+        if (deflate_out(s, &z, Z_FINISH) < 0 ||
+            out_write(s, OUT_BUF_SIZE - z.avail_out) < 0 ||
+            ftruncate(s->fd, s->written) < 0 ||
+            fdatasync(s->fd) < 0)
+            s->error = 1;
+    }
+    deflateEnd(&z);
+
+    return NULL;
+}
+
+void dump_dmesg(struct dump_stream *s)
+{
+    char buffer[KLOG_BUF_LEN + 1];
+    int n;
+
+    n = klogctl(KLOG_READ_ALL, buffer, KLOG_BUF_LEN);
+    if (n < 0)
+        return;
+
+    stream_write(s, buffer, n);
+}
+
+void dump_info(struct dump_stream *s)
 {
     char buf[4096];
     char val[PROPERTY_VALUE_MAX];
     char **p = props;
 
-    write(fd, dashes, strlen(dashes));
+    stream_write(s, dashes, strlen(dashes));
     while (*p) {
         property_get(*p,val,"");
         sprintf(buf,"%s: %s\n", *p, val);
-        write(fd, buf, strlen(buf));
+        stream_write(s, buf, strlen(buf));
         p++;
     }
-    write(fd, dashes, strlen(dashes));
-    dump_dmesg(fd);
-    write(fd, dashes, strlen(dashes));    
+    stream_write(s, dashes, strlen(dashes));
+    dump_dmesg(s);
+    stream_write(s, dashes, strlen(dashes));
+}
+
+static int compare_dumps(const void *a, const void *b)
+{
+    const struct dump_file *x = a, *y = b;
+
+    if (x->mtime != y->mtime)
+        return x->mtime < y->mtime ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+/*
+ * Fill files with the oldest max dumps on the card, oldest first. Every
+ * dump is looked at, however many there are. Returns how many there are
+ * in all, and their total size in *total if it is not NULL.
+ */
+static int find_dumps(struct dump_file *files, int max, off_t *total)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    struct dump_file f;
+    char path[256];
+    int n = 0, kept = 0, i;
+
+    if (total)
+        *total = 0;
+    d = opendir(DUMP_DIR);
+    if (d == NULL)
+        return 0;
+    while ((de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, DUMP_PREFIX, strlen(DUMP_PREFIX)) ||
+            strlen(de->d_name) >= sizeof(f.name))
+            continue;
+        snprintf(path, sizeof(path), DUMP_DIR "/%s", de->d_name);
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        strcpy(f.name, de->d_name);
+        f.size = st.st_size;
+        f.mtime = st.st_mtime;
+        n++;
+        if (total)
+            *total += f.size;
+
+        /* insert in order, dropping the newest once files is full */
+        if (kept == max) {
+            if (compare_dumps(&f, &files[kept - 1]) >= 0)
+                continue;
+            kept--;
+        }
+        for (i = kept; i > 0 && compare_dumps(&f, &files[i - 1]) < 0; i--)
+            files[i] = files[i - 1];
+        files[i] = f;
+        kept++;
+    }
+    closedir(d);
+    return n;
+}
+
+static int get_int_property(const char *key, const char *def)
+{
+    char val[PROPERTY_VALUE_MAX];
+
+    property_get(key, val, def);
+    return atoi(val);
+}
+
+/*
+ * Delete dumps, oldest first, until at most max_dumps are left and they
+ * fit in max_kb. The newest dump is always kept.
+ */
+static void trim_dumps(int max_dumps, int max_kb)
+{
+    struct dump_file files[MAX_DUMPS_LIMIT];
+    char path[256];
+    off_t total;
+    int n, kept, i;
+
+    /* files only holds the oldest MAX_DUMPS_LIMIT, look again if all of
+       them had to go */
+    do {
+        n = find_dumps(files, MAX_DUMPS_LIMIT, &total);
+        kept = n < MAX_DUMPS_LIMIT ? n : MAX_DUMPS_LIMIT;
+        for (i = 0; i < kept && n - i > 1; i++) {
+            if (n - i <= max_dumps && total <= (off_t) max_kb * 1024)
+                return;
+            snprintf(path, sizeof(path), DUMP_DIR "/%s", files[i].name);
+            if (unlink(path) < 0)
+                return;
+            total -= files[i].size;
+        }
+    } while (i == kept && n - i > 1);
+}
+
+/*
+ * Open a file for a new dump called name. Reuses the oldest dump if no
+ * more may be added, the caller truncates it to what was written.
+ */
+static int open_dump(const char *name, int max_dumps)
+{
+    struct dump_file oldest;
+    char path[256];
+    int n;
+
+    n = find_dumps(&oldest, 1, NULL);
+    if (n > 0 && n >= max_dumps) {
+        snprintf(path, sizeof(path), DUMP_DIR "/%s", oldest.name);
+        if (rename(path, name) == 0)
+            return open(name, O_WRONLY);
+    }
+    return open(name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
 }
 
 void dump_dsp_state(int dsp)
 {
-    int fd, r;
+    struct dump_stream *s;
+    pthread_t thread;
+    struct chunk *c;
+    int fd, r, i;
+    int max_dumps, max_kb;
     char name[128];
-    char buf[128*1024];
+    char buf[256];
 
-    sprintf(name,"/sdcard/dsp.crash.%d.img", (int) time(0));
+    max_dumps = get_int_property("persist.dspcrashd.max_dumps",
+                                 DEFAULT_MAX_DUMPS);
+    if (max_dumps < 1)
+        max_dumps = 1;
+    if (max_dumps > MAX_DUMPS_LIMIT)
+        max_dumps = MAX_DUMPS_LIMIT;
+    max_kb = get_int_property("persist.dspcrashd.max_kb", DEFAULT_MAX_KB);
 
-    fd = open(name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-    if (fd < 0)
+    sprintf(name, DUMP_DIR "/" DUMP_PREFIX "%d.img.gz", (int) time(0));
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return;
+    s->out = memalign(OUT_BUF_ALIGN, OUT_BUF_SIZE);
+    if (s->out == NULL) {
+        free(s);
         return;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    for (i = 0; i < CHUNK_COUNT; i++) {
+        s->chunks[i].next = s->free;
+        s->free = &s->chunks[i];
+    }
+
+    s->fd = open_dump(name, max_dumps);
+    if (s->fd < 0)
+        goto out;
+
+    if (pthread_create(&thread, NULL, compress_thread, s)) {
+        close(s->fd);
+        goto out;
+    }
 
     for (;;) {
-        r = read(dsp, buf, sizeof(buf));
-        if (r == 0) break;
-        if (r < 0) {
-            if (errno == EINTR)
+        c = get_chunk(s);
+        r = read(dsp, c->data, CHUNK_SIZE);
+        if (r <= 0) {
+            /* hand the unused chunk straight back */
+            pthread_mutex_lock(&s->lock);
+            c->next = s->free;
+            s->free = c;
+            pthread_mutex_unlock(&s->lock);
+            if (r < 0 && errno == EINTR)
                 continue;
             break;
         }
-        write(fd, buf, r);
+        c->len = r;
+        put_chunk(s, c);
     }
 
-    dump_info(fd);
-    close(fd);
+    dump_info(s);
+    stream_flush(s);
+
+    pthread_mutex_lock(&s->lock);
+    s->done = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(thread, NULL);
+
+    close(s->fd);
+
+    trim_dumps(max_dumps, max_kb);
 
     fd = open("/dev/kmsg", O_WRONLY);
     if (fd >= 0) {
-        sprintf(buf,"*** WROTE DSP RAMDUMP TO %s ***\n",name);
+        if (s->error)
+            sprintf(buf,"*** FAILED TO WRITE DSP RAMDUMP TO %s ***\n",name);
+        else
+            sprintf(buf,"*** WROTE DSP RAMDUMP TO %s ***\n",name);
         write(fd, buf, strlen(buf));
         close(fd);
     }
+
+out:
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    free(s->out);
+    free(s);
 }
 
 int main(int argc, char **argv)
@@ -135,12 +504,9 @@ int main(int argc, char **argv)
 
     write(fd, "wait-for-crash", 14);
 
+    /* dump_dsp_state() syncs the dump before returning */
     dump_dsp_state(fd);
 
-    sync();
-    sync();
-    sync();
-
     write(fd, "continue-crash", 14);
     
     close(fd);
@@ -0,0 +1,81 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "AudioHistogram.h"
+
+namespace android {
+
+// ----------------------------------------------------------------------------
+
+static const nsecs_t kFirstBucketNs = 250000;
+
+void AudioHistogram::reset()
+{
+    memset(mBuckets, 0, sizeof(mBuckets));
+    mCount = 0;
+    mTotal = 0;
+    mMax = 0;
+}
+
+void AudioHistogram::record(nsecs_t duration)
+{
+    int bucket = 0;
+    for (nsecs_t limit = kFirstBucketNs; duration >= limit && bucket < NUM_BUCKETS - 1;
+            limit <<= 1) {
+        bucket++;
+    }
+    mBuckets[bucket]++;
+    mCount++;
+    mTotal += duration;
+    if (duration > mMax) {
+        mMax = duration;
+    }
+}
+
+void AudioHistogram::dump(String8& result, const char* name) const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+
+    snprintf(buffer, SIZE, "\t%s: %u, mean %lld us, max %lld us\n", name, mCount,
+            mCount ? (long long)ns2us(mTotal / mCount) : 0LL, (long long)ns2us(mMax));
+    result.append(buffer);
+    if (mCount == 0) {
+        return;
+    }
+    result.append("\t   ");
+    nsecs_t limit = kFirstBucketNs;
+    for (int i = 0; i < NUM_BUCKETS; i++, limit <<= 1) {
+        if (mBuckets[i] == 0) {
+            continue;
+        }
+        if (i == NUM_BUCKETS - 1) {
+            snprintf(buffer, SIZE, " >=%lldus:%u", (long long)ns2us(limit >> 1), mBuckets[i]);
+        } else {
+            snprintf(buffer, SIZE, " <%lldus:%u", (long long)ns2us(limit), mBuckets[i]);
+        }
+        result.append(buffer);
+    }
+    result.append("\n");
+}
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android
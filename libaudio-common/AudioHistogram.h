@@ -0,0 +1,70 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+
+#ifndef ANDROID_AUDIO_HISTOGRAM_H
+#define ANDROID_AUDIO_HISTOGRAM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <utils/String8.h>
+#include <utils/Timers.h>
+
+namespace android {
+
+// ----------------------------------------------------------------------------
+
+// Durations in power-of-two buckets from 250us up, for the HAL dumps.
+// Recorded from one thread at a time; dump() may read it concurrently and
+// see a sample half added, which is harmless for diagnostics.
+class AudioHistogram
+{
+public:
+    enum { NUM_BUCKETS = 12 };  // the last one is everything above 256ms
+
+                        AudioHistogram() { reset(); }
+
+            void        reset();
+            void        record(nsecs_t duration);
+            uint32_t    count() const { return mCount; }
+    // One line with count, mean and max, one with the non-empty buckets.
+            void        dump(String8& result, const char* name) const;
+
+private:
+            uint32_t    mBuckets[NUM_BUCKETS];
+            uint32_t    mCount;
+            nsecs_t     mTotal;
+            nsecs_t     mMax;
+};
+
+// Records the lifetime of its scope, like Mutex::Autolock.
+class AutoHistogram
+{
+public:
+    inline              AutoHistogram(AudioHistogram& histogram) :
+                            mHistogram(histogram), mStart(systemTime()) { }
+    inline              ~AutoHistogram() { mHistogram.record(systemTime() - mStart); }
+private:
+            AudioHistogram& mHistogram;
+            nsecs_t     mStart;
+};
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android
+
+#endif // ANDROID_AUDIO_HISTOGRAM_H
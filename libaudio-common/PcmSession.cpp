@@ -0,0 +1,426 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "PcmSession"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "PcmSession.h"
+
+namespace android {
+
+// ----------------------------------------------------------------------------
+// The part of the msm audio driver interface that is the same on every
+// chipset; the HALs' own headers disagree on the rest.
+
+#define PCM_IOCTL_MAGIC 'a'
+#define PCM_AUDIO_START         _IOW(PCM_IOCTL_MAGIC, 0, unsigned)
+#define PCM_AUDIO_GET_CONFIG    _IOR(PCM_IOCTL_MAGIC, 3, unsigned)
+#define PCM_AUDIO_SET_CONFIG    _IOW(PCM_IOCTL_MAGIC, 4, unsigned)
+#define PCM_AUDIO_GET_STATS     _IOR(PCM_IOCTL_MAGIC, 5, unsigned)
+#define PCM_AUDIO_ADSP_PAUSE    _IOR(PCM_IOCTL_MAGIC, 17, unsigned)
+#define PCM_AUDIO_ADSP_RESUME   _IOR(PCM_IOCTL_MAGIC, 18, unsigned)
+
+#define PCM_CODEC_TYPE_PCM 0
+
+struct pcm_session_config {
+    uint32_t buffer_size;
+    uint32_t buffer_count;
+    uint32_t channel_count;
+    uint32_t sample_rate;
+    uint32_t codec_type;
+    uint32_t unused[3];
+};
+
+// only the byte count is common, qsd8k and 7x30 add a sample count that
+// msm7k lacks
+struct pcm_session_stats {
+    uint32_t byte_count;
+    uint32_t unused[3];
+};
+
+// ----------------------------------------------------------------------------
+
+PcmSession::PcmSession(const Config& config, Starter* starter) :
+    mConfig(config), mOpenConfig(config), mStarter(starter), mFd(-1),
+    mStartCount(0), mWarm(false), mPaused(false), mQueuedUntil(0), mRenderBase(0),
+    mLastRenderFrames(0), mLastRenderTime(0)
+{
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+PcmSession::~PcmSession()
+{
+    if (mStandbyTimer != 0) {
+        {
+            Mutex::Autolock lock(mLock);
+            mStandbyTimer->requestExit();
+            mWarmCond.signal();
+        }
+        mStandbyTimer->requestExitAndWait();
+        mStandbyTimer.clear();
+    }
+    close();
+}
+
+void PcmSession::setConfig(const Config& config)
+{
+    Mutex::Autolock lock(mLock);
+    mConfig = config;
+}
+
+bool PcmSession::isOpen() const
+{
+    Mutex::Autolock lock(mLock);
+    return mFd >= 0 && !mWarm;
+}
+
+bool PcmSession::isWarm() const
+{
+    Mutex::Autolock lock(mLock);
+    return mWarm;
+}
+
+status_t PcmSession::open()
+{
+    Mutex::Autolock lock(mLock);
+    if (mFd >= 0 && !mWarm) {
+        return NO_ERROR;
+    }
+    nsecs_t start = systemTime();
+    if (mWarm) {
+        mWarm = false;
+        mWarmCond.signal();
+        if (!sameDriverConfig(mOpenConfig, mConfig)) {
+            LOGV("config changed during warm standby");
+            closeDriver_l();
+        } else if (mPaused && ioctl(mFd, PCM_AUDIO_ADSP_RESUME, 0) < 0) {
+            LOGW("Cannot resume %s, reopening", mConfig.device);
+            closeDriver_l();
+        } else {
+            mPaused = false;
+            mStats.warmResumes++;
+            if (readRenderedBytes_l(&mRenderBase, NULL) != NO_ERROR) {
+                mRenderBase = 0;
+            }
+            mOpenTime.record(systemTime() - start);
+            return NO_ERROR;
+        }
+    }
+    status_t status = openDriver_l();
+    if (status != NO_ERROR) {
+        closeDriver_l();
+    } else {
+        mOpenTime.record(systemTime() - start);
+    }
+    return status;
+}
+
+status_t PcmSession::openDriver_l()
+{
+    mStats.opens++;
+    LOGV("open %s", mConfig.device);
+    int fd = ::open(mConfig.device, O_RDWR);
+    if (fd < 0) {
+        status_t status = -errno;
+        // at most 10 times, a missing driver would fill the log
+        if (mStats.opens <= 10) {
+            LOGE("Cannot open %s errno: %d", mConfig.device, errno);
+        }
+        return status;
+    }
+    mFd = fd;
+    mOpenConfig = mConfig;
+
+    struct pcm_session_config config;
+    if (ioctl(mFd, PCM_AUDIO_GET_CONFIG, &config) < 0) {
+        LOGE("Cannot read %s config", mConfig.device);
+        return -errno;
+    }
+
+    config.channel_count = mConfig.channelCount;
+    config.sample_rate = mConfig.sampleRate;
+    config.buffer_size = mConfig.bufferSize;
+    config.buffer_count = mConfig.bufferCount;
+    if (mConfig.setCodecType) {
+        config.codec_type = PCM_CODEC_TYPE_PCM;
+    }
+    if (ioctl(mFd, PCM_AUDIO_SET_CONFIG, &config) < 0) {
+        LOGE("Cannot set %s config", mConfig.device);
+        return -errno;
+    }
+
+    LOGV("buffer_size: %u", config.buffer_size);
+    LOGV("buffer_count: %u", config.buffer_count);
+    LOGV("channel_count: %u", config.channel_count);
+    LOGV("sample_rate: %u", config.sample_rate);
+
+    mStartCount = 0;
+    mQueuedUntil = 0;
+    mRenderBase = 0;
+    switch (mConfig.startMode) {
+    case START_ON_OPEN: {
+        status_t status = mStarter ? mStarter->start(mFd) : ioctl(mFd, PCM_AUDIO_START, 0);
+        if (status < 0) {
+            LOGE("Cannot start %s", mConfig.device);
+            return status;
+        }
+        break;
+    }
+    case START_WHEN_PRIMED:
+        mStartCount = mConfig.bufferCount;
+        break;
+    case START_NEVER:
+        break;
+    }
+    return NO_ERROR;
+}
+
+nsecs_t PcmSession::duration(const Config& config, size_t bytes)
+{
+    size_t frameSize = config.channelCount * sizeof(int16_t);
+    if (config.compressed || frameSize == 0 || config.sampleRate == 0) {
+        return 0;
+    }
+    return seconds(bytes / frameSize) / config.sampleRate;
+}
+
+// Whether a driver opened with a can be resumed for b
+bool PcmSession::sameDriverConfig(const Config& a, const Config& b)
+{
+    return strcmp(a.device, b.device) == 0 &&
+            a.sampleRate == b.sampleRate &&
+            a.channelCount == b.channelCount &&
+            a.bufferSize == b.bufferSize &&
+            a.bufferCount == b.bufferCount &&
+            a.setCodecType == b.setCodecType &&
+            a.compressed == b.compressed &&
+            a.startMode == b.startMode;
+}
+
+ssize_t PcmSession::write(const void* buffer, size_t bytes)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(buffer);
+    size_t count = bytes;
+
+    nsecs_t now = systemTime();
+    bool underrun = (!mOpenConfig.compressed && mStartCount == 0 &&
+            mQueuedUntil != 0 && now > mQueuedUntil);
+    if (underrun) {
+        LOGV("underrun, %lld us late", (long long)ns2us(now - mQueuedUntil));
+    }
+
+    uint32_t retries = 0;
+    nsecs_t start = now;
+    while (count) {
+        ssize_t written = ::write(mFd, p, count);
+        if (written >= 0) {
+            count -= written;
+            p += written;
+        } else {
+            if (errno != EAGAIN) {
+                return -errno;
+            }
+            retries++;
+            LOGV("EAGAIN - retry");
+        }
+    }
+    mWriteTime.record(systemTime() - start);
+
+    if (mStartCount) {
+        if (--mStartCount == 0) {
+            status_t status = mStarter ? mStarter->start(mFd) : ioctl(mFd, PCM_AUDIO_START, 0);
+            if (status < 0) {
+                LOGE("Cannot start %s", mOpenConfig.device);
+                return status;
+            }
+        }
+    }
+
+    // the write returns once the data is queued, so the DSP runs dry one
+    // buffer's worth of playback after the later of now and the last deadline
+    if (mStartCount == 0) {
+        now = systemTime();
+        mQueuedUntil = (mQueuedUntil > now ? mQueuedUntil : now) + duration(mOpenConfig, bytes);
+    }
+
+    Mutex::Autolock lock(mLock);
+    mStats.writes++;
+    mStats.bytes += bytes;
+    mStats.retries += retries;
+    if (underrun) {
+        mStats.underruns++;
+    }
+    return bytes;
+}
+
+void PcmSession::standby(bool warm)
+{
+    Mutex::Autolock lock(mLock);
+    if (mFd < 0) {
+        return;
+    }
+    nsecs_t start = systemTime();
+    bool active = !mWarm;
+    if (!warm || mConfig.warmStandbyMs == 0 || mWarm || !enterWarmStandby_l()) {
+        closeDriver_l();
+    }
+    if (active) {
+        mStats.standbys++;
+        mStandbyTime.record(systemTime() - start);
+    }
+}
+
+void PcmSession::close()
+{
+    Mutex::Autolock lock(mLock);
+    closeDriver_l();
+}
+
+// Keeps the session configured and started so that leaving standby costs
+// a single ioctl. Drivers that can't pause simply play out silence until
+// the timer closes them.
+bool PcmSession::enterWarmStandby_l()
+{
+    if (mStandbyTimer == 0) {
+        mStandbyTimer = new StandbyTimer(this);
+        if (mStandbyTimer->run("AudioOutStandby", ANDROID_PRIORITY_BACKGROUND) != NO_ERROR) {
+            LOGE("Cannot start warm standby timer");
+            mStandbyTimer.clear();
+            return false;
+        }
+    }
+    mPaused = (ioctl(mFd, PCM_AUDIO_ADSP_PAUSE, 0) >= 0);
+    mWarm = true;
+    mQueuedUntil = 0;
+    mWarmCond.signal();
+    return true;
+}
+
+void PcmSession::closeDriver_l()
+{
+    if (mFd >= 0) {
+        ::close(mFd);
+        mFd = -1;
+    }
+    mWarm = false;
+    mPaused = false;
+    mStartCount = 0;
+    mQueuedUntil = 0;
+}
+
+bool PcmSession::StandbyTimer::threadLoop()
+{
+    Mutex::Autolock lock(mSession->mLock);
+    while (!mSession->mWarm && !exitPending()) {
+        mSession->mWarmCond.wait(mSession->mLock);
+    }
+    if (exitPending()) {
+        return false;
+    }
+    // any signal means the state changed, so the wait starts over
+    status_t status = mSession->mWarmCond.waitRelative(mSession->mLock,
+            milliseconds(mSession->mOpenConfig.warmStandbyMs));
+    if (status == TIMED_OUT && mSession->mWarm) {
+        LOGD("%s warm standby expired.", mSession->mOpenConfig.device);
+        mSession->closeDriver_l();
+    }
+    return true;
+}
+
+uint32_t PcmSession::latency() const
+{
+    return ns2ms(duration(mConfig, mConfig.bufferCount * mConfig.bufferSize)) +
+            mConfig.extraLatencyMs;
+}
+
+status_t PcmSession::readRenderedBytes_l(uint32_t* bytes, nsecs_t* timestamp)
+{
+    struct pcm_session_stats stats;
+    if (ioctl(mFd, PCM_AUDIO_GET_STATS, &stats) < 0) {
+        return INVALID_OPERATION;
+    }
+    if (timestamp) {
+        *timestamp = systemTime(SYSTEM_TIME_MONOTONIC);
+    }
+    *bytes = stats.byte_count;
+    return NO_ERROR;
+}
+
+status_t PcmSession::getRenderPosition(uint32_t* frames, nsecs_t* timestamp)
+{
+    Mutex::Autolock lock(mLock);
+    if (mFd < 0 || mWarm || mOpenConfig.compressed) {
+        return INVALID_OPERATION;
+    }
+    uint32_t bytes;
+    nsecs_t now;
+    status_t status = readRenderedBytes_l(&bytes, &now);
+    if (status != NO_ERROR) {
+        return status;
+    }
+    // unsigned arithmetic, the driver counter wraps
+    mLastRenderFrames = (bytes - mRenderBase) / (mOpenConfig.channelCount * sizeof(int16_t));
+    mLastRenderTime = now;
+    *frames = mLastRenderFrames;
+    if (timestamp) {
+        *timestamp = now;
+    }
+    return NO_ERROR;
+}
+
+PcmSession::Stats PcmSession::stats() const
+{
+    Mutex::Autolock lock(mLock);
+    return mStats;
+}
+
+void PcmSession::dump(String8& result) const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    Mutex::Autolock lock(mLock);
+
+    snprintf(buffer, SIZE, "\tdevice: %s fd %d%s%s\n", mConfig.device, mFd,
+            mWarm ? " (warm)" : "", mPaused ? " (paused)" : "");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tbuffers: %u x %u bytes, latency %u ms, warm standby %u ms\n",
+            mConfig.bufferCount, (unsigned)mConfig.bufferSize, latency(), mConfig.warmStandbyMs);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\topens: %u, warm resumes: %u, standbys: %u\n",
+            mStats.opens, mStats.warmResumes, mStats.standbys);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\twrites: %u, bytes: %llu, EAGAIN retries: %u, underruns: %u\n",
+            mStats.writes, (unsigned long long)mStats.bytes, mStats.retries, mStats.underruns);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\trender position: %u frames at %lld ms\n",
+            mLastRenderFrames, (long long)ns2ms(mLastRenderTime));
+    result.append(buffer);
+    mWriteTime.dump(result, "write");
+    mOpenTime.dump(result, "standby exit");
+    mStandbyTime.dump(result, "standby enter");
+}
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android
@@ -0,0 +1,168 @@
+/*
+** Copyright 2008, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_AUDIO_PCM_SESSION_H
+#define ANDROID_AUDIO_PCM_SESSION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <utils/threads.h>
+#include <utils/String8.h>
+#include <utils/Timers.h>
+
+#include "AudioHistogram.h"
+
+namespace android {
+
+// ----------------------------------------------------------------------------
+
+// One playback session on an msm PCM DSP device (/dev/msm_pcm_out and
+// friends): open, configure, start, write and standby, shared by the msm7k,
+// qsd8k and 7x30 audio HALs so that work on the write path helps all three.
+// With Config::compressed it drives a tunneled ADSP decoder (/dev/msm_mp3,
+// /dev/msm_aac) the same way, minus everything derived from PCM frames.
+//
+// write() may only be called from one thread at a time. Everything else may
+// be called from any thread.
+class PcmSession
+{
+public:
+    // When AUDIO_START is sent
+    enum StartMode {
+        START_ON_OPEN,      // right after AUDIO_SET_CONFIG
+        START_WHEN_PRIMED,  // once bufferCount buffers have been written
+        START_NEVER         // the driver starts itself on the first write
+    };
+
+    struct Config {
+        const char* device;
+        uint32_t    sampleRate;
+        uint32_t    channelCount;
+        size_t      bufferSize;     // bytes per driver buffer
+        uint32_t    bufferCount;
+        bool        setCodecType;   // send CODEC_TYPE_PCM in AUDIO_SET_CONFIG
+        // encoded data for a DSP decoder: no underrun estimate or render
+        // position, and latency() is extraLatencyMs alone
+        bool        compressed;
+        StartMode   startMode;
+        // 0 closes the driver on standby, otherwise it stays configured
+        // (paused if the driver can) for this long
+        uint32_t    warmStandbyMs;
+        uint32_t    extraLatencyMs; // DSP and hardware latency on top of the buffers
+    };
+
+    // Sends AUDIO_START, for chipsets that pass an ACDB id or set a volume
+    // when starting. Without one, AUDIO_START is sent with a 0 argument.
+    class Starter {
+    public:
+        virtual             ~Starter() {}
+        virtual status_t    start(int fd) = 0;
+    };
+
+    struct Stats {
+        uint32_t    opens;          // driver opens, including failed ones
+        uint32_t    warmResumes;    // standbys left without reopening
+        uint32_t    standbys;
+        uint32_t    writes;
+        uint64_t    bytes;
+        uint32_t    retries;        // EAGAIN from write()
+        // writes that found the DSP queue already drained, estimated from
+        // the time spent between writes
+        uint32_t    underruns;
+    };
+
+                        PcmSession(const Config& config, Starter* starter = NULL);
+                        ~PcmSession();
+
+    // Takes effect the next time the driver is opened.
+            void        setConfig(const Config& config);
+            const Config& config() const { return mConfig; }
+
+    // Resumes a warm session or opens and configures the driver.
+            status_t    open();
+    // Writes all of buffer, retrying on EAGAIN. Returns bytes or a negative
+    // errno; the session is left open either way.
+            ssize_t     write(const void* buffer, size_t bytes);
+    // Warm standby if the config allows it and warm is true, closes otherwise.
+            void        standby(bool warm = true);
+            void        close();
+
+            bool        isOpen() const;
+            bool        isWarm() const;
+    // Only valid while open, or until the caller's next standby(), close()
+    // or the warm standby timer closes the driver.
+            int         fd() const { return mFd; }
+
+    // Milliseconds of audio the driver buffers plus extraLatencyMs.
+            uint32_t    latency() const;
+    // Frames the DSP has played since the session was last opened or
+    // resumed, from the driver's AUDIO_GET_STATS byte counter, and the
+    // CLOCK_MONOTONIC time the counter was read at. INVALID_OPERATION
+    // while closed or if the driver keeps no counter.
+            status_t    getRenderPosition(uint32_t* frames, nsecs_t* timestamp = NULL);
+            Stats       stats() const;
+    // Counters plus histograms of write, open (standby exit) and standby
+    // enter times.
+            void        dump(String8& result) const;
+
+private:
+    // Closes the driver once a warm standby outlives its grace period.
+    class StandbyTimer : public Thread {
+    public:
+                            StandbyTimer(PcmSession* session) :
+                                Thread(false), mSession(session) { }
+    private:
+        virtual bool        threadLoop();
+                PcmSession* mSession;
+    };
+    friend class StandbyTimer;
+
+                        PcmSession(const PcmSession&);
+            PcmSession& operator=(const PcmSession&);
+
+            status_t    openDriver_l();
+            status_t    readRenderedBytes_l(uint32_t* bytes, nsecs_t* timestamp);
+            bool        enterWarmStandby_l();
+            void        closeDriver_l();
+    static  nsecs_t     duration(const Config& config, size_t bytes);
+    static  bool        sameDriverConfig(const Config& a, const Config& b);
+
+    mutable Mutex       mLock;  // guards the fd against the standby timer
+            Condition   mWarmCond;
+            Config      mConfig;
+            Config      mOpenConfig;    // what the driver was opened with
+            Starter*    mStarter;
+            int         mFd;
+            uint32_t    mStartCount;    // buffers left before AUDIO_START
+            bool        mWarm;
+            bool        mPaused;
+            nsecs_t     mQueuedUntil;   // when the DSP runs out of written data
+            uint32_t    mRenderBase;    // driver byte count at the last open or resume
+            uint32_t    mLastRenderFrames;
+            nsecs_t     mLastRenderTime;
+            Stats       mStats;
+            AudioHistogram mWriteTime;   // only touched by the writer and dump
+            AudioHistogram mOpenTime;
+            AudioHistogram mStandbyTime;
+            sp<StandbyTimer> mStandbyTimer;
+};
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android
+
+#endif // ANDROID_AUDIO_PCM_SESSION_H
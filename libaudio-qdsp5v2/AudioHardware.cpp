@@ -32,6 +32,7 @@
 #include <fcntl.h>
 
 #include "AudioHardware.h"
+#include "haltrace.h"
 #include <media/AudioRecord.h>
 
 extern "C" {
@@ -161,16 +162,34 @@ status_t AudioHardware::setMasterVolume(float v)
 
 status_t AudioHardware::dump(int fd, const Vector<String16>& args)
 {
+    haltrace_dumpsys(fd);
     return NO_ERROR;
 }
 
 AudioHardware::AudioStreamOutQ5V2::AudioStreamOutQ5V2() :
-    mHardware(0), mFd(-1), mStartCount(0), mRetryCount(0), mStandby(true),
+    mHardware(0), mStandby(true),
     mDevices(0), mChannels(AUDIO_HW_OUT_CHANNELS), mSampleRate(AUDIO_HW_OUT_SAMPLERATE),
-    mBufferSize(AUDIO_HW_OUT_BUFSZ)
+    mBufferSize(AUDIO_HW_OUT_BUFSZ), mSession(sessionConfig())
 {
 }
 
+PcmSession::Config AudioHardware::AudioStreamOutQ5V2::sessionConfig() const
+{
+    PcmSession::Config config;
+    config.device = "/dev/msm_pcm_out";
+    config.sampleRate = mSampleRate;
+    config.channelCount = AudioSystem::popCount(mChannels);
+    config.bufferSize = mBufferSize;
+    config.bufferCount = AUDIO_HW_NUM_OUT_BUF;
+    config.setCodecType = false;
+    config.compressed = false;
+    // the 7x30 driver starts on the first write, AUDIO_START wants an ACDB id
+    config.startMode = PcmSession::START_NEVER;
+    config.warmStandbyMs = 0;
+    config.extraLatencyMs = AUDIO_HW_OUT_LATENCY_MS;
+    return config;
+}
+
 status_t AudioHardware::AudioStreamOutQ5V2::set(
         AudioHardware* hw, uint32_t devices, int *pFormat, uint32_t *pChannels, uint32_t *pRate)
 {
@@ -203,6 +222,7 @@ status_t AudioHardware::AudioStreamOutQ5V2::set(
     mChannels = lChannels;
     mSampleRate = lRate;
     mBufferSize = 4096;
+    mSession.setConfig(sessionConfig());
 
     return NO_ERROR;
 }
@@ -214,81 +234,26 @@ AudioHardware::AudioStreamOutQ5V2::~AudioStreamOutQ5V2()
 
 ssize_t AudioHardware::AudioStreamOutQ5V2::write(const void* buffer, size_t bytes)
 {
+    HALTRACE_SCOPE_ARGS("audio", "out_write", bytes, 0);
     // LOGD("AudioStreamOutQ5V2::write(%p, %u)", buffer, bytes);
-    status_t status = NO_INIT;
-    size_t count = bytes;
-    const uint8_t* p = static_cast<const uint8_t*>(buffer);
+    ssize_t status;
 
     if (mStandby) {
         LOGV("open pcm_out driver");
-        status = ::open("/dev/msm_pcm_out", O_RDWR);
-        if (status < 0) {
-                LOGE("Cannot open /dev/msm_pcm_out errno: %d", errno);
-            goto Error;
-        }
-        mFd = status;
-
-        // configuration
-        LOGV("get config");
-        struct msm_audio_config config;
-        status = ioctl(mFd, AUDIO_GET_CONFIG, &config);
-        if (status < 0) {
-            LOGE("Cannot read pcm_out config");
-            goto Error;
-        }
-
-        LOGV("set pcm_out config");
-        config.channel_count = AudioSystem::popCount(channels());
-        config.sample_rate = mSampleRate;
-        config.buffer_size = mBufferSize;
-        config.buffer_count = AUDIO_HW_NUM_OUT_BUF;
-//        config.codec_type = CODEC_TYPE_PCM;
-        status = ioctl(mFd, AUDIO_SET_CONFIG, &config);
-        if (status < 0) {
-            LOGE("Cannot set config");
-            goto Error;
-        }
-
-        LOGV("buffer_size: %u", config.buffer_size);
-        LOGV("buffer_count: %u", config.buffer_count);
-        LOGV("channel_count: %u", config.channel_count);
-        LOGV("sample_rate: %u", config.sample_rate);
-
-#if 0
-        status = ioctl(mFd, AUDIO_START, &acdb_id);
-        if (status < 0) {
-            LOGE("Cannot start pcm playback");
-            goto Error;
-        }
-
-        status = ioctl(mFd, AUDIO_SET_VOLUME, &stream_volume);
-        if (status < 0) {
-            LOGE("Cannot start pcm playback");
+        status = mSession.open();
+        if (status != NO_ERROR) {
             goto Error;
         }
-#endif
         mStandby = false;
     }
 
-    while (count) {
-        ssize_t written = ::write(mFd, p, count);
-        if (written >= 0) {
-            count -= written;
-            p += written;
-        } else {
-            if (errno != EAGAIN) return written;
-            mRetryCount++;
-            LOGW("EAGAIN - retry");
-        }
+    status = mSession.write(buffer, bytes);
+    if (status < 0) {
+        LOGE("pcm_out write error %d", (int)status);
     }
-
-    return bytes;
+    return status;
 
 Error:
-    if (mFd >= 0) {
-        ::close(mFd);
-        mFd = -1;
-    }
     // Simulate audio output timing in case of error
     usleep(bytes * 1000000 / frameSize() / sampleRate());
 
@@ -298,9 +263,8 @@ Error:
 status_t AudioHardware::AudioStreamOutQ5V2::standby()
 {
     status_t status = NO_ERROR;
-    if (!mStandby && mFd >= 0) {
-        ::close(mFd);
-        mFd = -1;
+    if (!mStandby) {
+        mSession.standby();
     }
     mStandby = true;
     LOGI("AudioHardware pcm playback is going to standby.");
@@ -309,6 +273,10 @@ status_t AudioHardware::AudioStreamOutQ5V2::standby()
 
 status_t AudioHardware::AudioStreamOutQ5V2::dump(int fd, const Vector<String16>& args)
 {
+    String8 result;
+    result.append("AudioStreamOutQ5V2::dump\n");
+    mSession.dump(result);
+    ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
 
@@ -331,7 +299,10 @@ String8 AudioHardware::AudioStreamOutQ5V2::getParameters(const String8& keys)
 
 status_t AudioHardware::AudioStreamOutQ5V2::getRenderPosition(uint32_t *dspFrames)
 {
-    return INVALID_OPERATION;
+    if (mStandby) {
+        return INVALID_OPERATION;
+    }
+    return mSession.getRenderPosition(dspFrames);
 }
 
 extern "C" AudioHardwareInterface* createAudioHardware(void) {
@@ -25,6 +25,8 @@
 
 #include <hardware_legacy/AudioHardwareBase.h>
 
+#include "PcmSession.h"
+
 namespace android {
 
 #define CODEC_TYPE_PCM 0
@@ -108,7 +110,7 @@ private:
         virtual size_t      bufferSize() const { return mBufferSize; }
         virtual uint32_t    channels() const { return mChannels; }
         virtual int         format() const { return AUDIO_HW_OUT_FORMAT; }
-        virtual uint32_t    latency() const { return (1000*AUDIO_HW_NUM_OUT_BUF*(bufferSize()/frameSize()))/sampleRate()+AUDIO_HW_OUT_LATENCY_MS; }
+        virtual uint32_t    latency() const { return mSession.latency(); }
         virtual status_t    setVolume(float left, float right) { return INVALID_OPERATION; }
         virtual ssize_t     write(const void* buffer, size_t bytes);
         virtual status_t    standby();
@@ -120,15 +122,16 @@ private:
         virtual status_t    getRenderPosition(uint32_t *dspFrames);
 
     private:
+                PcmSession::Config sessionConfig() const;
+
                 AudioHardware* mHardware;
-                int         mFd;
-                int         mStartCount;
-                int         mRetryCount;
                 bool        mStandby;
                 uint32_t    mDevices;
                 uint32_t    mChannels;
                 uint32_t    mSampleRate;
                 size_t      mBufferSize;
+                // last, it is configured from the members above
+                PcmSession  mSession;
     };
 
             bool        mInit;
@@ -19,6 +19,7 @@
 #include <utils/Log.h>
 #include "AudioPolicyManager.h"
 #include <media/mediarecorder.h>
+#include <string.h>
 
 namespace android {
 
@@ -49,6 +50,20 @@ extern "C" void destroyAudioPolicyManager(AudioPolicyInterface *interface)
 // ---
 
 
+void AudioPolicyManager::getRoutingInputs(RoutingInputs *inputs) const
+{
+    // cleared so that padding doesn't defeat the memcmp() below
+    memset(inputs, 0, sizeof(*inputs));
+    inputs->phoneState = mPhoneState;
+    for (int i = 0; i < AudioSystem::NUM_FORCE_USE; i++) {
+        inputs->forceUse[i] = mForceUse[i];
+    }
+    inputs->availableOutputDevices = mAvailableOutputDevices;
+#ifdef WITH_A2DP
+    inputs->a2dpOutput = mA2dpOutput;
+#endif
+}
+
 uint32_t AudioPolicyManager::getDeviceForStrategy(routing_strategy strategy, bool fromCache)
 {
     uint32_t device = 0;
@@ -59,6 +74,32 @@ uint32_t AudioPolicyManager::getDeviceForStrategy(routing_strategy strategy, boo
         return device;
     }
 
+    if ((uint32_t)strategy >= NUM_STRATEGIES) {
+        return computeDeviceForStrategy(strategy);
+    }
+
+    // The base class asks for uncached devices several times for each phone state, force use
+    // or device connection change. Compute each strategy once until one of those changes.
+    RoutingInputs inputs;
+    getRoutingInputs(&inputs);
+    if (memcmp(&inputs, &mComputedInputs, sizeof(inputs)) != 0) {
+        mComputedInputs = inputs;
+        mComputedStrategies = 0;
+    }
+    if (mComputedStrategies & (1 << strategy)) {
+        return mComputedDevice[strategy];
+    }
+
+    device = computeDeviceForStrategy(strategy);
+    mComputedDevice[strategy] = device;
+    mComputedStrategies |= 1 << strategy;
+    return device;
+}
+
+uint32_t AudioPolicyManager::computeDeviceForStrategy(routing_strategy strategy)
+{
+    uint32_t device = 0;
+
     switch (strategy) {
     case STRATEGY_DTMF:
         if (mPhoneState != AudioSystem::MODE_IN_CALL) {
@@ -40,7 +40,14 @@ LOCAL_SHARED_LIBRARIES := \
     libhardware_legacy \
     libdl
 
+LOCAL_SHARED_LIBRARIES += libhaltrace
+
 LOCAL_SRC_FILES += AudioHardware.cpp
+LOCAL_SRC_FILES += ../libaudio-common/PcmSession.cpp
+LOCAL_SRC_FILES += ../libaudio-common/AudioHistogram.cpp
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libaudio-common
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libhaltrace
 
 LOCAL_CFLAGS += -fno-short-enums
 
@@ -30,11 +30,13 @@
 #include <dlfcn.h>
 #include <fcntl.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h> // for property_get for the voice recognition mode switch
 
 // hardware specific functions
 
 #include "AudioHardware.h"
+#include "haltrace.h"
 #include <media/AudioRecord.h>
 #include <media/mediarecorder.h>
 
@@ -73,6 +75,8 @@ static int old_pathid = -1;
 static int new_pathid = -1;
 static int curr_out_device = -1;
 static int curr_mic_device = -1;
+static uint32_t curr_rx_acdb_id = 0;
+static uint32_t curr_tx_acdb_id = 0;
 static int voice_started = 0;
 static int fd_fm_device = -1;
 static int stream_volume = -300;
@@ -82,29 +86,115 @@ static bool vr_mode_change = false;
 static int vr_uses_ns = 0;
 static int alt_enable = 0;
 static int hac_enable = 0;
+// number of default sized capture buffers the driver fills per read
+static int in_batch = 1;
 // enable or disable 2-mic noise suppression in call on receiver mode
 static int enable1026 = 1;
 //FIXME add new settings in A1026 driver for an incall no ns mode, based on the current vr no ns
 #define A1026_PATH_INCALL_NO_NS_RECEIVER A1026_PATH_VR_NO_NS_RECEIVER
 
-int errCount = 0;
 static void * acoustic;
+// The DSP captures at all of these rates natively, so getInputSampleRate()
+// only pushes resampling up to AudioFlinger for rates outside this list.
 const uint32_t AudioHardware::inputSamplingRates[] = {
         8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000
 };
 
 // ID string for audio wakelock
 static const char kOutputWakelockStr[] = "AudioHardwareQSDOut";
+static const char kTunnelWakelockStr[] = "AudioHardwareQSDTunnel";
 static const char kInputWakelockStr[] = "AudioHardwareQSDIn";
 
+// how long a battery temperature reading is trusted for ALT selection
+static const nsecs_t kBattTempRefreshMs = 30000;
+// default for audio.qsd8k.route_debounce_ms, 0 routes in the caller's thread
+static const char kRouteDebounceMs[] = "40";
+
+// ----------------------------------------------------------------------------
+
+AudioRingBuffer::AudioRingBuffer() :
+    mData(0), mSize(0), mCapacity(0), mRead(0), mWrite(0)
+{
+}
+
+AudioRingBuffer::~AudioRingBuffer()
+{
+    delete[] mData;
+}
+
+status_t AudioRingBuffer::init(size_t size)
+{
+    size_t ringSize = 1;
+    while (ringSize < size)
+        ringSize <<= 1;
+    delete[] mData;
+    mData = new uint8_t[ringSize];
+    mSize = mData ? ringSize : 0;
+    mCapacity = mData ? size : 0;
+    reset();
+    return mData ? NO_ERROR : NO_MEMORY;
+}
+
+void AudioRingBuffer::reset()
+{
+    mRead = 0;
+    mWrite = 0;
+}
+
+size_t AudioRingBuffer::available() const
+{
+    // the indices run freely, the difference is the fill level
+    return uint32_t(android_atomic_acquire_load(&mWrite) -
+                    android_atomic_acquire_load(&mRead));
+}
+
+size_t AudioRingBuffer::space() const
+{
+    return mCapacity - available();
+}
+
+size_t AudioRingBuffer::write(const void* buffer, size_t bytes)
+{
+    const int32_t w = mWrite;
+    const size_t used = uint32_t(w - android_atomic_acquire_load(&mRead));
+    if (bytes > mCapacity - used)
+        bytes = mCapacity - used;
+
+    const size_t offset = w & (mSize - 1);
+    const size_t first = (bytes < mSize - offset) ? bytes : mSize - offset;
+    memcpy(mData + offset, buffer, first);
+    memcpy(mData, static_cast<const uint8_t*>(buffer) + first, bytes - first);
+
+    // publish the data only once it has been copied
+    android_atomic_release_store(w + bytes, &mWrite);
+    return bytes;
+}
+
+size_t AudioRingBuffer::read(void* buffer, size_t bytes)
+{
+    const int32_t r = mRead;
+    const size_t used = uint32_t(android_atomic_acquire_load(&mWrite) - r);
+    if (bytes > used)
+        bytes = used;
+
+    const size_t offset = r & (mSize - 1);
+    const size_t first = (bytes < mSize - offset) ? bytes : mSize - offset;
+    memcpy(buffer, mData + offset, first);
+    memcpy(static_cast<uint8_t*>(buffer) + first, mData, bytes - first);
+
+    // hand the space back only once the data has been copied out
+    android_atomic_release_store(r + bytes, &mRead);
+    return bytes;
+}
+
 // ----------------------------------------------------------------------------
 
 AudioHardware::AudioHardware() :
-    mA1026Init(false), mInit(false), mMicMute(true),
+    mA1026Init(false), mA1026Loading(true), mInit(false), mMicMute(true),
     mBluetoothNrec(true),
     mHACSetting(false),
     mBluetoothIdTx(0), mBluetoothIdRx(0),
-    mOutput(0),
+    mOutput(0), mTunnelOutput(0),
     mNoiseSuppressionState(A1026_NS_STATE_AUTO),
     mVoiceVolume(VOICE_VOLUME_MAX), mTTYMode(TTY_MODE_OFF)
 {
@@ -115,7 +205,24 @@ AudioHardware::AudioHardware() :
 
     struct msm_bt_endpoint *ept;
 
-    doA1026_init();
+    // the firmware download takes a while, do it without holding up
+    // mediaserver; only A1026 users wait for it
+    mA1026Loader = new A1026Loader(this);
+    if (mA1026Loader->run("AudioA1026Loader", ANDROID_PRIORITY_BACKGROUND) != NO_ERROR) {
+        LOGE("Cannot start A1026 loader, loading in place");
+        mA1026Loader.clear();
+        loadA1026();
+    }
+
+    // Trade capture latency for fewer reads, the default 256 byte buffer
+    // at 8 kHz means a syscall every 16 ms per stream
+    char batch[PROPERTY_VALUE_MAX];
+    property_get("audio.qsd8k.in_batch", batch, "1");
+    in_batch = atoi(batch);
+    if (in_batch < 1 || in_batch > AUDIO_HW_IN_MAX_BATCH) {
+        in_batch = 1;
+    }
+    LOGV("Capture batch: %d", in_batch);
 
     acoustic =:: dlopen("/system/lib/libhtc_acoustic.so", RTLD_NOW);
     if (acoustic == NULL ) {
@@ -196,22 +303,62 @@ AudioHardware::AudioHardware() :
     property_get("htc.audio.alt.enable", value, "0");
     alt_enable = atoi(value);
     LOGV("Enable ALT function: %d", alt_enable);
+    if (alt_enable) {
+        // prime the reading here rather than on the first stream start
+        mBattTempSampler = new BattTempSampler(this);
+        mBattTempSampler->sample();
+        if (mBattTempSampler->run("AudioBattTemp", ANDROID_PRIORITY_BACKGROUND) != NO_ERROR) {
+            LOGE("Cannot start battery temperature sampler");
+            mBattTempSampler.clear();
+        }
+    }
 
     // Check the system property for enable or not the HAC function
     property_get("htc.audio.hac.enable", value, "0");
     hac_enable = atoi(value);
     LOGV("Enable HAC function: %d", hac_enable);
 
+    // routing requests arrive in bursts (e.g. on headset insertion), apply
+    // only the last one of each burst
+    property_get("audio.qsd8k.route_debounce_ms", value, kRouteDebounceMs);
+    int debounceMs = atoi(value);
+    if (debounceMs > 0) {
+        mRoutingThread = new RoutingThread(this, debounceMs);
+        if (mRoutingThread->run("AudioRouting", ANDROID_PRIORITY_AUDIO) != NO_ERROR) {
+            LOGE("Cannot start routing thread");
+            mRoutingThread.clear();
+        }
+    }
+
     mInit = true;
 }
 
 AudioHardware::~AudioHardware()
 {
+    if (mRoutingThread != 0) {
+        mRoutingThread->stop();
+        mRoutingThread.clear();
+    }
+    if (mA1026Loader != 0) {
+        mA1026Loader->requestExitAndWait();
+        mA1026Loader.clear();
+    }
+    if (fd_a1026 >= 0) {
+        close(fd_a1026);
+        fd_a1026 = -1;
+    }
     for (size_t index = 0; index < mInputs.size(); index++) {
         closeInputStream((AudioStreamIn*)mInputs[index]);
     }
     mInputs.clear();
     closeOutputStream((AudioStreamOut*)mOutput);
+    if (mTunnelOutput) {
+        closeOutputStream((AudioStreamOut*)mTunnelOutput);
+    }
+    if (mBattTempSampler != 0) {
+        mBattTempSampler->stop();
+        mBattTempSampler.clear();
+    }
     mInit = false;
 }
 
@@ -226,6 +373,28 @@ AudioStreamOut* AudioHardware::openOutputStream(
     { // scope for the lock
         android::Mutex::Autolock lock(mLock);
 
+        if (format && AudioStreamOutTunnel::isTunnelFormat(*format)) {
+            if (mTunnelOutput) {
+                // the ADSP runs one decoder session at a time
+                LOGW("tunnel output already open");
+                if (status) {
+                    *status = INVALID_OPERATION;
+                }
+                return 0;
+            }
+            AudioStreamOutTunnel* out = new AudioStreamOutTunnel();
+            status_t lStatus = out->set(this, devices, format, channels, sampleRate);
+            if (status) {
+                *status = lStatus;
+            }
+            if (lStatus != NO_ERROR) {
+                delete out;
+                return 0;
+            }
+            mTunnelOutput = out;
+            return mTunnelOutput;
+        }
+
         AudioStreamOutMSM72xx* out;
         if (mOutput) {
             // only one output stream allowed
@@ -250,7 +419,10 @@ AudioStreamOut* AudioHardware::openOutputStream(
 
 void AudioHardware::closeOutputStream(AudioStreamOut* out) {
     android::Mutex::Autolock lock(mLock);
-    if (mOutput == 0 || mOutput != out) {
+    if (mTunnelOutput != 0 && mTunnelOutput == out) {
+        delete mTunnelOutput;
+        mTunnelOutput = 0;
+    } else if (mOutput == 0 || mOutput != out) {
         LOGW("Attempt to close invalid output stream");
     }
     else {
@@ -331,6 +503,9 @@ bool AudioHardware::checkOutputStandby()
     if (mOutput)
         if (!mOutput->checkStandby())
             return false;
+    if (mTunnelOutput)
+        if (!mTunnelOutput->checkStandby())
+            return false;
 
     return true;
 }
@@ -430,7 +605,7 @@ status_t AudioHardware::setParameters(const String8& keyValuePairs)
             LOGD("Using default acoustic parameters "
                  "(%s not in acoustic database)", value.string());
         }
-        doRouting();
+        requestRouting();
     }
     key = String8("noise_suppression");
     if (param.get(key, value) == NO_ERROR) {
@@ -449,20 +624,12 @@ status_t AudioHardware::setParameters(const String8& keyValuePairs)
             }
 
             if (noiseSuppressionState != mNoiseSuppressionState) {
-                if (!mA1026Init) {
+                mA1026Lock.lock();
+                if (!waitForA1026_l()) {
                     LOGW("Audience A1026 not initialized.\n");
+                    mA1026Lock.unlock();
                     return INVALID_OPERATION;
                 }
-
-                mA1026Lock.lock();
-                if (fd_a1026 < 0) {
-                    fd_a1026 = open("/dev/audience_a1026", O_RDWR);
-                    if (fd_a1026 < 0) {
-                        LOGE("Cannot open audience_a1026 device (%d)\n", fd_a1026);
-                        mA1026Lock.unlock();
-                        return -1;
-                    }
-                }
                 LOGV("Setting noise suppression %s", value.string());
 
                 int rc = ioctl(fd_a1026, A1026_SET_NS_STATE, &noiseSuppressionState);
@@ -471,8 +638,6 @@ status_t AudioHardware::setParameters(const String8& keyValuePairs)
                 } else {
                     LOGE("Failed to set noise suppression %s", value.string());
                 }
-                close(fd_a1026);
-                fd_a1026 = -1;
                 mA1026Lock.unlock();
             }
         } else {
@@ -498,7 +663,7 @@ status_t AudioHardware::setParameters(const String8& keyValuePairs)
         if (ttyMode != mTTYMode) {
             LOGV("new tty mode %d", ttyMode);
             mTTYMode = ttyMode;
-            doRouting();
+            requestRouting();
         }
      }
 
@@ -588,7 +753,7 @@ size_t AudioHardware::getInputBufferSize(uint32_t sampleRate, int format, int ch
         return 0;
     }
 
-    return getBufferSize(sampleRate, channelCount);
+    return getBufferSize(sampleRate, channelCount) * in_batch;
 }
 
 static status_t set_volume_rpc(uint32_t volume)
@@ -645,7 +810,7 @@ static status_t do_route_audio_dev_ctrl(uint32_t device, bool inCall, uint32_t r
 {
     uint32_t out_device = 0, mic_device = 0;
     uint32_t path[2];
-    int fd = 0;
+    int fd = -1;
 
     if (device == SND_DEVICE_CURRENT)
         goto Incall;
@@ -736,27 +901,42 @@ static status_t do_route_audio_dev_ctrl(uint32_t device, bool inCall, uint32_t r
     }
 #endif
 
+    // only switch the paths that change
+    if ((int)out_device == curr_out_device && rx_acdb_id == curr_rx_acdb_id &&
+        (int)mic_device == curr_mic_device && tx_acdb_id == curr_tx_acdb_id) {
+        LOGV("audio device already selected");
+        goto Incall;
+    }
+
     fd = open("/dev/msm_audio_ctl", O_RDWR);
     if (fd < 0)        {
        LOGE("Cannot open msm_audio_ctl");
        return -1;
     }
-    path[0] = out_device;
-    path[1] = rx_acdb_id;
-    if (ioctl(fd, AUDIO_SWITCH_DEVICE, &path)) {
-       LOGE("Cannot switch audio device");
-       close(fd);
-       return -1;
+    if ((int)out_device != curr_out_device || rx_acdb_id != curr_rx_acdb_id) {
+        path[0] = out_device;
+        path[1] = rx_acdb_id;
+        if (ioctl(fd, AUDIO_SWITCH_DEVICE, &path)) {
+           LOGE("Cannot switch audio device");
+           curr_out_device = -1;
+           close(fd);
+           return -1;
+        }
+        curr_out_device = out_device;
+        curr_rx_acdb_id = rx_acdb_id;
     }
-    path[0] = mic_device;
-    path[1] = tx_acdb_id;
-    if (ioctl(fd, AUDIO_SWITCH_DEVICE, &path)) {
-       LOGE("Cannot switch mic device");
-       close(fd);
-       return -1;
+    if ((int)mic_device != curr_mic_device || tx_acdb_id != curr_tx_acdb_id) {
+        path[0] = mic_device;
+        path[1] = tx_acdb_id;
+        if (ioctl(fd, AUDIO_SWITCH_DEVICE, &path)) {
+           LOGE("Cannot switch mic device");
+           curr_mic_device = -1;
+           close(fd);
+           return -1;
+        }
+        curr_mic_device = mic_device;
+        curr_tx_acdb_id = tx_acdb_id;
     }
-    curr_out_device = out_device;
-    curr_mic_device = mic_device;
 
 Incall:
     if (inCall == true && !voice_started) {
@@ -796,7 +976,9 @@ Incall:
         voice_started = 0;
     }
 
-    close(fd);
+    if (fd >= 0) {
+        close(fd);
+    }
     return NO_ERROR;
 }
 
@@ -804,6 +986,7 @@ Incall:
 // always call with mutex held
 status_t AudioHardware::doAudioRouteOrMute(uint32_t device)
 {
+    HALTRACE_SCOPE_ARGS("audio", "route", device, 0);
     uint32_t rx_acdb_id = 0;
     uint32_t tx_acdb_id = 0;
 
@@ -894,14 +1077,94 @@ status_t AudioHardware::get_batt_temp(int *batt_temp)
     return NO_ERROR;
 }
 
+AudioHardware::BattTempSampler::BattTempSampler(AudioHardware* hw) :
+    android::Thread(false), mHardware(hw), mRequested(false),
+    mStatus(NO_INIT), mTemp(0), mTime(0)
+{
+}
+
+status_t AudioHardware::BattTempSampler::get(int *batt_temp)
+{
+    android::Mutex::Autolock lock(mLock);
+    if (!mRequested && systemTime() - mTime > milliseconds(kBattTempRefreshMs)) {
+        mRequested = true;
+        mCond.signal();
+    }
+    if (mStatus == NO_ERROR) {
+        *batt_temp = mTemp;
+    }
+    return mStatus;
+}
+
+status_t AudioHardware::BattTempSampler::sample()
+{
+    int temp = 0;
+    status_t status = mHardware->get_batt_temp(&temp);
+
+    android::Mutex::Autolock lock(mLock);
+    // a failed read keeps the last good value until the next refresh
+    if (status == NO_ERROR || mStatus != NO_ERROR) {
+        mStatus = status;
+        mTemp = temp;
+    }
+    mTime = systemTime();
+    return status;
+}
+
+void AudioHardware::BattTempSampler::stop()
+{
+    {
+        android::Mutex::Autolock lock(mLock);
+        requestExit();
+        mCond.signal();
+    }
+    requestExitAndWait();
+}
+
+bool AudioHardware::BattTempSampler::threadLoop()
+{
+    {
+        android::Mutex::Autolock lock(mLock);
+        while (!mRequested && !exitPending()) {
+            mCond.wait(mLock);
+        }
+        if (exitPending()) {
+            return false;
+        }
+    }
+    sample();
+    android::Mutex::Autolock lock(mLock);
+    mRequested = false;
+    return true;
+}
+
+void AudioHardware::loadA1026()
+{
+    android::Mutex::Autolock lock(mA1026Lock);
+    doA1026_init();
+    mA1026Loading = false;
+    mA1026Cond.broadcast();
+}
+
+// call with mA1026Lock held, true once the chip is ready for fd_a1026
+bool AudioHardware::waitForA1026_l()
+{
+    while (mA1026Loading) {
+        mA1026Cond.wait(mA1026Lock);
+    }
+    return mA1026Init && fd_a1026 >= 0;
+}
+
 /*
- * Note: upon exiting doA1026_init(), fd_a1026 will be -1
+ * Call with mA1026Lock held, or before anyone else can use the chip.
+ * fd_a1026 stays open (and blocking) if the firmware is loaded, and is -1
+ * otherwise.
  */
 status_t AudioHardware::doA1026_init(void)
 {
     struct a1026img fwimg;
     char char_tmp = 0;
-    unsigned char local_vpimg_buf[A1026_MAX_FW_SIZE], *ptr = local_vpimg_buf;
+    unsigned char *local_vpimg_buf, *ptr;
     int rc = 0, fw_fd = -1;
     ssize_t nr;
     size_t remaining;
@@ -919,6 +1182,14 @@ status_t AudioHardware::doA1026_init(void)
         goto open_drv_err;
     }
 
+    local_vpimg_buf = (unsigned char *)malloc(A1026_MAX_FW_SIZE);
+    if (local_vpimg_buf == NULL) {
+        LOGE("Cannot allocate firmware buffer\n");
+        rc = -ENOMEM;
+        goto alloc_err;
+    }
+    ptr = local_vpimg_buf;
+
     fw_fd = open(fn, O_RDONLY);
     if (fw_fd < 0) {
         LOGE("Fail to open %s\n", fn);
@@ -937,9 +1208,9 @@ status_t AudioHardware::doA1026_init(void)
 
     LOGD("Firmware %s size %d\n", fn, remaining);
 
-    if (remaining > sizeof(local_vpimg_buf)) {
+    if (remaining > A1026_MAX_FW_SIZE) {
         LOGE("File %s size %d exceeds internal limit %d\n",
-             fn, remaining, sizeof(local_vpimg_buf));
+             fn, remaining, A1026_MAX_FW_SIZE);
         goto ld_img_error;
     }
 
@@ -970,12 +1241,18 @@ status_t AudioHardware::doA1026_init(void)
     if (!rc) {
         LOGD("audience_a1026 init OK\n");
         mA1026Init = 1;
+        // path and NS changes block until the chip takes them
+        fcntl(fd_a1026, F_SETFL, fcntl(fd_a1026, F_GETFL) & ~O_NONBLOCK);
+        free(local_vpimg_buf);
+        return rc;
     } else
         LOGE("audience_a1026 init failed\n");
 
 ld_img_error:
     if (fw_fd >= 0)
         close(fw_fd);
+    free(local_vpimg_buf);
+alloc_err:
     close(fd_a1026);
 open_drv_err:
     fd_a1026 = -1;
@@ -1011,7 +1288,8 @@ uint32_t AudioHardware::getACDB(int mode, int device)
                 acdb_id = ACDB_ID_SPKR_PLAYBACK;
                 if(alt_enable) {
                     LOGD("Enable ALT for speaker\n");
-                    if (get_batt_temp(&batt_temp) == NO_ERROR) {
+                    if (mBattTempSampler != 0 &&
+                            mBattTempSampler->get(&batt_temp) == NO_ERROR) {
                         if (batt_temp < 50)
                             acdb_id = ACDB_ID_ALT_SPKR_PLAYBACK;
                         LOGD("ALT batt temp = %d\n", batt_temp);
@@ -1108,21 +1386,13 @@ status_t AudioHardware::doAudience_A1026_Control(int Mode, bool Record, uint32_t
     int rc = 0;
     int retry = 4;
 
-    if (!mA1026Init) {
+    mA1026Lock.lock();
+    if (!waitForA1026_l()) {
         LOGW("Audience A1026 not initialized.\n");
+        mA1026Lock.unlock();
         return NO_INIT;
     }
 
-    mA1026Lock.lock();
-    if (fd_a1026 < 0) {
-        fd_a1026 = open("/dev/audience_a1026", O_RDWR);
-        if (fd_a1026 < 0) {
-            LOGE("Cannot open audience_a1026 device (%d)\n", fd_a1026);
-            mA1026Lock.unlock();
-            return -1;
-        }
-    }
-
     if ((Mode < AudioSystem::MODE_CURRENT) || (Mode >= AudioSystem::NUM_MODES)) {
         LOGW("Illegal value: doAudience_A1026_Control(%d, %u, %u)", Mode, Record, Routes);
         mA1026Lock.unlock();
@@ -1302,39 +1572,93 @@ status_t AudioHardware::doAudience_A1026_Control(int Mode, bool Record, uint32_t
 
         if (rc < 0) {
             LOGW("A1026 do hard reset to recover from error!\n");
+            mA1026Init = 0;
             rc = doA1026_init(); /* A1026 needs to do hard reset! */
             if (!rc) {
-                /* after doA1026_init(), fd_a1026 is -1*/
-                fd_a1026 = open("/dev/audience_a1026", O_RDWR);
-                if (fd_a1026 < 0) {
-                    LOGE("A1026 Fatal Error: unable to open A1026 after hard reset\n");
+                /* doA1026_init() left fd_a1026 open */
+                rc = ioctl(fd_a1026, A1026_SET_CONFIG, &new_pathid);
+                if (!rc) {
+                    old_pathid = new_pathid;
                 } else {
-                    rc = ioctl(fd_a1026, A1026_SET_CONFIG, &new_pathid);
-                    if (!rc) {
-                        old_pathid = new_pathid;
-                    } else {
-                        LOGE("A1026 Fatal Error: unable to A1026_SET_CONFIG after hard reset\n");
-                    }
+                    LOGE("A1026 Fatal Error: unable to A1026_SET_CONFIG after hard reset\n");
                 }
             } else
                 LOGE("A1026 Fatal Error: Re-init A1026 Failed\n");
         }
     }
 
-    if (fd_a1026 >= 0) {
-        close(fd_a1026);
-    }
-    fd_a1026 = -1;
     mA1026Lock.unlock();
 
     return rc;
 }
 
 
+AudioHardware::RoutingThread::RoutingThread(AudioHardware* hw, int debounceMs) :
+    android::Thread(false), mHardware(hw), mDebounce(milliseconds(debounceMs)),
+    mRequested(false), mRequestTime(0)
+{
+}
+
+void AudioHardware::RoutingThread::request()
+{
+    android::Mutex::Autolock lock(mLock);
+    mRequested = true;
+    mRequestTime = systemTime();
+    mCond.signal();
+}
+
+void AudioHardware::RoutingThread::stop()
+{
+    {
+        android::Mutex::Autolock lock(mLock);
+        requestExit();
+        mCond.signal();
+    }
+    requestExitAndWait();
+}
+
+bool AudioHardware::RoutingThread::threadLoop()
+{
+    {
+        android::Mutex::Autolock lock(mLock);
+        while (!mRequested && !exitPending()) {
+            mCond.wait(mLock);
+        }
+        // wait until no request has come in for mDebounce
+        nsecs_t quiet;
+        while (!exitPending() && (quiet = systemTime() - mRequestTime) < mDebounce) {
+            mCond.waitRelative(mLock, mDebounce - quiet);
+        }
+        if (exitPending()) {
+            return false;
+        }
+        mRequested = false;
+    }
+    mHardware->doRouting();
+    return true;
+}
+
+status_t AudioHardware::requestRouting()
+{
+    if (mRoutingThread == 0) {
+        return doRouting();
+    }
+    mRoutingThread->request();
+    return NO_ERROR;
+}
+
 status_t AudioHardware::doRouting()
 {
     android::Mutex::Autolock lock(mLock);
+    android::AutoHistogram timer(mRoutingTime);
+    if (mOutput == 0) {
+        // closed while a deferred request was pending
+        return NO_ERROR;
+    }
     uint32_t outputDevices = mOutput->devices();
+    if (mTunnelOutput && !mTunnelOutput->checkStandby()) {
+        outputDevices = mTunnelOutput->devices();
+    }
     status_t ret = NO_ERROR;
     AudioStreamInMSM72xx *input = getActiveInput_l();
     uint32_t inputDevice = (input == NULL) ? 0 : input->devices();
@@ -1446,6 +1770,7 @@ status_t AudioHardware::doRouting()
     if ((vr_mode_change) || (sndDevice != -1 && sndDevice != mCurSndDevice)) {
         ret = doAudioRouteOrMute(sndDevice);
         mCurSndDevice = sndDevice;
+        vr_mode_change = false;
         if (mMode == AudioSystem::MODE_IN_CALL) {
             if (mHACSetting && hac_enable && mCurSndDevice == (int) SND_DEVICE_HANDSET) {
                 LOGD("HAC enable: Setting in-call volume to maximum.\n");
@@ -1485,6 +1810,16 @@ status_t AudioHardware::dumpInternals(int fd, const Vector<String16>& args)
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmBluetoothIdrx: %d\n", mBluetoothIdRx);
     result.append(buffer);
+    if (mBattTempSampler != 0) {
+        int batt_temp = 0;
+        if (mBattTempSampler->get(&batt_temp) == NO_ERROR) {
+            snprintf(buffer, SIZE, "\tbattery temp: %d\n", batt_temp);
+        } else {
+            snprintf(buffer, SIZE, "\tbattery temp: unknown\n");
+        }
+        result.append(buffer);
+    }
+    mRoutingTime.dump(result, "doRouting");
     ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
@@ -1499,6 +1834,10 @@ status_t AudioHardware::dump(int fd, const Vector<String16>& args)
     if (mOutput) {
         mOutput->dump(fd, args);
     }
+    if (mTunnelOutput) {
+        mTunnelOutput->dump(fd, args);
+    }
+    haltrace_dumpsys(fd);
     return NO_ERROR;
 }
 
@@ -1532,10 +1871,28 @@ AudioHardware::AudioStreamInMSM72xx *AudioHardware::getActiveInput_l()
 // ----------------------------------------------------------------------------
 
 AudioHardware::AudioStreamOutMSM72xx::AudioStreamOutMSM72xx() :
-    mHardware(0), mFd(-1), mStartCount(0), mRetryCount(0), mStandby(true),
+    mHardware(0), mStandby(true),
     mDevices(0), mChannels(AUDIO_HW_OUT_CHANNELS), mSampleRate(AUDIO_HW_OUT_SAMPLERATE),
-    mBufferSize(AUDIO_HW_OUT_BUFSZ)
+    mBufferSize(AUDIO_HW_OUT_BUFSZ), mLowLatency(false),
+    mDriverBufferSize(AUDIO_HW_OUT_BUFSZ), mFeederDone(true), mFeederStatus(NO_ERROR),
+    mWarmStandbyMs(0), mStartSndDevice(-1), mSession(sessionConfig(), this)
+{
+}
+
+android::PcmSession::Config AudioHardware::AudioStreamOutMSM72xx::sessionConfig() const
 {
+    android::PcmSession::Config config;
+    config.device = "/dev/msm_pcm_out";
+    config.sampleRate = mSampleRate;
+    config.channelCount = AudioSystem::popCount(mChannels);
+    config.bufferSize = mDriverBufferSize;
+    config.bufferCount = mLowLatency ? AUDIO_HW_NUM_OUT_BUF_LOW_LATENCY : AUDIO_HW_NUM_OUT_BUF;
+    config.setCodecType = true;
+    config.compressed = false;
+    config.startMode = android::PcmSession::START_ON_OPEN;
+    config.warmStandbyMs = mWarmStandbyMs;
+    config.extraLatencyMs = AUDIO_HW_OUT_LATENCY_MS;
+    return config;
 }
 
 status_t AudioHardware::AudioStreamOutMSM72xx::set(
@@ -1571,16 +1928,59 @@ status_t AudioHardware::AudioStreamOutMSM72xx::set(
     mSampleRate = lRate;
     mBufferSize = hw->getBufferSize(lRate, AudioSystem::popCount(lChannels));
 
+    // the ring and driver buffers can only be resized while stopped
+    if (mStandby) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("audio.qsd8k.low_latency", value, "0");
+        mLowLatency = (atoi(value) != 0);
+        mDriverBufferSize = mLowLatency ? mBufferSize / 2 : mBufferSize;
+        if (mLowLatency &&
+                mRing.init(mDriverBufferSize * AUDIO_HW_OUT_RING_BUF) != NO_ERROR) {
+            LOGE("Cannot allocate output ring, low latency mode disabled");
+            mLowLatency = false;
+            mDriverBufferSize = mBufferSize;
+        }
+        LOGV("low latency output %s", mLowLatency ? "enabled" : "disabled");
+
+        property_get("audio.qsd8k.warm_standby_ms", value, "0");
+        mWarmStandbyMs = atoi(value);
+    }
+    mSession.setConfig(sessionConfig());
+
     return NO_ERROR;
 }
 
 AudioHardware::AudioStreamOutMSM72xx::~AudioStreamOutMSM72xx()
 {
-    standby();
+    doStandby(false);
+}
+
+status_t AudioHardware::AudioStreamOutMSM72xx::start(int fd)
+{
+    return mHardware->startPlayback(fd, &mStartSndDevice);
+}
+
+status_t AudioHardware::startPlayback(int fd, int *sndDevice)
+{
+    *sndDevice = get_snd_dev();
+    uint32_t acdb_id = getACDB(MOD_PLAY, *sndDevice);
+    status_t status = ioctl(fd, AUDIO_START, &acdb_id);
+    if (status < 0) {
+        LOGE("Cannot start pcm playback");
+        return status;
+    }
+
+    status = ioctl(fd, AUDIO_SET_VOLUME, &stream_volume);
+    if (status < 0) {
+        LOGE("Cannot start pcm playback");
+        return status;
+    }
+    return NO_ERROR;
 }
 
 ssize_t AudioHardware::AudioStreamOutMSM72xx::write(const void* buffer, size_t bytes)
 {
+    HALTRACE_SCOPE_ARGS("audio", "out_write", bytes, 0);
     // LOGD("AudioStreamOutMSM72xx::write(%p, %u)", buffer, bytes);
     status_t status = NO_INIT;
     size_t count = bytes;
@@ -1591,96 +1991,170 @@ ssize_t AudioHardware::AudioStreamOutMSM72xx::write(const void* buffer, size_t b
         LOGV("acquire output wakelock");
         acquire_wake_lock(PARTIAL_WAKE_LOCK, kOutputWakelockStr);
 
-        // open driver
-        LOGV("open pcm_out driver");
-        status = ::open("/dev/msm_pcm_out", O_RDWR);
-        if (status < 0) {
-            if (errCount++ < 10) {
-                LOGE("Cannot open /dev/msm_pcm_out errno: %d", errno);
-            }
+        // the ACDB settings applied at AUDIO_START follow the device
+        if (mSession.isWarm() && mHardware->get_snd_dev() != mStartSndDevice) {
+            LOGV("device changed during warm standby");
+            mSession.close();
+        }
+        status = mSession.open();
+        if (status != NO_ERROR) {
             release_wake_lock(kOutputWakelockStr);
             goto Error;
         }
-        mFd = status;
         mStandby = false;
 
-        // configuration
-        LOGV("get config");
-        struct msm_audio_config config;
-        status = ioctl(mFd, AUDIO_GET_CONFIG, &config);
-        if (status < 0) {
-            LOGE("Cannot read pcm_out config");
-            goto Error;
+        if (mLowLatency) {
+            status = startFeeder();
+            if (status != NO_ERROR) {
+                LOGE("Cannot start output feeder thread");
+                goto Error;
+            }
         }
+    }
 
-        LOGV("set pcm_out config");
-        config.channel_count = AudioSystem::popCount(channels());
-        config.sample_rate = mSampleRate;
-        config.buffer_size = mBufferSize;
-        config.buffer_count = AUDIO_HW_NUM_OUT_BUF;
-        config.codec_type = CODEC_TYPE_PCM;
-        status = ioctl(mFd, AUDIO_SET_CONFIG, &config);
-        if (status < 0) {
-            LOGE("Cannot set config");
+    {
+        ssize_t written = mLowLatency ? queue(p, count) : writeToDriver(p, count);
+        if (written < 0) {
+            status = written;
             goto Error;
         }
+    }
 
-        LOGV("buffer_size: %u", config.buffer_size);
-        LOGV("buffer_count: %u", config.buffer_count);
-        LOGV("channel_count: %u", config.channel_count);
-        LOGV("sample_rate: %u", config.sample_rate);
+    return bytes;
 
-        uint32_t acdb_id = mHardware->getACDB(MOD_PLAY, mHardware->get_snd_dev());
-        status = ioctl(mFd, AUDIO_START, &acdb_id);
-        if (status < 0) {
-            LOGE("Cannot start pcm playback");
-            goto Error;
+Error:
+
+    doStandby(false);
+
+    // Simulate audio output timing in case of error
+    usleep((((bytes * 1000) / frameSize()) * 1000) / sampleRate());
+    return status;
+}
+
+ssize_t AudioHardware::AudioStreamOutMSM72xx::writeToDriver(const uint8_t* p, size_t bytes)
+{
+    return mSession.write(p, bytes);
+}
+
+// only blocks when the ring is full, which happens at most once per
+// driver buffer drained by the feeder
+ssize_t AudioHardware::AudioStreamOutMSM72xx::queue(const uint8_t* p, size_t bytes)
+{
+    size_t count = bytes;
+    while (count) {
+        if (mFeederDone) {
+            return (mFeederStatus != NO_ERROR) ? mFeederStatus : NO_INIT;
         }
+        size_t queued = mRing.write(p, count);
+        count -= queued;
+        p += queued;
 
-        status = ioctl(mFd, AUDIO_SET_VOLUME, &stream_volume);
-        if (status < 0) {
-            LOGE("Cannot start pcm playback");
-            goto Error;
+        android::Mutex::Autolock lock(mRingLock);
+        if (queued) {
+            mDataCond.signal();
+        }
+        if (count && mRing.space() == 0 && !mFeederDone) {
+            mSpaceCond.wait(mRingLock);
         }
     }
+    return bytes;
+}
 
-    while (count) {
-        ssize_t written = ::write(mFd, p, count);
-        if (written >= 0) {
-            count -= written;
-            p += written;
-        } else {
-            if (errno != EAGAIN) {
-                status = written;
-                goto Error;
-            }
-            mRetryCount++;
-            LOGD("EAGAIN - retry");
+bool AudioHardware::AudioStreamOutMSM72xx::Feeder::threadLoop()
+{
+    uint8_t buffer[AUDIO_HW_OUT_BUFSZ];
+    size_t chunk = mOut->mDriverBufferSize;
+    if (chunk > sizeof(buffer))
+        chunk = sizeof(buffer);
+
+    {
+        android::Mutex::Autolock lock(mOut->mRingLock);
+        while (mOut->mRing.available() == 0 && !exitPending()) {
+            mOut->mDataCond.wait(mOut->mRingLock);
+        }
+        if (exitPending()) {
+            return false;
         }
     }
 
-    return bytes;
-
-Error:
+    size_t bytes = mOut->mRing.read(buffer, chunk);
+    {
+        android::Mutex::Autolock lock(mOut->mRingLock);
+        mOut->mSpaceCond.signal();
+    }
 
-    standby();
+    ssize_t written = mOut->writeToDriver(buffer, bytes);
+    if (written < 0) {
+        LOGE("output feeder write failed (%d)", (int)written);
+        android::Mutex::Autolock lock(mOut->mRingLock);
+        mOut->mFeederStatus = written;
+        mOut->mFeederDone = true;
+        mOut->mSpaceCond.signal();
+        return false;
+    }
+    return true;
+}
 
-    // Simulate audio output timing in case of error
-    usleep((((bytes * 1000) / frameSize()) * 1000) / sampleRate());
+status_t AudioHardware::AudioStreamOutMSM72xx::startFeeder()
+{
+    mRing.reset();
+    mFeederStatus = NO_ERROR;
+    mFeederDone = false;
+    mFeeder = new Feeder(this);
+    status_t status = mFeeder->run("AudioOutFeeder", ANDROID_PRIORITY_URGENT_AUDIO);
+    if (status != NO_ERROR) {
+        mFeeder.clear();
+        mFeederDone = true;
+    }
     return status;
 }
 
+void AudioHardware::AudioStreamOutMSM72xx::stopFeeder()
+{
+    if (mFeeder == 0) {
+        return;
+    }
+    {
+        // let the feeder hand what is still queued to the driver, then
+        // ask it to exit under the lock so it can't miss the wakeup
+        android::Mutex::Autolock lock(mRingLock);
+        while (mRing.available() && !mFeederDone) {
+            mSpaceCond.wait(mRingLock);
+        }
+        mFeeder->requestExit();
+        mDataCond.signal();
+    }
+    mFeeder->requestExitAndWait();
+    mFeeder.clear();
+    mFeederDone = true;
+}
+
+uint32_t AudioHardware::AudioStreamOutMSM72xx::latency() const
+{
+    uint32_t latency = mSession.latency();
+    if (mLowLatency) {
+        latency += (1000*(mRing.size()/frameSize()))/sampleRate();
+    }
+    return latency;
+}
+
 status_t AudioHardware::AudioStreamOutMSM72xx::standby()
+{
+    return doStandby(true);
+}
+
+status_t AudioHardware::AudioStreamOutMSM72xx::doStandby(bool warm)
 {
     if (!mStandby) {
-        LOGD("AudioHardware pcm playback is going to standby.");
-        if (mFd >= 0) {
-            ::close(mFd);
-            mFd = -1;
-        }
+        LOGD("AudioHardware pcm playback is going to %sstandby.",
+                (warm && mWarmStandbyMs) ? "warm " : "");
+        stopFeeder();
+        mSession.standby(warm);
         LOGV("release output wakelock");
         release_wake_lock(kOutputWakelockStr);
         mStandby = true;
+    } else if (!warm) {
+        mSession.close();
     }
     return NO_ERROR;
 }
@@ -1701,14 +2175,15 @@ status_t AudioHardware::AudioStreamOutMSM72xx::dump(int fd, const Vector<String1
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmHardware: %p\n", mHardware);
     result.append(buffer);
-    snprintf(buffer, SIZE, "\tmFd: %d\n", mFd);
-    result.append(buffer);
-    snprintf(buffer, SIZE, "\tmStartCount: %d\n", mStartCount);
-    result.append(buffer);
-    snprintf(buffer, SIZE, "\tmRetryCount: %d\n", mRetryCount);
-    result.append(buffer);
     snprintf(buffer, SIZE, "\tmStandby: %s\n", mStandby? "true": "false");
     result.append(buffer);
+    snprintf(buffer, SIZE, "\tmLowLatency: %s\n", mLowLatency? "true": "false");
+    result.append(buffer);
+    if (mLowLatency) {
+        snprintf(buffer, SIZE, "\tring fill: %u/%u\n", mRing.available(), mRing.size());
+        result.append(buffer);
+    }
+    mSession.dump(result);
     ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
@@ -1731,7 +2206,7 @@ status_t AudioHardware::AudioStreamOutMSM72xx::setParameters(const String8& keyV
     if (param.getInt(key, device) == NO_ERROR) {
         mDevices = device;
         LOGV("set output routing %x", mDevices);
-        status = mHardware->doRouting();
+        status = mHardware->requestRouting();
         param.remove(key);
     }
 
@@ -1758,7 +2233,227 @@ String8 AudioHardware::AudioStreamOutMSM72xx::getParameters(const String8& keys)
 
 status_t AudioHardware::AudioStreamOutMSM72xx::getRenderPosition(uint32_t *dspFrames)
 {
-    //TODO: enable when supported by driver
+    if (mStandby) {
+        return INVALID_OPERATION;
+    }
+    return mSession.getRenderPosition(dspFrames);
+}
+
+// ----------------------------------------------------------------------------
+
+AudioHardware::AudioStreamOutTunnel::AudioStreamOutTunnel() :
+    mHardware(0), mStandby(true), mDevices(0), mFormat(AudioSystem::MP3),
+    mChannels(AUDIO_HW_OUT_CHANNELS), mSampleRate(AUDIO_HW_OUT_SAMPLERATE),
+    mStartSndDevice(-1), mSession(sessionConfig(), this)
+{
+}
+
+bool AudioHardware::AudioStreamOutTunnel::isTunnelFormat(int format)
+{
+    return format == AudioSystem::MP3 || format == AudioSystem::AAC;
+}
+
+android::PcmSession::Config AudioHardware::AudioStreamOutTunnel::sessionConfig() const
+{
+    android::PcmSession::Config config;
+    config.device = (mFormat == AudioSystem::AAC) ? "/dev/msm_aac" : "/dev/msm_mp3";
+    config.sampleRate = mSampleRate;
+    config.channelCount = AudioSystem::popCount(mChannels);
+    config.bufferSize = AUDIO_HW_OUT_TUNNEL_BUFSZ;
+    config.bufferCount = AUDIO_HW_NUM_OUT_TUNNEL_BUF;
+    config.setCodecType = false;
+    config.compressed = true;
+    config.startMode = android::PcmSession::START_ON_OPEN;
+    config.warmStandbyMs = 0;
+    config.extraLatencyMs = AUDIO_HW_OUT_TUNNEL_LATENCY_MS;
+    return config;
+}
+
+status_t AudioHardware::AudioStreamOutTunnel::set(
+        AudioHardware* hw, uint32_t devices, int *pFormat, uint32_t *pChannels, uint32_t *pRate)
+{
+    int lFormat = pFormat ? *pFormat : 0;
+    uint32_t lChannels = pChannels ? *pChannels : 0;
+    uint32_t lRate = pRate ? *pRate : 0;
+
+    mHardware = hw;
+    mDevices = devices;
+
+    // fix up defaults
+    if (lChannels == 0) lChannels = channels();
+    if (lRate == 0) lRate = sampleRate();
+
+    if (!isTunnelFormat(lFormat) ||
+        (lChannels != AudioSystem::CHANNEL_OUT_MONO &&
+         lChannels != AudioSystem::CHANNEL_OUT_STEREO)) {
+        if (pFormat) *pFormat = AudioSystem::MP3;
+        if (pChannels) *pChannels = channels();
+        if (pRate) *pRate = sampleRate();
+        return BAD_VALUE;
+    }
+
+    mFormat = lFormat;
+    mChannels = lChannels;
+    mSampleRate = lRate;
+    mSession.setConfig(sessionConfig());
+
+    // without the decoder there is nothing to tunnel to, the caller has
+    // to decode and open a PCM output itself
+    if (access(mSession.config().device, W_OK) != 0) {
+        LOGV("no tunnel decoder %s", mSession.config().device);
+        return BAD_VALUE;
+    }
+
+    if (pChannels) *pChannels = lChannels;
+    if (pRate) *pRate = lRate;
+    return NO_ERROR;
+}
+
+AudioHardware::AudioStreamOutTunnel::~AudioStreamOutTunnel()
+{
+    standby();
+}
+
+status_t AudioHardware::AudioStreamOutTunnel::start(int fd)
+{
+    if (mFormat == AudioSystem::AAC) {
+        // the ADTS headers carry everything else the decoder needs
+        struct msm_audio_aac_config aac;
+        memset(&aac, 0, sizeof(aac));
+        aac.format = AUDIO_AAC_FORMAT_ADTS;
+        aac.audio_object = AUDIO_AAC_OBJECT_LC;
+        aac.sbr_on_flag = AUDIO_AAC_SBR_ON_FLAG_ON;
+        aac.sbr_ps_on_flag = AUDIO_AAC_SBR_PS_ON_FLAG_ON;
+        aac.dual_mono_mode = AUDIO_AAC_DUAL_MONO_PL_PR;
+        aac.channel_configuration = AudioSystem::popCount(mChannels);
+        if (ioctl(fd, AUDIO_SET_AAC_CONFIG, &aac) < 0) {
+            LOGE("Cannot set aac config");
+            return -errno;
+        }
+    }
+    return mHardware->startPlayback(fd, &mStartSndDevice);
+}
+
+ssize_t AudioHardware::AudioStreamOutTunnel::write(const void* buffer, size_t bytes)
+{
+    HALTRACE_SCOPE_ARGS("audio", "tunnel_write", bytes, 0);
+    status_t status;
+
+    if (mStandby) {
+        LOGV("acquire tunnel wakelock");
+        acquire_wake_lock(PARTIAL_WAKE_LOCK, kTunnelWakelockStr);
+        status = mSession.open();
+        if (status != NO_ERROR) {
+            release_wake_lock(kTunnelWakelockStr);
+            goto Error;
+        }
+        {
+            android::Mutex::Autolock lock(mLock);
+            mStandby = false;
+        }
+        LOGD("AudioHardware tunnel playback started on %s", mSession.config().device);
+    }
+
+    {
+        ssize_t written = mSession.write(buffer, bytes);
+        if (written < 0) {
+            status = written;
+            standby();
+            goto Error;
+        }
+    }
+    return bytes;
+
+Error:
+    // Simulate audio output timing in case of error
+    usleep((bytes * 8 * 1000000ULL) / AUDIO_HW_OUT_TUNNEL_NOMINAL_BPS);
+    return status;
+}
+
+status_t AudioHardware::AudioStreamOutTunnel::standby()
+{
+    if (!mStandby) {
+        LOGD("AudioHardware tunnel playback is going to standby.");
+        // a decoder can't be paused and resumed across a flush of its input
+        mSession.standby(false);
+        LOGV("release tunnel wakelock");
+        release_wake_lock(kTunnelWakelockStr);
+        android::Mutex::Autolock lock(mLock);
+        mStandby = true;
+    }
+    return NO_ERROR;
+}
+
+bool AudioHardware::AudioStreamOutTunnel::checkStandby()
+{
+    android::Mutex::Autolock lock(mLock);
+    return mStandby;
+}
+
+uint32_t AudioHardware::AudioStreamOutTunnel::devices()
+{
+    android::Mutex::Autolock lock(mLock);
+    return mDevices;
+}
+
+status_t AudioHardware::AudioStreamOutTunnel::dump(int fd, const Vector<String16>& args)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+    result.append("AudioStreamOutTunnel::dump\n");
+    snprintf(buffer, SIZE, "\tformat: %s\n", mFormat == AudioSystem::AAC ? "aac" : "mp3");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tsample rate: %d\n", sampleRate());
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tchannels: %d\n", channels());
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tmStandby: %s\n", mStandby? "true": "false");
+    result.append(buffer);
+    mSession.dump(result);
+    ::write(fd, result.string(), result.size());
+    return NO_ERROR;
+}
+
+status_t AudioHardware::AudioStreamOutTunnel::setParameters(const String8& keyValuePairs)
+{
+    AudioParameter param = AudioParameter(keyValuePairs);
+    String8 key = String8(AudioParameter::keyRouting);
+    status_t status = NO_ERROR;
+    int device;
+    LOGV("AudioStreamOutTunnel::setParameters() %s", keyValuePairs.string());
+
+    if (param.getInt(key, device) == NO_ERROR) {
+        {
+            android::Mutex::Autolock lock(mLock);
+            mDevices = device;
+        }
+        LOGV("set tunnel output routing %x", device);
+        status = mHardware->requestRouting();
+        param.remove(key);
+    }
+
+    if (param.size()) {
+        status = BAD_VALUE;
+    }
+    return status;
+}
+
+String8 AudioHardware::AudioStreamOutTunnel::getParameters(const String8& keys)
+{
+    AudioParameter param = AudioParameter(keys);
+    String8 value;
+    String8 key = String8(AudioParameter::keyRouting);
+
+    if (param.get(key, value) == NO_ERROR) {
+        param.addInt(key, (int)devices());
+    }
+    return param.toString();
+}
+
+status_t AudioHardware::AudioStreamOutTunnel::getRenderPosition(uint32_t *dspFrames)
+{
+    // the driver only counts compressed bytes
     return INVALID_OPERATION;
 }
 
@@ -1768,7 +2463,7 @@ AudioHardware::AudioStreamInMSM72xx::AudioStreamInMSM72xx() :
     mHardware(0), mFd(-1), mStandby(true), mRetryCount(0),
     mFormat(AUDIO_HW_IN_FORMAT), mChannels(AUDIO_HW_IN_CHANNELS),
     mSampleRate(AUDIO_HW_IN_SAMPLERATE), mBufferSize(AUDIO_HW_IN_BUFSZ),
-    mAcoustics((AudioSystem::audio_in_acoustics)0), mDevices(0)
+    mAcoustics((AudioSystem::audio_in_acoustics)0), mDevices(0), mStandbyCount(0)
 {
 }
 
@@ -1803,7 +2498,7 @@ status_t AudioHardware::AudioStreamInMSM72xx::set(
         return -EPERM;
     }
 
-    mBufferSize = hw->getBufferSize(*pRate, AudioSystem::popCount(*pChannels));
+    mBufferSize = hw->getBufferSize(*pRate, AudioSystem::popCount(*pChannels)) * in_batch;
     mDevices = devices;
     mFormat = AUDIO_HW_IN_FORMAT;
     mChannels = *pChannels;
@@ -1821,6 +2516,7 @@ AudioHardware::AudioStreamInMSM72xx::~AudioStreamInMSM72xx()
 
 ssize_t AudioHardware::AudioStreamInMSM72xx::read( void* buffer, ssize_t bytes)
 {
+    HALTRACE_SCOPE_ARGS("audio", "in_read", bytes, 0);
 //    LOGV("AudioStreamInMSM72xx::read(%p, %ld)", buffer, bytes);
     if (!mHardware) return -1;
 
@@ -1829,6 +2525,7 @@ ssize_t AudioHardware::AudioStreamInMSM72xx::read( void* buffer, ssize_t bytes)
     status_t status = NO_ERROR;
 
     if (mStandby) {
+        nsecs_t start = systemTime();
         {   // scope for the lock
             android::Mutex::Autolock lock(mHardware->mLock);
             LOGV("acquire input wakelock");
@@ -1881,20 +2578,24 @@ ssize_t AudioHardware::AudioStreamInMSM72xx::read( void* buffer, ssize_t bytes)
             LOGE("Error starting record");
             goto Error;
         }
+        mStartTime.record(systemTime() - start);
     }
 
-    while (count) {
-        ssize_t bytesRead = ::read(mFd, buffer, count);
-        if (bytesRead >= 0) {
-            count -= bytesRead;
-            p += bytesRead;
-        } else {
-            if (errno != EAGAIN) {
-                status = bytesRead;
-                goto Error;
+    {   // scope for the read timer
+        android::AutoHistogram timer(mReadTime);
+        while (count) {
+            ssize_t bytesRead = ::read(mFd, p, count);
+            if (bytesRead >= 0) {
+                count -= bytesRead;
+                p += bytesRead;
+            } else {
+                if (errno != EAGAIN) {
+                    status = bytesRead;
+                    goto Error;
+                }
+                mRetryCount++;
+                LOGD("EAGAIN - retrying");
             }
-            mRetryCount++;
-            LOGD("EAGAIN - retrying");
         }
     }
     return bytes;
@@ -1912,6 +2613,8 @@ status_t AudioHardware::AudioStreamInMSM72xx::standby()
 {
     if (!mStandby) {
         LOGD("AudioHardware PCM record is going to standby.");
+        android::AutoHistogram timer(mStandbyTime);
+        mStandbyCount++;
         if (mFd >= 0) {
             ::close(mFd);
             mFd = -1;
@@ -1957,8 +2660,13 @@ status_t AudioHardware::AudioStreamInMSM72xx::dump(int fd, const Vector<String16
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmStandby: %d\n", mStandby);
     result.append(buffer);
-    snprintf(buffer, SIZE, "\tmRetryCount: %d\n", mRetryCount);
+    snprintf(buffer, SIZE, "\tEAGAIN retries: %d\n", mRetryCount);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tstandbys: %u\n", mStandbyCount);
     result.append(buffer);
+    mReadTime.dump(result, "read");
+    mStartTime.dump(result, "standby exit");
+    mStandbyTime.dump(result, "standby enter");
     ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
@@ -1989,7 +2697,7 @@ status_t AudioHardware::AudioStreamInMSM72xx::setParameters(const String8& keyVa
             status = BAD_VALUE;
         } else {
             mDevices = device;
-            status = mHardware->doRouting();
+            status = mHardware->requestRouting();
         }
         param.remove(key);
     }
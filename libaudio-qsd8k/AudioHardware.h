@@ -25,6 +25,8 @@
 
 #include <hardware_legacy/AudioHardwareBase.h>
 
+#include "PcmSession.h"
+
 namespace android_audio_legacy {
 
 // ----------------------------------------------------------------------------
@@ -152,19 +154,59 @@ struct msm_mute_info {
 #define AUDIO_HW_OUT_CHANNELS (AudioSystem::CHANNEL_OUT_STEREO) // Default audio output channel mask
 #define AUDIO_HW_OUT_FORMAT (AudioSystem::PCM_16_BIT)  // Default audio output sample format
 #define AUDIO_HW_OUT_BUFSZ 3072  // Default audio output buffer size
+#define AUDIO_HW_NUM_OUT_BUF_LOW_LATENCY 2  // Number of driver buffers in low latency mode
+// Size of the low latency ring in driver buffers.  The ring and the driver
+// buffers together must not hold more than AUDIO_HW_NUM_OUT_BUF buffers of
+// AUDIO_HW_OUT_BUFSZ, the depth of the normal path.
+#define AUDIO_HW_OUT_RING_BUF 2
+#define AUDIO_HW_OUT_TUNNEL_BUFSZ 8192  // Compressed data per driver buffer in tunnel mode
+#define AUDIO_HW_NUM_OUT_TUNNEL_BUF 2  // Number of driver buffers in tunnel mode
+// compressed data has no fixed duration, this covers the decoder's own buffering
+#define AUDIO_HW_OUT_TUNNEL_LATENCY_MS 200
+#define AUDIO_HW_OUT_TUNNEL_NOMINAL_BPS 128000  // bit rate used to pace writes on error
 
 #define AUDIO_HW_IN_SAMPLERATE 8000                 // Default audio input sample rate
 #define AUDIO_HW_IN_CHANNELS (AudioSystem::CHANNEL_IN_MONO) // Default audio input channel mask
 #define AUDIO_HW_IN_FORMAT (AudioSystem::PCM_16_BIT)  // Default audio input sample format
 #define AUDIO_HW_IN_BUFSZ 256  // Default audio input buffer size
+#define AUDIO_HW_IN_MAX_BATCH 8  // Maximum audio input buffer size multiplier
 
 #define VOICE_VOLUME_MAX 5  // Maximum voice volume
 // ----------------------------------------------------------------------------
 
+// Lock-free single-producer/single-consumer byte ring. One thread may call
+// write() while another calls read(); everything else is only safe while
+// neither is running.
+class AudioRingBuffer
+{
+public:
+                        AudioRingBuffer();
+                        ~AudioRingBuffer();
+            // holds at most size bytes; the storage behind it is rounded
+            // up to a power of two
+            status_t    init(size_t size);
+            void        reset();
+            size_t      size() const { return mCapacity; }
+            size_t      available() const;  // bytes ready to be read
+            size_t      space() const;      // bytes that can be written
+            size_t      write(const void* buffer, size_t bytes);
+            size_t      read(void* buffer, size_t bytes);
+
+private:
+            uint8_t*    mData;
+            size_t      mSize;
+            size_t      mCapacity;
+            volatile int32_t mRead;     // only advanced by the consumer
+            volatile int32_t mWrite;    // only advanced by the producer
+};
+
+// ----------------------------------------------------------------------------
+
 
 class AudioHardware : public  AudioHardwareBase
 {
     class AudioStreamOutMSM72xx;
+    class AudioStreamOutTunnel;
     class AudioStreamInMSM72xx;
 
 public:
@@ -223,17 +265,24 @@ private:
     status_t    get_mRoutes();
     status_t    set_mRecordState(bool onoff);
     status_t    doA1026_init();
+    void        loadA1026();
+    bool        waitForA1026_l();
     status_t    get_snd_dev();
     status_t    get_batt_temp(int *batt_temp);
     status_t    doAudience_A1026_Control(int Mode, bool Record, uint32_t Routes);
     status_t    doRouting();
+    // routes from the routing thread once requests stop arriving, or right
+    // away if there is no routing thread
+    status_t    requestRouting();
     status_t    updateACDB();
     uint32_t    getACDB(int mode, int device);
     AudioStreamInMSM72xx*   getActiveInput_l();
     status_t    do_tpa2018_control(int mode);
+    // AUDIO_START with the ACDB id of the current device, then the stream volume
+    status_t    startPlayback(int fd, int *sndDevice);
     size_t      getBufferSize(uint32_t sampleRate, int channelCount);
 
-    class AudioStreamOutMSM72xx : public AudioStreamOut {
+    class AudioStreamOutMSM72xx : public AudioStreamOut, private android::PcmSession::Starter {
     public:
                             AudioStreamOutMSM72xx();
         virtual             ~AudioStreamOutMSM72xx();
@@ -247,7 +296,7 @@ private:
         virtual size_t      bufferSize() const { return mBufferSize; }
         virtual uint32_t    channels() const { return mChannels; }
         virtual int         format() const { return AUDIO_HW_OUT_FORMAT; }
-        virtual uint32_t    latency() const { return (1000*AUDIO_HW_NUM_OUT_BUF*(bufferSize()/frameSize()))/sampleRate()+AUDIO_HW_OUT_LATENCY_MS; }
+        virtual uint32_t    latency() const;
         virtual status_t    setVolume(float left, float right) { return INVALID_OPERATION; }
         virtual ssize_t     write(const void* buffer, size_t bytes);
         virtual status_t    standby();
@@ -259,15 +308,100 @@ private:
         virtual status_t    getRenderPosition(uint32_t *dspFrames);
 
     private:
+        // In low latency mode write() only queues into mRing, and the
+        // feeder thread moves the data to the driver at audio priority,
+        // so the caller never blocks on the DSP.
+        class Feeder : public android::Thread {
+        public:
+                                Feeder(AudioStreamOutMSM72xx* out) :
+                                    android::Thread(false), mOut(out) { }
+        private:
+            virtual bool        threadLoop();
+                    AudioStreamOutMSM72xx* mOut;
+        };
+        friend class Feeder;
+
+        // PcmSession::Starter, AUDIO_START with the ACDB id of the current device
+        virtual status_t    start(int fd);
+
+                android::PcmSession::Config sessionConfig() const;
+                status_t    doStandby(bool warm);
+
+                ssize_t     writeToDriver(const uint8_t* p, size_t bytes);
+                ssize_t     queue(const uint8_t* p, size_t bytes);
+                status_t    startFeeder();
+                void        stopFeeder();
+
                 AudioHardware* mHardware;
-                int         mFd;
-                int         mStartCount;
-                int         mRetryCount;
                 bool        mStandby;
                 uint32_t    mDevices;
                 uint32_t    mChannels;
                 uint32_t    mSampleRate;
                 size_t      mBufferSize;
+                bool        mLowLatency;
+                size_t      mDriverBufferSize;
+                AudioRingBuffer mRing;
+                android::sp<Feeder> mFeeder;
+                android::Mutex      mRingLock;  // only for sleeping on the ring
+                android::Condition  mDataCond;
+                android::Condition  mSpaceCond;
+                volatile bool       mFeederDone;
+                status_t            mFeederStatus;
+                uint32_t            mWarmStandbyMs;
+                int                 mStartSndDevice;
+                // last, it is configured from the members above
+                android::PcmSession mSession;
+    };
+
+    // MP3 or AAC (ADTS) frames decoded by the ADSP, so the ARM can idle
+    // during playback. Routed and started like the PCM output.
+    // Nothing opens it yet: the policy manager and AudioFlinger only ask
+    // for PCM outputs, so it is reached only by a client that passes MP3
+    // or AAC to openOutputStream() itself.
+    class AudioStreamOutTunnel : public AudioStreamOut, private android::PcmSession::Starter {
+    public:
+                            AudioStreamOutTunnel();
+        virtual             ~AudioStreamOutTunnel();
+                status_t    set(AudioHardware* mHardware,
+                                uint32_t devices,
+                                int *pFormat,
+                                uint32_t *pChannels,
+                                uint32_t *pRate);
+        virtual uint32_t    sampleRate() const { return mSampleRate; }
+        virtual size_t      bufferSize() const { return AUDIO_HW_OUT_TUNNEL_BUFSZ; }
+        virtual uint32_t    channels() const { return mChannels; }
+        virtual int         format() const { return mFormat; }
+        virtual uint32_t    latency() const { return mSession.latency(); }
+        virtual status_t    setVolume(float left, float right) { return INVALID_OPERATION; }
+        virtual ssize_t     write(const void* buffer, size_t bytes);
+        virtual status_t    standby();
+        virtual status_t    dump(int fd, const Vector<String16>& args);
+                bool        checkStandby();
+        virtual status_t    setParameters(const String8& keyValuePairs);
+        virtual String8     getParameters(const String8& keys);
+                uint32_t    devices();
+        virtual status_t    getRenderPosition(uint32_t *dspFrames);
+
+        static  bool        isTunnelFormat(int format);
+
+    private:
+        virtual status_t    start(int fd);
+
+                android::PcmSession::Config sessionConfig() const;
+
+                AudioHardware* mHardware;
+                // doRouting() reads mStandby and mDevices under the hardware
+                // lock; never held while calling into the session or the
+                // hardware, which take their own locks
+                android::Mutex mLock;
+                bool        mStandby;
+                uint32_t    mDevices;
+                int         mFormat;
+                uint32_t    mChannels;
+                uint32_t    mSampleRate;
+                int         mStartSndDevice;
+                // last, it is configured from the members above
+                android::PcmSession mSession;
     };
 
     class AudioStreamInMSM72xx : public AudioStreamIn {
@@ -306,6 +440,11 @@ private:
                 size_t      mBufferSize;
                 AudioSystem::audio_in_acoustics mAcoustics;
                 uint32_t    mDevices;
+                // diagnostics for dump()
+                uint32_t    mStandbyCount;
+                android::AudioHistogram mReadTime;
+                android::AudioHistogram mStartTime;
+                android::AudioHistogram mStandbyTime;
     };
 
             enum tty_modes {
@@ -315,9 +454,63 @@ private:
                 TTY_MODE_HCO
             };
 
+    // Keeps the last battery temperature reading so that getACDB() never
+    // touches sysfs on the stream start path. A stale reading is refreshed
+    // in the background the next time it is asked for.
+    class BattTempSampler : public android::Thread {
+    public:
+                            BattTempSampler(AudioHardware* hw);
+                status_t    get(int *batt_temp);
+                status_t    sample();
+                void        stop();
+    private:
+        virtual bool        threadLoop();
+                AudioHardware*      mHardware;
+                android::Mutex      mLock;
+                android::Condition  mCond;
+                bool                mRequested;
+                status_t            mStatus;
+                int                 mTemp;
+                nsecs_t             mTime;
+    };
+    friend class BattTempSampler;
+
+    // Applies the routing for a burst of requests once, after none has come
+    // in for the debounce time. doRouting() still routes synchronously for
+    // callers that need the new route before they continue.
+    class RoutingThread : public android::Thread {
+    public:
+                            RoutingThread(AudioHardware* hw, int debounceMs);
+                void        request();
+                void        stop();
+    private:
+        virtual bool        threadLoop();
+                AudioHardware*      mHardware;
+                nsecs_t             mDebounce;
+                android::Mutex      mLock;
+                android::Condition  mCond;
+                bool                mRequested;
+                nsecs_t             mRequestTime;
+    };
+    friend class RoutingThread;
+
+    // Downloads the A1026 firmware once, off the constructor's thread.
+    class A1026Loader : public android::Thread {
+    public:
+                            A1026Loader(AudioHardware* hw) :
+                                android::Thread(false), mHardware(hw) { }
+    private:
+        virtual bool        threadLoop() { mHardware->loadA1026(); return false; }
+                AudioHardware*      mHardware;
+    };
+    friend class A1026Loader;
+
             static const uint32_t inputSamplingRates[];
+    // mA1026Lock guards fd_a1026, which stays open while mA1026Init
     android::Mutex       mA1026Lock;
+    android::Condition   mA1026Cond;
     bool        mA1026Init;
+    bool        mA1026Loading;
             bool        mRecordState;
             bool        mInit;
             bool        mMicMute;
@@ -326,6 +519,7 @@ private:
             uint32_t    mBluetoothIdTx;
             uint32_t    mBluetoothIdRx;
             AudioStreamOutMSM72xx*  mOutput;
+            AudioStreamOutTunnel*   mTunnelOutput;
             android::SortedVector<AudioStreamInMSM72xx*>   mInputs;
 
             msm_bt_endpoint *mBTEndpoints;
@@ -333,6 +527,10 @@ private:
             int mCurSndDevice;
             int mNoiseSuppressionState;
             uint32_t mVoiceVolume;
+            android::AudioHistogram mRoutingTime;   // doRouting(), under mLock
+            android::sp<BattTempSampler> mBattTempSampler;
+            android::sp<RoutingThread> mRoutingThread;
+            android::sp<A1026Loader> mA1026Loader;
 
      friend class AudioStreamInMSM72xx;
             android::Mutex       mLock;
@@ -32,7 +32,7 @@ class AudioPolicyManager: public AudioPolicyManagerBase
 
 public:
                 AudioPolicyManager(AudioPolicyClientInterface *clientInterface)
-                : AudioPolicyManagerBase(clientInterface) {}
+                : AudioPolicyManagerBase(clientInterface), mComputedStrategies(0) {}
 
         virtual ~AudioPolicyManager() {}
 
@@ -50,6 +50,26 @@ protected:
         // phone state, connected devices...
         virtual uint32_t getDeviceForStrategy(routing_strategy strategy, bool fromCache = true);
         virtual float computeVolume(int stream, int index, audio_io_handle_t output, uint32_t device);
+
+private:
+        // everything computeDeviceForStrategy() bases its choice on
+        struct RoutingInputs {
+            int phoneState;
+            AudioSystem::forced_config forceUse[AudioSystem::NUM_FORCE_USE];
+            uint32_t availableOutputDevices;
+#ifdef WITH_A2DP
+            audio_io_handle_t a2dpOutput;
+#endif
+        };
+
+        void getRoutingInputs(RoutingInputs *inputs) const;
+        uint32_t computeDeviceForStrategy(routing_strategy strategy);
+
+        // devices computed for the current RoutingInputs, valid for the strategies whose
+        // bit is set in mComputedStrategies
+        RoutingInputs mComputedInputs;
+        uint32_t mComputedStrategies;
+        uint32_t mComputedDevice[NUM_STRATEGIES];
 };
 
 };
@@ -14,6 +14,7 @@
 ** limitations under the License.
 */
 
+#include <ctype.h>
 #include <math.h>
 
 //#define LOG_NDEBUG 0
@@ -32,6 +33,7 @@
 // hardware specific functions
 
 #include "AudioHardware.h"
+#include "haltrace.h"
 #include <media/AudioRecord.h>
 
 #define LOG_SND_RPC 0  // Set to 1 to log sound RPC's
@@ -60,9 +62,16 @@ AudioHardware::AudioHardware() :
     SND_DEVICE_FM_HEADSET(-1),
     SND_DEVICE_HEADSET_AND_SPEAKER(-1),
     SND_DEVICE_FM_SPEAKER(-1),
-    SND_DEVICE_BT_EC_OFF(-1)
+    SND_DEVICE_BT_EC_OFF(-1),
+    mEndpointIndex(NULL), mEndpointIndexSize(0)
 {
+    loadEndpoints();
+    buildEndpointIndex();
+    buildRoutingTable();
+}
 
+void AudioHardware::loadEndpoints()
+{
     int (*snd_get_num)();
     int (*snd_get_endpoint)(int, msm_snd_endpoint *);
     int (*set_acoustic_parameters)();
@@ -111,6 +120,9 @@ AudioHardware::AudioHardware() :
     for (int cnt = 0; cnt < mNumSndEndpoints; cnt++, ept++) {
         ept->id = cnt;
         snd_get_endpoint(cnt, ept);
+        if (!strcmp(ept->name, "CURRENT")) {
+            mSndControl.setCurrentDeviceId(ept->id);
+        }
 #define CHECK_FOR(desc) \
         if (!strcmp(ept->name, #desc)) { \
             SND_DEVICE_##desc = ept->id; \
@@ -142,6 +154,7 @@ AudioHardware::~AudioHardware()
     mInputs.clear();
     closeOutputStream((AudioStreamOut*)mOutput);
     delete [] mSndEndpoints;
+    delete [] mEndpointIndex;
     if (acoustic) {
         ::dlclose(acoustic);
         acoustic = 0;
@@ -149,6 +162,204 @@ AudioHardware::~AudioHardware()
     mInit = false;
 }
 
+// Open addressed, keyed by the case folded endpoint name.
+static uint32_t endpointHash(const char* name)
+{
+    uint32_t hash = 2166136261U;    // FNV-1a
+    for (; *name; name++) {
+        hash = (hash ^ (uint32_t)tolower((unsigned char)*name)) * 16777619U;
+    }
+    return hash;
+}
+
+void AudioHardware::buildEndpointIndex()
+{
+    if (mNumSndEndpoints <= 0 || mSndEndpoints == NULL) {
+        return;
+    }
+    // at most half full, so probe runs stay short
+    size_t size = 8;
+    while (size < 2 * (size_t)mNumSndEndpoints) {
+        size <<= 1;
+    }
+    mEndpointIndex = new int[size];
+    mEndpointIndexSize = size;
+    for (size_t i = 0; i < size; i++) {
+        mEndpointIndex[i] = -1;
+    }
+    for (int cnt = 0; cnt < mNumSndEndpoints; cnt++) {
+        size_t slot = endpointHash(mSndEndpoints[cnt].name) & (size - 1);
+        while (mEndpointIndex[slot] >= 0) {
+            slot = (slot + 1) & (size - 1);
+        }
+        mEndpointIndex[slot] = cnt;
+    }
+}
+
+// Returns the endpoint whose name matches ignoring case, NULL if none.
+const msm_snd_endpoint* AudioHardware::findEndpoint(const char* name) const
+{
+    if (mEndpointIndex == NULL) {
+        return NULL;
+    }
+    size_t mask = mEndpointIndexSize - 1;
+    for (size_t slot = endpointHash(name) & mask; mEndpointIndex[slot] >= 0;
+            slot = (slot + 1) & mask) {
+        const msm_snd_endpoint* ept = &mSndEndpoints[mEndpointIndex[slot]];
+        if (!strcasecmp(name, ept->name)) {
+            return ept;
+        }
+    }
+    return NULL;
+}
+
+// doRouting() only looks at which class the input device is in and at
+// these output bits, so every decision fits in a table of
+// ROUTE_INPUT_CLASSES << ROUTE_OUTPUT_BITS entries.
+enum {
+    ROUTE_OUT_BT            = 1 << 0,   // SCO or SCO headset
+    ROUTE_OUT_CARKIT        = 1 << 1,
+    ROUTE_OUT_HEADSET       = 1 << 2,
+    ROUTE_OUT_HEADPHONE     = 1 << 3,
+    ROUTE_OUT_SPEAKER       = 1 << 4,
+};
+
+enum {
+    ROUTE_IN_NONE,
+    ROUTE_IN_BT,
+    ROUTE_IN_HEADSET,
+    ROUTE_IN_OTHER,
+};
+
+size_t AudioHardware::routeIndex(uint32_t inputDevice, uint32_t outputDevices)
+{
+    int in;
+    if (inputDevice == 0) {
+        in = ROUTE_IN_NONE;
+    } else if (inputDevice & AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
+        in = ROUTE_IN_BT;
+    } else if (inputDevice & AudioSystem::DEVICE_IN_WIRED_HEADSET) {
+        in = ROUTE_IN_HEADSET;
+    } else {
+        in = ROUTE_IN_OTHER;
+    }
+
+    int out = 0;
+    if (outputDevices &
+        (AudioSystem::DEVICE_OUT_BLUETOOTH_SCO | AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET))
+        out |= ROUTE_OUT_BT;
+    if (outputDevices & AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT)
+        out |= ROUTE_OUT_CARKIT;
+    if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET)
+        out |= ROUTE_OUT_HEADSET;
+    if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE)
+        out |= ROUTE_OUT_HEADPHONE;
+    if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER)
+        out |= ROUTE_OUT_SPEAKER;
+
+    return (in << ROUTE_OUTPUT_BITS) | out;
+}
+
+void AudioHardware::buildRoutingTable()
+{
+    static const uint32_t inputs[ROUTE_INPUT_CLASSES] = {
+        0,
+        AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET,
+        AudioSystem::DEVICE_IN_WIRED_HEADSET,
+        AudioSystem::DEVICE_IN_BUILTIN_MIC,
+    };
+    for (int in = 0; in < ROUTE_INPUT_CLASSES; in++) {
+        for (int out = 0; out < (1 << ROUTE_OUTPUT_BITS); out++) {
+            uint32_t outputDevices = 0;
+            if (out & ROUTE_OUT_BT)
+                outputDevices |= AudioSystem::DEVICE_OUT_BLUETOOTH_SCO;
+            if (out & ROUTE_OUT_CARKIT)
+                outputDevices |= AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT;
+            if (out & ROUTE_OUT_HEADSET)
+                outputDevices |= AudioSystem::DEVICE_OUT_WIRED_HEADSET;
+            if (out & ROUTE_OUT_HEADPHONE)
+                outputDevices |= AudioSystem::DEVICE_OUT_WIRED_HEADPHONE;
+            if (out & ROUTE_OUT_SPEAKER)
+                outputDevices |= AudioSystem::DEVICE_OUT_SPEAKER;
+            computeRoute(inputs[in], outputDevices,
+                    &mRoutes[routeIndex(inputs[in], outputDevices)]);
+        }
+    }
+}
+
+void AudioHardware::computeRoute(uint32_t inputDevice, uint32_t outputDevices, SndRoute* route)
+{
+    int audProcess = (ADRC_DISABLE | EQ_DISABLE | RX_IIR_DISABLE);
+    int sndDevice = -1;
+    const char* name = NULL;
+
+    if (inputDevice != 0) {
+        if (inputDevice & AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
+            name = "Bluetooth PCM";
+            sndDevice = SND_DEVICE_BT;
+        } else if (inputDevice & AudioSystem::DEVICE_IN_WIRED_HEADSET) {
+            if ((outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) &&
+                (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER)) {
+                name = "Wired Headset and Speaker";
+                sndDevice = SND_DEVICE_HEADSET_AND_SPEAKER;
+                audProcess = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE);
+            } else {
+                name = "Wired Headset";
+                sndDevice = SND_DEVICE_HEADSET;
+            }
+        } else {
+            if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) {
+                name = "Speakerphone";
+                sndDevice = SND_DEVICE_SPEAKER;
+                audProcess = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE);
+            } else {
+                name = "Handset";
+                sndDevice = SND_DEVICE_HANDSET;
+            }
+        }
+    }
+    // if inputDevice == 0, restore output routing
+
+    if (sndDevice == -1) {
+        if (outputDevices &
+            (AudioSystem::DEVICE_OUT_BLUETOOTH_SCO | AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET)) {
+            name = "Bluetooth PCM";
+            sndDevice = SND_DEVICE_BT;
+        } else if (outputDevices & AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT) {
+            name = "Bluetooth PCM";
+            sndDevice = SND_DEVICE_CARKIT;
+        } else if ((outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) &&
+                   (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER)) {
+            name = "Wired Headset and Speaker";
+            sndDevice = SND_DEVICE_HEADSET_AND_SPEAKER;
+            audProcess = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE);
+        } else if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE) {
+            if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) {
+                name = "No microphone Wired Headset and Speaker";
+                sndDevice = SND_DEVICE_HEADSET_AND_SPEAKER;
+                audProcess = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE);
+            } else {
+                name = "No microphone Wired Headset";
+                sndDevice = SND_DEVICE_NO_MIC_HEADSET;
+            }
+        } else if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) {
+            name = "Wired Headset";
+            sndDevice = SND_DEVICE_HEADSET;
+        } else if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) {
+            name = "Speakerphone";
+            sndDevice = SND_DEVICE_SPEAKER;
+            audProcess = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE);
+        } else {
+            name = "Handset";
+            sndDevice = SND_DEVICE_HANDSET;
+        }
+    }
+
+    route->sndDevice = sndDevice;
+    route->audProcess = audProcess;
+    route->name = name;
+}
+
 status_t AudioHardware::initCheck()
 {
     return mInit ? NO_ERROR : NO_INIT;
@@ -242,6 +453,7 @@ status_t AudioHardware::setMode(int mode)
     if (status == NO_ERROR) {
         // make sure that doAudioRouteOrMute() is called by doRouting()
         // even if the new device selected is the same as current one.
+        Mutex::Autolock lock(mLock);
         clearCurDevice();
     }
     return status;
@@ -305,12 +517,10 @@ status_t AudioHardware::setParameters(const String8& keyValuePairs)
     key = String8(BT_NAME_KEY);
     if (param.get(key, value) == NO_ERROR) {
         mBluetoothId = 0;
-        for (int i = 0; i < mNumSndEndpoints; i++) {
-            if (!strcasecmp(value.string(), mSndEndpoints[i].name)) {
-                mBluetoothId = mSndEndpoints[i].id;
-                LOGI("Using custom acoustic parameters for %s", value.string());
-                break;
-            }
+        const msm_snd_endpoint* ept = findEndpoint(value.string());
+        if (ept) {
+            mBluetoothId = ept->id;
+            LOGI("Using custom acoustic parameters for %s", value.string());
         }
         if (mBluetoothId == 0) {
             LOGI("Using default acoustic parameters "
@@ -357,20 +567,64 @@ size_t AudioHardware::getInputBufferSize(uint32_t sampleRate, int format, int ch
     return 2048*channelCount;
 }
 
-static status_t set_volume_rpc(uint32_t device,
-                               uint32_t method,
-                               uint32_t volume)
+// ----------------------------------------------------------------------------
+
+AudioHardware::SndControl::SndControl() :
+    mFd(-1), mCurrentId(-1U), mDeviceValid(false), mDevice(0), mEarMute(false),
+    mMicMute(false), mVolumeValid(false), mVolumeDevice(0), mVolumeMethod(0), mVolume(0),
+    mIoctls(0), mSkipped(0)
+{
+}
+
+AudioHardware::SndControl::~SndControl()
+{
+    if (mFd >= 0) {
+        close(mFd);
+    }
+}
+
+int AudioHardware::SndControl::open_l()
+{
+    if (mFd < 0) {
+        mFd = open("/dev/msm_snd", O_RDWR);
+        if (mFd < 0) {
+            LOGE("Can not open snd device");
+        }
+    }
+    return mFd;
+}
+
+// the driver state is unknown after an error, so reopen and resend
+void AudioHardware::SndControl::fail_l()
+{
+    close(mFd);
+    mFd = -1;
+    invalidate();
+}
+
+void AudioHardware::SndControl::invalidate()
+{
+    mDeviceValid = false;
+    mVolumeValid = false;
+}
+
+status_t AudioHardware::SndControl::setVolume(uint32_t device, uint32_t method, uint32_t volume)
 {
-    int fd;
 #if LOG_SND_RPC
     LOGD("rpc_snd_set_volume(%d, %d, %d)\n", device, method, volume);
 #endif
 
     if (device == -1UL) return NO_ERROR;
 
-    fd = open("/dev/msm_snd", O_RDWR);
-    if (fd < 0) {
-        LOGE("Can not open snd device");
+    // SND_DEVICE_CURRENT and the device it currently means are the same
+    uint32_t target = (device == mCurrentId && mDeviceValid) ? mDevice : device;
+    if (mVolumeValid && mVolumeDevice == target && mVolumeMethod == method &&
+            mVolume == volume) {
+        mSkipped++;
+        return NO_ERROR;
+    }
+
+    if (open_l() < 0) {
         return -EPERM;
     }
     /* rpc_snd_set_volume(
@@ -382,70 +636,40 @@ static status_t set_volume_rpc(uint32_t device,
      *  )
      * rpc_snd_set_volume only works for in-call sound volume.
      */
-     struct msm_snd_volume_config args;
-     args.device = device;
-     args.method = method;
-     args.volume = volume;
-
-     if (ioctl(fd, SND_SET_VOLUME, &args) < 0) {
-         LOGE("snd_set_volume error.");
-         close(fd);
-         return -EIO;
-     }
-     close(fd);
-     return NO_ERROR;
-}
+    struct msm_snd_volume_config args;
+    args.device = device;
+    args.method = method;
+    args.volume = volume;
 
-status_t AudioHardware::setVoiceVolume(float v)
-{
-    if (v < 0.0) {
-        LOGW("setVoiceVolume(%f) under 0.0, assuming 0.0\n", v);
-        v = 0.0;
-    } else if (v > 1.0) {
-        LOGW("setVoiceVolume(%f) over 1.0, assuming 1.0\n", v);
-        v = 1.0;
+    mIoctls++;
+    if (ioctl(mFd, SND_SET_VOLUME, &args) < 0) {
+        LOGE("snd_set_volume error.");
+        fail_l();
+        return -EIO;
     }
-
-    int vol = lrint(v * 5.0);
-    LOGD("setVoiceVolume(%f)\n", v);
-    LOGI("Setting in-call volume to %d (available range is 0 to 5)\n", vol);
-
-    Mutex::Autolock lock(mLock);
-    set_volume_rpc(SND_DEVICE_CURRENT, SND_METHOD_VOICE, vol);
+    mVolumeValid = true;
+    mVolumeDevice = target;
+    mVolumeMethod = method;
+    mVolume = volume;
     return NO_ERROR;
 }
 
-status_t AudioHardware::setMasterVolume(float v)
-{
-    Mutex::Autolock lock(mLock);
-    int vol = ceil(v * 5.0);
-    LOGI("Set master volume to %d.\n", vol);
-    /*
-    set_volume_rpc(SND_DEVICE_HANDSET, SND_METHOD_VOICE, vol);
-    set_volume_rpc(SND_DEVICE_SPEAKER, SND_METHOD_VOICE, vol);
-    set_volume_rpc(SND_DEVICE_BT,      SND_METHOD_VOICE, vol);
-    set_volume_rpc(SND_DEVICE_HEADSET, SND_METHOD_VOICE, vol);
-    */
-    // We return an error code here to let the audioflinger do in-software
-    // volume on top of the maximum volume that we set through the SND API.
-    // return error - software mixer will handle it
-    return -1;
-}
-
-static status_t do_route_audio_rpc(uint32_t device,
-                                   bool ear_mute, bool mic_mute)
+status_t AudioHardware::SndControl::setDevice(uint32_t device, bool earMute, bool micMute)
 {
     if (device == -1UL)
         return NO_ERROR;
 
-    int fd;
 #if LOG_SND_RPC
-    LOGD("rpc_snd_set_device(%d, %d, %d)\n", device, ear_mute, mic_mute);
+    LOGD("rpc_snd_set_device(%d, %d, %d)\n", device, earMute, micMute);
 #endif
 
-    fd = open("/dev/msm_snd", O_RDWR);
-    if (fd < 0) {
-        LOGE("Can not open snd device");
+    uint32_t target = (device == mCurrentId && mDeviceValid) ? mDevice : device;
+    if (mDeviceValid && mDevice == target && mEarMute == earMute && mMicMute == micMute) {
+        mSkipped++;
+        return NO_ERROR;
+    }
+
+    if (open_l() < 0) {
         return -EPERM;
     }
     // RPC call to switch audio path
@@ -460,22 +684,80 @@ static status_t do_route_audio_rpc(uint32_t device,
      */
     struct msm_snd_device_config args;
     args.device = device;
-    args.ear_mute = ear_mute ? SND_MUTE_MUTED : SND_MUTE_UNMUTED;
-    args.mic_mute = mic_mute ? SND_MUTE_MUTED : SND_MUTE_UNMUTED;
+    args.ear_mute = earMute ? SND_MUTE_MUTED : SND_MUTE_UNMUTED;
+    args.mic_mute = micMute ? SND_MUTE_MUTED : SND_MUTE_UNMUTED;
 
-    if (ioctl(fd, SND_SET_DEVICE, &args) < 0) {
+    mIoctls++;
+    if (ioctl(mFd, SND_SET_DEVICE, &args) < 0) {
         LOGE("snd_set_device error.");
-        close(fd);
+        fail_l();
         return -EIO;
     }
+    if (!mDeviceValid || mDevice != target) {
+        // the in-call volume is kept per device
+        mVolumeValid = false;
+    }
+    mDeviceValid = (target != mCurrentId);
+    mDevice = target;
+    mEarMute = earMute;
+    mMicMute = micMute;
+    return NO_ERROR;
+}
+
+void AudioHardware::SndControl::dump(String8& result) const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    snprintf(buffer, SIZE, "\tsnd: fd %d, device %d%s, ear mute %d, mic mute %d\n",
+            mFd, mDevice, mDeviceValid ? "" : " (unknown)", mEarMute, mMicMute);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tsnd: %u ioctls, %u redundant requests skipped\n",
+            mIoctls, mSkipped);
+    result.append(buffer);
+}
+
+// ----------------------------------------------------------------------------
+
+status_t AudioHardware::setVoiceVolume(float v)
+{
+    if (v < 0.0) {
+        LOGW("setVoiceVolume(%f) under 0.0, assuming 0.0\n", v);
+        v = 0.0;
+    } else if (v > 1.0) {
+        LOGW("setVoiceVolume(%f) over 1.0, assuming 1.0\n", v);
+        v = 1.0;
+    }
 
-    close(fd);
+    int vol = lrint(v * 5.0);
+    LOGD("setVoiceVolume(%f)\n", v);
+    LOGI("Setting in-call volume to %d (available range is 0 to 5)\n", vol);
+
+    Mutex::Autolock lock(mLock);
+    mSndControl.setVolume(SND_DEVICE_CURRENT, SND_METHOD_VOICE, vol);
     return NO_ERROR;
 }
 
+status_t AudioHardware::setMasterVolume(float v)
+{
+    Mutex::Autolock lock(mLock);
+    int vol = ceil(v * 5.0);
+    LOGI("Set master volume to %d.\n", vol);
+    /*
+    mSndControl.setVolume(SND_DEVICE_HANDSET, SND_METHOD_VOICE, vol);
+    mSndControl.setVolume(SND_DEVICE_SPEAKER, SND_METHOD_VOICE, vol);
+    mSndControl.setVolume(SND_DEVICE_BT,      SND_METHOD_VOICE, vol);
+    mSndControl.setVolume(SND_DEVICE_HEADSET, SND_METHOD_VOICE, vol);
+    */
+    // We return an error code here to let the audioflinger do in-software
+    // volume on top of the maximum volume that we set through the SND API.
+    // return error - software mixer will handle it
+    return -1;
+}
+
 // always call with mutex held
 status_t AudioHardware::doAudioRouteOrMute(uint32_t device)
 {
+    HALTRACE_SCOPE_ARGS("audio", "route", device, 0);
     if (device == (uint32_t)SND_DEVICE_BT || device == (uint32_t)SND_DEVICE_CARKIT) {
         if (mBluetoothId) {
             device = mBluetoothId;
@@ -484,8 +766,8 @@ status_t AudioHardware::doAudioRouteOrMute(uint32_t device)
         }
     }
     LOGV("doAudioRouteOrMute() device %x, mMode %d, mMicMute %d", device, mMode, mMicMute);
-    return do_route_audio_rpc(device,
-                              mMode != AudioSystem::MODE_IN_CALL, mMicMute);
+    return mSndControl.setDevice(device,
+                                 mMode != AudioSystem::MODE_IN_CALL, mMicMute);
 }
 
 status_t AudioHardware::doRouting()
@@ -499,80 +781,22 @@ status_t AudioHardware::doRouting()
     status_t ret = NO_ERROR;
     int (*msm72xx_enable_audpp)(int);
     msm72xx_enable_audpp = (int (*)(int))::dlsym(acoustic, "msm72xx_enable_audpp");
-    int audProcess = (ADRC_DISABLE | EQ_DISABLE | RX_IIR_DISABLE);
     AudioStreamInMSM72xx *input = getActiveInput_l();
     uint32_t inputDevice = (input == NULL) ? 0 : input->devices();
-    int sndDevice = -1;
 
     if (inputDevice != 0) {
         LOGI("do input routing device %x\n", inputDevice);
-        if (inputDevice & AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
-            LOGI("Routing audio to Bluetooth PCM\n");
-            sndDevice = SND_DEVICE_BT;
-        } else if (inputDevice & AudioSystem::DEVICE_IN_WIRED_HEADSET) {
-            if ((outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) &&
-                (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER)) {
-                LOGI("Routing audio to Wired Headset and Speaker\n");
-                sndDevice = SND_DEVICE_HEADSET_AND_SPEAKER;
-                audProcess = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE);
-            } else {
-                LOGI("Routing audio to Wired Headset\n");
-                sndDevice = SND_DEVICE_HEADSET;
-            }
-        } else {
-            if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) {
-                LOGI("Routing audio to Speakerphone\n");
-                sndDevice = SND_DEVICE_SPEAKER;
-                audProcess = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE);
-            } else {
-                LOGI("Routing audio to Handset\n");
-                sndDevice = SND_DEVICE_HANDSET;
-            }
+    } else if (outputDevices & (outputDevices - 1)) {
+        if ((outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) == 0) {
+            LOGW("Hardware does not support requested route combination (%#X),"
+                 " picking closest possible route...", outputDevices);
         }
     }
-    // if inputDevice == 0, restore output routing
 
-    if (sndDevice == -1) {
-        if (outputDevices & (outputDevices - 1)) {
-            if ((outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) == 0) {
-                LOGW("Hardware does not support requested route combination (%#X),"
-                     " picking closest possible route...", outputDevices);
-            }
-        }
-
-        if (outputDevices &
-            (AudioSystem::DEVICE_OUT_BLUETOOTH_SCO | AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET)) {
-            LOGI("Routing audio to Bluetooth PCM\n");
-            sndDevice = SND_DEVICE_BT;
-        } else if (outputDevices & AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT) {
-            LOGI("Routing audio to Bluetooth PCM\n");
-            sndDevice = SND_DEVICE_CARKIT;
-        } else if ((outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) &&
-                   (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER)) {
-            LOGI("Routing audio to Wired Headset and Speaker\n");
-            sndDevice = SND_DEVICE_HEADSET_AND_SPEAKER;
-            audProcess = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE);
-        } else if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE) {
-            if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) {
-                LOGI("Routing audio to No microphone Wired Headset and Speaker (%d,%x)\n", mMode, outputDevices);
-                sndDevice = SND_DEVICE_HEADSET_AND_SPEAKER;
-                audProcess = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE);
-            } else {
-                LOGI("Routing audio to No microphone Wired Headset (%d,%x)\n", mMode, outputDevices);
-                sndDevice = SND_DEVICE_NO_MIC_HEADSET;
-            }
-        } else if (outputDevices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) {
-            LOGI("Routing audio to Wired Headset\n");
-            sndDevice = SND_DEVICE_HEADSET;
-        } else if (outputDevices & AudioSystem::DEVICE_OUT_SPEAKER) {
-            LOGI("Routing audio to Speakerphone\n");
-            sndDevice = SND_DEVICE_SPEAKER;
-            audProcess = (ADRC_ENABLE | EQ_ENABLE | RX_IIR_ENABLE);
-        } else {
-            LOGI("Routing audio to Handset\n");
-            sndDevice = SND_DEVICE_HANDSET;
-        }
-    }
+    const SndRoute& route = mRoutes[routeIndex(inputDevice, outputDevices)];
+    int sndDevice = route.sndDevice;
+    int audProcess = route.audProcess;
+    LOGI("Routing audio to %s (%d,%x)\n", route.name, mMode, outputDevices);
 
     if (sndDevice != -1 && sndDevice != mCurSndDevice) {
         ret = doAudioRouteOrMute(sndDevice);
@@ -611,6 +835,10 @@ status_t AudioHardware::dumpInternals(int fd, const Vector<String16>& args)
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmBluetoothId: %d\n", mBluetoothId);
     result.append(buffer);
+    {
+        Mutex::Autolock lock(mLock);
+        mSndControl.dump(result);
+    }
     ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
@@ -625,6 +853,7 @@ status_t AudioHardware::dump(int fd, const Vector<String16>& args)
     if (mOutput) {
         mOutput->dump(fd, args);
     }
+    haltrace_dumpsys(fd);
     return NO_ERROR;
 }
 
@@ -658,10 +887,27 @@ AudioHardware::AudioStreamInMSM72xx *AudioHardware::getActiveInput_l()
 // ----------------------------------------------------------------------------
 
 AudioHardware::AudioStreamOutMSM72xx::AudioStreamOutMSM72xx() :
-    mHardware(0), mFd(-1), mStartCount(0), mRetryCount(0), mStandby(true), mDevices(0)
+    mHardware(0), mSession(sessionConfig()), mStandby(true), mDevices(0)
 {
 }
 
+PcmSession::Config AudioHardware::AudioStreamOutMSM72xx::sessionConfig()
+{
+    PcmSession::Config config;
+    config.device = "/dev/msm_pcm_out";
+    config.sampleRate = 44100;
+    config.channelCount = 2;
+    config.bufferSize = 4800;
+    config.bufferCount = AUDIO_HW_NUM_OUT_BUF;
+    config.setCodecType = true;
+    config.compressed = false;
+    // fill 2 buffers before AUDIO_START
+    config.startMode = PcmSession::START_WHEN_PRIMED;
+    config.warmStandbyMs = 0;
+    config.extraLatencyMs = AUDIO_HW_OUT_LATENCY_MS;
+    return config;
+}
+
 status_t AudioHardware::AudioStreamOutMSM72xx::set(
         AudioHardware* hw, uint32_t devices, int *pFormat, uint32_t *pChannels, uint32_t *pRate)
 {
@@ -697,83 +943,29 @@ status_t AudioHardware::AudioStreamOutMSM72xx::set(
 
 AudioHardware::AudioStreamOutMSM72xx::~AudioStreamOutMSM72xx()
 {
-    if (mFd >= 0) close(mFd);
 }
 
 ssize_t AudioHardware::AudioStreamOutMSM72xx::write(const void* buffer, size_t bytes)
 {
+    HALTRACE_SCOPE_ARGS("audio", "out_write", bytes, 0);
     // LOGD("AudioStreamOutMSM72xx::write(%p, %u)", buffer, bytes);
-    status_t status = NO_INIT;
-    size_t count = bytes;
-    const uint8_t* p = static_cast<const uint8_t*>(buffer);
+    ssize_t status;
 
     if (mStandby) {
-
-        // open driver
-        LOGV("open driver");
-        status = ::open("/dev/msm_pcm_out", O_RDWR);
-        if (status < 0) {
-            LOGE("Cannot open /dev/msm_pcm_out errno: %d", errno);
-            goto Error;
-        }
-        mFd = status;
-
-        // configuration
-        LOGV("get config");
-        struct msm_audio_config config;
-        status = ioctl(mFd, AUDIO_GET_CONFIG, &config);
-        if (status < 0) {
-            LOGE("Cannot read config");
+        status = mSession.open();
+        if (status != NO_ERROR) {
             goto Error;
         }
-
-        LOGV("set config");
-        config.channel_count = AudioSystem::popCount(channels());
-        config.sample_rate = sampleRate();
-        config.buffer_size = bufferSize();
-        config.buffer_count = AUDIO_HW_NUM_OUT_BUF;
-        config.codec_type = CODEC_TYPE_PCM;
-        status = ioctl(mFd, AUDIO_SET_CONFIG, &config);
-        if (status < 0) {
-            LOGE("Cannot set config");
-            goto Error;
-        }
-
-        LOGV("buffer_size: %u", config.buffer_size);
-        LOGV("buffer_count: %u", config.buffer_count);
-        LOGV("channel_count: %u", config.channel_count);
-        LOGV("sample_rate: %u", config.sample_rate);
-
-        // fill 2 buffers before AUDIO_START
-        mStartCount = AUDIO_HW_NUM_OUT_BUF;
         mStandby = false;
     }
 
-    while (count) {
-        ssize_t written = ::write(mFd, p, count);
-        if (written >= 0) {
-            count -= written;
-            p += written;
-        } else {
-            if (errno != EAGAIN) return written;
-            mRetryCount++;
-            LOGW("EAGAIN - retry");
-        }
-    }
-
-    // start audio after we fill 2 buffers
-    if (mStartCount) {
-        if (--mStartCount == 0) {
-            ioctl(mFd, AUDIO_START, 0);
-        }
+    status = mSession.write(buffer, bytes);
+    if (status < 0) {
+        LOGE("write error %d", (int)status);
     }
-    return bytes;
+    return status;
 
 Error:
-    if (mFd >= 0) {
-        ::close(mFd);
-        mFd = -1;
-    }
     // Simulate audio output timing in case of error
     usleep(bytes * 1000000 / frameSize() / sampleRate());
 
@@ -783,9 +975,8 @@ Error:
 status_t AudioHardware::AudioStreamOutMSM72xx::standby()
 {
     status_t status = NO_ERROR;
-    if (!mStandby && mFd >= 0) {
-        ::close(mFd);
-        mFd = -1;
+    if (!mStandby) {
+        mSession.standby();
     }
     mStandby = true;
     return status;
@@ -807,14 +998,9 @@ status_t AudioHardware::AudioStreamOutMSM72xx::dump(int fd, const Vector<String1
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmHardware: %p\n", mHardware);
     result.append(buffer);
-    snprintf(buffer, SIZE, "\tmFd: %d\n", mFd);
-    result.append(buffer);
-    snprintf(buffer, SIZE, "\tmStartCount: %d\n", mStartCount);
-    result.append(buffer);
-    snprintf(buffer, SIZE, "\tmRetryCount: %d\n", mRetryCount);
-    result.append(buffer);
     snprintf(buffer, SIZE, "\tmStandby: %s\n", mStandby? "true": "false");
     result.append(buffer);
+    mSession.dump(result);
     ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
@@ -863,8 +1049,10 @@ String8 AudioHardware::AudioStreamOutMSM72xx::getParameters(const String8& keys)
 
 status_t AudioHardware::AudioStreamOutMSM72xx::getRenderPosition(uint32_t *dspFrames)
 {
-    //TODO: enable when supported by driver
-    return INVALID_OPERATION;
+    if (mStandby) {
+        return INVALID_OPERATION;
+    }
+    return mSession.getRenderPosition(dspFrames);
 }
 
 // ----------------------------------------------------------------------------
@@ -1006,6 +1194,7 @@ AudioHardware::AudioStreamInMSM72xx::~AudioStreamInMSM72xx()
 
 ssize_t AudioHardware::AudioStreamInMSM72xx::read( void* buffer, ssize_t bytes)
 {
+    HALTRACE_SCOPE_ARGS("audio", "in_read", bytes, 0);
     LOGV("AudioStreamInMSM72xx::read(%p, %ld)", buffer, bytes);
     if (!mHardware) return -1;
 
@@ -1022,7 +1211,10 @@ ssize_t AudioHardware::AudioStreamInMSM72xx::read( void* buffer, ssize_t bytes)
     if (mState < AUDIO_INPUT_STARTED) {
         mState = AUDIO_INPUT_STARTED;
         // force routing to input device
-        mHardware->clearCurDevice();
+        {
+            Mutex::Autolock lock(mHardware->mLock);
+            mHardware->clearCurDevice();
+        }
         mHardware->doRouting();
         if (ioctl(mFd, AUDIO_START, 0)) {
             LOGE("Error starting record");
@@ -1056,7 +1248,10 @@ status_t AudioHardware::AudioStreamInMSM72xx::standby()
     }
     if (!mHardware) return -1;
     // restore output routing if necessary
-    mHardware->clearCurDevice();
+    {
+        Mutex::Autolock lock(mHardware->mLock);
+        mHardware->clearCurDevice();
+    }
     mHardware->doRouting();
     return NO_ERROR;
 }
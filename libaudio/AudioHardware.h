@@ -25,6 +25,8 @@
 
 #include <hardware_legacy/AudioHardwareBase.h>
 
+#include "PcmSession.h"
+
 extern "C" {
 #include <linux/msm_audio.h>
 }
@@ -140,7 +142,8 @@ public:
     virtual    void        closeInputStream(AudioStreamIn* in);
 
     virtual    size_t      getInputBufferSize(uint32_t sampleRate, int format, int channelCount);
-               void        clearCurDevice() { mCurSndDevice = -1; }
+               // call with mLock held
+               void        clearCurDevice() { mCurSndDevice = -1; mSndControl.invalidate(); }
 
 protected:
     virtual status_t    dump(int fd, const Vector<String16>& args);
@@ -156,6 +159,56 @@ private:
     status_t    doRouting();
     AudioStreamInMSM72xx*   getActiveInput_l();
 
+    // built once by the constructor, see computeRoute()
+    struct SndRoute {
+        int         sndDevice;
+        int         audProcess;
+        const char* name;
+    };
+    enum {
+        ROUTE_INPUT_CLASSES = 4,
+        ROUTE_OUTPUT_BITS = 5,
+    };
+
+    void        loadEndpoints();
+    void        buildEndpointIndex();
+    const msm_snd_endpoint* findEndpoint(const char* name) const;
+    void        buildRoutingTable();
+    void        computeRoute(uint32_t inputDevice, uint32_t outputDevices, SndRoute* route);
+    static size_t routeIndex(uint32_t inputDevice, uint32_t outputDevices);
+
+    // Keeps /dev/msm_snd open and drops requests matching the state last
+    // applied, since every SND ioctl is an RPC round trip to the ARM9.
+    // Callers hold mLock.
+    class SndControl {
+    public:
+                            SndControl();
+                            ~SndControl();
+        // the endpoint id standing for whatever device is routed
+                void        setCurrentDeviceId(uint32_t id) { mCurrentId = id; }
+                status_t    setDevice(uint32_t device, bool earMute, bool micMute);
+                status_t    setVolume(uint32_t device, uint32_t method, uint32_t volume);
+        // forget the applied state, the next requests reach the driver
+                void        invalidate();
+                void        dump(String8& result) const;
+    private:
+                int         open_l();
+                void        fail_l();
+
+                int         mFd;
+                uint32_t    mCurrentId;
+                bool        mDeviceValid;
+                uint32_t    mDevice;
+                bool        mEarMute;
+                bool        mMicMute;
+                bool        mVolumeValid;
+                uint32_t    mVolumeDevice;
+                uint32_t    mVolumeMethod;
+                uint32_t    mVolume;
+                uint32_t    mIoctls;
+                uint32_t    mSkipped;
+    };
+
     class AudioStreamOutMSM72xx : public AudioStreamOut {
     public:
                             AudioStreamOutMSM72xx();
@@ -170,7 +223,7 @@ private:
         virtual size_t      bufferSize() const { return 4800; }
         virtual uint32_t    channels() const { return AudioSystem::CHANNEL_OUT_STEREO; }
         virtual int         format() const { return AudioSystem::PCM_16_BIT; }
-        virtual uint32_t    latency() const { return (1000*AUDIO_HW_NUM_OUT_BUF*(bufferSize()/frameSize()))/sampleRate()+AUDIO_HW_OUT_LATENCY_MS; }
+        virtual uint32_t    latency() const { return mSession.latency(); }
         virtual status_t    setVolume(float left, float right) { return INVALID_OPERATION; }
         virtual ssize_t     write(const void* buffer, size_t bytes);
         virtual status_t    standby();
@@ -182,10 +235,10 @@ private:
         virtual status_t    getRenderPosition(uint32_t *dspFrames);
 
     private:
+        static  PcmSession::Config sessionConfig();
+
                 AudioHardware* mHardware;
-                int         mFd;
-                int         mStartCount;
-                int         mRetryCount;
+                PcmSession  mSession;
                 bool        mStandby;
                 uint32_t    mDevices;
     };
@@ -244,6 +297,7 @@ private:
             msm_snd_endpoint *mSndEndpoints;
             int mNumSndEndpoints;
             int mCurSndDevice;
+            SndControl  mSndControl;
 
      friend class AudioStreamInMSM72xx;
             Mutex       mLock;
@@ -262,6 +316,10 @@ private:
             int SND_DEVICE_HEADSET_AND_SPEAKER;
             int SND_DEVICE_FM_SPEAKER;
             int SND_DEVICE_BT_EC_OFF;
+
+            int*        mEndpointIndex;     // indices into mSndEndpoints, -1 when free
+            size_t      mEndpointIndexSize;
+            SndRoute    mRoutes[ROUTE_INPUT_CLASSES << ROUTE_OUTPUT_BITS];
 };
 
 // ----------------------------------------------------------------------------
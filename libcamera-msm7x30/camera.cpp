@@ -28,10 +28,12 @@
 #include <unistd.h>
 
 #include <cutils/log.h>
+#include <cutils/atomic.h>
 #include <ui/Overlay.h>
 #include <camera/CameraParameters.h>
 #include <hardware/camera.h>
 #include "CameraHardwareInterface.h"
+#include "preview_convert.h"
 
 using android::sp;
 using android::Overlay;
@@ -92,8 +94,33 @@ typedef struct priv_camera_device {
     int preview_height;
     sp<Overlay> overlay;
     gralloc_module_t const *gralloc;
+    /* preview heap of the legacy HAL, looked up on the first frame after
+     * start_preview; it does not change while the preview runs */
+    sp<IMemoryHeap> preview_heap;
+    char *preview_base;
+    /* copies an NV21 frame into a buffer of the window format */
+    preview_convert_func preview_convert;
+    /* flattened parameters as last returned by get_parameters; stale once
+     * params_generation moves past params_cache_generation.  The legacy
+     * HAL changes parameters itself (zoom, focus, scene detection), so its
+     * callbacks move the generation too, from its own threads. */
+    char *params_cache;
+    volatile int32_t params_generation;
+    int32_t params_cache_generation;
 } priv_camera_device_t;
 
+/* Window formats to try, best first; frames from the legacy HAL are always
+ * NV21, so anything else costs a conversion. */
+static const struct {
+    int hal_format;
+    preview_convert_func convert;
+    const char *name;
+} preview_formats[] = {
+    { HAL_PIXEL_FORMAT_YCrCb_420_SP, preview_copy_nv21, "NV21" },
+    { HAL_PIXEL_FORMAT_YV12, preview_nv21_to_yv12, "YV12" },
+    { HAL_PIXEL_FORMAT_RGB_565, preview_nv21_to_rgb565, "RGB565" },
+};
+
 
 static struct {
     int type;
@@ -154,7 +181,6 @@ static void wrap_set_crop_hook(void *data,
 
 static void wrap_queue_buffer_hook(void *data, void* buffer)
 {
-    sp<IMemoryHeap> heap;
     priv_camera_device_t* dev = NULL;
     preview_stream_ops* window = NULL;
 
@@ -163,9 +189,16 @@ static void wrap_queue_buffer_hook(void *data, void* buffer)
 
     dev = (priv_camera_device_t*) data;
     window = dev->window;
-    heap =  gCameraHals[dev->cameraid]->getPreviewHeap();
+    if (!dev->preview_base) {
+        dev->preview_heap = gCameraHals[dev->cameraid]->getPreviewHeap();
+        if (dev->preview_heap == NULL) {
+            LOGE("%s: no preview heap", __FUNCTION__);
+            return;
+        }
+        dev->preview_base = (char *)(dev->preview_heap->base());
+    }
     int offset = (int)buffer;
-    char *frame = (char *)(heap->base()) + offset;
+    char *frame = dev->preview_base + offset;
 
     //LOGD("%s: base:%p offset:%i frame:%p", __FUNCTION__,
     //     heap->base(), offset, frame);
@@ -176,6 +209,10 @@ static void wrap_queue_buffer_hook(void *data, void* buffer)
 
     int width = dev->preview_width;
     int height = dev->preview_height;
+    if (!window) {
+        // the preview window went away while the preview was running
+        goto skipframe;
+    }
     if (0 != window->dequeue_buffer(window, &buf_handle, &stride)) {
         LOGE("%s: could not dequeue gralloc buffer", __FUNCTION__);
 	goto skipframe;
@@ -183,8 +220,8 @@ static void wrap_queue_buffer_hook(void *data, void* buffer)
     if (0 == dev->gralloc->lock(dev->gralloc, *buf_handle,
 			    GRALLOC_USAGE_SW_WRITE_MASK,
 			    0, 0, width, height, &vaddr)) {
-        // the code below assumes YUV, not RGB
-	memcpy(vaddr, frame, width * height * 3 / 2);
+        dev->preview_convert(vaddr, stride, (const uint8_t *)frame,
+                             width, height);
         //LOGD("%s: copy frame to gralloc buffer", __FUNCTION__);
     } else {
         LOGE("%s: could not lock gralloc buffer", __FUNCTION__);
@@ -268,6 +305,7 @@ static void wrap_notify_callback(int32_t msg_type, int32_t ext1,
         return;
 
     dev = (priv_camera_device_t*) user;
+    android_atomic_inc(&dev->params_generation);
 
     if (dev->notify_callback)
         dev->notify_callback(msg_type, ext1, ext2, dev->user);
@@ -286,6 +324,9 @@ static void wrap_data_callback(int32_t msg_type, const sp<IMemory>& dataPtr,
         return;
 
     dev = (priv_camera_device_t*) user;
+    // preview frames are the bulk of the traffic and change nothing
+    if (msg_type != CAMERA_MSG_PREVIEW_FRAME)
+        android_atomic_inc(&dev->params_generation);
 
     data = wrap_memory_data(dev, dataPtr);
 
@@ -362,7 +403,6 @@ int camera_set_preview_window(struct camera_device * device,
     int preview_height;
     CameraParameters params(gCameraHals[dev->cameraid]->getParameters());
     params.getPreviewSize(&preview_width, &preview_height);
-    int hal_pixel_format = HAL_PIXEL_FORMAT_YCrCb_420_SP;
 
     const char *str_preview_format = params.getPreviewFormat();
     LOGD("%s: preview format %s", __FUNCTION__, str_preview_format);
@@ -372,12 +412,21 @@ int camera_set_preview_window(struct camera_device * device,
         return -1;
     }
 
-    if (window->set_buffers_geometry(window, preview_width,
-                                     preview_height, hal_pixel_format)) {
-        LOGE("%s: could not set buffers geometry to %s",
-             __FUNCTION__, str_preview_format);
+    unsigned int i;
+    for (i = 0; i < sizeof(preview_formats) / sizeof(preview_formats[0]); i++) {
+        if (!window->set_buffers_geometry(window, preview_width,
+                                          preview_height,
+                                          preview_formats[i].hal_format))
+            break;
+        LOGW("%s: window does not take %s buffers", __FUNCTION__,
+             preview_formats[i].name);
+    }
+    if (i == sizeof(preview_formats) / sizeof(preview_formats[0])) {
+        LOGE("%s: could not set buffers geometry", __FUNCTION__);
         return -1;
     }
+    LOGD("%s: using %s window buffers", __FUNCTION__, preview_formats[i].name);
+    dev->preview_convert = preview_formats[i].convert;
 
     dev->preview_width = preview_width;
     dev->preview_height = preview_height;
@@ -473,6 +522,9 @@ int camera_start_preview(struct camera_device * device)
 
     dev = (priv_camera_device_t*) device;
 
+    // the legacy HAL (re)allocates its preview heap when the preview starts
+    dev->preview_heap.clear();
+    dev->preview_base = NULL;
     rv = gCameraHals[dev->cameraid]->startPreview();
 
     return rv;
@@ -490,6 +542,8 @@ void camera_stop_preview(struct camera_device * device)
     dev = (priv_camera_device_t*) device;
 
     gCameraHals[dev->cameraid]->stopPreview();
+    dev->preview_heap.clear();
+    dev->preview_base = NULL;
 }
 
 int camera_preview_enabled(struct camera_device * device)
@@ -651,11 +705,74 @@ int camera_cancel_picture(struct camera_device * device)
     return rv;
 }
 
+/* Fetches the parameters from the legacy HAL and flattens them the way
+ * get_parameters reports them, into the cache. */
+static const char *camera_params_refresh(priv_camera_device_t *dev)
+{
+    // read before fetching: a callback that races with us leaves the cache
+    // stale rather than marked fresh
+    int32_t generation = android_atomic_acquire_load(&dev->params_generation);
+    CameraParameters camParams = gCameraHals[dev->cameraid]->getParameters();
+
+    // filter picture size
+    camParams.set(CameraParameters::KEY_SUPPORTED_PICTURE_SIZES,
+                  "3264x2448,2592x1936,2048x1536,1280x960,640x480");
+    camParams.set(CameraParameters::KEY_SUPPORTED_PREVIEW_SIZES,
+                  "640x480");
+
+    String8 params_str8 = camParams.flatten();
+    free(dev->params_cache);
+    dev->params_cache = strdup(params_str8.string());
+    dev->params_cache_generation = generation;
+    return dev->params_cache;
+}
+
+/* Returns the flattened parameters the way get_parameters reports them,
+ * fetching them from the legacy HAL only when the cache is stale. */
+static const char *camera_params_cache(priv_camera_device_t *dev)
+{
+    if (dev->params_cache && dev->params_cache_generation ==
+            android_atomic_acquire_load(&dev->params_generation))
+        return dev->params_cache;
+    return camera_params_refresh(dev);
+}
+
+/* Finds key in the flattened "k1=v1;k2=v2" string params.  Returns its
+ * value, not terminated, and its length in *value_len; NULL if the key is
+ * not there. */
+static const char *camera_param_find(const char *params, const char *key,
+                                     size_t key_len, size_t *value_len)
+{
+    const char *p = params;
+    while (*p) {
+        const char *end = strchr(p, ';');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len > key_len && !strncmp(p, key, key_len) && p[key_len] == '=') {
+            *value_len = len - key_len - 1;
+            return p + key_len + 1;
+        }
+        if (!end)
+            break;
+        p = end + 1;
+    }
+    return NULL;
+}
+
+/* Whether the flattened string params holds key=value. */
+static bool camera_param_matches(const char *params, const char *key,
+                                 size_t key_len, const char *value, size_t value_len)
+{
+    size_t len;
+    const char *v = camera_param_find(params, key, key_len, &len);
+    return v && len == value_len && !strncmp(v, value, value_len);
+}
+
 int camera_set_parameters(struct camera_device * device, const char *params)
 {
     int rv = -EINVAL;
     priv_camera_device_t* dev = NULL;
     CameraParameters camParams;
+    const char *current;
 
     LOGD("%s", __FUNCTION__);
 
@@ -664,10 +781,60 @@ int camera_set_parameters(struct camera_device * device, const char *params)
 
     dev = (priv_camera_device_t*) device;
 
-    String8 params_str8(params);
-    camParams.unflatten(params_str8);
+    // compare with what the legacy HAL holds now, not with the cache: the
+    // HAL may have changed values since the caller fetched its copy
+    current = camera_params_refresh(dev);
+    if (current && !strcmp(current, params)) {
+        // nothing changed, don't make the legacy HAL reconfigure the sensor
+        LOGV("%s: unchanged", __FUNCTION__);
+        return 0;
+    }
+
+    if (current) {
+        // forward only the keys that differ from the legacy HAL's current
+        // values, and drop those the caller removed
+        int changed = 0;
+        const char *p = params;
+        camParams = gCameraHals[dev->cameraid]->getParameters();
+        while (*p) {
+            const char *end = strchr(p, ';');
+            size_t len = end ? (size_t)(end - p) : strlen(p);
+            const char *eq = (const char *)memchr(p, '=', len);
+            if (eq && !camera_param_matches(current, p, eq - p, eq + 1, len - (eq - p) - 1)) {
+                String8 key(p, eq - p);
+                String8 value(eq + 1, len - (eq - p) - 1);
+                LOGV("%s: %s=%s", __FUNCTION__, key.string(), value.string());
+                camParams.set(key.string(), value.string());
+                changed++;
+            }
+            if (!end)
+                break;
+            p = end + 1;
+        }
+        for (p = current; *p; ) {
+            const char *end = strchr(p, ';');
+            size_t len = end ? (size_t)(end - p) : strlen(p);
+            const char *eq = (const char *)memchr(p, '=', len);
+            size_t value_len;
+            if (eq && !camera_param_find(params, p, eq - p, &value_len)) {
+                String8 key(p, eq - p);
+                LOGV("%s: removing %s", __FUNCTION__, key.string());
+                camParams.remove(key.string());
+                changed++;
+            }
+            if (!end)
+                break;
+            p = end + 1;
+        }
+        if (!changed)
+            return 0;
+    } else {
+        String8 params_str8(params);
+        camParams.unflatten(params_str8);
+    }
 
     rv = gCameraHals[dev->cameraid]->setParameters(camParams);
+    android_atomic_inc(&dev->params_generation);
 
     //camParams.dump();
 
@@ -678,8 +845,7 @@ char* camera_get_parameters(struct camera_device * device)
 {
     char* params = NULL;
     priv_camera_device_t* dev = NULL;
-    String8 params_str8;
-    CameraParameters camParams;
+    const char *current;
 
     LOGD("%s", __FUNCTION__);
 
@@ -688,19 +854,10 @@ char* camera_get_parameters(struct camera_device * device)
 
     dev = (priv_camera_device_t*) device;
 
-    camParams = gCameraHals[dev->cameraid]->getParameters();
-
-    // filter picture size
-    camParams.set(CameraParameters::KEY_SUPPORTED_PICTURE_SIZES,
-                  "3264x2448,2592x1936,2048x1536,1280x960,640x480");
-    camParams.set(CameraParameters::KEY_SUPPORTED_PREVIEW_SIZES,
-                  "640x480");
-
-    params_str8 = camParams.flatten();
-    params = (char*) malloc(sizeof(char) * (params_str8.length()+1));
-    strcpy(params, params_str8.string());
-
-    //camParams.dump();
+    // the caller frees its copy through put_parameters
+    current = camera_params_cache(dev);
+    if (current)
+        params = strdup(current);
 
     return params;
 }
@@ -725,6 +882,8 @@ int camera_send_command(struct camera_device * device,
     dev = (priv_camera_device_t*) device;
 
     rv = gCameraHals[dev->cameraid]->sendCommand(cmd, arg1, arg2);
+    // commands like zoom move parameters behind our back
+    android_atomic_inc(&dev->params_generation);
     return rv;
 }
 
@@ -781,6 +940,8 @@ int camera_device_close(hw_device_t* device)
         if (dev->base.ops) {
             free(dev->base.ops);
         }
+        dev->preview_heap.clear();
+        free(dev->params_cache);
         free(dev);
     }
 done:
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+* @file preview_convert.cpp
+*/
+
+#include <string.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "preview_convert.h"
+
+#define ALIGN16(x) (((x) + 15) & ~15)
+
+static void copy_plane(uint8_t *dst, int dst_stride,
+                       const uint8_t *src, int src_stride,
+                       int width, int height)
+{
+    if (dst_stride == src_stride && src_stride == width) {
+        memcpy(dst, src, width * height);
+        return;
+    }
+    for (int y = 0; y < height; y++) {
+        memcpy(dst, src, width);
+        dst += dst_stride;
+        src += src_stride;
+    }
+}
+
+void preview_copy_nv21(void *dst, int stride, const uint8_t *src,
+                       int width, int height)
+{
+    uint8_t *d = (uint8_t *)dst;
+
+    copy_plane(d, stride, src, width, width, height);
+    copy_plane(d + stride * height, stride,
+               src + width * height, width, width, height / 2);
+}
+
+void preview_nv21_to_yv12(void *dst, int stride, const uint8_t *src,
+                          int width, int height)
+{
+    uint8_t *y_dst = (uint8_t *)dst;
+    int c_stride = ALIGN16(stride / 2);
+    uint8_t *cr_dst = y_dst + stride * height;
+    uint8_t *cb_dst = cr_dst + c_stride * (height / 2);
+    const uint8_t *vu = src + width * height;
+
+    copy_plane(y_dst, stride, src, width, width, height);
+
+    for (int y = 0; y < height / 2; y++) {
+        const uint8_t *s = vu + y * width;
+        uint8_t *cr = cr_dst + y * c_stride;
+        uint8_t *cb = cb_dst + y * c_stride;
+        int x = 0;
+#if defined(__ARM_NEON__)
+        for (; x + 16 <= width / 2; x += 16) {
+            uint8x16x2_t p = vld2q_u8(s + 2 * x);
+            vst1q_u8(cr + x, p.val[0]);
+            vst1q_u8(cb + x, p.val[1]);
+        }
+#endif
+        for (; x < width / 2; x++) {
+            cr[x] = s[2 * x];
+            cb[x] = s[2 * x + 1];
+        }
+    }
+}
+
+static inline uint8_t clamp_u8(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* Coefficients are the BT.601 ones scaled by 64, so that the NEON path can
+ * work in 16 bits: R = 1.164 C + 1.596 E, G = 1.164 C - 0.391 D - 0.813 E,
+ * B = 1.164 C + 2.018 D with C = Y - 16, D = U - 128, E = V - 128. */
+enum {
+    K_Y  = 74,
+    K_RV = 102,
+    K_GU = 25,
+    K_GV = 52,
+    K_BU = 129,
+};
+
+static inline uint16_t yuv_to_rgb565(int y, int u, int v)
+{
+    int c = (y - 16) * K_Y;
+    int d = u - 128;
+    int e = v - 128;
+    int r = clamp_u8((c + K_RV * e + 32) >> 6);
+    int g = clamp_u8((c - K_GU * d - K_GV * e + 32) >> 6);
+    int b = clamp_u8((c + K_BU * d + 32) >> 6);
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+#if defined(__ARM_NEON__)
+static inline uint16x8_t pack_rgb565(int16x8_t c, int16x8_t rc,
+                                     int16x8_t gc, int16x8_t bc)
+{
+    uint8x8_t r = vqrshrun_n_s16(vqaddq_s16(c, rc), 6);
+    uint8x8_t g = vqrshrun_n_s16(vqsubq_s16(c, gc), 6);
+    uint8x8_t b = vqrshrun_n_s16(vqaddq_s16(c, bc), 6);
+    uint16x8_t p = vshlq_n_u16(vmovl_u8(vshr_n_u8(r, 3)), 11);
+    p = vorrq_u16(p, vshlq_n_u16(vmovl_u8(vshr_n_u8(g, 2)), 5));
+    return vorrq_u16(p, vmovl_u8(vshr_n_u8(b, 3)));
+}
+#endif
+
+void preview_nv21_to_rgb565(void *dst, int stride, const uint8_t *src,
+                            int width, int height)
+{
+    const uint8_t *vu_plane = src + width * height;
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t *ys = src + y * width;
+        const uint8_t *vu = vu_plane + (y / 2) * width;
+        uint16_t *d = (uint16_t *)dst + y * stride;
+        int x = 0;
+#if defined(__ARM_NEON__)
+        const int16x8_t k16 = vdupq_n_s16(16);
+        const int16x8_t k128 = vdupq_n_s16(128);
+        for (; x + 16 <= width; x += 16) {
+            uint8x16_t yv = vld1q_u8(ys + x);
+            uint8x8x2_t c = vld2_u8(vu + x);   /* 8 V, 8 U for 16 pixels */
+            int16x8_t e = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(c.val[0])), k128);
+            int16x8_t dd = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(c.val[1])), k128);
+
+            int16x8_t rc = vmulq_n_s16(e, K_RV);
+            int16x8_t gc = vaddq_s16(vmulq_n_s16(dd, K_GU), vmulq_n_s16(e, K_GV));
+            int16x8_t bc = vmulq_n_s16(dd, K_BU);
+            /* each chroma sample covers two pixels */
+            int16x8x2_t rz = vzipq_s16(rc, rc);
+            int16x8x2_t gz = vzipq_s16(gc, gc);
+            int16x8x2_t bz = vzipq_s16(bc, bc);
+
+            int16x8_t lo = vmulq_n_s16(vsubq_s16(
+                    vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(yv))), k16), K_Y);
+            int16x8_t hi = vmulq_n_s16(vsubq_s16(
+                    vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(yv))), k16), K_Y);
+
+            vst1q_u16(d + x, pack_rgb565(lo, rz.val[0], gz.val[0], bz.val[0]));
+            vst1q_u16(d + x + 8, pack_rgb565(hi, rz.val[1], gz.val[1], bz.val[1]));
+        }
+#endif
+        for (; x < width; x++) {
+            int c = x & ~1;
+            d[x] = yuv_to_rgb565(ys[x], vu[c + 1], vu[c]);
+        }
+    }
+}
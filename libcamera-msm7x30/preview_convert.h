@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+* @file preview_convert.h
+*
+* Copies of NV21 preview frames from the legacy HAL into preview window
+* buffers, in the layout of the window format.
+*/
+
+#ifndef PREVIEW_CONVERT_H
+#define PREVIEW_CONVERT_H
+
+#include <stdint.h>
+
+/* Copy a width x height NV21 frame into a window buffer whose rows are
+ * stride pixels apart. */
+typedef void (*preview_convert_func)(void *dst, int stride,
+                                     const uint8_t *src,
+                                     int width, int height);
+
+/* NV21 to NV21, fixing up the row stride */
+void preview_copy_nv21(void *dst, int stride, const uint8_t *src,
+                       int width, int height);
+
+/* NV21 to YV12: Y plane, then Cr, then Cb, chroma rows 16-byte aligned */
+void preview_nv21_to_yv12(void *dst, int stride, const uint8_t *src,
+                          int width, int height);
+
+/* NV21 to RGB565, BT.601 limited range */
+void preview_nv21_to_rgb565(void *dst, int stride, const uint8_t *src,
+                            int width, int height);
+
+#endif
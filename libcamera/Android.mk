@@ -16,7 +16,10 @@ LOCAL_CFLAGS+=-DDLOPEN_LIBQCAMERA=$(DLOPEN_LIBQCAMERA)
 
 LOCAL_SRC_FILES:= QualcommCameraHardware.cpp
 
-LOCAL_SHARED_LIBRARIES:= libutils libbinder libui liblog libcamera_client
+LOCAL_C_INCLUDES+= $(LOCAL_PATH)/../libhaltrace
+
+LOCAL_SHARED_LIBRARIES:= libutils libcutils libbinder libui liblog libcamera_client
+LOCAL_SHARED_LIBRARIES+= libhaltrace
 ifneq ($(DLOPEN_LIBQCAMERA),1)
 LOCAL_SHARED_LIBRARIES+= liboemcamera
 else
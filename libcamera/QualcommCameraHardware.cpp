@@ -22,8 +22,10 @@
 #define LOG_TAG "QualcommCameraHardware"
 #include <utils/Log.h>
 #include <utils/threads.h>
+#include <utils/Timers.h>
 #include <binder/MemoryHeapPmem.h>
 #include <utils/String16.h>
+#include <cutils/properties.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
@@ -40,19 +42,8 @@
 #include <dlfcn.h>
 #endif
 
-#define PRINT_TIME 0
-
 extern "C" {
 
-static inline void print_time()
-{
-#if PRINT_TIME
-    struct timeval time; 
-    gettimeofday(&time, NULL);
-    LOGV("time: %lld us.", time.tv_sec * 1000000LL + time.tv_usec);
-#endif
-}
-
 typedef struct {
     int width;
     int height;
@@ -269,6 +260,7 @@ static preview_size_type preview_sizes[] = {
 }
 
 #include "QualcommCameraHardware.h"
+#include "haltrace.h"
 
 namespace android {
 
@@ -289,7 +281,15 @@ namespace android {
           mPreviewWidth(-1),
           mRawHeight(-1),
           mRawWidth(-1),
+          mSnapshotCacheWidth(-1),
+          mSnapshotCacheHeight(-1),
+          mSnapshotCacheUses(0),
+          mPreviewCacheWidth(-1),
+          mPreviewCacheHeight(-1),
+          mPreviewCacheBuffers(0),
+          mPreviewCacheUses(0),
           mCameraState(QCS_INIT),
+          mCaptureCount(0),
           mShutterCallback(0),
           mRawPictureCallback(0),
           mJpegPictureCallback(0),
@@ -302,8 +302,26 @@ namespace android {
           mRecordingCallbackCookie(0),
           mPreviewFrameSize(0),
           mRawSize(0),
-          mPreviewCount(0)
+          mPreviewCount(0),
+          mRingDepth(0),
+          mRingDropNewest(false),
+          mRingRunning(false),
+          mRingStop(false),
+          mRingBusy(false),
+          mRingHead(0),
+          mRingCount(0),
+          mPreviewFramesDelivered(0),
+          mPreviewFramesDropped(0),
+          mPreviewLastFrame(0),
+          mPreviewLastInterval(0),
+          mPreviewIntervals(0),
+          mPreviewIntervalMin(0),
+          mPreviewIntervalMax(0),
+          mPreviewIntervalSum(0),
+          mPreviewJitter(0),
+          mPreviewFramesBad(0)
     {
+        memset(mCaptureTiming, 0, sizeof(mCaptureTiming));
         LOGV("constructor EX");
     }
 
@@ -489,7 +507,27 @@ namespace android {
         result.append(buffer);
         snprintf(buffer, 255, "preview frame size(%d), raw size (%d), jpeg size (%d) and jpeg max size (%d)\n", mPreviewFrameSize, mRawSize, mJpegSize, mJpegMaxSize);
         result.append(buffer);
+        snprintf(buffer, 255, "snapshot heap cache %dx%d (raw %s, jpeg %s), used %d times\n", mSnapshotCacheWidth, mSnapshotCacheHeight, mRawHeapCache != NULL ? "yes" : "no", mJpegHeapCache != NULL ? "yes" : "no", mSnapshotCacheUses);
+        result.append(buffer);
+        snprintf(buffer, 255, "preview heap cache %dx%d (%d buffers, %s), used %d times\n", mPreviewCacheWidth, mPreviewCacheHeight, mPreviewCacheBuffers, mPreviewHeapCache != NULL ? "yes" : "no", mPreviewCacheUses);
+        result.append(buffer);
+        snprintf(buffer, 255, "preview ring depth (%d, drop %s), frames delivered (%u) dropped (%u)\n", mRingDepth, mRingDropNewest ? "newest" : "oldest", mPreviewFramesDelivered, mPreviewFramesDropped);
+        result.append(buffer);
+        snprintf(buffer, 255, "preview frames (%d) interval us min (%lld) avg (%lld) max (%lld) jitter (%lld), bad frames (%u)\n", mPreviewCount, (long long)mPreviewIntervalMin, (long long)(mPreviewIntervals ? mPreviewIntervalSum / mPreviewIntervals : 0), (long long)mPreviewIntervalMax, (long long)mPreviewJitter, mPreviewFramesBad);
+        result.append(buffer);
+
+        // Capture timings are in ms from takePicture(); -1 if not reached.
+        int first = mCaptureCount > kCaptureTimingCount ?
+            mCaptureCount - kCaptureTimingCount : 0;
+        for (int i = first; i < mCaptureCount; i++) {
+            const capture_timing *t = &mCaptureTiming[i % kCaptureTimingCount];
+#define SINCE(x) (t->x ? (long long)ns2ms(t->x - t->take_picture) : -1LL)
+            snprintf(buffer, 255, "capture %d: shutter (%lld) raw (%lld) encode (%lld) jpeg fragments (%d) first (%lld) last (%lld) max gap (%lld) done (%lld) size (%u)\n", i, SINCE(shutter), SINCE(raw), SINCE(encode), t->fragments, SINCE(first_fragment), SINCE(last_fragment), (long long)ns2ms(t->max_fragment_gap), SINCE(jpeg), t->jpeg_size);
+#undef SINCE
+            result.append(buffer);
+        }
         write(fd, result.string(), result.size());
+        haltrace_dumpsys(fd);
         
         // Dump internal objects.
         if (mPreviewHeap != 0) {
@@ -523,17 +561,63 @@ namespace android {
         LOGV("initPreview: preview size=%dx%d", mPreviewWidth, mPreviewHeight);
 
         mPreviewFrameSize = mPreviewWidth * mPreviewHeight * 3 / 2; // reality
-        mPreviewHeap =
-            new PreviewPmemPool(kRawFrameHeaderSize +
-                                mPreviewWidth * mPreviewHeight * 2, // worst
-                                kPreviewBufferCount,
-                                mPreviewFrameSize,
-                                kRawFrameHeaderSize,
-                                "preview");
-        
-        if (!mPreviewHeap->initialized()) {
-            mPreviewHeap = NULL;
-            return false;
+
+        // The delivery ring needs one buffer more than its depth, for the
+        // frame that is being handed to the callback while the ring is full.
+        char value[PROPERTY_VALUE_MAX];
+        property_get("persist.camera.preview.ring", value, "2");
+        mRingDepth = atoi(value);
+        if (mRingDepth < 0)
+            mRingDepth = 0;
+        if (mRingDepth > kPreviewRingMax)
+            mRingDepth = kPreviewRingMax;
+        property_get("persist.camera.preview.drop", value, "oldest");
+        mRingDropNewest = !strcmp(value, "newest");
+        LOGV("initPreview: preview ring depth %d, drop %s",
+             mRingDepth, mRingDropNewest ? "newest" : "oldest");
+
+        int num_buffers = kPreviewBufferCount +
+            (mRingDepth ? mRingDepth + 1 : 0);
+
+        // Like the snapshot heaps, the preview heap is kept across
+        // stopPreview()/startPreview() for the same preview size and
+        // buffer count, so that restarting preview around a snapshot or
+        // a mode switch does not allocate and map pmem again.
+        property_get("persist.camera.preview.cache", value, "1");
+        bool cache = atoi(value);
+        if (!cache ||
+            mPreviewCacheWidth != mPreviewWidth ||
+            mPreviewCacheHeight != mPreviewHeight ||
+            mPreviewCacheBuffers != num_buffers) {
+            dropPreviewCache();
+        }
+
+        if (mPreviewHeapCache != NULL) {
+            LOGV("initPreview: reusing cached mPreviewHeap.");
+            mPreviewHeap = mPreviewHeapCache;
+        }
+        else {
+            mPreviewHeap =
+                new PreviewPmemPool(kRawFrameHeaderSize +
+                                    mPreviewWidth * mPreviewHeight * 2, // worst
+                                    num_buffers,
+                                    mPreviewFrameSize,
+                                    kRawFrameHeaderSize,
+                                    "preview");
+
+            if (!mPreviewHeap->initialized()) {
+                mPreviewHeap = NULL;
+                return false;
+            }
+            if (cache)
+                mPreviewHeapCache = mPreviewHeap;
+        }
+
+        if (cache) {
+            mPreviewCacheWidth = mPreviewWidth;
+            mPreviewCacheHeight = mPreviewHeight;
+            mPreviewCacheBuffers = num_buffers;
+            mPreviewCacheUses++;
         }
 
 //      LINK_camera_af_init();
@@ -546,6 +630,171 @@ namespace android {
         mPreviewHeap = NULL;
     }
 
+    void QualcommCameraHardware::dropPreviewCache()
+    {
+        if (mPreviewHeapCache != NULL)
+            LOGV("dropping preview heap cache (%dx%d, %d buffers), used %d times",
+                 mPreviewCacheWidth, mPreviewCacheHeight,
+                 mPreviewCacheBuffers, mPreviewCacheUses);
+        mPreviewHeapCache = NULL;
+        mPreviewCacheWidth = -1;
+        mPreviewCacheHeight = -1;
+        mPreviewCacheBuffers = 0;
+        mPreviewCacheUses = 0;
+    }
+
+    // Called with mStateLock held, after initPreview().
+    bool QualcommCameraHardware::startPreviewRing()
+    {
+        Mutex::Autolock ringLock(&mRingLock);
+
+        mRingHead = 0;
+        mRingCount = 0;
+        mRingStop = false;
+        mRingBusy = false;
+        mPreviewFramesDelivered = 0;
+        mPreviewFramesDropped = 0;
+        for (int i = 0; i <= kPreviewRingMax; i++)
+            mRingState[i] = PREVIEW_SLOT_FREE;
+
+        if (!mRingDepth || mRingRunning)
+            return true;
+
+        if (pthread_create(&mRingThread, NULL, preview_ring_thread, this)) {
+            LOGE("startPreviewRing: pthread_create failed: %s (%d); "
+                 "delivering preview frames inline",
+                 strerror(errno), errno);
+            mRingDepth = 0;
+            return false;
+        }
+        mRingRunning = true;
+        return true;
+    }
+
+    // Must not be called with mCallbackLock held, since the delivery thread
+    // may be waiting for it.
+    void QualcommCameraHardware::stopPreviewRing()
+    {
+        mRingLock.lock();
+        if (!mRingRunning) {
+            mRingLock.unlock();
+            return;
+        }
+        mRingStop = true;
+        mRingWait.broadcast();
+        mRingLock.unlock();
+
+        pthread_join(mRingThread, NULL);
+
+        mRingLock.lock();
+        mRingRunning = false;
+        mRingCount = 0;
+        mRingLock.unlock();
+        LOGV("stopPreviewRing: delivered %u preview frames, dropped %u",
+             mPreviewFramesDelivered, mPreviewFramesDropped);
+    }
+
+    // Copies VFE preview buffer 'index' into a free ring slot.  Called on
+    // the libqcamera thread; the caller releases the VFE frame right after,
+    // whether or not the frame was queued.
+    bool QualcommCameraHardware::queuePreviewFrame(int index)
+    {
+        int slots = mRingDepth + 1;
+        int slot = -1;
+
+        mRingLock.lock();
+        if (!mRingRunning || mRingStop) {
+            mRingLock.unlock();
+            return false;
+        }
+        if (mRingCount == mRingDepth) {
+            mPreviewFramesDropped++;
+            if (mRingDropNewest) {
+                mRingLock.unlock();
+                return false;
+            }
+            // Recycle the oldest queued frame.
+            slot = mRingQueue[mRingHead];
+            mRingHead = (mRingHead + 1) % slots;
+            mRingCount--;
+        }
+        else {
+            for (int i = 0; i < slots; i++) {
+                if (mRingState[i] == PREVIEW_SLOT_FREE) {
+                    slot = i;
+                    break;
+                }
+            }
+        }
+        mRingState[slot] = PREVIEW_SLOT_FILLING;
+        mRingLock.unlock();
+
+        // Only this thread touches a slot in PREVIEW_SLOT_FILLING, so the
+        // copy happens outside of mRingLock.
+        uint8_t *base = (uint8_t *)mPreviewHeap->mHeap->base();
+        int buffer_size = mPreviewHeap->mBufferSize;
+        int frame_offset = mPreviewHeap->mFrameOffset;
+        memcpy(base + (kPreviewBufferCount + slot) * buffer_size + frame_offset,
+               base + index * buffer_size + frame_offset,
+               mPreviewHeap->mFrameSize);
+
+        mRingLock.lock();
+        mRingState[slot] = PREVIEW_SLOT_QUEUED;
+        mRingQueue[(mRingHead + mRingCount) % slots] = slot;
+        mRingCount++;
+        mRingWait.signal();
+        mRingLock.unlock();
+        return true;
+    }
+
+    void QualcommCameraHardware::runPreviewRing()
+    {
+        int slots = mRingDepth + 1;
+
+        LOGV("preview ring thread E");
+        mRingLock.lock();
+        while (true) {
+            while (!mRingStop && !mRingCount)
+                mRingWait.wait(mRingLock);
+            if (mRingStop)
+                break;
+
+            int slot = mRingQueue[mRingHead];
+            mRingHead = (mRingHead + 1) % slots;
+            mRingCount--;
+            mRingState[slot] = PREVIEW_SLOT_BUSY;
+            mRingBusy = true;
+            mRingLock.unlock();
+
+            // Do not hold mCallbackLock across the callback, or
+            // receivePreviewFrame() would stall behind it.  setCallbacks()
+            // waits for mRingBusy to clear instead.
+            mCallbackLock.lock();
+            preview_callback pcb = mPreviewCallback;
+            void *puser = mPreviewCallbackCookie;
+            mCallbackLock.unlock();
+
+            if (pcb != NULL)
+                pcb(mPreviewHeap->mBuffers[kPreviewBufferCount + slot], puser);
+
+            mRingLock.lock();
+            mRingState[slot] = PREVIEW_SLOT_FREE;
+            mRingBusy = false;
+            if (pcb != NULL)
+                mPreviewFramesDelivered++;
+            mRingIdle.broadcast();
+        }
+        mRingLock.unlock();
+        LOGV("preview ring thread X");
+    }
+
+    void *QualcommCameraHardware::preview_ring_thread(void *user)
+    {
+        QualcommCameraHardware *obj = (QualcommCameraHardware *)user;
+        obj->runPreviewRing();
+        return NULL;
+    }
+
     // Called with mStateLock held!
     bool QualcommCameraHardware::initRaw(bool initJpegHeap)
     {
@@ -571,44 +820,104 @@ namespace android {
 
         mJpegMaxSize = mRawWidth * mRawHeight * 2;
 
+        // The snapshot heaps are kept across captures at the same picture
+        // size, so that back-to-back shots do not pay for allocating and
+        // mapping them again.  A "snapshot-burst" of N keeps them for N
+        // captures even when the cache is otherwise disabled.
+        char value[PROPERTY_VALUE_MAX];
+        property_get("persist.camera.snapshot.cache", value, "1");
+        bool cache = atoi(value) || mParameters.getInt("snapshot-burst") > 0;
+        if (!cache ||
+            mSnapshotCacheWidth != mRawWidth ||
+            mSnapshotCacheHeight != mRawHeight) {
+            dropSnapshotCache();
+        }
+
         LOGV("initRaw: clearing old mJpegHeap.");
         mJpegHeap = NULL;
 
-        LOGV("initRaw: initializing mRawHeap.");
-        mRawHeap =
-            new RawPmemPool("/dev/pmem_camera",
-                            kRawFrameHeaderSize + mJpegMaxSize, /* worst */
-                            kRawBufferCount,
-                            mRawSize,
-                            kRawFrameHeaderSize,
-                            "snapshot camera");
-
-        if (!mRawHeap->initialized()) {
-            LOGE("initRaw X failed: error initializing mRawHeap");
-            mRawHeap = NULL;
-            return false;
+        // A client may still hold the buffer of the last capture; writing
+        // the next one over it would change the picture under its feet.
+        if (mRawHeapCache != NULL && mRawHeapCache->inUse()) {
+            LOGV("initRaw: cached mRawHeap still in use, not reusing it.");
+            mRawHeapCache = NULL;
+        }
+        if (mJpegHeapCache != NULL && mJpegHeapCache->inUse()) {
+            LOGV("initRaw: cached mJpegHeap still in use, not reusing it.");
+            mJpegHeapCache = NULL;
         }
 
-        if (initJpegHeap) {
-            LOGV("initRaw: initializing mJpegHeap.");
-            mJpegHeap =
-                new AshmemPool(mJpegMaxSize,
-                               kJpegBufferCount,
-                               0, // we do not know how big the picture wil be
-                               0,
-                               "jpeg");
-            if (!mJpegHeap->initialized()) {
-                LOGE("initRaw X failed: error initializing mJpegHeap.");
-                mJpegHeap = NULL;
+        if (mRawHeapCache != NULL) {
+            LOGV("initRaw: reusing cached mRawHeap.");
+            mRawHeap = mRawHeapCache;
+        }
+        else {
+            LOGV("initRaw: initializing mRawHeap.");
+            mRawHeap =
+                new RawPmemPool("/dev/pmem_camera",
+                                kRawFrameHeaderSize + mJpegMaxSize, /* worst */
+                                kRawBufferCount,
+                                mRawSize,
+                                kRawFrameHeaderSize,
+                                "snapshot camera");
+
+            if (!mRawHeap->initialized()) {
+                LOGE("initRaw X failed: error initializing mRawHeap");
                 mRawHeap = NULL;
                 return false;
             }
+            if (cache)
+                mRawHeapCache = mRawHeap;
+        }
+
+        if (initJpegHeap) {
+            if (mJpegHeapCache != NULL) {
+                LOGV("initRaw: reusing cached mJpegHeap.");
+                mJpegHeap = mJpegHeapCache;
+            }
+            else {
+                LOGV("initRaw: initializing mJpegHeap.");
+                mJpegHeap =
+                    new AshmemPool(mJpegMaxSize,
+                                   kJpegBufferCount,
+                                   0, // we do not know how big the picture wil be
+                                   0,
+                                   "jpeg");
+                if (!mJpegHeap->initialized()) {
+                    LOGE("initRaw X failed: error initializing mJpegHeap.");
+                    mJpegHeap = NULL;
+                    mRawHeap = NULL;
+                    dropSnapshotCache();
+                    return false;
+                }
+                if (cache)
+                    mJpegHeapCache = mJpegHeap;
+            }
+        }
+
+        if (cache) {
+            mSnapshotCacheWidth = mRawWidth;
+            mSnapshotCacheHeight = mRawHeight;
+            mSnapshotCacheUses++;
         }
 
         LOGV("initRaw X success");
         return true;
     }
 
+    void QualcommCameraHardware::dropSnapshotCache()
+    {
+        if (mRawHeapCache != NULL || mJpegHeapCache != NULL)
+            LOGV("dropping snapshot heap cache (%dx%d, used %d times)",
+                 mSnapshotCacheWidth, mSnapshotCacheHeight,
+                 mSnapshotCacheUses);
+        mRawHeapCache = NULL;
+        mJpegHeapCache = NULL;
+        mSnapshotCacheWidth = -1;
+        mSnapshotCacheHeight = -1;
+        mSnapshotCacheUses = 0;
+    }
+
     void QualcommCameraHardware::release()
     {
         LOGV("release E");
@@ -625,6 +934,12 @@ namespace android {
                  getCameraStateStr(mCameraState));
         }
         
+        // The cached heaps release their pmem through libqcamera, so they
+        // must go before it is shut down.
+        dropSnapshotCache();
+        dropPreviewCache();
+        mPreviewHeap = NULL;
+
         mStateLock.lock();
         if (mCameraState != QCS_INIT) {
             // When libqcamera detects an error, it calls camera_cb from the
@@ -686,13 +1001,22 @@ namespace android {
         preview_callback pcb, void *puser,
         recording_callback rcb, void *ruser)
     {
-        Mutex::Autolock cbLock(&mCallbackLock);
-        mPreviewCallback = pcb;
-        mPreviewCallbackCookie = puser;
-        mRecordingCallback = rcb;
-        mRecordingCallbackCookie = ruser;
-        return mPreviewCallback != NULL ||
-            mRecordingCallback != NULL;
+        {
+            Mutex::Autolock cbLock(&mCallbackLock);
+            mPreviewCallback = pcb;
+            mPreviewCallbackCookie = puser;
+            mRecordingCallback = rcb;
+            mRecordingCallbackCookie = ruser;
+        }
+
+        // Make sure the delivery thread is not still inside the previous
+        // preview callback when we return.
+        Mutex::Autolock ringLock(&mRingLock);
+        if (mRingRunning && !pthread_equal(pthread_self(), mRingThread)) {
+            while (mRingBusy)
+                mRingIdle.wait(mRingLock);
+        }
+        return pcb != NULL || rcb != NULL;
     }
 
     status_t QualcommCameraHardware::startPreviewInternal(
@@ -737,10 +1061,20 @@ namespace android {
         }
 
         setCallbacks(pcb, puser, rcb, ruser);
+        startPreviewRing();
 
         // hack to prevent first preview frame from being black
         mPreviewCount = 0;
 
+        mPreviewLastFrame = 0;
+        mPreviewLastInterval = 0;
+        mPreviewIntervals = 0;
+        mPreviewIntervalMin = 0;
+        mPreviewIntervalMax = 0;
+        mPreviewIntervalSum = 0;
+        mPreviewJitter = 0;
+        mPreviewFramesBad = 0;
+
         mCameraState = QCS_INTERNAL_PREVIEW_REQUESTED;
         camera_ret_code_type qret =
             LINK_camera_start_preview(camera_cb, this);
@@ -756,6 +1090,9 @@ namespace android {
             mCameraState = QCS_ERROR;
         }
 
+        if (mCameraState != QCS_PREVIEW_IN_PROGRESS)
+            stopPreviewRing();
+
         LOGV("startPreview X");
         return mCameraState == QCS_PREVIEW_IN_PROGRESS ?
             NO_ERROR : UNKNOWN_ERROR;
@@ -792,7 +1129,10 @@ namespace android {
             mStateWait.wait(mStateLock);
         }
 
-        LOGV("stopPreviewInternal: Freeing preview heap.");
+        stopPreviewRing();
+
+        // The heap itself stays in mPreviewHeapCache, if caching is on.
+        LOGV("stopPreviewInternal: Releasing preview heap.");
         mPreviewHeap = NULL;
         mPreviewCallback = NULL;
 
@@ -892,13 +1232,17 @@ namespace android {
                                                  jpeg_callback jpeg_cb,
                                                  void* user)
     {
+        HALTRACE_SCOPE("camera", "takePicture");
         LOGV("takePicture: E raw_cb = %p, jpeg_cb = %p",
              raw_cb, jpeg_cb);
-        print_time();
 
         Mutex::Autolock l(&mLock);
         Mutex::Autolock stateLock(&mStateLock);
 
+        capture_timing *t = &mCaptureTiming[mCaptureCount++ % kCaptureTimingCount];
+        memset(t, 0, sizeof(*t));
+        t->take_picture = systemTime();
+
         qualcomm_camera_state last_state = mCameraState;
         if (mCameraState == QCS_PREVIEW_IN_PROGRESS) {
             stopPreviewInternal();
@@ -960,6 +1304,8 @@ namespace android {
 
         mCameraState = QCS_INTERNAL_RAW_REQUESTED;
 
+        // spans the capture until the JPEG, or the raw picture, is delivered
+        HALTRACE_ASYNC_BEGIN("camera", "capture", mCaptureCount);
         LINK_camera_take_picture(camera_cb, this);
 
         // It's possible for the YUV callback as well as the JPEG callbacks
@@ -977,7 +1323,6 @@ namespace android {
         }
 
         LOGV("takePicture: X");
-        print_time();
         return mCameraState != QCS_ERROR ?
             NO_ERROR : UNKNOWN_ERROR;
     }
@@ -1219,10 +1564,44 @@ namespace android {
         return;
     }
 
+    void QualcommCameraHardware::recordPreviewFrame()
+    {
+        nsecs_t now = systemTime();
+        if (mPreviewLastFrame) {
+            int64_t interval = ns2us(now - mPreviewLastFrame);
+            if (mPreviewIntervals) {
+                // Smoothed variation between successive frame intervals,
+                // as in the RTP interarrival jitter estimate.
+                int64_t d = interval - mPreviewLastInterval;
+                if (d < 0)
+                    d = -d;
+                mPreviewJitter += (d - mPreviewJitter) / 16;
+            }
+            if (!mPreviewIntervals || interval < mPreviewIntervalMin)
+                mPreviewIntervalMin = interval;
+            if (interval > mPreviewIntervalMax)
+                mPreviewIntervalMax = interval;
+            mPreviewIntervalSum += interval;
+            mPreviewIntervals++;
+            mPreviewLastInterval = interval;
+        }
+        mPreviewLastFrame = now;
+    }
+
+    QualcommCameraHardware::capture_timing *
+    QualcommCameraHardware::captureTiming()
+    {
+        return &mCaptureTiming[(mCaptureCount + kCaptureTimingCount - 1) %
+                               kCaptureTimingCount];
+    }
+
     void QualcommCameraHardware::receivePreviewFrame(camera_frame_type *frame)
     {
+        HALTRACE_SCOPE("camera", "receivePreviewFrame");
         Mutex::Autolock cbLock(&mCallbackLock);
 
+        recordPreviewFrame();
+
         // Ignore the first frame--there is a bug in the VFE pipeline and that
         // frame may be bad.
         if (++mPreviewCount == 1) {
@@ -1253,6 +1632,15 @@ namespace android {
                  mPreviewFrameSize, frame->header_size);
 #endif
             offset /= frame_size;
+            if (mRecordingCallback == NULL && mRingDepth) {
+                // Hand the frame to the delivery thread and give the VFE
+                // buffer back right away, no matter how slow the preview
+                // callback is.
+                if (mPreviewCallback != NULL)
+                    queuePreviewFrame(offset);
+                LINK_camera_release_frame();
+                return;
+            }
             if (mPreviewCallback != NULL)
                 mPreviewCallback(mPreviewHeap->mBuffers[offset],
                                  mPreviewCallbackCookie);
@@ -1274,19 +1662,22 @@ namespace android {
                 LINK_camera_release_frame();
             }
         }
-        else LOGE("Preview frame virtual address %p is out of range!",
+        else {
+            LOGE("Preview frame virtual address %p is out of range!",
                   frame->buf_Virt_Addr);
+            mPreviewFramesBad++;
+        }
     }
 
     void
     QualcommCameraHardware::notifyShutter()
     {
         LOGV("notifyShutter: E");
-        print_time();
+        captureTiming()->shutter = systemTime();
+        HALTRACE_INSTANT("camera", "shutter");
         Mutex::Autolock lock(&mStateLock);
         if (mShutterCallback)
             mShutterCallback(mPictureCallbackCookie);
-        print_time();
         LOGV("notifyShutter: X");
     }
 
@@ -1295,10 +1686,13 @@ namespace android {
     // which startPreview() or takePicture() are called.
     void QualcommCameraHardware::receiveRawPicture(camera_frame_type *frame)
     {
+        HALTRACE_SCOPE("camera", "receiveRawPicture");
         LOGV("receiveRawPicture: E");
-        print_time();
+        captureTiming()->raw = systemTime();
 
         Mutex::Autolock cbLock(&mCallbackLock);
+        if (mJpegPictureCallback == NULL)
+            HALTRACE_ASYNC_END("camera", "capture", mCaptureCount);
 
         if (mRawPictureCallback != NULL) {
             // FIXME: WHY IS buf_Virt_Addr ZERO??
@@ -1340,7 +1734,6 @@ namespace android {
         }
         else LOGV("Raw-picture callback was canceled--skipping.");
 
-        print_time();
         LOGV("receiveRawPicture: X");
     }
 
@@ -1352,7 +1745,8 @@ namespace android {
     QualcommCameraHardware::receivePostLpmRawPicture(camera_frame_type *frame)
     {
         LOGV("receivePostLpmRawPicture: E");
-        print_time();
+        captureTiming()->encode = systemTime();
+        HALTRACE_INSTANT("camera", "encode");
         qualcomm_camera_state new_state = QCS_ERROR;
 
         Mutex::Autolock cbLock(&mCallbackLock);
@@ -1422,7 +1816,6 @@ namespace android {
             // that heap.
             mRawHeap = NULL;
         }                    
-        print_time();
         LOGV("receivePostLpmRawPicture: X");
     }
 
@@ -1430,6 +1823,8 @@ namespace android {
     QualcommCameraHardware::receiveJpegPictureFragment(
         JPEGENC_CBrtnType *encInfo)
     {
+        HALTRACE_SCOPE_ARGS("camera", "receiveJpegPictureFragment",
+                            encInfo->size, 0);
         camera_encode_mem_type *enc =
             (camera_encode_mem_type *)encInfo->outPtr;
         int index = enc - camera_handle.mem.encBuf;
@@ -1443,6 +1838,14 @@ namespace android {
              encInfo->status,
              size);
 
+        capture_timing *t = captureTiming();
+        nsecs_t now = systemTime();
+        if (!t->fragments++)
+            t->first_fragment = now;
+        else if (now - t->last_fragment > t->max_fragment_gap)
+            t->max_fragment_gap = now - t->last_fragment;
+        t->last_fragment = now;
+
         if (size > remaining) {
             LOGE("receiveJpegPictureFragment: size %d exceeds what "
                  "remains in JPEG heap (%d), truncating",
@@ -1464,7 +1867,11 @@ namespace android {
     {
         LOGV("receiveJpegPicture: E image (%d bytes out of %d)",
              mJpegSize, mJpegHeap->mBufferSize);
-        print_time();
+        HALTRACE_SCOPE("camera", "receiveJpegPicture");
+        capture_timing *t = captureTiming();
+        t->jpeg = systemTime();
+        t->jpeg_size = mJpegSize;
+        HALTRACE_ASYNC_END("camera", "capture", mCaptureCount);
         Mutex::Autolock cbLock(&mCallbackLock);
 
         int index = 0;
@@ -1488,6 +1895,12 @@ namespace android {
         // to keep the heap around until the encoding is complete.
         mJpegHeap = NULL;
         mRawHeap = NULL;        
+
+        int burst = mParameters.getInt("snapshot-burst");
+        if (burst > 0 && mSnapshotCacheUses >= burst) {
+            LOGV("receiveJpegPicture: burst of %d done.", burst);
+            dropSnapshotCache();
+        }
         
         for (int cnt = 0; cnt < MAX_JPEG_ENCODE_BUF_NUM; cnt++) {
             if (camera_handle.mem.encBuf[cnt].buffer != NULL) {
@@ -1497,7 +1910,6 @@ namespace android {
             }
         } /* for */
 
-        print_time();
         LOGV("receiveJpegPicture: X callback done.");
     }
 
@@ -2184,6 +2596,21 @@ namespace android {
         mHeap.clear();
         LOGV("destroying MemPool %s completed", mName);        
     }
+
+    bool QualcommCameraHardware::MemPool::inUse() const
+    {
+        // One reference to the heap is ours, and each of our buffers holds
+        // one more.
+        int32_t refs = 1;
+        if (mBuffers != NULL) {
+            for (int i = 0; i < mNumBuffers; i++) {
+                if (mBuffers[i]->getStrongCount() > 1)
+                    return true;
+                refs++;
+            }
+        }
+        return mHeap->getStrongCount() > refs;
+    }
     
     status_t QualcommCameraHardware::MemPool::dump(int fd, const Vector<String16>& args) const
     {
@@ -20,9 +20,11 @@
 #include <camera/CameraHardwareInterface.h>
 #include <binder/MemoryBase.h>
 #include <binder/MemoryHeapBase.h>
+#include <utils/Timers.h>
 
 extern "C" {
     #include <linux/android_pmem.h>
+    #include <pthread.h>
 }
 
 namespace android {
@@ -80,6 +82,12 @@ private:
     static const int kJpegBufferCount = 1;
     static const int kRawFrameHeaderSize = 0x48;
 
+    /* Upper bound on the depth of the preview delivery ring.  The ring
+       borrows depth + 1 extra buffers from the preview heap, after the
+       kPreviewBufferCount ones that libqcamera owns.
+    */
+    static const int kPreviewRingMax = 4;
+
     //TODO: put the picture dimensions in the CameraParameters object;
     CameraParameters mParameters;
     int mPreviewHeight;
@@ -88,6 +96,26 @@ private:
     int mRawWidth;
 
     void receivePreviewFrame(camera_frame_type *frame);
+    void recordPreviewFrame();
+
+    // Preview frames are copied out of the VFE buffers into a small ring
+    // and delivered to mPreviewCallback from a dedicated thread, so that a
+    // slow consumer cannot hold up LINK_camera_release_frame().  Recording
+    // still hands out the VFE buffers directly, because the encoder
+    // releases them through releaseRecordingFrame().
+
+    enum preview_slot_state {
+        PREVIEW_SLOT_FREE,
+        PREVIEW_SLOT_FILLING,
+        PREVIEW_SLOT_QUEUED,
+        PREVIEW_SLOT_BUSY,
+    };
+
+    bool startPreviewRing();
+    void stopPreviewRing();
+    bool queuePreviewFrame(int index);
+    void runPreviewRing();
+    static void *preview_ring_thread(void *user);
 
     static void stop_camera_cb(camera_cb_type cb,
             const void *client_data,
@@ -118,6 +146,10 @@ private:
 
         virtual status_t dump(int fd, const Vector<String16>& args) const;
 
+        // True while anything besides this pool holds mHeap or one of
+        // mBuffers, such as a client that has not released a callback yet.
+        bool inUse() const;
+
         int mBufferSize;
         int mNumBuffers;
         int mFrameSize;
@@ -168,10 +200,24 @@ private:
     sp<RawPmemPool> mRawHeap;
     sp<AshmemPool> mJpegHeap;
 
+    sp<RawPmemPool> mRawHeapCache;
+    sp<AshmemPool> mJpegHeapCache;
+    int mSnapshotCacheWidth;
+    int mSnapshotCacheHeight;
+    int mSnapshotCacheUses;
+
+    sp<PreviewPmemPool> mPreviewHeapCache;
+    int mPreviewCacheWidth;
+    int mPreviewCacheHeight;
+    int mPreviewCacheBuffers;
+    int mPreviewCacheUses;
+
     void startCameraIfNecessary();
     bool initPreview();
     void deinitPreview();
     bool initRaw(bool initJpegHeap);
+    void dropSnapshotCache();
+    void dropPreviewCache();
 
     void initDefaultParameters();
     void initCameraParameters();
@@ -217,6 +263,25 @@ private:
     void receiveRawPicture(camera_frame_type *frame);
     void receiveJpegPicture(void);
 
+    // Timestamps of the last kCaptureTimingCount captures, for dump().
+    struct capture_timing {
+        nsecs_t take_picture;
+        nsecs_t shutter;
+        nsecs_t raw;
+        nsecs_t encode;
+        nsecs_t first_fragment;
+        nsecs_t last_fragment;
+        nsecs_t max_fragment_gap;
+        nsecs_t jpeg;
+        int fragments;
+        uint32_t jpeg_size;
+    };
+
+    static const int kCaptureTimingCount = 8;
+    capture_timing mCaptureTiming[kCaptureTimingCount];
+    int mCaptureCount;
+    capture_timing *captureTiming();
+
     Mutex mLock; // API lock -- all public methods
     Mutex mCallbackLock;
     Mutex mStateLock;
@@ -253,6 +318,32 @@ private:
     // hack to prevent black frame on first preview
     int                 mPreviewCount;
 
+    int                 mRingDepth;     // 0 disables the ring
+    bool                mRingDropNewest;
+    bool                mRingRunning;
+    bool                mRingStop;
+    bool                mRingBusy;
+    int                 mRingHead;
+    int                 mRingCount;
+    int                 mRingQueue[kPreviewRingMax + 1];
+    preview_slot_state  mRingState[kPreviewRingMax + 1];
+    pthread_t           mRingThread;
+    Mutex               mRingLock;
+    Condition           mRingWait;
+    Condition           mRingIdle;
+    uint32_t            mPreviewFramesDelivered;
+    uint32_t            mPreviewFramesDropped;
+
+    // Preview inter-frame intervals in us, reset by startPreview().
+    nsecs_t             mPreviewLastFrame;
+    int64_t             mPreviewLastInterval;
+    uint32_t            mPreviewIntervals;
+    int64_t             mPreviewIntervalMin;
+    int64_t             mPreviewIntervalMax;
+    int64_t             mPreviewIntervalSum;
+    int64_t             mPreviewJitter;
+    uint32_t            mPreviewFramesBad;
+
 #if DLOPEN_LIBQCAMERA == 1
     void *libqcamera;
 #endif
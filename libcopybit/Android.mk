@@ -21,11 +21,12 @@ ifeq ($(TARGET_BOARD_PLATFORM),msm7k)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
-LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_SHARED_LIBRARIES := liblog libhaltrace
 LOCAL_SRC_FILES := copybit.cpp
 LOCAL_MODULE := copybit.msm7k
 LOCAL_MODULE_TAGS := optional
 LOCAL_C_INCLUDES += hardware/msm7k/libgralloc
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libhaltrace
 LOCAL_CFLAGS += -DCOPYBIT_MSM7K=1
 include $(BUILD_SHARED_LIBRARY)
 endif
@@ -34,11 +35,12 @@ ifeq ($(TARGET_BOARD_PLATFORM),qsd8k)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
-LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_SHARED_LIBRARIES := liblog libhaltrace
 LOCAL_SRC_FILES := copybit.cpp
 LOCAL_MODULE := copybit.qsd8k
 LOCAL_MODULE_TAGS := optional
 LOCAL_C_INCLUDES += hardware/libhardware/modules/gralloc
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libhaltrace
 LOCAL_CFLAGS += -DCOPYBIT_QSD8K=1
 include $(BUILD_SHARED_LIBRARY)
 endif
@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -35,6 +36,8 @@
 #include <hardware/copybit.h>
 
 #include "gralloc_priv.h"
+#include "copybit_priv.h"
+#include "haltrace.h"
 
 #define DEBUG_MDP_ERRORS 1
 
@@ -43,21 +46,51 @@
 #if defined(COPYBIT_MSM7K)
 #define MAX_SCALE_FACTOR    (4)
 #define MAX_DIMENSION       (4096)
+/** the 7k MDP fetches rotated sources a column at a time, which thrashes
+ *  its cache on wide blits. Split them in strips this many pixels wide.
+ */
+#define ROT_STRIP_WIDTH     (64)
 #elif defined(COPYBIT_QSD8K)
 #define MAX_SCALE_FACTOR    (8)
 #define MAX_DIMENSION       (2048)
+#define ROT_STRIP_WIDTH     (0)
 #else
 #error "Unsupported MDP version"
 #endif
 
+/** max number of requests handed to the driver in one MSMFB_BLIT */
+#define MAX_BLIT_REQ        (12)
+
+/** number of request lists the async worker can hold, a power of two */
+#define ASYNC_QUEUE_DEPTH   (4)
+
 /******************************************************************************/
 
+struct blit_req_list_t {
+    uint32_t count;
+    struct mdp_blit_req req[MAX_BLIT_REQ];
+};
+
 /** State information for each device instance */
 struct copybit_context_t {
     struct copybit_device_t device;
     int     mFD;
     uint8_t mAlpha;
     uint8_t mFlags;
+    bool    mDefer;
+    struct blit_req_list_t mPending;
+
+    /* async submission, the fences count lists handed to the worker */
+    bool    mAsync;
+    bool    mExit;
+    bool    mThreadStarted;
+    pthread_t mThread;
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+    uint32_t mQueued;
+    uint32_t mCompleted;
+    int     mAsyncStatus;
+    struct blit_req_list_t mQueue[ASYNC_QUEUE_DEPTH];
 };
 
 /**
@@ -193,6 +226,26 @@ static void set_rects(struct copybit_context_t *dev,
     }
 }
 
+/** width of the strips the clip rect is blitted in, the whole rect if
+ *  it doesn't need splitting */
+static int strip_width(struct copybit_context_t *dev,
+                       const struct copybit_rect_t *dst,
+                       const struct copybit_rect_t *src,
+                       const struct copybit_rect_t *clip) {
+    const int w = clip->r - clip->l;
+    // each destination column of a 90/270 blit is a source row, so
+    // narrow strips read a band of consecutive source lines. Only split
+    // unscaled blits: set_rects() rounds each strip's source edges on its
+    // own, which would leave seams between the bands of a scaled one.
+    if (ROT_STRIP_WIDTH && (dev->mFlags & MDP_ROT_90) &&
+        w > 2*ROT_STRIP_WIDTH &&
+        (src->r - src->l) == (dst->b - dst->t) &&
+        (src->b - src->t) == (dst->r - dst->l)) {
+        return ROT_STRIP_WIDTH;
+    }
+    return w;
+}
+
 /** setup mdp request */
 static void set_infos(struct copybit_context_t *dev, struct mdp_blit_req *req) {
     req->alpha = dev->mAlpha;
@@ -203,8 +256,13 @@ static void set_infos(struct copybit_context_t *dev, struct mdp_blit_req *req) {
 /** copy the bits */
 static int msm_copybit(struct copybit_context_t *dev, void const *list) 
 {
-    int err = ioctl(dev->mFD, MSMFB_BLIT,
+    int err;
+    {
+        HALTRACE_SCOPE_ARGS("mdp", "copybit",
+                            ((struct mdp_blit_req_list const*)list)->count, 0);
+        err = ioctl(dev->mFD, MSMFB_BLIT,
                     (struct mdp_blit_req_list const*)list);
+    }
     LOGE_IF(err<0, "copyBits failed (%s)", strerror(errno));
     if (err == 0) {
         return 0;
@@ -239,6 +297,124 @@ static int msm_copybit(struct copybit_context_t *dev, void const *list)
     }
 }
 
+/** number of fences from 'from' to 'to' */
+static inline uint32_t fence_distance(uint32_t from, uint32_t to) {
+    return (to - from) & COPYBIT_FENCE_MASK;
+}
+
+/** drain the async queue into the driver */
+static void *async_worker(void *arg)
+{
+    struct copybit_context_t *dev = (struct copybit_context_t *)arg;
+    pthread_mutex_lock(&dev->mLock);
+    for (;;) {
+        while (dev->mCompleted == dev->mQueued && !dev->mExit) {
+            pthread_cond_wait(&dev->mCond, &dev->mLock);
+        }
+        if (dev->mCompleted == dev->mQueued) {
+            // only exit once everything queued went out
+            break;
+        }
+        uint32_t next = (dev->mCompleted + 1) & COPYBIT_FENCE_MASK;
+        struct blit_req_list_t *list = &dev->mQueue[next % ASYNC_QUEUE_DEPTH];
+        pthread_mutex_unlock(&dev->mLock);
+
+        int err = msm_copybit(dev, list);
+
+        pthread_mutex_lock(&dev->mLock);
+        if (err && !dev->mAsyncStatus) {
+            dev->mAsyncStatus = err;
+        }
+        dev->mCompleted = next;
+        pthread_cond_broadcast(&dev->mCond);
+    }
+    pthread_mutex_unlock(&dev->mLock);
+    return NULL;
+}
+
+/** hand a copy of list to the async worker, blocks while the queue is full */
+static int queue_copybit(struct copybit_context_t *dev,
+                         struct blit_req_list_t const *list)
+{
+    pthread_mutex_lock(&dev->mLock);
+    while (fence_distance(dev->mCompleted, dev->mQueued) == ASYNC_QUEUE_DEPTH) {
+        pthread_cond_wait(&dev->mCond, &dev->mLock);
+    }
+    uint32_t next = (dev->mQueued + 1) & COPYBIT_FENCE_MASK;
+    struct blit_req_list_t *slot = &dev->mQueue[next % ASYNC_QUEUE_DEPTH];
+    slot->count = list->count;
+    memcpy(slot->req, list->req, list->count * sizeof(list->req[0]));
+    dev->mQueued = next;
+    pthread_cond_broadcast(&dev->mCond);
+    pthread_mutex_unlock(&dev->mLock);
+    return 0;
+}
+
+/** send a request list to the driver, or to the worker in async mode */
+static int submit_copybit(struct copybit_context_t *dev,
+                          struct blit_req_list_t const *list)
+{
+    if (dev->mAsync) {
+        return queue_copybit(dev, list);
+    }
+    return msm_copybit(dev, list);
+}
+
+/** wait until the lists up to fence completed, returns their first error */
+static int wait_copybit(struct copybit_context_t *dev, uint32_t fence)
+{
+    pthread_mutex_lock(&dev->mLock);
+    uint32_t wait = fence_distance(dev->mCompleted, fence & COPYBIT_FENCE_MASK);
+    // fences that were never handed out are treated as already signaled
+    if (wait > fence_distance(dev->mCompleted, dev->mQueued)) {
+        wait = 0;
+    }
+    while (wait) {
+        pthread_cond_wait(&dev->mCond, &dev->mLock);
+        wait = fence_distance(dev->mCompleted, fence & COPYBIT_FENCE_MASK);
+        if (wait > fence_distance(dev->mCompleted, dev->mQueued)) {
+            wait = 0;
+        }
+    }
+    int status = dev->mAsyncStatus;
+    dev->mAsyncStatus = 0;
+    pthread_mutex_unlock(&dev->mLock);
+    return status;
+}
+
+/** enable or disable async submission */
+static int set_async_copybit(struct copybit_context_t *dev, bool enable)
+{
+    if (enable) {
+        if (!dev->mThreadStarted) {
+            int err = pthread_create(&dev->mThread, NULL, async_worker, dev);
+            if (err) {
+                LOGE("Cannot start copybit worker (%s)", strerror(err));
+                return -err;
+            }
+            dev->mThreadStarted = true;
+        }
+        dev->mAsync = true;
+        return 0;
+    }
+    if (!dev->mAsync) {
+        return 0;
+    }
+    dev->mAsync = false;
+    return wait_copybit(dev, dev->mQueued);
+}
+
+/** submit the blits queued in deferred mode */
+static int flush_copybit(struct copybit_context_t *dev)
+{
+    int status = 0;
+    if (dev->mPending.count) {
+        status = submit_copybit(dev, &dev->mPending);
+        dev->mPending.count = 0;
+    }
+    return status;
+}
+
 /*****************************************************************************/
 
 /** Set a parameter to value */
@@ -297,6 +473,27 @@ static int set_parameter_copybit(
             ctx->mFlags &= ~0x7;
             ctx->mFlags |= value & 0x7;
             break;
+        case COPYBIT_PRIVATE_DEFER:
+            if (value == COPYBIT_ENABLE) {
+                ctx->mDefer = true;
+            } else if (value == COPYBIT_DISABLE) {
+                status = flush_copybit(ctx);
+                ctx->mDefer = false;
+            }
+            break;
+        case COPYBIT_PRIVATE_FLUSH:
+            status = flush_copybit(ctx);
+            break;
+        case COPYBIT_PRIVATE_ASYNC:
+            if (value == COPYBIT_ENABLE) {
+                status = set_async_copybit(ctx, true);
+            } else if (value == COPYBIT_DISABLE) {
+                status = set_async_copybit(ctx, false);
+            }
+            break;
+        case COPYBIT_PRIVATE_WAIT:
+            status = wait_copybit(ctx, value);
+            break;
         default:
             status = -EINVAL;
             break;
@@ -326,6 +523,16 @@ static int get(struct copybit_device_t *dev, int name)
         case COPYBIT_ROTATION_STEP_DEG:
             value = 90;
             break;
+        case COPYBIT_PRIVATE_FENCE:
+            pthread_mutex_lock(&ctx->mLock);
+            value = ctx->mQueued;
+            pthread_mutex_unlock(&ctx->mLock);
+            break;
+        case COPYBIT_PRIVATE_COMPLETED:
+            pthread_mutex_lock(&ctx->mLock);
+            value = ctx->mCompleted;
+            pthread_mutex_unlock(&ctx->mLock);
+            break;
         default:
             value = -EINVAL;
         }
@@ -335,6 +542,59 @@ static int get(struct copybit_device_t *dev, int name)
     return value;
 }
 
+/** true if b continues a below or to the right, then a becomes the union.
+ *  All the clip rects of a stretch share its src to dst mapping, so the
+ *  union can go to the MDP as a single blit. */
+static bool merge_rects(struct copybit_rect_t *a,
+                        const struct copybit_rect_t *b) {
+    if (a->l == b->l && a->r == b->r && a->b == b->t) {
+        a->b = b->b;
+        return true;
+    }
+    if (a->t == b->t && a->b == b->b && a->r == b->l) {
+        a->r = b->r;
+        return true;
+    }
+    return false;
+}
+
+/** add the requests for one clip rect to list, submitting it when full */
+static int add_clip_copybit(
+        struct copybit_context_t *ctx,
+        struct blit_req_list_t *list,
+        struct copybit_image_t const *dst,
+        struct copybit_image_t const *src,
+        struct copybit_rect_t const *dst_rect,
+        struct copybit_rect_t const *src_rect,
+        struct copybit_rect_t const *clip)
+{
+    const uint32_t maxCount = sizeof(list->req)/sizeof(list->req[0]);
+    const int step = strip_width(ctx, dst_rect, src_rect, clip);
+    struct copybit_rect_t strip = *clip;
+    int status = 0;
+    for (int l = clip->l ; (status == 0) && l < clip->r ; l += step) {
+        strip.l = l;
+        strip.r = min(l + step, clip->r);
+        mdp_blit_req* req = &list->req[list->count];
+        set_infos(ctx, req);
+        set_image(&req->dst, dst);
+        set_image(&req->src, src);
+        set_rects(ctx, req, dst_rect, src_rect, &strip);
+
+        if (req->src_rect.w<=0 || req->src_rect.h<=0)
+            continue;
+
+        if (req->dst_rect.w<=0 || req->dst_rect.h<=0)
+            continue;
+
+        if (++list->count == maxCount) {
+            status = submit_copybit(ctx, list);
+            list->count = 0;
+        }
+    }
+    return status;
+}
+
 /** do a stretch blit type operation */
 static int stretch_copybit(
         struct copybit_device_t *dev,
@@ -344,13 +604,13 @@ static int stretch_copybit(
         struct copybit_rect_t const *src_rect,
         struct copybit_region_t const *region) 
 {
+    HALTRACE_SCOPE("copybit", "stretch");
     struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
     int status = 0;
     if (ctx) {
-        struct {
-            uint32_t count;
-            struct mdp_blit_req req[12];
-        } list;
+        struct blit_req_list_t local;
+        // in deferred mode the requests pile up across calls
+        struct blit_req_list_t* list = ctx->mDefer ? &ctx->mPending : &local;
 
         if (ctx->mAlpha < 255) {
             switch (src->format) {
@@ -375,32 +635,35 @@ static int stretch_copybit(
         if (dst->w > MAX_DIMENSION || dst->h > MAX_DIMENSION)
             return -EINVAL;
 
-        const uint32_t maxCount = sizeof(list.req)/sizeof(list.req[0]);
         const struct copybit_rect_t bounds = { 0, 0, dst->w, dst->h };
         struct copybit_rect_t clip;
-        list.count = 0;
+        struct copybit_rect_t pending;
+        bool hasPending = false;
+        if (!ctx->mDefer) {
+            local.count = 0;
+        }
         status = 0;
+        // region iterators hand out lots of thin adjacent rects, grow
+        // them into as few blits as possible before building requests
         while ((status == 0) && region->next(region, &clip)) {
             intersect(&clip, &bounds, &clip);
-            mdp_blit_req* req = &list.req[list.count];
-            set_infos(ctx, req);
-            set_image(&req->dst, dst);
-            set_image(&req->src, src);
-            set_rects(ctx, req, dst_rect, src_rect, &clip);
-
-            if (req->src_rect.w<=0 || req->src_rect.h<=0)
+            if (clip.r <= clip.l || clip.b <= clip.t)
                 continue;
-
-            if (req->dst_rect.w<=0 || req->dst_rect.h<=0)
+            if (hasPending && merge_rects(&pending, &clip))
                 continue;
-
-            if (++list.count == maxCount) {
-                status = msm_copybit(ctx, &list);
-                list.count = 0;
+            if (hasPending) {
+                status = add_clip_copybit(ctx, list, dst, src,
+                        dst_rect, src_rect, &pending);
             }
+            pending = clip;
+            hasPending = true;
+        }
+        if ((status == 0) && hasPending) {
+            status = add_clip_copybit(ctx, list, dst, src,
+                    dst_rect, src_rect, &pending);
         }
-        if ((status == 0) && list.count) {
-            status = msm_copybit(ctx, &list);
+        if ((status == 0) && list->count && !ctx->mDefer) {
+            status = submit_copybit(ctx, list);
         }
     } else {
         status = -EINVAL;
@@ -427,6 +690,18 @@ static int close_copybit(struct hw_device_t *dev)
 {
     struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
     if (ctx) {
+        if (ctx->mFD >= 0) {
+            flush_copybit(ctx);
+        }
+        if (ctx->mThreadStarted) {
+            pthread_mutex_lock(&ctx->mLock);
+            ctx->mExit = true;
+            pthread_cond_broadcast(&ctx->mCond);
+            pthread_mutex_unlock(&ctx->mLock);
+            pthread_join(ctx->mThread, NULL);
+        }
+        pthread_cond_destroy(&ctx->mCond);
+        pthread_mutex_destroy(&ctx->mLock);
         close(ctx->mFD);
         free(ctx);
     }
@@ -452,6 +727,16 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
     ctx->device.stretch = stretch_copybit;
     ctx->mAlpha = MDP_ALPHA_NOP;
     ctx->mFlags = 0;
+    ctx->mDefer = false;
+    ctx->mPending.count = 0;
+    ctx->mAsync = false;
+    ctx->mExit = false;
+    ctx->mThreadStarted = false;
+    ctx->mQueued = 0;
+    ctx->mCompleted = 0;
+    ctx->mAsyncStatus = 0;
+    pthread_mutex_init(&ctx->mLock, NULL);
+    pthread_cond_init(&ctx->mCond, NULL);
     ctx->mFD = open("/dev/graphics/fb0", O_RDWR, 0);
     
     if (ctx->mFD < 0) {
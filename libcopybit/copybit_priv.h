@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_COPYBIT_PRIV_H
+#define ANDROID_COPYBIT_PRIV_H
+
+#include <hardware/copybit.h>
+
+__BEGIN_DECLS
+
+/**
+ * MSM specific parameters for copybit_device_t::set_parameter(). They are
+ * outside the range used by <hardware/copybit.h>.
+ */
+enum {
+    /*
+     * COPYBIT_ENABLE queues the blits of each stretch()/blit() call instead
+     * of submitting them, so that all the layers of a frame go to the MDP
+     * in as few MSMFB_BLIT ioctls as possible. The source and destination
+     * buffers must stay valid until the blits are flushed.
+     * COPYBIT_DISABLE flushes and returns to immediate submission.
+     */
+    COPYBIT_PRIVATE_DEFER = 0x10000,
+    /*
+     * Submit all queued blits, the value is ignored. Returns the error of
+     * the submission, if any.
+     */
+    COPYBIT_PRIVATE_FLUSH,
+    /*
+     * COPYBIT_ENABLE makes blit submission return as soon as the requests
+     * are queued for a worker thread, instead of waiting for the MDP.
+     * COPYBIT_DISABLE waits for everything queued and returns to
+     * synchronous submission. Buffers must stay valid until their fence
+     * has completed.
+     */
+    COPYBIT_PRIVATE_ASYNC,
+    /*
+     * Wait until the fence given as value has completed. Returns the
+     * first error of the asynchronous blits since the last wait.
+     */
+    COPYBIT_PRIVATE_WAIT,
+};
+
+/**
+ * MSM specific values for copybit_device_t::get(). Fences are counters
+ * that wrap within COPYBIT_FENCE_MASK.
+ */
+enum {
+    /* fence of the most recently queued submission */
+    COPYBIT_PRIVATE_FENCE = 0x10000,
+    /* fence of the most recently completed submission, for polling */
+    COPYBIT_PRIVATE_COMPLETED,
+};
+
+#define COPYBIT_FENCE_MASK  0x7fffffff
+
+__END_DECLS
+
+#endif // ANDROID_COPYBIT_PRIV_H
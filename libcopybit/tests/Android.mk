@@ -0,0 +1,24 @@
+# Copyright (C) 2008 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+LOCAL_PATH := $(call my-dir)
+
+# Throughput and CPU reference checks of the copybit module on a device.
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := copybit_test.cpp
+LOCAL_SHARED_LIBRARIES := libhardware libcutils liblog
+LOCAL_MODULE := copybit_test
+LOCAL_MODULE_TAGS := eng tests
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,505 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Throughput and correctness harness for the copybit module.  Every case
+ * is a stretch() from a pmem source to a pmem destination with a given
+ * format, scale factor, rotation, plane alpha and clip region; the
+ * harness reports Mpix/s of destination pixels and the per-call latency
+ * percentiles.  Unscaled opaque blits between identical formats are also
+ * checked pixel for pixel against a CPU reference.  Stop the framework
+ * first (adb shell stop) so that nothing else is using the MDP.
+ *
+ *   copybit_test [-n iterations] [-s WxH] [filter]
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/hardware.h>
+#include <hardware/gralloc.h>
+#include <hardware/copybit.h>
+
+static gralloc_module_t const* sGralloc;
+static alloc_device_t* sAllocDev;
+static copybit_device_t* sCopybit;
+
+static int sIterations = 100;
+static int sWidth = 480;
+static int sHeight = 320;
+
+// pmem the MDP can reach, mapped uncached (O_SYNC) so that the CPU sees
+// what the MDP wrote without any cache maintenance.
+static const int kUsage = GRALLOC_USAGE_HW_2D |
+        GRALLOC_USAGE_SW_READ_RARELY | GRALLOC_USAGE_SW_WRITE_RARELY;
+
+/*****************************************************************************/
+
+static inline int64_t nanoTime() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int64_t(t.tv_sec) * 1000000000LL + t.tv_nsec;
+}
+
+struct Format {
+    const char* name;
+    int format;
+    int bpp;        // bytes per pixel of the first plane
+};
+
+// the formats of copybit's get_format() table
+static const Format kFormats[] = {
+    { "RGB_565",        COPYBIT_FORMAT_RGB_565,         2 },
+    { "RGBX_8888",      COPYBIT_FORMAT_RGBX_8888,       4 },
+    { "RGB_888",        COPYBIT_FORMAT_RGB_888,         3 },
+    { "RGBA_8888",      COPYBIT_FORMAT_RGBA_8888,       4 },
+    { "BGRA_8888",      COPYBIT_FORMAT_BGRA_8888,       4 },
+    { "YCrCb_420_SP",   COPYBIT_FORMAT_YCrCb_420_SP,    1 },
+    { "YCbCr_422_SP",   COPYBIT_FORMAT_YCbCr_422_SP,    1 },
+};
+
+struct Rotation {
+    const char* name;
+    int degrees;
+};
+
+static const Rotation kRotations[] = {
+    { "rot0", 0 }, { "rot90", 90 }, { "rot180", 180 }, { "rot270", 270 },
+};
+
+struct Scale {
+    const char* name;
+    int num;
+    int den;
+};
+
+static const Scale kScales[] = {
+    { "1x", 1, 1 }, { "0.5x", 1, 2 }, { "2x", 2, 1 },
+};
+
+static const int kAlphas[] = { 255, 128 };
+
+enum RegionKind {
+    REGION_FULL,        // one rect
+    REGION_STRIPS,      // 32 abutting horizontal strips, can be merged
+    REGION_CHECKER,     // 8x8 checkerboard, nothing to merge
+};
+
+static const struct { const char* name; RegionKind kind; } kRegions[] = {
+    { "full", REGION_FULL },
+    { "strips", REGION_STRIPS },
+    { "checker", REGION_CHECKER },
+};
+
+/*****************************************************************************/
+
+struct Region : public copybit_region_t {
+    enum { kMaxRects = 64 };
+    copybit_rect_t rects[kMaxRects];
+    int count;
+    mutable int current;
+
+    static int iterate(copybit_region_t const* self, copybit_rect_t* rect) {
+        Region const* r = static_cast<Region const*>(self);
+        if (r->current >= r->count)
+            return 0;
+        *rect = r->rects[r->current++];
+        return 1;
+    }
+
+    Region(RegionKind kind, const copybit_rect_t& bounds) : count(0), current(0) {
+        next = iterate;
+        const int w = bounds.r - bounds.l;
+        const int h = bounds.b - bounds.t;
+        switch (kind) {
+        case REGION_FULL:
+            rects[count++] = bounds;
+            break;
+        case REGION_STRIPS:
+            for (int i = 0; i < 32; i++) {
+                copybit_rect_t r = { bounds.l, bounds.t + (h * i) / 32,
+                                     bounds.r, bounds.t + (h * (i+1)) / 32 };
+                rects[count++] = r;
+            }
+            break;
+        case REGION_CHECKER:
+            for (int y = 0; y < 8; y++) {
+                for (int x = (y & 1); x < 8; x += 2) {
+                    copybit_rect_t r = { bounds.l + (w * x) / 8,
+                                         bounds.t + (h * y) / 8,
+                                         bounds.l + (w * (x+1)) / 8,
+                                         bounds.t + (h * (y+1)) / 8 };
+                    rects[count++] = r;
+                }
+            }
+            break;
+        }
+    }
+
+    bool contains(int x, int y) const {
+        for (int i = 0; i < count; i++) {
+            if (x >= rects[i].l && x < rects[i].r &&
+                y >= rects[i].t && y < rects[i].b)
+                return true;
+        }
+        return false;
+    }
+
+    void rewind() const { current = 0; }
+};
+
+struct Buffer {
+    buffer_handle_t handle;
+    copybit_image_t image;
+    int bpp;
+
+    Buffer() : handle(0), bpp(0) {}
+
+    int alloc(int w, int h, const Format& f) {
+        int stride;
+        int err = sAllocDev->alloc(sAllocDev, w, h, f.format, kUsage,
+                &handle, &stride);
+        if (err)
+            return err;
+        image.w = stride;
+        image.h = h;
+        image.format = f.format;
+        image.base = 0;
+        image.handle = (native_handle_t*)handle;
+        bpp = f.bpp;
+        return 0;
+    }
+
+    void free() {
+        if (handle)
+            sAllocDev->free(sAllocDev, handle);
+        handle = 0;
+    }
+
+    uint8_t* lock(int usage) {
+        void* vaddr = 0;
+        if (sGralloc->lock(sGralloc, handle, usage, 0, 0, image.w, image.h,
+                &vaddr))
+            return 0;
+        return (uint8_t*)vaddr;
+    }
+
+    void unlock() {
+        sGralloc->unlock(sGralloc, handle);
+    }
+
+    // bytes of the whole buffer, chroma planes included
+    size_t size() const {
+        size_t luma = image.w * image.h * bpp;
+        if (image.format == COPYBIT_FORMAT_YCrCb_420_SP)
+            return luma + luma / 2;
+        if (image.format == COPYBIT_FORMAT_YCbCr_422_SP)
+            return luma * 2;
+        return luma;
+    }
+};
+
+/** fill with a pattern where every pixel of the first plane is unique-ish */
+static void fillPattern(Buffer& b, uint32_t seed) {
+    uint8_t* p = b.lock(GRALLOC_USAGE_SW_WRITE_RARELY);
+    if (!p)
+        return;
+    const size_t size = b.size();
+    uint32_t v = seed;
+    for (size_t i = 0; i < size; i++) {
+        v = v * 1103515245 + 12345;
+        p[i] = v >> 16;
+    }
+    if (b.image.format == COPYBIT_FORMAT_RGBX_8888 ||
+        b.image.format == COPYBIT_FORMAT_RGBA_8888 ||
+        b.image.format == COPYBIT_FORMAT_BGRA_8888) {
+        // opaque, so that blending leaves the source alone and the MDP
+        // doesn't have to preserve X
+        for (size_t i = 3; i < size; i += 4)
+            p[i] = 0xff;
+    }
+    b.unlock();
+}
+
+/** source pixel that lands on destination (x, y) for an unscaled blit */
+static void sourceFor(int degrees, int x, int y, int srcW, int srcH,
+        int* sx, int* sy) {
+    switch (degrees) {
+    case 90:    *sx = y;            *sy = srcH - 1 - x; break;
+    case 180:   *sx = srcW - 1 - x; *sy = srcH - 1 - y; break;
+    case 270:   *sx = srcW - 1 - y; *sy = x;            break;
+    default:    *sx = x;            *sy = y;            break;
+    }
+}
+
+/**
+ * Compares the first plane of dst against the CPU reference: inside the
+ * region, the rotated source; outside, what was there before.  Returns
+ * the number of mismatching pixels.
+ */
+static int verify(Buffer& dst, const uint8_t* before, Buffer& src,
+        int srcW, int srcH, const copybit_rect_t& dr, int degrees,
+        const Region& region) {
+    uint8_t* d = dst.lock(GRALLOC_USAGE_SW_READ_RARELY);
+    uint8_t* s = src.lock(GRALLOC_USAGE_SW_READ_RARELY);
+    int errors = 0;
+    if (d && s) {
+        const int bpp = dst.bpp;
+        for (int y = 0; y < (int)dst.image.h; y++) {
+            for (int x = 0; x < (int)dst.image.w; x++) {
+                const size_t o = (y * dst.image.w + x) * bpp;
+                const uint8_t* expected = before + o;
+                if (region.contains(x, y) && x >= dr.l && x < dr.r &&
+                        y >= dr.t && y < dr.b) {
+                    int sx, sy;
+                    sourceFor(degrees, x - dr.l, y - dr.t, srcW, srcH,
+                            &sx, &sy);
+                    expected = s + (sy * src.image.w + sx) * bpp;
+                }
+                if (memcmp(d + o, expected, bpp))
+                    errors++;
+            }
+        }
+    } else {
+        errors = -1;
+    }
+    if (s) src.unlock();
+    if (d) dst.unlock();
+    return errors;
+}
+
+static int compareInt64(const void* a, const void* b) {
+    int64_t l = *(const int64_t*)a;
+    int64_t r = *(const int64_t*)b;
+    return (l < r) ? -1 : (l > r);
+}
+
+/*****************************************************************************/
+
+struct Case {
+    const Format* src;
+    const Format* dst;
+    const Scale* scale;
+    const Rotation* rotation;
+    int alpha;
+    RegionKind region;
+    char name[96];
+};
+
+static int runCase(const Case& c) {
+    // the source is sized so that the scaled, rotated result fits the
+    // destination
+    const bool swap = (c.rotation->degrees == 90 || c.rotation->degrees == 270);
+    int outW = sWidth;
+    int outH = sHeight;
+    int srcW = (swap ? outH : outW) * c.scale->den / c.scale->num;
+    int srcH = (swap ? outW : outH) * c.scale->den / c.scale->num;
+    srcW &= ~1;
+    srcH &= ~1;
+
+    Buffer src, dst;
+    if (src.alloc(srcW, srcH, *c.src) || dst.alloc(outW, outH, *c.dst)) {
+        printf("%-56s alloc failed\n", c.name);
+        src.free();
+        dst.free();
+        return -ENOMEM;
+    }
+    fillPattern(src, 1);
+    fillPattern(dst, 2);
+
+    const bool checkable = c.src == c.dst && c.scale->num == c.scale->den &&
+            c.alpha == 255 && c.dst->format != COPYBIT_FORMAT_YCrCb_420_SP &&
+            c.dst->format != COPYBIT_FORMAT_YCbCr_422_SP;
+    uint8_t* before = 0;
+    if (checkable) {
+        before = (uint8_t*)malloc(dst.size());
+        uint8_t* p = dst.lock(GRALLOC_USAGE_SW_READ_RARELY);
+        if (before && p)
+            memcpy(before, p, dst.size());
+        if (p)
+            dst.unlock();
+    }
+
+    const copybit_rect_t dr = { 0, 0, outW, outH };
+    const copybit_rect_t sr = { 0, 0, srcW, srcH };
+    Region region(c.region, dr);
+
+    sCopybit->set_parameter(sCopybit, COPYBIT_ROTATION_DEG, c.rotation->degrees);
+    sCopybit->set_parameter(sCopybit, COPYBIT_PLANE_ALPHA, c.alpha);
+    sCopybit->set_parameter(sCopybit, COPYBIT_DITHER, COPYBIT_DISABLE);
+
+    // the first blit is checked and warms up the driver
+    region.rewind();
+    int err = sCopybit->stretch(sCopybit, &dst.image, &src.image, &dr, &sr,
+            &region);
+    if (err) {
+        printf("%-56s unsupported (%s)\n", c.name, strerror(-err));
+        ::free(before);
+        src.free();
+        dst.free();
+        return err;
+    }
+
+    char check[32] = "-";
+    int status = 0;
+    if (before) {
+        int errors = verify(dst, before, src, srcW, srcH, dr,
+                c.rotation->degrees, region);
+        if (errors == 0) {
+            strcpy(check, "ok");
+        } else {
+            snprintf(check, sizeof(check), "%d bad", errors);
+            status = -EIO;
+        }
+    }
+
+    int64_t* latency = new int64_t[sIterations];
+    int64_t total = 0;
+    for (int i = 0; i < sIterations; i++) {
+        region.rewind();
+        int64_t start = nanoTime();
+        sCopybit->stretch(sCopybit, &dst.image, &src.image, &dr, &sr, &region);
+        latency[i] = nanoTime() - start;
+        total += latency[i];
+    }
+    qsort(latency, sIterations, sizeof(latency[0]), compareInt64);
+
+    int64_t pixels = 0;
+    for (int i = 0; i < region.count; i++) {
+        pixels += (region.rects[i].r - region.rects[i].l) *
+                  (region.rects[i].b - region.rects[i].t);
+    }
+    const double mpixs = total ? (double)pixels * sIterations * 1000.0 / total : 0;
+    printf("%-56s %8.1f %8.2f %8.2f %8.2f %8s\n", c.name, mpixs,
+            latency[sIterations / 2] / 1e6,
+            latency[sIterations * 9 / 10] / 1e6,
+            latency[sIterations * 99 / 100] / 1e6, check);
+
+    delete[] latency;
+    ::free(before);
+    src.free();
+    dst.free();
+    return status;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-n iterations] [-s WxH] [filter]\n", name);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            sIterations = atoi(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &sWidth, &sHeight) != 2) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (sIterations < 1 || sWidth < 16 || sHeight < 16) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char* filter = (optind < argc) ? argv[optind] : NULL;
+
+    hw_module_t const* module;
+    int err = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &module);
+    if (err) {
+        fprintf(stderr, "cannot load gralloc module: %s\n", strerror(-err));
+        return 1;
+    }
+    sGralloc = (gralloc_module_t const*)module;
+    err = gralloc_open(module, &sAllocDev);
+    if (err) {
+        fprintf(stderr, "cannot open gralloc device: %s\n", strerror(-err));
+        return 1;
+    }
+
+    err = hw_get_module(COPYBIT_HARDWARE_MODULE_ID, &module);
+    if (err == 0)
+        err = copybit_open(module, &sCopybit);
+    if (err) {
+        fprintf(stderr, "cannot open copybit: %s\n", strerror(-err));
+        gralloc_close(sAllocDev);
+        return 1;
+    }
+
+    printf("%dx%d destination, %d iterations, latency in ms\n",
+            sWidth, sHeight, sIterations);
+    printf("%-56s %8s %8s %8s %8s %8s\n", "case", "Mpix/s", "p50", "p90",
+            "p99", "check");
+
+    // Formats are crossed with an RGB_565 destination, then blitted onto
+    // themselves; the other parameters are crossed with every pair.
+    const Format* dstFormats[] = { &kFormats[0], 0 };
+    int failures = 0;
+    const int numFormats = sizeof(kFormats) / sizeof(kFormats[0]);
+    for (int f = 0; f < numFormats; f++) {
+        const Format* src = &kFormats[f];
+        // YUV is a source only format
+        dstFormats[1] = (src->format == COPYBIT_FORMAT_YCrCb_420_SP ||
+                src->format == COPYBIT_FORMAT_YCbCr_422_SP ||
+                src == &kFormats[0]) ? 0 : src;
+        for (int d = 0; d < 2 && dstFormats[d]; d++) {
+            for (size_t s = 0; s < sizeof(kScales) / sizeof(kScales[0]); s++) {
+                for (size_t r = 0; r < sizeof(kRotations) / sizeof(kRotations[0]); r++) {
+                    for (size_t a = 0; a < sizeof(kAlphas) / sizeof(kAlphas[0]); a++) {
+                        for (size_t g = 0; g < sizeof(kRegions) / sizeof(kRegions[0]); g++) {
+                            Case c;
+                            c.src = src;
+                            c.dst = dstFormats[d];
+                            c.scale = &kScales[s];
+                            c.rotation = &kRotations[r];
+                            c.alpha = kAlphas[a];
+                            c.region = kRegions[g].kind;
+                            snprintf(c.name, sizeof(c.name),
+                                    "%s->%s/%s/%s/a%d/%s", c.src->name,
+                                    c.dst->name, c.scale->name,
+                                    c.rotation->name, c.alpha,
+                                    kRegions[g].name);
+                            if (filter && !strstr(c.name, filter))
+                                continue;
+                            if (runCase(c) == -EIO)
+                                failures++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    copybit_close(sCopybit);
+    gralloc_close(sAllocDev);
+
+    if (failures) {
+        printf("%d cases did not match the CPU reference\n", failures);
+        return 1;
+    }
+    return 0;
+}
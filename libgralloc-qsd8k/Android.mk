@@ -19,13 +19,15 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
-LOCAL_SHARED_LIBRARIES := liblog libcutils libGLESv1_CM
+LOCAL_SHARED_LIBRARIES := liblog libcutils libGLESv1_CM libEGL libhaltrace
 
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libhaltrace
 LOCAL_C_INCLUDES += $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr/include
 LOCAL_ADDITIONAL_DEPENDENCIES += $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr
 
 LOCAL_SRC_FILES := 	\
 	allocator.cpp 	\
+	flush.cpp 		\
 	framebuffer.cpp \
 	gpu.cpp			\
 	gralloc.cpp		\
@@ -44,12 +46,15 @@ include $(BUILD_SHARED_LIBRARY)
 ifeq ($(HOST_OS),linux)
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES :=		\
+    allocator.cpp		\
+    flush.cpp			\
     gpu.cpp				\
 	pmemalloc.cpp
 
 LOCAL_MODULE_TAGS := tests
 LOCAL_MODULE := libgralloc_qsd8k_host
 LOCAL_MODULE_TAGS := optional
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libhaltrace
 LOCAL_CFLAGS:= -DLOG_TAG=\"gralloc-qsd8k\"
 include $(BUILD_HOST_STATIC_LIBRARY)
 endif
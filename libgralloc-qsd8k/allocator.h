@@ -105,25 +105,42 @@ public:
     virtual ssize_t allocate(size_t size, uint32_t flags = 0);
     virtual ssize_t deallocate(size_t offset);
     virtual size_t  size() const;
+    virtual void    getStats(pmem_pool_stats_t* stats) const;
 
 private:
     struct chunk_t {
         chunk_t(size_t start, size_t size) 
-            : start(start), size(size), free(1), prev(0), next(0) {
+            : start(start), size(size), free(1), prev(0), next(0),
+              freePrev(0), freeNext(0) {
         }
         size_t              start;
         size_t              size : 28;
         int                 free : 4;
         mutable chunk_t*    prev;
         mutable chunk_t*    next;
+        // links in the size-class bin, only valid while the chunk is free
+        mutable chunk_t*    freePrev;
+        mutable chunk_t*    freeNext;
     };
 
     ssize_t  alloc(size_t size, uint32_t flags);
     chunk_t* dealloc(size_t start);
 
+    // free chunks are binned by size class (floor(log2(size))) so that
+    // alloc() only looks at chunks that can possibly fit, and allocated
+    // chunks are indexed by their (page aligned) start so that dealloc()
+    // doesn't have to walk mList.
+    enum { kNumBins = 28 };
+    static int  binFor(size_t size);
+    void        insertFree(chunk_t* chunk);
+    void        removeFree(chunk_t* chunk);
+
     static const int    kMemoryAlign;
     mutable Locker      mLock;
     LinkedList<chunk_t> mList;
+    chunk_t*            mBins[kNumBins];
+    chunk_t**           mAllocated;
+    size_t              mNumPages;
     size_t              mHeapSize;
 };
 
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cutils/log.h>
+
+#include <hardware/gralloc.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+static int bytesPerPixel(int format)
+{
+    switch (format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            return 4;
+        case HAL_PIXEL_FORMAT_RGB_888:
+            return 3;
+        case HAL_PIXEL_FORMAT_RGB_565:
+        case HAL_PIXEL_FORMAT_RGBA_5551:
+        case HAL_PIXEL_FORMAT_RGBA_4444:
+            return 2;
+    }
+    return 0;
+}
+
+/*
+ * Adds the rows covered by the locked rectangle to the range cleaned at
+ * unlock.  Multi-plane formats, and rectangles we cannot make sense of,
+ * fall back to the whole buffer.
+ */
+void addFlushRange(private_handle_t* hnd, int l, int t, int w, int h)
+{
+    int start = 0;
+    int end = hnd->size;
+    int bpp = bytesPerPixel(hnd->format);
+    if (bpp && w > 0 && h > 0 && l >= 0 && t >= 0 &&
+            l + w <= hnd->width && t + h <= hnd->height) {
+        int stride = hnd->width * bpp;
+        start = t * stride + l * bpp;
+        end = (t + h - 1) * stride + (l + w) * bpp;
+        if (end > hnd->size)
+            end = hnd->size;
+    }
+    if (hnd->flushSize) {
+        if (hnd->flushOffset < start)
+            start = hnd->flushOffset;
+        if (hnd->flushOffset + hnd->flushSize > end)
+            end = hnd->flushOffset + hnd->flushSize;
+    }
+    hnd->flushOffset = start;
+    hnd->flushSize = end - start;
+}
+
+/*
+ * The pmem region to clean at unlock.  flushOffset is relative to the
+ * start of the buffer, so it moves both the virtual address the L1 is
+ * cleaned at and the pmem offset the L2 is cleaned at.
+ */
+void getFlushRegion(const private_handle_t* hnd, unsigned long* vaddr,
+        unsigned long* offset, unsigned long* length)
+{
+    *vaddr = hnd->base + hnd->flushOffset;
+    *offset = hnd->offset + hnd->flushOffset;
+    *length = hnd->flushSize;
+}
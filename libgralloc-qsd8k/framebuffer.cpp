@@ -39,9 +39,12 @@
 #include <linux/msm_mdp.h>
 
 #include <GLES/gl.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #include "gralloc_priv.h"
 #include "gr.h"
+#include "haltrace.h"
 #ifdef NO_SURFACEFLINGER_SWAPINTERVAL
 #include <cutils/properties.h>
 #endif
@@ -52,21 +55,41 @@
 #define NUM_BUFFERS 2
 
 
+template <class T> static inline T min(T a, T b) { return (a < b) ? a : b; }
+template <class T> static inline T max(T a, T b) { return (a > b) ? a : b; }
+
 enum {
     PAGE_FLIP = 0x00000001,
     LOCKED = 0x00000002
 };
 
+#ifndef EGL_SYNC_FENCE_KHR
+#define EGL_SYNC_FENCE_KHR 0x30F9
+#endif
+
+typedef EGLSyncKHR (*fb_create_sync_t)(EGLDisplay dpy, EGLenum type,
+        const EGLint *attrib_list);
+typedef EGLint (*fb_client_wait_sync_t)(EGLDisplay dpy, EGLSyncKHR sync,
+        EGLint flags, EGLTimeKHR timeout);
+typedef EGLBoolean (*fb_destroy_sync_t)(EGLDisplay dpy, EGLSyncKHR sync);
+
 struct fb_context_t {
     framebuffer_device_t  device;
+    /* EGL_KHR_fence_sync entry points, NULL if the driver lacks them */
+    fb_create_sync_t createSync;
+    fb_client_wait_sync_t clientWaitSync;
+    fb_destroy_sync_t destroySync;
+    /* fence after the last composition, waited for by the next post */
+    EGLDisplay syncDpy;
+    EGLSyncKHR sync;
 };
 
 /*****************************************************************************/
 
 static void
 msm_copy_buffer(buffer_handle_t handle, int fd,
-                int width, int height, int format,
-                int x, int y, int w, int h);
+                int width, int height, int src_format, int dst_format,
+                uint32_t dst_offset, int x, int y, int w, int h);
 
 static int fb_setSwapInterval(struct framebuffer_device_t* dev,
             int interval)
@@ -90,24 +113,153 @@ static int fb_setUpdateRect(struct framebuffer_device_t* dev,
     fb_context_t* ctx = (fb_context_t*)dev;
     private_module_t* m = reinterpret_cast<private_module_t*>(
             dev->common.module);
+    int r = l + w;
+    int b = t + h;
+    // several updates before a post add up
+    if (m->info.reserved[0] == 0x54445055) {
+        l = min(l, int(m->info.reserved[1] & 0xffff));
+        t = min(t, int(m->info.reserved[1] >> 16));
+        r = max(r, int(m->info.reserved[2] & 0xffff));
+        b = max(b, int(m->info.reserved[2] >> 16));
+    }
     m->info.reserved[0] = 0x54445055; // "UPDT";
     m->info.reserved[1] = (uint16_t)l | ((uint32_t)t << 16);
-    m->info.reserved[2] = (uint16_t)(l+w) | ((uint32_t)(t+h) << 16);
+    m->info.reserved[2] = (uint16_t)r | ((uint32_t)b << 16);
     return 0;
 }
 
+/* The area to update for this post: the accumulated update rect if one was
+ * set, clipped to the screen, or the whole screen. */
+static void fb_getUpdateRect(private_module_t const* m,
+        int* l, int* t, int* w, int* h)
+{
+    int r = m->info.xres;
+    int b = m->info.yres;
+    *l = *t = 0;
+    if (m->info.reserved[0] == 0x54445055) {
+        *l = min(int(m->info.reserved[1] & 0xffff), r);
+        *t = min(int(m->info.reserved[1] >> 16), b);
+        r = min(int(m->info.reserved[2] & 0xffff), r);
+        b = min(int(m->info.reserved[2] >> 16), b);
+    }
+    *w = max(r - *l, 0);
+    *h = max(b - *t, 0);
+}
+
+/* The update rect covers one post only. */
+static void fb_clearUpdateRect(private_module_t* m)
+{
+    m->info.reserved[0] = 0;
+    m->info.reserved[1] = 0;
+    m->info.reserved[2] = 0;
+}
+
+/*
+ * Display thread for the flip queue. Each queued buffer stays at the head of
+ * the queue until the pan to it has completed (FB_ACTIVATE_VBL blocks until
+ * vsync); the buffer it replaces on screen is then retired and unlocked.
+ */
+static void *disp_loop(void *ptr)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(ptr);
+
+    while (true) {
+        pthread_mutex_lock(&m->qlock);
+        while (m->qcount == 0)
+            pthread_cond_wait(&m->qpost, &m->qlock);
+        struct fb_flip_t flip = m->queue[m->qhead];
+        pthread_mutex_unlock(&m->qlock);
+
+        buffer_handle_t retired = m->currentBuffer;
+        if (ioctl(m->framebuffer->fd, FBIOPUT_VSCREENINFO, &flip.info) == -1) {
+            LOGE("FBIOPUT_VSCREENINFO failed");
+            retired = flip.buffer;
+        } else {
+            m->currentBuffer = flip.buffer;
+        }
+
+        /* Unlock before announcing the retirement: a compositor woken by
+         * qretire goes on to lock this buffer for drawing. */
+        if (retired)
+            m->base.unlock(&m->base, retired);
+
+        pthread_mutex_lock(&m->qlock);
+        m->qhead = (m->qhead + 1) % NUM_FRAMEBUFFERS_MAX;
+        m->qcount--;
+        pthread_cond_broadcast(&m->qretire);
+        pthread_mutex_unlock(&m->qlock);
+    }
+    return NULL;
+}
+
+static int fb_queue_post(private_module_t* m, buffer_handle_t buffer)
+{
+    private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(buffer);
+
+    m->base.lock(&m->base, buffer,
+            private_module_t::PRIV_USAGE_LOCKED_FOR_POST,
+            0, 0, m->info.xres, m->info.yres, NULL);
+
+    const size_t offset = hnd->base - m->framebuffer->base;
+    pthread_mutex_lock(&m->qlock);
+    m->info.activate = FB_ACTIVATE_VBL;
+    m->info.yoffset = offset / m->finfo.line_length;
+
+    int tail = (m->qhead + m->qcount) % NUM_FRAMEBUFFERS_MAX;
+    m->queue[tail].buffer = buffer;
+    m->queue[tail].info = m->info;
+    m->qcount++;
+    fb_clearUpdateRect(m);
+    pthread_cond_signal(&m->qpost);
+
+    /* The compositor draws into the buffers in turn, and the next one it
+     * will draw into is the oldest of the others: wait until that one has
+     * left the screen, i.e. until nothing but this post is pending. */
+    while (m->qcount > int(m->numBuffers) - 2)
+        pthread_cond_wait(&m->qretire, &m->qlock);
+    pthread_mutex_unlock(&m->qlock);
+    return 0;
+}
+
+/* Wait for the GPU to finish the composition fenced by
+ * fb_compositionComplete(), if it has not yet. */
+static void fb_wait_composition(fb_context_t* ctx)
+{
+    if (ctx->sync == EGL_NO_SYNC_KHR)
+        return;
+
+    EGLint status = ctx->clientWaitSync(ctx->syncDpy, ctx->sync,
+            EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, EGL_FOREVER_KHR);
+    LOGE_IF(status != EGL_CONDITION_SATISFIED_KHR,
+            "eglClientWaitSyncKHR failed (0x%x)", eglGetError());
+    ctx->destroySync(ctx->syncDpy, ctx->sync);
+    ctx->sync = EGL_NO_SYNC_KHR;
+}
+
 static int fb_post(struct framebuffer_device_t* dev, buffer_handle_t buffer)
 {
     if (private_handle_t::validate(buffer) < 0)
         return -EINVAL;
 
+    HALTRACE_SCOPE("gralloc", "fb_post");
     fb_context_t* ctx = (fb_context_t*)dev;
+    fb_wait_composition(ctx);
 
     private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(buffer);
     private_module_t* m = reinterpret_cast<private_module_t*>(
             dev->common.module);
-    
-    if (m->currentBuffer) {
+
+    if (m->flipQueue) {
+        if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)
+            return fb_queue_post(m, buffer);
+
+        /* the copy below targets the current offset: let pending flips
+         * land first */
+        pthread_mutex_lock(&m->qlock);
+        while (m->qcount)
+            pthread_cond_wait(&m->qretire, &m->qlock);
+        pthread_mutex_unlock(&m->qlock);
+    } else if (m->currentBuffer) {
         m->base.unlock(&m->base, m->currentBuffer);
         m->currentBuffer = 0;
     }
@@ -124,49 +276,172 @@ static int fb_post(struct framebuffer_device_t* dev, buffer_handle_t buffer)
         if (ioctl(m->framebuffer->fd, FBIOPUT_VSCREENINFO, &m->info) == -1) {
             LOGE("FBIOPUT_VSCREENINFO failed");
             m->base.unlock(&m->base, buffer); 
+            fb_clearUpdateRect(m);
             return -errno;
         }
         m->currentBuffer = buffer;
+        fb_clearUpdateRect(m);
         
     } else {
-        void* fb_vaddr;
-        void* buffer_vaddr;
-        
+        int l, t, w, h;
+        fb_getUpdateRect(m, &l, &t, &w, &h);
+
+        // the copy is done by the MDP, so the buffers need not be mapped
         m->base.lock(&m->base, m->framebuffer, 
-                GRALLOC_USAGE_SW_WRITE_RARELY, 
-                0, 0, m->info.xres, m->info.yres,
-                &fb_vaddr);
+                GRALLOC_USAGE_HW_2D, 
+                l, t, w, h, NULL);
 
         m->base.lock(&m->base, buffer, 
-                GRALLOC_USAGE_SW_READ_RARELY, 
-                0, 0, m->info.xres, m->info.yres,
-                &buffer_vaddr);
-
-        //memcpy(fb_vaddr, buffer_vaddr, m->finfo.line_length * m->info.yres);
+                GRALLOC_USAGE_HW_2D, 
+                l, t, w, h, NULL);
 
-        msm_copy_buffer(
-                m->framebuffer, m->framebuffer->fd,
-                m->info.xres, m->info.yres, m->fbFormat,
-                m->info.xoffset, m->info.yoffset,
-                m->info.width, m->info.height);
+        // the MDP converts the buffer to the framebuffer format, if need be
+        if (w && h)
+            msm_copy_buffer(
+                    buffer, m->framebuffer->fd,
+                    m->info.xres, m->info.yres, hnd->format, m->fbFormat,
+                    m->info.yoffset * m->finfo.line_length,
+                    l, t, w, h);
 
         m->base.unlock(&m->base, buffer); 
         m->base.unlock(&m->base, m->framebuffer); 
+
+        /* on panels that update on demand, tell the display which part of
+         * the screen changed */
+        if (m->info.reserved[0] == 0x54445055 &&
+                m->finfo.reserved[0] == 0x5444 &&
+                m->finfo.reserved[1] == 0x5055) {
+            m->info.activate = FB_ACTIVATE_VBL;
+            if (ioctl(m->framebuffer->fd, FBIOPUT_VSCREENINFO, &m->info) == -1)
+                LOGE("FBIOPUT_VSCREENINFO failed");
+        }
+        fb_clearUpdateRect(m);
     }
 
     return 0;
 }
 
+/*
+ * Rather than draining the GPU with glFinish(), put a fence after the
+ * composition and let the post of the framebuffer wait for it. Only the
+ * composed frame has to be complete by then, and the compositor can go on
+ * issuing commands in the meantime.
+ */
 static int fb_compositionComplete(struct framebuffer_device_t* dev)
 {
-    // TODO: Properly implement composition complete callback
-    glFinish();
+    fb_context_t* ctx = (fb_context_t*)dev;
+    EGLDisplay dpy = eglGetCurrentDisplay();
+
+    if (!ctx->createSync || dpy == EGL_NO_DISPLAY) {
+        glFinish();
+        return 0;
+    }
+
+    // never more than one composition in flight
+    fb_wait_composition(ctx);
+
+    ctx->sync = ctx->createSync(dpy, EGL_SYNC_FENCE_KHR, NULL);
+    if (ctx->sync == EGL_NO_SYNC_KHR) {
+        LOGW("eglCreateSyncKHR failed (0x%x), using glFinish", eglGetError());
+        glFinish();
+        return 0;
+    }
+    ctx->syncDpy = dpy;
+    glFlush();
 
     return 0;
 }
 
 /*****************************************************************************/
 
+/* Fill in the depth and color fields of info for one of the formats the
+ * framebuffer can be set up in. Returns false for any other format. */
+static bool fb_format_info(struct fb_var_screeninfo& info, int format)
+{
+    /* Interpretation of offset for color fields: All offsets are from the
+     * right, inside a "pixel" value, which is exactly 'bits_per_pixel' wide
+     * (means: you can use the offset as right argument to <<). A pixel
+     * afterwards is a bit stream and is written to video memory as that
+     * unmodified. This implies big-endian byte order if bits_per_pixel is
+     * greater than 8.
+     */
+    switch (format) {
+    case HAL_PIXEL_FORMAT_RGBA_8888:
+    case HAL_PIXEL_FORMAT_RGBX_8888:
+        info.bits_per_pixel = 32;
+        info.red.offset     = 24;
+        info.red.length     = 8;
+        info.green.offset   = 16;
+        info.green.length   = 8;
+        info.blue.offset    = 8;
+        info.blue.length    = 8;
+        info.transp.offset  = 0;
+        info.transp.length  = 8;
+        return true;
+    case HAL_PIXEL_FORMAT_RGB_565:
+        info.bits_per_pixel = 16;
+        info.red.offset     = 11;
+        info.red.length     = 5;
+        info.green.offset   = 5;
+        info.green.length   = 6;
+        info.blue.offset    = 0;
+        info.blue.length    = 5;
+        info.transp.offset  = 0;
+        info.transp.length  = 0;
+        return true;
+    }
+    return false;
+}
+
+/* Set up the framebuffer in the format asked for with debug.gr.fbformat
+ * ("rgba8888", "rgbx8888" or "rgb565") if the panel takes it, and in the
+ * panel's default format otherwise. Buffers in any other format the MDP
+ * reads are converted by the blit in fb_post(). */
+static int fb_negotiate_format(int fd, struct fb_var_screeninfo& info,
+                               int defaultFormat)
+{
+    static const struct {
+        const char* name;
+        int format;
+    } formats[] = {
+        { "rgba8888", HAL_PIXEL_FORMAT_RGBA_8888 },
+        { "rgbx8888", HAL_PIXEL_FORMAT_RGBX_8888 },
+        { "rgb565",   HAL_PIXEL_FORMAT_RGB_565 },
+    };
+    char property[PROPERTY_VALUE_MAX];
+    int format = defaultFormat;
+
+    if (property_get("debug.gr.fbformat", property, NULL) > 0) {
+        size_t i;
+        for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+            if (!strcmp(property, formats[i].name))
+                break;
+        if (i == sizeof(formats) / sizeof(formats[0]))
+            LOGW("unknown debug.gr.fbformat %s, using the panel default",
+                 property);
+        else
+            format = formats[i].format;
+    }
+
+    if (format != defaultFormat) {
+        struct fb_var_screeninfo test = info;
+        fb_format_info(test, format);
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &test) == 0 &&
+                ioctl(fd, FBIOGET_VSCREENINFO, &test) == 0 &&
+                test.bits_per_pixel == (format == HAL_PIXEL_FORMAT_RGB_565 ? 16u : 32u) &&
+                test.red.offset == (format == HAL_PIXEL_FORMAT_RGB_565 ? 11u : 24u)) {
+            LOGI("framebuffer format %s", property);
+            fb_format_info(info, format);
+            return format;
+        }
+        LOGW("panel does not take framebuffer format %s, using the default",
+             property);
+    }
+
+    fb_format_info(info, defaultFormat);
+    return defaultFormat;
+}
+
 int mapFrameBufferLocked(struct private_module_t* module)
 {
     // already initialized...
@@ -207,51 +482,24 @@ int mapFrameBufferLocked(struct private_module_t* module)
     info.yoffset = 0;
     info.activate = FB_ACTIVATE_NOW;
 
-    /* Interpretation of offset for color fields: All offsets are from the right,
-    * inside a "pixel" value, which is exactly 'bits_per_pixel' wide (means: you
-    * can use the offset as right argument to <<). A pixel afterwards is a bit
-    * stream and is written to video memory as that unmodified. This implies
-    * big-endian byte order if bits_per_pixel is greater than 8.
-    */
-
-    if(info.bits_per_pixel == 32) {
-	/*
-	* Explicitly request RGBA_8888
-	*/
-	info.bits_per_pixel = 32;
-	info.red.offset     = 24;
-	info.red.length     = 8;
-	info.green.offset   = 16;
-	info.green.length   = 8;
-	info.blue.offset    = 8;
-	info.blue.length    = 8;
-	info.transp.offset  = 0;
-	info.transp.length  = 8;
-
-	/* Note: the GL driver does not have a r=8 g=8 b=8 a=0 config, so if we do
-	* not use the MDP for composition (i.e. hw composition == 0), ask for
-	* RGBA instead of RGBX. */
-	if (property_get("debug.sf.hw", property, NULL) > 0 && atoi(property) == 0)
-		module->fbFormat = HAL_PIXEL_FORMAT_RGBX_8888;
-	else if(property_get("debug.composition.type", property, NULL) > 0 && (strncmp(property, "mdp", 3) == 0))
-		module->fbFormat = HAL_PIXEL_FORMAT_RGBX_8888;
-	else
-		module->fbFormat = HAL_PIXEL_FORMAT_RGBA_8888;
+    /* The panel's default follows its native depth. On 32bpp panels the GL
+     * driver does not have a r=8 g=8 b=8 a=0 config, so if we do not use the
+     * MDP for composition (i.e. hw composition == 0), ask for RGBA instead of
+     * RGBX. */
+    int format;
+    if (info.bits_per_pixel == 32) {
+        if (property_get("debug.sf.hw", property, NULL) > 0 && atoi(property) == 0)
+            format = HAL_PIXEL_FORMAT_RGBX_8888;
+        else if (property_get("debug.composition.type", property, NULL) > 0 &&
+                 (strncmp(property, "mdp", 3) == 0))
+            format = HAL_PIXEL_FORMAT_RGBX_8888;
+        else
+            format = HAL_PIXEL_FORMAT_RGBA_8888;
     } else {
-	/*
-	* Explicitly request 5/6/5
-	*/
-	info.bits_per_pixel = 16;
-	info.red.offset     = 11;
-	info.red.length     = 5;
-	info.green.offset   = 5;
-	info.green.length   = 6;
-	info.blue.offset    = 0;
-	info.blue.length    = 5;
-	info.transp.offset  = 0;
-	info.transp.length  = 0;
-	module->fbFormat = HAL_PIXEL_FORMAT_RGB_565;
+        format = HAL_PIXEL_FORMAT_RGB_565;
     }
+    module->fbFormat = fb_negotiate_format(fd, info, format);
+
     /*
      * Request NUM_BUFFERS screens (at lest 2 for page flipping)
      */
@@ -399,6 +647,27 @@ int mapFrameBufferLocked(struct private_module_t* module)
     }
     module->framebuffer->base = intptr_t(vaddr);
     memset(vaddr, 0, fbSize);
+
+    /*
+     * With three or more buffers, queue flips to a display thread so that
+     * fb_post() need not wait for vsync. With two there is no buffer to
+     * render into while a flip is pending, so post synchronously.
+     */
+    if ((flags & PAGE_FLIP) && module->numBuffers > 2) {
+        pthread_t thread;
+        pthread_mutex_init(&module->qlock, NULL);
+        pthread_cond_init(&module->qpost, NULL);
+        pthread_cond_init(&module->qretire, NULL);
+        module->qhead = 0;
+        module->qcount = 0;
+        if (pthread_create(&thread, NULL, disp_loop, module) == 0) {
+            pthread_detach(thread);
+            module->flipQueue = 1;
+            LOGI("using a flip queue for %d framebuffers", module->numBuffers);
+        } else {
+            LOGW("cannot create display thread, posting synchronously");
+        }
+    }
     return 0;
 }
 
@@ -416,6 +685,7 @@ static int fb_close(struct hw_device_t *dev)
 {
     fb_context_t* ctx = (fb_context_t*)dev;
     if (ctx) {
+        fb_wait_composition(ctx);
         free(ctx);
     }
     return 0;
@@ -445,6 +715,19 @@ int fb_device_open(hw_module_t const* module, const char* name,
         dev->device.setUpdateRect = 0;
         dev->device.compositionComplete = fb_compositionComplete;
 
+        dev->createSync = (fb_create_sync_t)
+                eglGetProcAddress("eglCreateSyncKHR");
+        dev->clientWaitSync = (fb_client_wait_sync_t)
+                eglGetProcAddress("eglClientWaitSyncKHR");
+        dev->destroySync = (fb_destroy_sync_t)
+                eglGetProcAddress("eglDestroySyncKHR");
+        if (!dev->createSync || !dev->clientWaitSync || !dev->destroySync) {
+            LOGW("EGL_KHR_fence_sync not available, "
+                 "compositionComplete will use glFinish");
+            dev->createSync = 0;
+        }
+        dev->sync = EGL_NO_SYNC_KHR;
+
         private_module_t* m = (private_module_t*)module;
         status = mapFrameBuffer(m);
         if (status >= 0) {
@@ -464,6 +747,11 @@ int fb_device_open(hw_module_t const* module, const char* name,
                     m->finfo.reserved[1] == 0x5055) {
                 dev->device.setUpdateRect = fb_setUpdateRect;
                 LOGD("UPDATE_ON_DEMAND supported");
+            } else if (!(m->flags & PAGE_FLIP)) {
+                // posts are copies into the framebuffer, which keeps what
+                // is outside the update rect
+                dev->device.setUpdateRect = fb_setUpdateRect;
+                LOGD("partial updates by copy supported");
             }
 
             *device = &dev->device.common;
@@ -475,18 +763,37 @@ int fb_device_open(hw_module_t const* module, const char* name,
     return status;
 }
 
-/* Copy a pmem buffer to the framebuffer */
+static int msm_mdp_format(int format)
+{
+    switch (format) {
+    case HAL_PIXEL_FORMAT_RGBA_8888:    return MDP_RGBA_8888;
+    case HAL_PIXEL_FORMAT_RGBX_8888:    return MDP_RGBX_8888;
+    case HAL_PIXEL_FORMAT_BGRA_8888:    return MDP_BGRA_8888;
+    case HAL_PIXEL_FORMAT_RGB_565:      return MDP_RGB_565;
+    }
+    return -1;
+}
+
+/* Copy the rect (x, y, w, h) of a pmem buffer to the framebuffer, into the
+ * screen starting dst_offset bytes into it, converting from src_format to
+ * dst_format on the way */
 
 static void
 msm_copy_buffer(buffer_handle_t handle, int fd,
-                int width, int height, int format,
-                int x, int y, int w, int h)
+                int width, int height, int src_format, int dst_format,
+                uint32_t dst_offset, int x, int y, int w, int h)
 {
     struct {
         unsigned int count;
         mdp_blit_req req;
     } blit;
     private_handle_t *priv = (private_handle_t*) handle;
+    int src_mdp = msm_mdp_format(src_format);
+
+    /* a buffer the MDP cannot read is copied as if it were in the
+     * framebuffer format, as it always used to be */
+    if (src_mdp < 0)
+        src_mdp = msm_mdp_format(dst_format);
 
     memset(&blit, 0, sizeof(blit));
     blit.count = 1;
@@ -497,20 +804,22 @@ msm_copy_buffer(buffer_handle_t handle, int fd,
 
     blit.req.src.width = width;
     blit.req.src.height = height;
-    blit.req.src.offset = 0;
+    blit.req.src.offset = priv->offset;
     blit.req.src.memory_id = priv->fd;
+    blit.req.src.format = src_mdp;
 
     blit.req.dst.width = width;
     blit.req.dst.height = height;
-    blit.req.dst.offset = 0;
+    blit.req.dst.offset = dst_offset;
     blit.req.dst.memory_id = fd; 
-    blit.req.dst.format = format;
+    blit.req.dst.format = msm_mdp_format(dst_format);
 
     blit.req.src_rect.x = blit.req.dst_rect.x = x;
     blit.req.src_rect.y = blit.req.dst_rect.y = y;
     blit.req.src_rect.w = blit.req.dst_rect.w = w;
     blit.req.src_rect.h = blit.req.dst_rect.h = h;
 
+    HALTRACE_SCOPE_ARGS("mdp", "blit", w, h);
     if (ioctl(fd, MSMFB_BLIT, &blit))
         LOGE("MSMFB_BLIT failed = %d", -errno);
 }
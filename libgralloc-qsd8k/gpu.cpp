@@ -21,11 +21,13 @@
 #include <sys/mman.h>
 
 #include <cutils/properties.h>
+#include <private/android_filesystem_config.h>
 #ifdef HOST
 #include <linux/ashmem.h>
 #endif
 #include "gr.h"
 #include "gpu.h"
+#include "haltrace.h"
 
 static const int OMX_QCOM_COLOR_FormatYVU420SemiPlanar = 0x7FA30C00;
 static const int QOMX_COLOR_FormatYUV420PackedSemiPlanar64x32Tile2m8ka = 0x7FA30C03;
@@ -36,11 +38,18 @@ gpu_context_t::gpu_context_t(Deps& deps, PmemAllocator& pmemAllocator,
         PmemAllocator& pmemAdspAllocator, const private_module_t* module) :
     deps(deps),
     pmemAllocator(pmemAllocator),
-    pmemAdspAllocator(pmemAdspAllocator)
+    pmemAdspAllocator(pmemAdspAllocator),
+    ashmemAllocated(0),
+    ashmemBuffers(0),
+    ashmemFailures(0),
+    trustUninitialized(getuid() == AID_MEDIA)
 {
     // Zero out the alloc_device_t
     memset(static_cast<alloc_device_t*>(this), 0, sizeof(alloc_device_t));
 
+    pthread_mutex_init(&statsLock, NULL);
+    memset(usageFailures, 0, sizeof(usageFailures));
+
     char property[PROPERTY_VALUE_MAX];
     if (property_get("debug.sf.hw", property, NULL) > 0) {
         if(atoi(property) == 0) {
@@ -70,6 +79,7 @@ gpu_context_t::gpu_context_t(Deps& deps, PmemAllocator& pmemAllocator,
     common.close   = gralloc_close;
     alloc          = gralloc_alloc;
     free           = gralloc_free;
+    dump           = gralloc_dump;
 }
 
 int gpu_context_t::gralloc_alloc_framebuffer_locked(size_t size, int usage,
@@ -164,14 +174,13 @@ int gpu_context_t::alloc_ashmem_buffer(size_t size, unsigned int postfix, void**
             close(fd);
             err = -errno;
         } else {
+            // a new ashmem region is zero-filled by the kernel already
             base = mmap(0, size, prot, MAP_SHARED|MAP_POPULATE|MAP_LOCKED, fd, 0);
             if (base == MAP_FAILED) {
                 LOGE("alloc mmap(fd=%d, size=%d, prot=%x) failed (%s)",
                      fd, size, prot, strerror(errno));
                 close(fd);
                 err = -errno;
-            } else {
-                memset((char*)base + offset, 0, size);
             }
         }
     }
@@ -278,15 +287,26 @@ int gpu_context_t::gralloc_alloc_buffer(size_t size, int usage, buffer_handle_t*
         }
     } else {
 try_ashmem:
+        flags |= private_handle_t::PRIV_FLAGS_USES_ASHMEM;
         err = alloc_ashmem_buffer(size, (unsigned int)pHandle, &base, &offset, &fd);
         if (err >= 0) {
             lockState |= private_handle_t::LOCK_STATE_MAPPED;
-            flags |= private_handle_t::PRIV_FLAGS_USES_ASHMEM;
         } else {
             LOGE("Ashmem fallback failed");
         }
     }
 
+    if (flags & private_handle_t::PRIV_FLAGS_USES_ASHMEM) {
+        pthread_mutex_lock(&statsLock);
+        if (err == 0) {
+            ashmemAllocated += size;
+            ashmemBuffers++;
+        } else {
+            ashmemFailures++;
+        }
+        pthread_mutex_unlock(&statsLock);
+    }
+
     if (err == 0) {
         private_handle_t* hnd = new private_handle_t(fd, size, flags, bufferType, format, width, height);
         hnd->offset = offset;
@@ -330,9 +350,16 @@ void gpu_context_t::getGrallocInformationFromFormat(int inputFormat, int *colorF
 
 int gpu_context_t::alloc_impl(int w, int h, int format, int usage,
         buffer_handle_t* pHandle, int* pStride, int bufferSize) {
+    HALTRACE_SCOPE_ARGS("gralloc", "alloc", w, h);
     if (!pHandle || !pStride)
         return -EINVAL;
 
+    // A recycled buffer that isn't cleared still holds whatever its last
+    // owner drew. surfaceflinger passes through the usage bits its clients
+    // ask for, so only trust allocations made by mediaserver itself.
+    if (!trustUninitialized)
+        usage &= ~GRALLOC_USAGE_PRIVATE_UNINITIALIZED;
+
     size_t size, alignedw, alignedh;
 
     alignedw = ALIGN(w, 32);
@@ -406,6 +433,7 @@ int gpu_context_t::alloc_impl(int w, int h, int format, int usage,
     }
 
     if (err < 0) {
+        account_failure(usage);
         return err;
     }
 
@@ -414,7 +442,9 @@ int gpu_context_t::alloc_impl(int w, int h, int format, int usage,
 }
 
 int gpu_context_t::free_impl(private_handle_t const* hnd) {
+    HALTRACE_SCOPE("gralloc", "free");
     private_module_t* m = reinterpret_cast<private_module_t*>(common.module);
+    bool keepFd = false;
     if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) {
         // free this buffer
         const size_t bufferSize = m->finfo.line_length * m->info.yres;
@@ -436,20 +466,117 @@ int gpu_context_t::free_impl(private_handle_t const* hnd) {
                         strerror(errno), hnd->fd, hnd->offset, hnd->size);
                 }
             }
+            pthread_mutex_lock(&statsLock);
+            ashmemAllocated -= hnd->size;
+            ashmemBuffers--;
+            pthread_mutex_unlock(&statsLock);
         }
         if (pmem_allocator) {
-            pmem_allocator->free_pmem_buffer(hnd->size, (void*)hnd->base,
-                    hnd->offset, hnd->fd);
+            // if the allocator keeps the sub-heap for reuse, it now owns
+            // the fd as well
+            if (pmem_allocator->recycle_pmem_buffer(hnd->size,
+                    (void*)hnd->base, hnd->offset, hnd->fd) == 0) {
+                keepFd = true;
+            } else {
+                pmem_allocator->free_pmem_buffer(hnd->size, (void*)hnd->base,
+                        hnd->offset, hnd->fd);
+            }
         }
 
         deps.terminateBuffer(&m->base, const_cast<private_handle_t*>(hnd));
     }
 
-    deps.close(hnd->fd);
+    if (!keepFd)
+        deps.close(hnd->fd);
     delete hnd; // XXX JMG: move this to the deps
     return 0;
 }
 
+void gpu_context_t::account_failure(int usage) {
+    pthread_mutex_lock(&statsLock);
+    for (int i = 0; i < NUM_USAGE_BITS; i++) {
+        if (usage & (1<<i))
+            usageFailures[i]++;
+    }
+    pthread_mutex_unlock(&statsLock);
+}
+
+static void dump_pool(PmemAllocator& allocator, char* buff, int buff_len,
+        int* pLength) {
+    pmem_pool_stats_t stats;
+    for (int i = 0; i < allocator.get_pool_count(); i++) {
+        if (allocator.get_pool_stats(i, &stats) < 0)
+            continue;
+        int length = *pLength;
+        length += snprintf(buff + length, buff_len - length,
+                "  %-18s %6u KiB in %3d buffers",
+                stats.name, stats.allocated/1024, stats.buffers);
+        if (length < buff_len && stats.size) {
+            length += snprintf(buff + length, buff_len - length,
+                    ", %6u KiB free, largest %6u KiB, %d chunks (%d free)",
+                    (stats.size - stats.allocated)/1024,
+                    stats.largestFree/1024, stats.chunks, stats.freeChunks);
+        }
+        if (length < buff_len && stats.cached) {
+            length += snprintf(buff + length, buff_len - length,
+                    ", %u KiB cached", stats.cached/1024);
+        }
+        if (length < buff_len) {
+            length += snprintf(buff + length, buff_len - length,
+                    ", %d failures\n", stats.failures);
+        }
+        *pLength = length < buff_len ? length : buff_len;
+    }
+}
+
+void gpu_context_t::dump_impl(char* buff, int buff_len) {
+    if (buff_len <= 0)
+        return;
+    buff[0] = 0;
+
+    int length = snprintf(buff, buff_len, "gralloc pools:\n");
+    if (length >= buff_len)
+        return;
+    dump_pool(pmemAllocator, buff, buff_len, &length);
+    dump_pool(pmemAdspAllocator, buff, buff_len, &length);
+
+    pthread_mutex_lock(&statsLock);
+    if (length < buff_len) {
+        length += snprintf(buff + length, buff_len - length,
+                "  %-18s %6u KiB in %3d buffers, %d failures\n",
+                "ashmem", ashmemAllocated/1024, ashmemBuffers, ashmemFailures);
+    }
+    if (length < buff_len) {
+        length += snprintf(buff + length, buff_len - length,
+                "allocation failures by usage bit:\n");
+    }
+    for (int i = 0; i < NUM_USAGE_BITS && length < buff_len; i++) {
+        if (usageFailures[i]) {
+            length += snprintf(buff + length, buff_len - length,
+                    "  0x%08x: %d\n", 1<<i, usageFailures[i]);
+        }
+    }
+    pthread_mutex_unlock(&statsLock);
+
+    // the trace is too big for buff; it goes to a file of its own, in a
+    // directory surfaceflinger can write to
+    if (haltrace_update() && length < buff_len) {
+        char path[PROPERTY_VALUE_MAX + 32];
+        int err = haltrace_dump_file(path, sizeof(path));
+        if (err == 0) {
+            length += snprintf(buff + length, buff_len - length,
+                    "trace written to %s\n", path);
+        } else if (err == -ENOENT) {
+            length += snprintf(buff + length, buff_len - length,
+                    "set debug.haltrace.dir to dump the trace\n");
+        } else {
+            length += snprintf(buff + length, buff_len - length,
+                    "cannot write the trace to %s (%s)\n", path,
+                    strerror(-err));
+        }
+    }
+}
+
 /******************************************************************************
  * Static functions
  *****************************************************************************/
@@ -485,6 +612,15 @@ int gpu_context_t::gralloc_free(alloc_device_t* dev,
     return gpu->free_impl(hnd);
 }
 
+void gpu_context_t::gralloc_dump(alloc_device_t* dev, char* buff, int buff_len)
+{
+    if (!dev) {
+        return;
+    }
+    gpu_context_t* gpu = reinterpret_cast<gpu_context_t*>(dev);
+    gpu->dump_impl(buff, buff_len);
+}
+
 /*****************************************************************************/
 
 int gpu_context_t::gralloc_close(struct hw_device_t *dev)
@@ -68,14 +68,31 @@ class gpu_context_t : public alloc_device_t {
     static int gralloc_alloc_size(alloc_device_t* dev, int w, int h, int format,
             int usage, buffer_handle_t* pHandle, int* pStride, int bufferSize);
     static int gralloc_close(struct hw_device_t *dev);
+    static void gralloc_dump(alloc_device_t* dev, char* buff, int buff_len);
     int get_composition_type() const { return compositionType; }
 
+    // Writes the pool statistics and allocation failures to buff.
+    void dump_impl(char* buff, int buff_len);
+
  private:
 
+    enum { NUM_USAGE_BITS = 32 };
+
     Deps& deps;
     PmemAllocator& pmemAllocator;
     PmemAllocator& pmemAdspAllocator;
     int compositionType;
+    // whether GRALLOC_USAGE_PRIVATE_UNINITIALIZED is honoured
+    bool trustUninitialized;
+
+    // ashmem and per usage bit accounting, protected by statsLock
+    pthread_mutex_t statsLock;
+    size_t ashmemAllocated;
+    int ashmemBuffers;
+    int ashmemFailures;
+    int usageFailures[NUM_USAGE_BITS];
+
+    void account_failure(int usage);
     int alloc_ashmem_buffer(size_t size, unsigned int postfix, void** pBase,
             int* pOffset, int* pFd);
     void getGrallocInformationFromFormat(int inputFormat, int *colorFormat, int *bufferType);
@@ -48,6 +48,9 @@ size_t calculateBufferSize(int width, int height, int format);
 int decideBufferHandlingMechanism(int format, const char *compositionUsed,
                                    int hasBlitEngine, int *needConversion,
                                    int *useBufferDirectly);
+void addFlushRange(private_handle_t* hnd, int l, int t, int w, int h);
+void getFlushRegion(const private_handle_t* hnd, unsigned long* vaddr,
+        unsigned long* offset, unsigned long* length);
 /*****************************************************************************/
 
 class Locker {
@@ -23,6 +23,9 @@
 #include <sys/ioctl.h>
 
 #include <linux/android_pmem.h>
+#include <linux/msm_mdp.h>
+
+#include <cutils/properties.h>
 
 #include "allocator.h"
 #include "gr.h"
@@ -116,6 +119,52 @@ class PmemAllocatorDepsDeviceImpl : public PmemUserspaceAllocator::Deps,
         return ioctl(fd, PMEM_CLEAN_INV_CACHES, &pmem_addr);
     }
 
+    virtual int clearPmem(int fd, int offset, size_t size) {
+#ifdef MDP_SOLID_FILL
+        // Fill the sub-heap as RGB 565 rows of 2 KiB. pmem buffers are
+        // whole pages, so the rows always cover it exactly.
+        enum { ROW_PIXELS = 1024, ROW_BYTES = ROW_PIXELS * 2,
+               MAX_ROWS = 1024, MAX_REQS = 8 };
+        struct {
+            uint32_t count;
+            struct mdp_blit_req req[MAX_REQS];
+        } list;
+
+        if (module == NULL || module->framebuffer == NULL ||
+                size % ROW_BYTES) {
+            errno = ENODEV;
+            return -1;
+        }
+
+        uint32_t rows = size / ROW_BYTES;
+        while (rows) {
+            memset(&list, 0, sizeof(list));
+            for (; rows && list.count < MAX_REQS; list.count++) {
+                uint32_t h = rows < MAX_ROWS ? rows : MAX_ROWS;
+                struct mdp_blit_req* req = &list.req[list.count];
+                req->flags = MDP_SOLID_FILL;
+                req->alpha = MDP_ALPHA_NOP;
+                req->transp_mask = MDP_TRANSP_NOP;
+                req->src.width = req->dst.width = ROW_PIXELS;
+                req->src.height = req->dst.height = h;
+                req->src.format = req->dst.format = MDP_RGB_565;
+                req->src.offset = req->dst.offset = offset;
+                req->src.memory_id = req->dst.memory_id = fd;
+                req->src_rect.w = req->dst_rect.w = ROW_PIXELS;
+                req->src_rect.h = req->dst_rect.h = h;
+                offset += h * ROW_BYTES;
+                rows -= h;
+            }
+            if (ioctl(module->framebuffer->fd, MSMFB_BLIT, &list) < 0)
+                return -1;
+        }
+        return 0;
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+
     virtual int getErrno() {
         return errno;
     }
@@ -137,6 +186,10 @@ class PmemAllocatorDepsDeviceImpl : public PmemUserspaceAllocator::Deps,
         return ::close(fd);
     }
 
+    virtual int getFileFlags(int fd) {
+        return ::fcntl(fd, F_GETFL);
+    }
+
 public:
     void setModule(const private_module_t* m) {
         module = m;
@@ -219,6 +272,13 @@ int gralloc_device_open(const hw_module_t* module, const char* name,
         const private_module_t* m = reinterpret_cast<const private_module_t*>(
                 module);
         pmemAllocatorDeviceDepsImpl.setModule(m);
+
+        // size of the pool of freed /dev/pmem sub-heaps kept for reuse
+        char property[PROPERTY_VALUE_MAX];
+        if (property_get("debug.gralloc.pmem_cache_kb", property, "0") > 0) {
+            pmemAllocator.set_cache_limit(size_t(atoi(property)) << 10);
+        }
+
         gpu_context_t *dev;
         dev = new gpu_context_t(gpuContextDeviceDepsImpl, pmemAllocator,
                 pmemAdspAllocator, m);
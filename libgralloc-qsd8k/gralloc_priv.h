@@ -34,6 +34,10 @@ enum {
     GRALLOC_USAGE_PRIVATE_PMEM_ADSP = GRALLOC_USAGE_PRIVATE_0,
     GRALLOC_USAGE_PRIVATE_PMEM_SMIPOOL = GRALLOC_USAGE_PRIVATE_1,
     GRALLOC_USAGE_PRIVATE_PMEM = GRALLOC_USAGE_PRIVATE_2,
+    /* the client overwrites the whole buffer before reading it, so the
+     * allocator may skip zero-filling it. Only honoured in mediaserver,
+     * see gpu_context_t::alloc_impl() */
+    GRALLOC_USAGE_PRIVATE_UNINITIALIZED = GRALLOC_USAGE_PRIVATE_3,
 };
 
 enum {
@@ -100,6 +104,12 @@ struct private_module_t;
 struct private_handle_t;
 struct PmemAllocator;
 
+/* a framebuffer waiting in the flip queue to be shown */
+struct fb_flip_t {
+    buffer_handle_t buffer;
+    struct fb_var_screeninfo info;
+};
+
 struct private_module_t {
     gralloc_module_t base;
 
@@ -117,6 +127,18 @@ struct private_module_t {
     float ydpi;
     float fps;
     int swapInterval;
+
+    /* With more than two framebuffers, fb_post() queues each buffer here and
+     * a display thread pans to it, so that the compositor does not wait for
+     * vsync. qlock protects the queue; currentBuffer then belongs to the
+     * display thread. */
+    int flipQueue;
+    pthread_mutex_t qlock;
+    pthread_cond_t qpost;
+    pthread_cond_t qretire;
+    int qhead;
+    int qcount;
+    struct fb_flip_t queue[NUM_FRAMEBUFFERS_MAX];
     
     enum {
         // flag to indicate we'll post this buffer
@@ -148,7 +170,8 @@ struct private_handle_t {
     enum {
         LOCK_STATE_WRITE     =   1<<31,
         LOCK_STATE_MAPPED    =   1<<30,
-        LOCK_STATE_READ_MASK =   0x3FFFFFFF
+        LOCK_STATE_MAPPING   =   1<<29,
+        LOCK_STATE_READ_MASK =   0x1FFFFFFF
     };
 
     // file-descriptors
@@ -169,16 +192,19 @@ struct private_handle_t {
     int     format;
     int     width;
     int     height;
+    // byte range, relative to base, written under the current SW lock
+    int     flushOffset;
+    int     flushSize;
 
 #ifdef __cplusplus
-    static const int sNumInts = 13;
+    static const int sNumInts = 15;
     static const int sNumFds = 1;
     static const int sMagic = 'gmsm';
 
     private_handle_t(int fd, int size, int flags, int bufferType, int format, int width, int height) :
         fd(fd), magic(sMagic), flags(flags), size(size), offset(0), bufferType(bufferType),
         base(0), lockState(0), writeOwner(0), gpuaddr(0), pid(getpid()), format(format), width(width),
-        height(height)
+        height(height), flushOffset(0), flushSize(0)
     {
         version = sizeof(native_handle);
         numInts = sNumInts;
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdarg.h>
 
@@ -37,6 +38,7 @@
 #include <linux/android_pmem.h>
 
 #include "gralloc_priv.h"
+#include "gr.h"
 
 
 // we need this for now because pmem cannot mmap at an offset
@@ -63,13 +65,9 @@ static int gralloc_map(gralloc_module_t const* module,
 #if PMEM_HACK
         size += hnd->offset;
 #endif
-        if (hnd->flags & private_handle_t::PRIV_FLAGS_USES_ASHMEM) {
-            mappedAddress = mmap(0, size,
-                PROT_READ|PROT_WRITE, MAP_SHARED | MAP_POPULATE, hnd->fd, 0);
-        } else {
-            mappedAddress = mmap(0, size,
-                PROT_READ|PROT_WRITE, MAP_SHARED, hnd->fd, 0);
-        }
+        // No MAP_POPULATE: pages fault in as they are first touched.
+        mappedAddress = mmap(0, size,
+            PROT_READ|PROT_WRITE, MAP_SHARED, hnd->fd, 0);
         if (mappedAddress == MAP_FAILED) {
             LOGE("Could not mmap handle %p, fd=%d (%s)",
                     handle, hnd->fd, strerror(errno));
@@ -107,6 +105,49 @@ static int gralloc_unmap(gralloc_module_t const* module,
 /*****************************************************************************/
 
 static pthread_mutex_t sMapLock = PTHREAD_MUTEX_INITIALIZER; 
+static pthread_cond_t sMapCond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Maps 'hnd' exactly once.  The thread that sets LOCK_STATE_MAPPING does
+ * the mmap without holding any lock, so different handles are mapped
+ * concurrently; sMapLock is only taken to publish the result and by
+ * threads waiting for the same handle.
+ */
+static int gralloc_map_once(gralloc_module_t const* module,
+        private_handle_t* hnd, void** vaddr)
+{
+    volatile int32_t* state = (volatile int32_t*)&hnd->lockState;
+    for (;;) {
+        int32_t current_value = android_atomic_acquire_load(state);
+        if (current_value & private_handle_t::LOCK_STATE_MAPPED)
+            return 0;
+
+        if (!(current_value & private_handle_t::LOCK_STATE_MAPPING)) {
+            if (android_atomic_acquire_cas(current_value,
+                    current_value | private_handle_t::LOCK_STATE_MAPPING,
+                    state))
+                continue;
+
+            int err = gralloc_map(module, hnd, vaddr);
+            pthread_mutex_lock(&sMapLock);
+            if (err == 0)
+                android_atomic_or(private_handle_t::LOCK_STATE_MAPPED, state);
+            android_atomic_and(~private_handle_t::LOCK_STATE_MAPPING, state);
+            pthread_cond_broadcast(&sMapCond);
+            pthread_mutex_unlock(&sMapLock);
+            return err;
+        }
+
+        // another thread is mapping this handle, wait for it
+        pthread_mutex_lock(&sMapLock);
+        while ((hnd->lockState & (private_handle_t::LOCK_STATE_MAPPED |
+                        private_handle_t::LOCK_STATE_MAPPING)) ==
+                private_handle_t::LOCK_STATE_MAPPING) {
+            pthread_cond_wait(&sMapCond, &sMapLock);
+        }
+        pthread_mutex_unlock(&sMapLock);
+    }
+}
 
 /*****************************************************************************/
 
@@ -131,6 +172,8 @@ int gralloc_register_buffer(gralloc_module_t const* module,
         hnd->base = 0;
         hnd->lockState  = 0;
         hnd->writeOwner = 0;
+        hnd->flushOffset = 0;
+        hnd->flushSize = 0;
     }
     return 0;
 }
@@ -247,26 +290,27 @@ int gralloc_lock(gralloc_module_t const* module,
     }
 
     // if requesting sw write for non-framebuffer handles, flag for
-    // flushing at unlock
+    // flushing at unlock.  pmem opened with O_SYNC is mapped uncached,
+    // so there is nothing to clean.
 
     if ((usage & GRALLOC_USAGE_SW_WRITE_MASK) &&
             !(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
-        hnd->flags |= private_handle_t::PRIV_FLAGS_NEEDS_FLUSH;
+        bool uncached = false;
+        if (hnd->flags & (private_handle_t::PRIV_FLAGS_USES_PMEM |
+                          private_handle_t::PRIV_FLAGS_USES_PMEM_ADSP)) {
+            int fl = fcntl(hnd->fd, F_GETFL);
+            uncached = fl >= 0 && (fl & O_SYNC);
+        }
+        if (!uncached) {
+            hnd->flags |= private_handle_t::PRIV_FLAGS_NEEDS_FLUSH;
+            addFlushRange(hnd, l, t, w, h);
+        }
     }
 
     if (usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK)) {
         if (!(current_value & private_handle_t::LOCK_STATE_MAPPED)) {
             // we need to map for real
-            pthread_mutex_t* const lock = &sMapLock;
-            pthread_mutex_lock(lock);
-            if (!(hnd->lockState & private_handle_t::LOCK_STATE_MAPPED)) {
-                err = gralloc_map(module, handle, vaddr);
-                if (err == 0) {
-                    android_atomic_or(private_handle_t::LOCK_STATE_MAPPED,
-                            (volatile int32_t*)&(hnd->lockState));
-                }
-            }
-            pthread_mutex_unlock(lock);
+            err = gralloc_map_once(module, hnd, vaddr);
         }
         *vaddr = (void*)hnd->base;
     }
@@ -288,18 +332,20 @@ int gralloc_unlock(gralloc_module_t const* module,
         if (hnd->flags & (private_handle_t::PRIV_FLAGS_USES_PMEM |
                           private_handle_t::PRIV_FLAGS_USES_PMEM_ADSP)) {
             struct pmem_addr pmem_addr;
-            pmem_addr.vaddr = hnd->base;
-            pmem_addr.offset = hnd->offset;
-            pmem_addr.length = hnd->size;
+            getFlushRegion(hnd, &pmem_addr.vaddr, &pmem_addr.offset,
+                    &pmem_addr.length);
             err = ioctl( hnd->fd, PMEM_CLEAN_CACHES,  &pmem_addr);
         } else if ((hnd->flags & private_handle_t::PRIV_FLAGS_USES_ASHMEM)) {
-            unsigned long addr = hnd->base + hnd->offset;
+            // ashmem only knows how to flush the whole region
             err = ioctl(hnd->fd, ASHMEM_CACHE_FLUSH_RANGE, NULL);
         }         
 
         LOGE_IF(err < 0, "cannot flush handle %p (offs=%x len=%x, flags = 0x%x) err=%s\n",
-                hnd, hnd->offset, hnd->size, hnd->flags, strerror(errno));
+                hnd, hnd->offset + hnd->flushOffset, hnd->flushSize,
+                hnd->flags, strerror(errno));
         hnd->flags &= ~private_handle_t::PRIV_FLAGS_NEEDS_FLUSH;
+        hnd->flushOffset = 0;
+        hnd->flushSize = 0;
     }
 
     do {
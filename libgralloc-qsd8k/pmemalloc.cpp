@@ -29,12 +29,20 @@
 #include <cutils/ashmem.h>
 
 #include "gralloc_priv.h"
+#include "haltrace.h"
 #include "pmemalloc.h"
 
 
-#define BEGIN_FUNC LOGV("%s begin", __PRETTY_FUNCTION__)
+// The trace span of a function lasts until it returns, whichever way it
+// returns; END_FUNC only logs.
+#define BEGIN_FUNC LOGV("%s begin", __PRETTY_FUNCTION__); \
+    HALTRACE_SCOPE("pmem", __PRETTY_FUNCTION__)
 #define END_FUNC LOGV("%s end", __PRETTY_FUNCTION__)
 
+// Large page sizes of the MMU, used to align big video buffers
+#define PMEM_ALIGN_64K  (64<<10)
+#define PMEM_ALIGN_1M   (1<<20)
+
 
 static int get_open_flags(int usage) {
     int openFlags = O_RDWR | O_SYNC;
@@ -54,11 +62,35 @@ PmemAllocator::~PmemAllocator()
 }
 
 
+int PmemAllocator::recycle_pmem_buffer(size_t size, void* base, int offset, int fd)
+{
+    BEGIN_FUNC;
+    END_FUNC;
+    return -ENOSYS;
+}
+
+
+int PmemAllocator::get_pool_count()
+{
+    return 0;
+}
+
+
+int PmemAllocator::get_pool_stats(int index, pmem_pool_stats_t* stats)
+{
+    return -EINVAL;
+}
+
+
 PmemUserspaceAllocator::PmemUserspaceAllocator(Deps& deps, Deps::Allocator& allocator, const char* pmemdev):
     deps(deps),
     allocator(allocator),
     pmemdev(pmemdev),
-    master_fd(MASTER_FD_INIT)
+    master_fd(MASTER_FD_INIT),
+    cache(0),
+    cacheBytes(0),
+    cacheLimit(0),
+    failures(0)
 {
     BEGIN_FUNC;
     pthread_mutex_init(&lock, NULL);
@@ -69,6 +101,7 @@ PmemUserspaceAllocator::PmemUserspaceAllocator(Deps& deps, Deps::Allocator& allo
 PmemUserspaceAllocator::~PmemUserspaceAllocator()
 {
     BEGIN_FUNC;
+    trim_cache(0);
     END_FUNC;
 }
 
@@ -149,27 +182,40 @@ int PmemUserspaceAllocator::alloc_pmem_buffer(size_t size, int usage,
     int err = init_pmem_area();
     if (err == 0) {
         void* base = master_base;
-        int offset = allocator.allocate(size);
+        int openFlags = get_open_flags(usage);
+        int fd = -1;
+        int offset = take_cached_buffer(size, openFlags, &fd);
+        if (offset < 0) {
+            offset = allocator.allocate(size);
+            if (offset < 0) {
+                // we may be sitting on the memory we need, give it back
+                trim_cache(0);
+                offset = allocator.allocate(size);
+            }
+        }
         if (offset < 0) {
             // no more pmem memory
             LOGE("%s: no more pmem available", pmemdev);
             err = -ENOMEM;
+            pthread_mutex_lock(&lock);
+            failures++;
+            pthread_mutex_unlock(&lock);
         } else {
-            int openFlags = get_open_flags(usage);
-
-            //LOGD("%s: allocating pmem at offset 0x%p", pmemdev, offset);
+            if (fd < 0) {
+                //LOGD("%s: allocating pmem at offset 0x%p", pmemdev, offset);
 
-            // now create the "sub-heap"
-            int fd = deps.open(pmemdev, openFlags, 0);
-            err = fd < 0 ? fd : 0;
+                // now create the "sub-heap"
+                fd = deps.open(pmemdev, openFlags, 0);
+                err = fd < 0 ? fd : 0;
 
-            // and connect to it
-            if (err == 0)
-                err = deps.connectPmem(fd, master_fd);
+                // and connect to it
+                if (err == 0)
+                    err = deps.connectPmem(fd, master_fd);
 
-            // and make it available to the client process
-            if (err == 0)
-                err = deps.mapPmem(fd, offset, size);
+                // and make it available to the client process
+                if (err == 0)
+                    err = deps.mapPmem(fd, offset, size);
+            }
 
             if (err < 0) {
                 LOGE("%s: failed to initialize pmem sub-heap: %d", pmemdev,
@@ -180,15 +226,23 @@ int PmemUserspaceAllocator::alloc_pmem_buffer(size_t size, int usage,
                 fd = -1;
             } else {
                 LOGV("%s: mapped fd %d at offset %d, size %d", pmemdev, fd, offset, size);
-                memset((char*)base + offset, 0, size);
-                //Clean cache before flushing to ensure pmem is properly flushed
-                err = deps.cleanPmem(fd, (unsigned long) base + offset, offset, size);
-                if (err < 0) {
-                    LOGE("cleanPmem failed: (%s)", strerror(deps.getErrno()));
-                }
+                if (!(usage & GRALLOC_USAGE_PRIVATE_UNINITIALIZED)) {
+                    // The MDP writes behind the CPU cache, so write back and
+                    // drop what the cache holds for the range first. Nothing
+                    // stale can then land on top of the zeroes later.
+                    err = deps.cleanPmem(fd, (unsigned long) base + offset, offset, size);
+                    if (err < 0 || deps.clearPmem(fd, offset, size) < 0) {
+                        memset((char*)base + offset, 0, size);
+                        //Clean cache before flushing to ensure pmem is properly flushed
+                        err = deps.cleanPmem(fd, (unsigned long) base + offset, offset, size);
 #ifdef HOST
-                 cacheflush(intptr_t(base) + offset, intptr_t(base) + offset + size, 0);
+                        cacheflush(intptr_t(base) + offset, intptr_t(base) + offset + size, 0);
 #endif
+                    }
+                    if (err < 0) {
+                        LOGE("cleanPmem failed: (%s)", strerror(deps.getErrno()));
+                    }
+                }
                 *pBase = base;
                 *pOffset = offset;
                 *pFd = fd;
@@ -220,12 +274,122 @@ int PmemUserspaceAllocator::free_pmem_buffer(size_t size, void* base, int offset
     return err;
 }
 
+int PmemUserspaceAllocator::recycle_pmem_buffer(size_t size, void* base, int offset, int fd)
+{
+    BEGIN_FUNC;
+    int err = -EINVAL;
+    int fileFlags = (fd >= 0) ? deps.getFileFlags(fd) : -1;
+    pthread_mutex_lock(&lock);
+    if (fileFlags >= 0 && size <= cacheLimit) {
+        trim_cache_locked(cacheLimit - size);
+        cached_buffer_t* entry = new cached_buffer_t;
+        entry->size = size;
+        entry->offset = offset;
+        entry->fd = fd;
+        entry->openFlags = fileFlags & (O_ACCMODE | O_SYNC);
+        entry->next = cache;
+        cache = entry;
+        cacheBytes += size;
+        err = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    END_FUNC;
+    return err;
+}
+
+
+int PmemUserspaceAllocator::take_cached_buffer(size_t size, int openFlags, int* pFd)
+{
+    BEGIN_FUNC;
+    int offset = -ENOENT;
+    pthread_mutex_lock(&lock);
+    for (cached_buffer_t** pp = &cache ; *pp ; pp = &(*pp)->next) {
+        cached_buffer_t* entry = *pp;
+        if (entry->size == size && entry->openFlags == openFlags) {
+            *pp = entry->next;
+            cacheBytes -= entry->size;
+            offset = entry->offset;
+            *pFd = entry->fd;
+            delete entry;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    END_FUNC;
+    return offset;
+}
+
+
+void PmemUserspaceAllocator::trim_cache_locked(size_t bytes)
+{
+    // the oldest entries are at the end of the list
+    while (cache && cacheBytes > bytes) {
+        cached_buffer_t** pp = &cache;
+        while ((*pp)->next)
+            pp = &(*pp)->next;
+        cached_buffer_t* entry = *pp;
+        *pp = 0;
+        cacheBytes -= entry->size;
+        free_pmem_buffer(entry->size, master_base, entry->offset, entry->fd);
+        deps.close(entry->fd);
+        delete entry;
+    }
+}
+
+
+void PmemUserspaceAllocator::trim_cache(size_t bytes)
+{
+    BEGIN_FUNC;
+    pthread_mutex_lock(&lock);
+    trim_cache_locked(bytes);
+    pthread_mutex_unlock(&lock);
+    END_FUNC;
+}
+
+
+int PmemUserspaceAllocator::get_pool_count()
+{
+    return 1;
+}
+
+
+int PmemUserspaceAllocator::get_pool_stats(int index, pmem_pool_stats_t* stats)
+{
+    if (index != 0)
+        return -EINVAL;
+    memset(stats, 0, sizeof(*stats));
+    stats->name = pmemdev;
+    allocator.getStats(stats);
+    pthread_mutex_lock(&lock);
+    stats->cached = cacheBytes;
+    stats->failures = failures;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+
+void PmemUserspaceAllocator::set_cache_limit(size_t bytes)
+{
+    BEGIN_FUNC;
+    pthread_mutex_lock(&lock);
+    cacheLimit = bytes;
+    trim_cache_locked(bytes);
+    pthread_mutex_unlock(&lock);
+    END_FUNC;
+}
+
+
 PmemUserspaceAllocator::Deps::Allocator::~Allocator()
 {
     BEGIN_FUNC;
     END_FUNC;
 }
 
+void PmemUserspaceAllocator::Deps::Allocator::getStats(
+        pmem_pool_stats_t* stats) const
+{
+}
+
 PmemUserspaceAllocator::Deps::~Deps()
 {
     BEGIN_FUNC;
@@ -233,9 +397,14 @@ PmemUserspaceAllocator::Deps::~Deps()
 }
 
 PmemKernelAllocator::PmemKernelAllocator(Deps& deps):
-    deps(deps)
+    deps(deps),
+    buffers(0)
 {
     BEGIN_FUNC;
+    pthread_mutex_init(&lock, NULL);
+    memset(pools, 0, sizeof(pools));
+    pools[POOL_ADSP].name = DEVICE_PMEM_ADSP;
+    pools[POOL_SMIPOOL].name = DEVICE_PMEM_SMIPOOL;
     END_FUNC;
 }
 
@@ -243,10 +412,78 @@ PmemKernelAllocator::PmemKernelAllocator(Deps& deps):
 PmemKernelAllocator::~PmemKernelAllocator()
 {
     BEGIN_FUNC;
+    while (buffers) {
+        kernel_buffer_t* next = buffers->next;
+        delete buffers;
+        buffers = next;
+    }
+    pthread_mutex_destroy(&lock);
     END_FUNC;
 }
 
 
+void PmemKernelAllocator::account_alloc(int pool, void* base, size_t size)
+{
+    kernel_buffer_t* buffer = new kernel_buffer_t;
+    buffer->base = base;
+    buffer->size = size;
+    buffer->pool = pool;
+    pthread_mutex_lock(&lock);
+    buffer->next = buffers;
+    buffers = buffer;
+    pools[pool].allocated += size;
+    pools[pool].buffers++;
+    pthread_mutex_unlock(&lock);
+}
+
+
+void PmemKernelAllocator::account_failure(int pool)
+{
+    pthread_mutex_lock(&lock);
+    pools[pool].failures++;
+    pthread_mutex_unlock(&lock);
+}
+
+
+void PmemKernelAllocator::account_free(void* base)
+{
+    pthread_mutex_lock(&lock);
+    for (kernel_buffer_t** pp = &buffers ; *pp ; pp = &(*pp)->next) {
+        kernel_buffer_t* buffer = *pp;
+        if (buffer->base == base) {
+            *pp = buffer->next;
+            pools[buffer->pool].allocated -= buffer->size;
+            pools[buffer->pool].buffers--;
+            delete buffer;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+
+int PmemKernelAllocator::get_pool_count()
+{
+    return POOL_COUNT;
+}
+
+
+int PmemKernelAllocator::get_pool_stats(int index, pmem_pool_stats_t* stats)
+{
+    if (index < 0 || index >= POOL_COUNT)
+        return -EINVAL;
+    // the kernel doesn't tell us how big or fragmented its pools are
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&lock);
+    stats->name = pools[index].name;
+    stats->allocated = pools[index].allocated;
+    stats->buffers = pools[index].buffers;
+    stats->failures = pools[index].failures;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+
 void* PmemKernelAllocator::get_base_address() {
     BEGIN_FUNC;
     END_FUNC;
@@ -254,14 +491,54 @@ void* PmemKernelAllocator::get_base_address() {
 }
 
 
-static unsigned clp2(unsigned x) {
-    x = x - 1;
-    x = x | (x >> 1);
-    x = x | (x >> 2);
-    x = x | (x >> 4);
-    x = x | (x >> 8);
-    x = x | (x >>16);
-    return x + 1;
+static bool is_video_format(int format) {
+    switch (format) {
+        case HAL_PIXEL_FORMAT_YCbCr_420_SP_TILED:
+        case HAL_PIXEL_FORMAT_YCbCr_420_SP:
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP_ADRENO:
+        case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+        case HAL_PIXEL_FORMAT_YCrCb_422_SP:
+        case HAL_PIXEL_FORMAT_YCbCr_420_P:
+        case HAL_PIXEL_FORMAT_YCbCr_422_P:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Physical alignment policy for kernel pmem allocations.
+ *
+ * The alignment the hardware needs is returned in *pRequired (0 if any
+ * page-aligned address will do), the alignment we would like in
+ * *pPreferred. Large video buffers ask for 64K or 1M so they can be
+ * mapped with large pages, which spares the video core and the CPU a
+ * lot of TLB misses. Everything else is left to the kernel, which packs
+ * it at page granularity; we don't round sizes up to a power of 2, that
+ * wastes up to half of every buffer.
+ */
+static void get_pmem_alignment(size_t size, int format,
+        int* pRequired, int* pPreferred)
+{
+    int required = 0;
+    int preferred = 0;
+
+    if (format == HAL_PIXEL_FORMAT_YCbCr_420_SP_TILED) {
+        // Tile format buffers need physical alignment to 8K
+        required = 8192;
+    }
+
+    if (is_video_format(format)) {
+        if (size >= PMEM_ALIGN_1M) {
+            preferred = PMEM_ALIGN_1M;
+        } else if (size >= PMEM_ALIGN_64K) {
+            preferred = PMEM_ALIGN_64K;
+        }
+    }
+
+    *pRequired = required;
+    *pPreferred = (preferred > required) ? preferred : required;
 }
 
 
@@ -277,19 +554,24 @@ int PmemKernelAllocator::alloc_pmem_buffer(size_t size, int usage,
     int err, offset = 0;
     int openFlags = get_open_flags(usage);
     const char *device;
+    int pool;
     
     if (usage & GRALLOC_USAGE_PRIVATE_PMEM_ADSP) {
         device = DEVICE_PMEM_ADSP;
+        pool = POOL_ADSP;
     } else if (usage & GRALLOC_USAGE_PRIVATE_PMEM_SMIPOOL) {
         device = DEVICE_PMEM_SMIPOOL;
+        pool = POOL_SMIPOOL;
     } else if ((usage & GRALLOC_USAGE_EXTERNAL_DISP) ||
                (usage & GRALLOC_USAGE_PROTECTED)) {
         int tempFd = deps.open(DEVICE_PMEM_SMIPOOL, openFlags, 0);
         if (tempFd < 0) {
             device = DEVICE_PMEM_ADSP;
+            pool = POOL_ADSP;
         } else {
             close(tempFd);
             device = DEVICE_PMEM_SMIPOOL;
+            pool = POOL_SMIPOOL;
         }
     } else {
         LOGE("Invalid device");
@@ -301,17 +583,29 @@ int PmemKernelAllocator::alloc_pmem_buffer(size_t size, int usage,
         err = -deps.getErrno();
         END_FUNC;
         LOGE("Error opening %s", device);
+        account_failure(pool);
         return err;
     }
 
-    // The size should already be page aligned, now round it up to a power of 2.
-    //size = clp2(size);
-
-    if (format == HAL_PIXEL_FORMAT_YCbCr_420_SP_TILED) {
-        // Tile format buffers need physical alignment to 8K
-        err = deps.alignPmem(fd, size, 8192);
+    // The size should already be page aligned.
+    int required, preferred;
+    get_pmem_alignment(size, format, &required, &preferred);
+    if (preferred) {
+        err = deps.alignPmem(fd, size, preferred);
+        if (err < 0 && required && required != preferred) {
+            // the pool may be too fragmented for a large-page aligned
+            // chunk, settle for what the hardware really needs
+            LOGW("%s: no %d KiB aligned chunk for %d KiB, trying %d KiB",
+                 device, preferred/1024, size/1024, required/1024);
+            err = deps.alignPmem(fd, size, required);
+        }
         if (err < 0) {
-            LOGE("alignPmem failed");
+            if (required) {
+                LOGE("alignPmem failed");
+            } else {
+                LOGV("%s: no %d KiB aligned chunk for %d KiB",
+                     device, preferred/1024, size/1024);
+            }
         }
     }
 
@@ -321,11 +615,15 @@ int PmemKernelAllocator::alloc_pmem_buffer(size_t size, int usage,
              strerror(deps.getErrno()));
         err = -deps.getErrno();
         deps.close(fd);
+        account_failure(pool);
         END_FUNC;
         return err;
     }
 
-    memset(base, 0, size);
+    if (!(usage & GRALLOC_USAGE_PRIVATE_UNINITIALIZED)) {
+        memset(base, 0, size);
+    }
+    account_alloc(pool, base, size);
 
     *pBase = base;
     *pOffset = 0;
@@ -339,9 +637,8 @@ int PmemKernelAllocator::alloc_pmem_buffer(size_t size, int usage,
 int PmemKernelAllocator::free_pmem_buffer(size_t size, void* base, int offset, int fd)
 {
     BEGIN_FUNC;
-    // The size should already be page aligned, now round it up to a power of 2
-    // like we did when allocating.
-    //size = clp2(size);
+    // The size should already be page aligned. It is never padded when
+    // allocating, so this unmaps the whole buffer.
 
     int err = deps.munmap(base, size);
     if (err < 0) {
@@ -349,6 +646,7 @@ int PmemKernelAllocator::free_pmem_buffer(size_t size, void* base, int offset, i
         LOGW("error unmapping pmem fd: %s", strerror(err));
         return -err;
     }
+    account_free(base);
     END_FUNC;
     return 0;
 }
@@ -23,6 +23,23 @@
 #include <unistd.h>
 
 
+/**
+ * Usage statistics of one pmem device, reported by
+ * PmemAllocator::get_pool_stats().
+ */
+struct pmem_pool_stats_t {
+    const char* name;       // the pmem device
+    size_t size;            // bytes in the pool, 0 if unknown
+    size_t allocated;       // bytes handed out, including cached sub-heaps
+    size_t cached;          // bytes of freed sub-heaps kept for reuse
+    size_t largestFree;     // largest free chunk, 0 if unknown
+    int buffers;            // live allocations, including cached sub-heaps
+    int chunks;             // chunks (free or not) in the pool, 0 if unknown
+    int freeChunks;
+    int failures;           // allocations that failed
+};
+
+
 /**
  * An interface to the PMEM allocators.
  */
@@ -38,6 +55,19 @@ class PmemAllocator {
     virtual int alloc_pmem_buffer(size_t size, int usage, void** pBase,
             int* pOffset, int* pFd, int format) = 0;
     virtual int free_pmem_buffer(size_t size, void* base, int offset, int fd) = 0;
+
+    // Offers a buffer that is being freed back to the allocator so that it
+    // can be handed out again by alloc_pmem_buffer(). Returns 0 if the
+    // allocator kept the buffer, in which case it now owns fd. Otherwise the
+    // caller must release it with free_pmem_buffer() and close fd itself.
+    virtual int recycle_pmem_buffer(size_t size, void* base, int offset, int fd);
+
+    // Number of pmem devices this allocator hands out buffers from.
+    virtual int get_pool_count();
+
+    // Fills in the statistics of pool 'index', 0 <= index < get_pool_count().
+    // Returns -EINVAL if there is no such pool.
+    virtual int get_pool_stats(int index, pmem_pool_stats_t* stats);
 };
 
 
@@ -60,6 +90,9 @@ class PmemUserspaceAllocator: public PmemAllocator {
             virtual size_t  size() const = 0;
             virtual ssize_t allocate(size_t size, uint32_t flags = 0) = 0;
             virtual ssize_t deallocate(size_t offset) = 0;
+            // Fills in size, allocated, largestFree, buffers, chunks and
+            // freeChunks. Allocators that don't keep track leave them alone.
+            virtual void getStats(pmem_pool_stats_t* stats) const;
         };
 
         virtual ~Deps();
@@ -70,6 +103,9 @@ class PmemUserspaceAllocator: public PmemAllocator {
         virtual int mapPmem(int fd, int offset, size_t size) = 0;
         virtual int unmapPmem(int fd, int offset, size_t size) = 0;
         virtual int cleanPmem(int fd, unsigned long base, int offset, size_t size) = 0;
+        // Zero-fills a sub-heap without going through the CPU. Returns -1
+        // and sets errno when there is nothing to do it with.
+        virtual int clearPmem(int fd, int offset, size_t size) = 0;
 
         // C99
         virtual int getErrno() = 0;
@@ -79,6 +115,7 @@ class PmemUserspaceAllocator: public PmemAllocator {
                 off_t offset) = 0;
         virtual int open(const char* pathname, int flags, int mode) = 0;
         virtual int close(int fd) = 0;
+        virtual int getFileFlags(int fd) = 0;
     };
 
     PmemUserspaceAllocator(Deps& deps, Deps::Allocator& allocator, const char* pmemdev);
@@ -92,6 +129,21 @@ class PmemUserspaceAllocator: public PmemAllocator {
     virtual int alloc_pmem_buffer(size_t size, int usage, void** pBase,
             int* pOffset, int* pFd, int format);
     virtual int free_pmem_buffer(size_t size, void* base, int offset, int fd);
+    virtual int recycle_pmem_buffer(size_t size, void* base, int offset, int fd);
+    virtual int get_pool_count();
+    virtual int get_pool_stats(int index, pmem_pool_stats_t* stats);
+
+    // Sets the maximum number of bytes of freed sub-heaps kept around for
+    // reuse. 0 (the default) disables recycling.
+    //
+    // A recycled sub-heap is handed to its next owner without going through
+    // PMEM_UNMAP, so a process that leaked the previous owner's fd could see
+    // the new contents. Only enable this where all gralloc clients are
+    // trusted.
+    void set_cache_limit(size_t bytes);
+
+    // Releases cached sub-heaps until at most 'bytes' remain cached.
+    void trim_cache(size_t bytes);
 
 #ifndef ANDROID_OS
     // DO NOT USE: For testing purposes only.
@@ -107,6 +159,18 @@ class PmemUserspaceAllocator: public PmemAllocator {
         MASTER_FD_INIT = -1,
     };
 
+    // A sub-heap that is still connected and mapped, waiting to be reused.
+    struct cached_buffer_t {
+        size_t size;
+        int offset;
+        int fd;
+        int openFlags;
+        cached_buffer_t* next;
+    };
+
+    int take_cached_buffer(size_t size, int openFlags, int* pFd);
+    void trim_cache_locked(size_t bytes);
+
     Deps& deps;
     Deps::Allocator& allocator;
 
@@ -114,6 +178,14 @@ class PmemUserspaceAllocator: public PmemAllocator {
     const char* pmemdev;
     int master_fd;
     void* master_base;
+
+    // most recently recycled first, protected by lock
+    cached_buffer_t* cache;
+    size_t cacheBytes;
+    size_t cacheLimit;
+
+    // allocations that failed, protected by lock
+    int failures;
 };
 
 
@@ -152,10 +224,43 @@ class PmemKernelAllocator: public PmemAllocator {
     virtual int alloc_pmem_buffer(size_t size, int usage, void** pBase,
             int* pOffset, int* pFd, int format);
     virtual int free_pmem_buffer(size_t size, void* base, int offset, int fd);
+    virtual int get_pool_count();
+    virtual int get_pool_stats(int index, pmem_pool_stats_t* stats);
 
  private:
 
+    enum {
+        POOL_ADSP,
+        POOL_SMIPOOL,
+        POOL_COUNT
+    };
+
+    struct pool_t {
+        const char* name;
+        size_t allocated;
+        int buffers;
+        int failures;
+    };
+
+    // A live buffer, so that free_pmem_buffer() knows which pool it
+    // came from.
+    struct kernel_buffer_t {
+        void* base;
+        size_t size;
+        int pool;
+        kernel_buffer_t* next;
+    };
+
+    void account_alloc(int pool, void* base, size_t size);
+    void account_failure(int pool);
+    void account_free(void* base);
+
     Deps& deps;
+
+    // protects pools and buffers
+    pthread_mutex_t lock;
+    pool_t pools[POOL_COUNT];
+    kernel_buffer_t* buffers;
 };
 
 #endif  // GRALLOC_QSD8K_PMEMALLOC_H
@@ -27,9 +27,11 @@ libgralloc_test_includes:= \
 
 libgralloc_test_static_libs := \
     libgralloc_qsd8k_host \
+    libhaltrace_host \
     libgtest_main_host \
 	libgtest_host  \
 	libastl_host \
+    libcutils \
     liblog
 
 define host-test
@@ -50,6 +52,27 @@ define host-test
 endef
 
 TEST_SRC_FILES := \
+	flush_test.cpp \
 	pmemalloc_test.cpp
 
 $(call host-test, $(TEST_SRC_FILES))
+
+# Allocator benchmarks against mocked Deps, and the same kind of numbers
+# from the real gralloc module on a device.
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := gralloc_benchmark.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES := libgralloc_qsd8k_host libhaltrace_host libcutils liblog
+LOCAL_LDLIBS += -lpthread -lrt
+LOCAL_MODULE := gralloc_benchmark
+LOCAL_MODULE_TAGS := eng tests
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := gralloc_device_benchmark.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_SHARED_LIBRARIES := libhardware libcutils liblog
+LOCAL_MODULE := gralloc_device_benchmark
+LOCAL_MODULE_TAGS := eng tests
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GRALLOC_QSD8K_TESTS_BENCHMARK_H
+#define GRALLOC_QSD8K_TESTS_BENCHMARK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * A minimal benchmark runner in the style of Google's benchmark library.
+ * A benchmark is a function taking an iteration count; the runner calls
+ * it with a growing count until one run takes at least kMinTimeNs, and
+ * reports the time per iteration.  Setup inside a benchmark can be kept
+ * out of the measurement with StopBenchmarkTiming()/StartBenchmarkTiming().
+ */
+
+namespace benchmark {
+
+static const int64_t kMinTimeNs = 200000000LL;
+static const int kMaxIterations = 1 << 24;
+
+static inline int64_t NanoTime() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int64_t(t.tv_sec) * 1000000000LL + t.tv_nsec;
+}
+
+struct Benchmark {
+    typedef void (*Function)(int iterations);
+
+    Benchmark(const char* name, Function fn) : name(name), fn(fn), next(0) {
+        Benchmark** p = &head();
+        while (*p) p = &(*p)->next;
+        *p = this;
+    }
+
+    static Benchmark*& head() {
+        static Benchmark* sHead = 0;
+        return sHead;
+    }
+
+    const char* name;
+    Function fn;
+    Benchmark* next;
+};
+
+struct State {
+    int64_t start;
+    int64_t elapsed;
+    bool running;
+    char label[64];
+
+    static State& get() {
+        static State sState;
+        return sState;
+    }
+};
+
+static inline void StartBenchmarkTiming() {
+    State& s = State::get();
+    if (!s.running) {
+        s.start = NanoTime();
+        s.running = true;
+    }
+}
+
+static inline void StopBenchmarkTiming() {
+    State& s = State::get();
+    if (s.running) {
+        s.elapsed += NanoTime() - s.start;
+        s.running = false;
+    }
+}
+
+// Extra text printed after the timing, e.g. a failure count.
+static inline void SetBenchmarkLabel(const char* label) {
+    strncpy(State::get().label, label, sizeof(State::get().label) - 1);
+}
+
+static inline int64_t RunOnce(Benchmark* b, int iterations) {
+    State& s = State::get();
+    s.elapsed = 0;
+    s.running = false;
+    s.label[0] = 0;
+    StartBenchmarkTiming();
+    b->fn(iterations);
+    StopBenchmarkTiming();
+    return s.elapsed;
+}
+
+// Runs every benchmark whose name contains 'filter' (all if NULL).
+static inline int RunBenchmarks(const char* filter) {
+    printf("%-44s %10s %14s\n", "benchmark", "iterations", "ns/op");
+    for (Benchmark* b = Benchmark::head(); b; b = b->next) {
+        if (filter && !strstr(b->name, filter))
+            continue;
+        int iterations = 1;
+        int64_t elapsed = RunOnce(b, iterations);
+        while (elapsed < kMinTimeNs && iterations < kMaxIterations) {
+            int64_t next = elapsed > 0 ?
+                    iterations * kMinTimeNs / elapsed + 1 : iterations * 10;
+            if (next > iterations * 10LL) next = iterations * 10LL;
+            if (next > kMaxIterations) next = kMaxIterations;
+            iterations = int(next);
+            elapsed = RunOnce(b, iterations);
+        }
+        printf("%-44s %10d %14lld %s\n", b->name, iterations,
+                (long long)(elapsed / iterations), State::get().label);
+    }
+    return 0;
+}
+
+} // namespace benchmark
+
+#define BENCHMARK(f) \
+    static ::benchmark::Benchmark sBenchmark_##f(#f, f)
+
+#endif // GRALLOC_QSD8K_TESTS_BENCHMARK_H
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cutils/log.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/******************************************************************************/
+
+static const int fakeBase = 0x40000000;
+static const int fakeOffset = 0x300000;
+
+static private_handle_t* newPmemHandle(int width, int height)
+{
+    private_handle_t* hnd = new private_handle_t(1234, width * height * 2,
+            private_handle_t::PRIV_FLAGS_USES_PMEM, 0,
+            HAL_PIXEL_FORMAT_RGB_565, width, height);
+    hnd->base = fakeBase;
+    hnd->offset = fakeOffset;
+    return hnd;
+}
+
+/******************************************************************************/
+
+TEST(test_gralloc_flush, testFlushRegionOfWholeBuffer) {
+    private_handle_t* hnd = newPmemHandle(64, 32);
+
+    addFlushRange(hnd, 0, 0, 64, 32);
+
+    unsigned long vaddr, offset, length;
+    getFlushRegion(hnd, &vaddr, &offset, &length);
+    ASSERT_EQ((unsigned long)fakeBase, vaddr);
+    ASSERT_EQ((unsigned long)fakeOffset, offset);
+    ASSERT_EQ((unsigned long)hnd->size, length);
+    delete hnd;
+}
+
+/******************************************************************************/
+
+TEST(test_gralloc_flush, testFlushRegionOfSubRange) {
+    private_handle_t* hnd = newPmemHandle(64, 32);
+
+    // rows 8 to 11, columns 4 to 19 of a 128 byte stride
+    addFlushRange(hnd, 4, 8, 16, 4);
+    ASSERT_EQ(8 * 128 + 4 * 2, hnd->flushOffset);
+    ASSERT_EQ(3 * 128 + 16 * 2, hnd->flushSize);
+
+    // the L1 (virtual) and L2 (physical) ranges must start at the same byte
+    unsigned long vaddr, offset, length;
+    getFlushRegion(hnd, &vaddr, &offset, &length);
+    ASSERT_EQ((unsigned long)(fakeBase + hnd->flushOffset), vaddr);
+    ASSERT_EQ((unsigned long)(fakeOffset + hnd->flushOffset), offset);
+    ASSERT_EQ(vaddr - fakeBase, offset - fakeOffset);
+    ASSERT_EQ((unsigned long)hnd->flushSize, length);
+    delete hnd;
+}
+
+/******************************************************************************/
+
+TEST(test_gralloc_flush, testFlushRangeGrowsOverSeveralLocks) {
+    private_handle_t* hnd = newPmemHandle(64, 32);
+
+    addFlushRange(hnd, 0, 10, 64, 2);
+    addFlushRange(hnd, 0, 4, 64, 2);
+    ASSERT_EQ(4 * 128, hnd->flushOffset);
+    ASSERT_EQ(8 * 128, hnd->flushSize);
+
+    unsigned long vaddr, offset, length;
+    getFlushRegion(hnd, &vaddr, &offset, &length);
+    ASSERT_EQ((unsigned long)(fakeBase + 4 * 128), vaddr);
+    ASSERT_EQ((unsigned long)(fakeOffset + 4 * 128), offset);
+    ASSERT_EQ((unsigned long)(8 * 128), length);
+    delete hnd;
+}
+
+/******************************************************************************/
+
+TEST(test_gralloc_flush, testFlushRangeOfBadRectangleIsWholeBuffer) {
+    private_handle_t* hnd = newPmemHandle(64, 32);
+
+    addFlushRange(hnd, 60, 0, 16, 4);
+    ASSERT_EQ(0, hnd->flushOffset);
+    ASSERT_EQ(hnd->size, hnd->flushSize);
+    delete hnd;
+}
+
+/******************************************************************************/
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host benchmarks for the gralloc-qsd8k allocators, run against mocked
+ * Deps so they measure only the allocator itself.
+ *
+ *   gralloc_benchmark [filter]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <cutils/log.h>
+
+#include "gralloc_priv.h"
+#include "allocator.h"
+#include "pmemalloc.h"
+#include "benchmark.h"
+
+using namespace benchmark;
+
+static const size_t kHeapSize = 32 << 20;
+
+// deterministic, so that runs are comparable
+static uint32_t sSeed;
+static uint32_t nextRandom() {
+    sSeed = sSeed * 1103515245 + 12345;
+    return sSeed >> 8;
+}
+
+// 4K..1M, skewed towards small buffers like a real mix of UI surfaces
+static size_t randomSize() {
+    int shift = 12 + nextRandom() % 9;
+    return (1 << shift) + ((nextRandom() % 4) << (shift - 2));
+}
+
+/******************************************************************************/
+
+class HeapDeps : public PmemUserspaceAllocator::Deps,
+                 public PmemKernelAllocator::Deps {
+ public:
+    HeapDeps() : mHeap((char*)calloc(1, kHeapSize)), mFd(100) {}
+    ~HeapDeps() { free(mHeap); }
+
+    virtual size_t getPmemTotalSize(int fd, size_t* size) {
+        *size = kHeapSize;
+        return 0;
+    }
+    virtual int connectPmem(int fd, int master_fd) { return 0; }
+    virtual int mapPmem(int fd, int offset, size_t size) { return 0; }
+    virtual int unmapPmem(int fd, int offset, size_t size) { return 0; }
+    virtual int cleanPmem(int fd, unsigned long base, int offset, size_t size) {
+        return 0;
+    }
+    virtual int clearPmem(int fd, int offset, size_t size) {
+        memset(mHeap + offset, 0, size);
+        return 0;
+    }
+    virtual int alignPmem(int fd, size_t size, int align) { return 0; }
+    virtual int getErrno() { return ENOMEM; }
+    virtual void* mmap(void* start, size_t length, int prot, int flags, int fd,
+            off_t offset) {
+        return length <= kHeapSize ? mHeap : MAP_FAILED;
+    }
+    virtual int munmap(void* start, size_t length) { return 0; }
+    virtual int open(const char* pathname, int flags, int mode) {
+        return mFd++;
+    }
+    virtual int close(int fd) { return 0; }
+    virtual int getFileFlags(int fd) { return O_RDWR; }
+
+ private:
+    char* mHeap;
+    int mFd;
+};
+
+/******************************************************************************/
+
+static void BM_BestFitAllocFree(int iterations) {
+    SimpleBestFitAllocator allocator(kHeapSize);
+    for (int i = 0; i < iterations; i++) {
+        ssize_t offset = allocator.allocate(64 << 10);
+        allocator.deallocate(offset);
+    }
+}
+BENCHMARK(BM_BestFitAllocFree);
+
+// Keeps kLive buffers of random sizes alive and replaces a random one per
+// iteration, which fragments the heap the way surface churn does.
+static void BM_BestFitFragmenting(int iterations) {
+    static const int kLive = 64;
+    StopBenchmarkTiming();
+    SimpleBestFitAllocator allocator(kHeapSize);
+    ssize_t live[kLive];
+    sSeed = 1;
+    for (int i = 0; i < kLive; i++)
+        live[i] = allocator.allocate(randomSize());
+    StartBenchmarkTiming();
+
+    int failures = 0;
+    for (int i = 0; i < iterations; i++) {
+        int slot = nextRandom() % kLive;
+        if (live[slot] >= 0)
+            allocator.deallocate(live[slot]);
+        live[slot] = allocator.allocate(randomSize());
+        if (live[slot] < 0)
+            failures++;
+    }
+
+    char label[64];
+    snprintf(label, sizeof(label), "failures=%d", failures);
+    SetBenchmarkLabel(label);
+}
+BENCHMARK(BM_BestFitFragmenting);
+
+static void BM_PmemUserspaceAllocFree(int iterations) {
+    StopBenchmarkTiming();
+    HeapDeps deps;
+    SimpleBestFitAllocator allocator;
+    PmemUserspaceAllocator pma(deps, allocator, "/dev/pmem");
+    pma.init_pmem_area();
+    StartBenchmarkTiming();
+
+    for (int i = 0; i < iterations; i++) {
+        void* base;
+        int offset, fd;
+        if (pma.alloc_pmem_buffer(256 << 10, 0, &base, &offset, &fd, 0) == 0)
+            pma.free_pmem_buffer(256 << 10, base, offset, fd);
+    }
+}
+BENCHMARK(BM_PmemUserspaceAllocFree);
+
+static void BM_PmemUserspaceAllocRecycle(int iterations) {
+    StopBenchmarkTiming();
+    HeapDeps deps;
+    SimpleBestFitAllocator allocator;
+    PmemUserspaceAllocator pma(deps, allocator, "/dev/pmem");
+    pma.init_pmem_area();
+    pma.set_cache_limit(4 << 20);
+    StartBenchmarkTiming();
+
+    for (int i = 0; i < iterations; i++) {
+        void* base;
+        int offset, fd;
+        if (pma.alloc_pmem_buffer(256 << 10, 0, &base, &offset, &fd, 0) == 0) {
+            if (pma.recycle_pmem_buffer(256 << 10, base, offset, fd) < 0)
+                pma.free_pmem_buffer(256 << 10, base, offset, fd);
+        }
+    }
+}
+BENCHMARK(BM_PmemUserspaceAllocRecycle);
+
+static void BM_PmemKernelAllocFree(int iterations) {
+    StopBenchmarkTiming();
+    HeapDeps deps;
+    PmemKernelAllocator pma(deps);
+    StartBenchmarkTiming();
+
+    for (int i = 0; i < iterations; i++) {
+        void* base;
+        int offset, fd;
+        if (pma.alloc_pmem_buffer(256 << 10, GRALLOC_USAGE_PRIVATE_PMEM_ADSP,
+                &base, &offset, &fd, 0) == 0)
+            pma.free_pmem_buffer(256 << 10, base, offset, fd);
+    }
+}
+BENCHMARK(BM_PmemKernelAllocFree);
+
+/******************************************************************************/
+
+int main(int argc, char** argv) {
+    return RunBenchmarks(argc > 1 ? argv[1] : NULL);
+}
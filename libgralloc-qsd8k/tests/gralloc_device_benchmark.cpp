@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * On-device benchmarks that go through the real gralloc module, pmem and
+ * framebuffer drivers.  Stop the framework first (adb shell stop) so that
+ * SurfaceFlinger does not own the framebuffer.
+ *
+ *   gralloc_device_benchmark [filter]
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include <hardware/hardware.h>
+#include <hardware/gralloc.h>
+
+#include "gralloc_priv.h"
+#include "benchmark.h"
+
+using namespace benchmark;
+
+static gralloc_module_t const* sModule;
+static alloc_device_t* sAllocDev;
+static framebuffer_device_t* sFbDev;
+
+static void allocFree(int iterations, int usage) {
+    for (int i = 0; i < iterations; i++) {
+        buffer_handle_t handle;
+        int stride;
+        if (sAllocDev->alloc(sAllocDev, 256, 256, HAL_PIXEL_FORMAT_RGB_565,
+                usage, &handle, &stride) == 0)
+            sAllocDev->free(sAllocDev, handle);
+    }
+}
+
+static void BM_AllocFreeAshmem(int iterations) {
+    allocFree(iterations, GRALLOC_USAGE_SW_READ_OFTEN |
+            GRALLOC_USAGE_SW_WRITE_OFTEN);
+}
+BENCHMARK(BM_AllocFreeAshmem);
+
+static void BM_AllocFreePmem(int iterations) {
+    allocFree(iterations, GRALLOC_USAGE_PRIVATE_PMEM |
+            GRALLOC_USAGE_HW_TEXTURE);
+}
+BENCHMARK(BM_AllocFreePmem);
+
+static void lockUnlock(int iterations, int usage, int w, int h) {
+    StopBenchmarkTiming();
+    buffer_handle_t handle;
+    int stride;
+    if (sAllocDev->alloc(sAllocDev, 256, 256, HAL_PIXEL_FORMAT_RGB_565,
+            usage, &handle, &stride) != 0) {
+        SetBenchmarkLabel("alloc failed");
+        return;
+    }
+    StartBenchmarkTiming();
+
+    for (int i = 0; i < iterations; i++) {
+        void* vaddr;
+        if (sModule->lock(sModule, handle, GRALLOC_USAGE_SW_WRITE_OFTEN,
+                0, 0, w, h, &vaddr) == 0)
+            sModule->unlock(sModule, handle);
+    }
+
+    StopBenchmarkTiming();
+    sAllocDev->free(sAllocDev, handle);
+}
+
+static void BM_LockUnlockPmemFull(int iterations) {
+    lockUnlock(iterations, GRALLOC_USAGE_PRIVATE_PMEM |
+            GRALLOC_USAGE_SW_WRITE_OFTEN, 256, 256);
+}
+BENCHMARK(BM_LockUnlockPmemFull);
+
+static void BM_LockUnlockPmemSmallRect(int iterations) {
+    lockUnlock(iterations, GRALLOC_USAGE_PRIVATE_PMEM |
+            GRALLOC_USAGE_SW_WRITE_OFTEN, 16, 16);
+}
+BENCHMARK(BM_LockUnlockPmemSmallRect);
+
+static void BM_LockUnlockAshmem(int iterations) {
+    lockUnlock(iterations, GRALLOC_USAGE_SW_READ_OFTEN |
+            GRALLOC_USAGE_SW_WRITE_OFTEN, 256, 256);
+}
+BENCHMARK(BM_LockUnlockAshmem);
+
+// Time per post is the flip cadence; the label has the worst interval.
+static void BM_FbPost(int iterations) {
+    static const int kMaxBuffers = 3;
+    StopBenchmarkTiming();
+    if (!sFbDev) {
+        SetBenchmarkLabel("no framebuffer");
+        return;
+    }
+    buffer_handle_t buffers[kMaxBuffers];
+    int count = 0;
+    for (; count < kMaxBuffers; count++) {
+        int stride;
+        if (sAllocDev->alloc(sAllocDev, sFbDev->width, sFbDev->height,
+                sFbDev->format, GRALLOC_USAGE_HW_FB, &buffers[count],
+                &stride) != 0)
+            break;
+    }
+    if (!count) {
+        SetBenchmarkLabel("alloc failed");
+        return;
+    }
+    StartBenchmarkTiming();
+
+    int64_t last = NanoTime();
+    int64_t worst = 0;
+    for (int i = 0; i < iterations; i++) {
+        sFbDev->post(sFbDev, buffers[i % count]);
+        int64_t now = NanoTime();
+        if (now - last > worst)
+            worst = now - last;
+        last = now;
+    }
+
+    StopBenchmarkTiming();
+    for (int i = 0; i < count; i++)
+        sAllocDev->free(sAllocDev, buffers[i]);
+
+    char label[64];
+    snprintf(label, sizeof(label), "buffers=%d worst=%lldus", count,
+            (long long)(worst / 1000));
+    SetBenchmarkLabel(label);
+}
+BENCHMARK(BM_FbPost);
+
+int main(int argc, char** argv) {
+    hw_module_t const* module;
+    int err = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &module);
+    if (err) {
+        fprintf(stderr, "cannot load gralloc module: %s\n", strerror(-err));
+        return 1;
+    }
+    sModule = (gralloc_module_t const*)module;
+
+    err = gralloc_open(module, &sAllocDev);
+    if (err) {
+        fprintf(stderr, "cannot open gralloc device: %s\n", strerror(-err));
+        return 1;
+    }
+    if (framebuffer_open(module, &sFbDev))
+        sFbDev = 0;
+
+    RunBenchmarks(argc > 1 ? argv[1] : NULL);
+
+    if (sFbDev)
+        framebuffer_close(sFbDev);
+    gralloc_close(sAllocDev);
+    return 0;
+}
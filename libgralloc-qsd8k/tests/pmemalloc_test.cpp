@@ -19,8 +19,12 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/mman.h>
 
+#include <cutils/log.h>
+
+#include "gralloc_priv.h"
 #include "pmemalloc.h"
 
 class DepsStub : public PmemUserspaceAllocator::Deps, public PmemKernelAllocator::Deps {
@@ -43,6 +47,18 @@ class DepsStub : public PmemUserspaceAllocator::Deps, public PmemKernelAllocator
         return 0;
     }
 
+    virtual int cleanPmem(int fd, unsigned long base, int offset, size_t size) {
+        return 0;
+    }
+
+    virtual int clearPmem(int fd, int offset, size_t size) {
+        return -1;
+    }
+
+    virtual int alignPmem(int fd, size_t size, int align) {
+        return 0;
+    }
+
     virtual int getErrno() {
         return 0;
     }
@@ -63,6 +79,10 @@ class DepsStub : public PmemUserspaceAllocator::Deps, public PmemKernelAllocator
     virtual int close(int fd) {
         return 0;
     }
+
+    virtual int getFileFlags(int fd) {
+        return O_RDWR;
+    }
 };
 
 /******************************************************************************/
@@ -327,7 +347,7 @@ TEST(test_pmem_userspace_allocator, testAllocPmemBufferWithSuccessfulCompletionW
     int offset = -9182, fd = -9182;
     int size = 0x100;
     int flags = 0;
-    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd);
+    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd, 0);
     ASSERT_EQ(0, result);
     ASSERT_EQ(0x300, offset);
     ASSERT_EQ(5678, fd);
@@ -353,8 +373,8 @@ TEST(test_pmem_userspace_allocator, testAllocPmemBufferWithSuccessfulCompletionW
     void* base = 0;
     int offset = -9182, fd = -9182;
     int size = 0x100;
-    int flags = ~0;
-    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd);
+    int flags = ~GRALLOC_USAGE_PRIVATE_UNINITIALIZED;
+    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd, 0);
     ASSERT_EQ(0, result);
     ASSERT_EQ(0x300, offset);
     ASSERT_EQ(5678, fd);
@@ -365,6 +385,87 @@ TEST(test_pmem_userspace_allocator, testAllocPmemBufferWithSuccessfulCompletionW
 
 /******************************************************************************/
 
+struct Deps_AllocPmemBufferWithUninitializedFlag : public Deps_InitPmemAreaLockedWithSuccessfulCompletionWithNoFlags {
+
+    virtual int cleanPmem(int fd, unsigned long base, int offset, size_t size) {
+        ADD_FAILURE() << "cache maintenance on a buffer that wasn't written";
+        return 0;
+    }
+};
+
+typedef Allocator_AllocPmemBufferWithSuccessfulCompletionWithNoFlags Allocator_AllocPmemBufferWithUninitializedFlag;
+
+TEST(test_pmem_userspace_allocator, testAllocPmemBufferWithUninitializedFlag) {
+    Deps_AllocPmemBufferWithUninitializedFlag depsMock;
+    Allocator_AllocPmemBufferWithUninitializedFlag allocMock;
+    PmemUserspaceAllocator pma(depsMock, allocMock, fakePmemDev);
+
+    uint8_t buf[0x300 + 0x100];
+    memset(buf, 0xff, sizeof(buf));
+    pma.set_master_values(1234, buf); // Indicate that the pma has been successfully init'd
+
+    void* base = 0;
+    int offset = -9182, fd = -9182;
+    int size = 0x100;
+    int flags = GRALLOC_USAGE_PRIVATE_UNINITIALIZED;
+    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd, 0);
+    ASSERT_EQ(0, result);
+    ASSERT_EQ(0x300, offset);
+    ASSERT_EQ(5678, fd);
+    for (int i = 0x300; i < 0x400; ++i) {
+        ASSERT_EQ(uint8_t(0xff), buf[i]);
+    }
+}
+
+/******************************************************************************/
+
+struct Deps_AllocPmemBufferClearedByMdp : public Deps_InitPmemAreaLockedWithSuccessfulCompletionWithNoFlags {
+
+    int numCleans;
+    int numClears;
+
+    Deps_AllocPmemBufferClearedByMdp() : numCleans(0), numClears(0) {}
+
+    virtual int cleanPmem(int fd, unsigned long base, int offset, size_t size) {
+        EXPECT_EQ(0, numClears) << "cache cleaned after the MDP wrote the buffer";
+        numCleans++;
+        return 0;
+    }
+
+    virtual int clearPmem(int fd, int offset, size_t size) {
+        EXPECT_EQ(5678, fd);
+        EXPECT_EQ(0x300, offset);
+        EXPECT_EQ(size_t(0x100), size);
+        numClears++;
+        return 0;
+    }
+};
+
+typedef Allocator_AllocPmemBufferWithSuccessfulCompletionWithNoFlags Allocator_AllocPmemBufferClearedByMdp;
+
+TEST(test_pmem_userspace_allocator, testAllocPmemBufferClearedByMdp) {
+    Deps_AllocPmemBufferClearedByMdp depsMock;
+    Allocator_AllocPmemBufferClearedByMdp allocMock;
+    PmemUserspaceAllocator pma(depsMock, allocMock, fakePmemDev);
+
+    uint8_t buf[0x300 + 0x100];
+    memset(buf, 0xff, sizeof(buf));
+    pma.set_master_values(1234, buf); // Indicate that the pma has been successfully init'd
+
+    void* base = 0;
+    int offset = -9182, fd = -9182;
+    int result = pma.alloc_pmem_buffer(0x100, 0, &base, &offset, &fd, 0);
+    ASSERT_EQ(0, result);
+    ASSERT_EQ(1, depsMock.numCleans);
+    ASSERT_EQ(1, depsMock.numClears);
+    // the CPU never touched the buffer
+    for (int i = 0x300; i < 0x400; ++i) {
+        ASSERT_EQ(uint8_t(0xff), buf[i]);
+    }
+}
+
+/******************************************************************************/
+
 struct Deps_InitPmemAreaLockedWithEnodevOnOpen : public Deps_InitPmemAreaLockedWithSuccessfulCompletionWithNoFlags {
 
     virtual int getErrno() {
@@ -393,7 +494,7 @@ TEST(test_pmem_userspace_allocator, testAllocPmemBufferWithSuccessfulCompletionW
     int offset = -9182, fd = -9182;
     int size = 0x100;
     int flags = ~0;
-    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd);
+    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd, 0);
     ASSERT_EQ(-ENODEV, result);
 }
 
@@ -426,7 +527,7 @@ TEST(test_pmem_userspace_allocator, testAllocPmemBufferWithSuccessfulCompletionW
     int offset = -9182, fd = -9182;
     int size = 0x100;
     int flags = ~0;
-    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd);
+    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd, 0);
     ASSERT_EQ(-ENOMEM, result);
 }
 
@@ -460,12 +561,98 @@ TEST(test_pmem_userspace_allocator, testAllocPmemBufferWithEnomemOnMapPmem) {
     int offset = -9182, fd = -9182;
     int size = 0x100;
     int flags = ~0;
-    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd);
+    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd, 0);
     ASSERT_EQ(-ENOMEM, result);
 }
 
 /******************************************************************************/
 
+struct Deps_AllocPmemBufferFromRecycledSubHeap : public DepsStub {
+
+    int numOpens;
+    int numCloses;
+    int openFlags;
+
+    Deps_AllocPmemBufferFromRecycledSubHeap() :
+            numOpens(0), numCloses(0), openFlags(0) {}
+
+    virtual int open(const char* pathname, int flags, int mode) {
+        numOpens++;
+        openFlags = flags;
+        return 5678;
+    }
+
+    virtual int getFileFlags(int fd) {
+        EXPECT_EQ(5678, fd);
+        return openFlags;
+    }
+
+    virtual int close(int fd) {
+        EXPECT_EQ(5678, fd);
+        numCloses++;
+        return 0;
+    }
+};
+
+struct Allocator_AllocPmemBufferFromRecycledSubHeap : public AllocatorStub {
+
+    int numAllocations;
+    int numDeallocations;
+
+    Allocator_AllocPmemBufferFromRecycledSubHeap() :
+            numAllocations(0), numDeallocations(0) {}
+
+    virtual ssize_t allocate(size_t size, uint32_t flags = 0) {
+        numAllocations++;
+        return 0x300;
+    }
+
+    virtual ssize_t deallocate(size_t offset) {
+        EXPECT_EQ(size_t(0x300), offset);
+        numDeallocations++;
+        return 0;
+    }
+};
+
+TEST(test_pmem_userspace_allocator, testAllocPmemBufferFromRecycledSubHeap) {
+    Deps_AllocPmemBufferFromRecycledSubHeap depsMock;
+    Allocator_AllocPmemBufferFromRecycledSubHeap allocMock;
+    PmemUserspaceAllocator pma(depsMock, allocMock, fakePmemDev);
+
+    uint8_t buf[0x300 + 0x100];
+    pma.set_master_values(1234, buf); // Indicate that the pma has been successfully init'd
+    pma.set_cache_limit(0x100);
+
+    void* base = 0;
+    int offset = -9182, fd = -9182;
+    int result = pma.alloc_pmem_buffer(0x100, 0, &base, &offset, &fd, 0);
+    ASSERT_EQ(0, result);
+    ASSERT_EQ(0, pma.recycle_pmem_buffer(0x100, (uint8_t*)base + offset, offset, fd));
+
+    // the recycled sub-heap comes back without another open or allocation
+    memset(buf + 0x300, 0xff, 0x100);
+    result = pma.alloc_pmem_buffer(0x100, 0, &base, &offset, &fd, 0);
+    ASSERT_EQ(0, result);
+    ASSERT_EQ(0x300, offset);
+    ASSERT_EQ(5678, fd);
+    ASSERT_EQ(1, depsMock.numOpens);
+    ASSERT_EQ(1, allocMock.numAllocations);
+    for (int i = 0x300; i < 0x400; ++i) {
+        ASSERT_EQ(uint8_t(0), buf[i]);
+    }
+
+    // buffers over the limit are not kept
+    ASSERT_EQ(-EINVAL, pma.recycle_pmem_buffer(0x200, (uint8_t*)base + offset, offset, fd));
+
+    // lowering the limit releases what is cached
+    ASSERT_EQ(0, pma.recycle_pmem_buffer(0x100, (uint8_t*)base + offset, offset, fd));
+    pma.set_cache_limit(0);
+    ASSERT_EQ(1, depsMock.numCloses);
+    ASSERT_EQ(1, allocMock.numDeallocations);
+}
+
+/******************************************************************************/
+
 struct Deps_KernelAllocPmemBufferWithSuccessfulCompletionWithNoFlags : public DepsStub {
 
     void* mmapResult;
@@ -474,7 +661,7 @@ struct Deps_KernelAllocPmemBufferWithSuccessfulCompletionWithNoFlags : public De
             mmapResult(mmapResult) {}
 
     virtual int open(const char* pathname, int flags, int mode) {
-        EXPECT_EQ(fakePmemDev, pathname);
+        EXPECT_STREQ(DEVICE_PMEM_ADSP, pathname);
         EXPECT_EQ(O_RDWR, flags & O_RDWR);
         EXPECT_EQ(0, mode);
         return 5678;
@@ -490,13 +677,13 @@ struct Deps_KernelAllocPmemBufferWithSuccessfulCompletionWithNoFlags : public De
 TEST(test_pmem_kernel_allocator, testAllocPmemBufferWithSuccessfulCompletionWithNoFlags) {
     uint8_t buf[0x100]; // Create a buffer to get memzero'd
     Deps_KernelAllocPmemBufferWithSuccessfulCompletionWithNoFlags depsMock(buf);
-    PmemKernelAllocator pma(depsMock, fakePmemDev);
+    PmemKernelAllocator pma(depsMock);
 
     void* base = 0;
     int offset = -9182, fd = -9182;
     int size = 0x100;
-    int flags = 0;
-    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd);
+    int flags = GRALLOC_USAGE_PRIVATE_PMEM_ADSP;
+    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd, 0);
     ASSERT_EQ(0, result);
     ASSERT_EQ(buf, base);
     ASSERT_EQ(0, offset);
@@ -513,13 +700,13 @@ typedef Deps_KernelAllocPmemBufferWithSuccessfulCompletionWithNoFlags Deps_Kerne
 TEST(test_pmem_kernel_allocator, testAllocPmemBufferWithSuccessfulCompletionWithAllFlags) {
     uint8_t buf[0x100]; // Create a buffer to get memzero'd
     Deps_KernelAllocPmemBufferWithSuccessfulCompletionWithAllFlags depsMock(buf);
-    PmemKernelAllocator pma(depsMock, fakePmemDev);
+    PmemKernelAllocator pma(depsMock);
 
     void* base = 0;
     int offset = -9182, fd = -9182;
     int size = 0x100;
-    int flags = ~0;
-    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd);
+    int flags = ~GRALLOC_USAGE_PRIVATE_UNINITIALIZED;
+    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd, 0);
     ASSERT_EQ(0, result);
     ASSERT_EQ(buf, base);
     ASSERT_EQ(0, offset);
@@ -538,7 +725,7 @@ struct Deps_KernelAllocPmemBufferWithEpermOnOpen : public DepsStub {
     }
 
     virtual int open(const char* pathname, int flags, int mode) {
-        EXPECT_EQ(fakePmemDev, pathname);
+        EXPECT_STREQ(DEVICE_PMEM_ADSP, pathname);
         EXPECT_EQ(O_RDWR, flags & O_RDWR);
         EXPECT_EQ(0, mode);
         return -1;
@@ -548,13 +735,13 @@ struct Deps_KernelAllocPmemBufferWithEpermOnOpen : public DepsStub {
 
 TEST(test_pmem_kernel_allocator, testAllocPmemBufferWithEpermOnOpen) {
     Deps_KernelAllocPmemBufferWithEpermOnOpen depsMock;
-    PmemKernelAllocator pma(depsMock, fakePmemDev);
+    PmemKernelAllocator pma(depsMock);
 
     void* base = 0;
     int offset = -9182, fd = -9182;
     int size = 0x100;
     int flags = ~0;
-    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd);
+    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd, 0);
     ASSERT_EQ(-EPERM, result);
     ASSERT_EQ(0, base);
     ASSERT_EQ(0, offset);
@@ -566,7 +753,7 @@ TEST(test_pmem_kernel_allocator, testAllocPmemBufferWithEpermOnOpen) {
 struct Deps_KernelAllocPmemBufferWithEnomemOnMmap : DepsStub {
 
     virtual int open(const char* pathname, int flags, int mode) {
-        EXPECT_EQ(fakePmemDev, pathname);
+        EXPECT_STREQ(DEVICE_PMEM_ADSP, pathname);
         EXPECT_EQ(O_RDWR, flags & O_RDWR);
         EXPECT_EQ(0, mode);
         return 5678;
@@ -585,13 +772,13 @@ struct Deps_KernelAllocPmemBufferWithEnomemOnMmap : DepsStub {
 
 TEST(test_pmem_kernel_allocator, testAllocPmemBufferWithEnomemOnMmap) {
     Deps_KernelAllocPmemBufferWithEnomemOnMmap depsMock;
-    PmemKernelAllocator pma(depsMock, fakePmemDev);
+    PmemKernelAllocator pma(depsMock);
 
     void* base = 0;
     int offset = -9182, fd = -9182;
     int size = 0x100;
     int flags = ~0;
-    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd);
+    int result = pma.alloc_pmem_buffer(size, flags, &base, &offset, &fd, 0);
     ASSERT_EQ(-ENOMEM, result);
     ASSERT_EQ(0, base);
     ASSERT_EQ(0, offset);
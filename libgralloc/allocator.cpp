@@ -14,6 +14,9 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <cutils/log.h>
 
 #include "allocator.h"
@@ -23,13 +26,15 @@
 const int SimpleBestFitAllocator::kMemoryAlign = 32;
 
 SimpleBestFitAllocator::SimpleBestFitAllocator()
-    : mHeapSize(0)
+    : mAllocated(0), mNumPages(0), mHeapSize(0)
 {
+    memset(mBins, 0, sizeof(mBins));
 }
 
 SimpleBestFitAllocator::SimpleBestFitAllocator(size_t size)
-    : mHeapSize(0)
+    : mAllocated(0), mNumPages(0), mHeapSize(0)
 {
+    memset(mBins, 0, sizeof(mBins));
     setSize(size);
 }
 
@@ -38,6 +43,7 @@ SimpleBestFitAllocator::~SimpleBestFitAllocator()
     while(!mList.isEmpty()) {
         delete mList.remove(mList.head());
     }
+    free(mAllocated);
 }
 
 ssize_t SimpleBestFitAllocator::setSize(size_t size)
@@ -45,9 +51,14 @@ ssize_t SimpleBestFitAllocator::setSize(size_t size)
     Locker::Autolock _l(mLock);
     if (mHeapSize != 0) return -EINVAL;
     size_t pagesize = getpagesize();
-    mHeapSize = ((size + pagesize-1) & ~(pagesize-1));
+    size_t heapSize = ((size + pagesize-1) & ~(pagesize-1));
+    mAllocated = (chunk_t**)calloc(heapSize / pagesize, sizeof(chunk_t*));
+    if (mAllocated == 0) return -ENOMEM;
+    mNumPages = heapSize / pagesize;
+    mHeapSize = heapSize;
     chunk_t* node = new chunk_t(0, mHeapSize / kMemoryAlign);
     mList.insertHead(node);
+    insertFree(node);
     return size;
 }
     
@@ -76,6 +87,30 @@ ssize_t SimpleBestFitAllocator::deallocate(size_t offset)
     return -ENOENT;
 }
 
+int SimpleBestFitAllocator::binFor(size_t size)
+{
+    if (size == 0) return 0;
+    int bin = 31 - __builtin_clz(size);
+    return (bin < kNumBins) ? bin : kNumBins-1;
+}
+
+void SimpleBestFitAllocator::insertFree(chunk_t* chunk)
+{
+    chunk_t*& head = mBins[binFor(chunk->size)];
+    chunk->freePrev = 0;
+    chunk->freeNext = head;
+    if (head) head->freePrev = chunk;
+    head = chunk;
+}
+
+void SimpleBestFitAllocator::removeFree(chunk_t* chunk)
+{
+    if (chunk->freePrev == 0)   mBins[binFor(chunk->size)] = chunk->freeNext;
+    else                        chunk->freePrev->freeNext = chunk->freeNext;
+    if (chunk->freeNext)        chunk->freeNext->freePrev = chunk->freePrev;
+    chunk->freePrev = chunk->freeNext = 0;
+}
+
 ssize_t SimpleBestFitAllocator::alloc(size_t size, uint32_t flags)
 {
     if (size == 0) {
@@ -83,34 +118,42 @@ ssize_t SimpleBestFitAllocator::alloc(size_t size, uint32_t flags)
     }
     size = (size + kMemoryAlign-1) / kMemoryAlign;
     chunk_t* free_chunk = 0;
-    chunk_t* cur = mList.head();
 
     size_t pagesize = getpagesize();
-    while (cur) {
-        int extra = ( -cur->start & ((pagesize/kMemoryAlign)-1) ) ;
-
-        // best fit
-        if (cur->free && (cur->size >= (size+extra))) {
-            if ((!free_chunk) || (cur->size < free_chunk->size)) {
-                free_chunk = cur;
-            }
-            if (cur->size == size) {
-                break;
+    const size_t pageMask = (pagesize/kMemoryAlign)-1;
+
+    // every chunk in a bin is smaller than every chunk in the next one, so
+    // the best fit is in the first bin that has any chunk that fits.
+    for (int bin = binFor(size) ; bin < kNumBins && !free_chunk ; bin++) {
+        chunk_t* cur = mBins[bin];
+        while (cur) {
+            int extra = ( -cur->start & pageMask ) ;
+
+            // best fit
+            if (cur->size >= (size+extra)) {
+                if ((!free_chunk) || (cur->size < free_chunk->size)) {
+                    free_chunk = cur;
+                }
+                if (cur->size == size) {
+                    break;
+                }
             }
+            cur = cur->freeNext;
         }
-        cur = cur->next;
     }
 
     if (free_chunk) {
         const size_t free_size = free_chunk->size;
+        removeFree(free_chunk);
         free_chunk->free = 0;
         free_chunk->size = size;
         if (free_size > size) {
-            int extra = ( -free_chunk->start & ((pagesize/kMemoryAlign)-1) ) ;
+            int extra = ( -free_chunk->start & pageMask ) ;
             if (extra) {
                 chunk_t* split = new chunk_t(free_chunk->start, extra);
                 free_chunk->start += extra;
                 mList.insertBefore(free_chunk, split);
+                insertFree(split);
             }
 
             LOGE_IF(((free_chunk->start*kMemoryAlign)&(pagesize-1)),
@@ -121,8 +164,10 @@ ssize_t SimpleBestFitAllocator::alloc(size_t size, uint32_t flags)
                 chunk_t* split = new chunk_t(
                         free_chunk->start + free_chunk->size, tail_free);
                 mList.insertAfter(free_chunk, split);
+                insertFree(split);
             }
         }
+        mAllocated[(free_chunk->start*kMemoryAlign) / pagesize] = free_chunk;
         return (free_chunk->start)*kMemoryAlign;
     }
     return -ENOMEM;
@@ -130,36 +175,45 @@ ssize_t SimpleBestFitAllocator::alloc(size_t size, uint32_t flags)
 
 SimpleBestFitAllocator::chunk_t* SimpleBestFitAllocator::dealloc(size_t start)
 {
-    start = start / kMemoryAlign;
-    chunk_t* cur = mList.head();
-    while (cur) {
-        if (cur->start == start) {
-            LOG_FATAL_IF(cur->free,
-                "block at offset 0x%08lX of size 0x%08lX already freed",
-                cur->start*kMemoryAlign, cur->size*kMemoryAlign);
-
-            // merge freed blocks together
-            chunk_t* freed = cur;
-            cur->free = 1;
-            do {
-                chunk_t* const p = cur->prev;
-                chunk_t* const n = cur->next;
-                if (p && (p->free || !cur->size)) {
-                    freed = p;
-                    p->size += cur->size;
-                    mList.remove(cur);
-                    delete cur;
-                }
-                cur = n;
-            } while (cur && cur->free);
-
-            LOG_FATAL_IF(!freed->free,
-                "freed block at offset 0x%08lX of size 0x%08lX is not free!",
-                freed->start * kMemoryAlign, freed->size * kMemoryAlign);
+    // allocated chunks always start on a page boundary
+    size_t pagesize = getpagesize();
+    if (start & (pagesize-1)) {
+        return 0;
+    }
+    const size_t page = start / pagesize;
+    if (page >= mNumPages || mAllocated[page] == 0) {
+        return 0;
+    }
 
-            return freed;
-        }
-        cur = cur->next;
+    chunk_t* cur = mAllocated[page];
+    mAllocated[page] = 0;
+    LOG_FATAL_IF(cur->free,
+        "block at offset 0x%08lX of size 0x%08lX already freed",
+        cur->start*kMemoryAlign, cur->size*kMemoryAlign);
+
+    // merge freed blocks together
+    chunk_t* freed = cur;
+    cur->free = 1;
+    chunk_t* const p = cur->prev;
+    if (p && p->free) {
+        removeFree(p);
+        p->size += cur->size;
+        mList.remove(cur);
+        delete cur;
+        freed = p;
     }
-    return 0;
+    chunk_t* const n = freed->next;
+    if (n && n->free) {
+        removeFree(n);
+        freed->size += n->size;
+        mList.remove(n);
+        delete n;
+    }
+    insertFree(freed);
+
+    LOG_FATAL_IF(!freed->free,
+        "freed block at offset 0x%08lX of size 0x%08lX is not free!",
+        freed->start * kMemoryAlign, freed->size * kMemoryAlign);
+
+    return freed;
 }
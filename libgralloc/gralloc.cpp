@@ -21,6 +21,7 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -46,11 +47,92 @@
 #define ALLOCATORREGION_RESERVED_SIZE           (1200<<10)
 #define FB_ARENA                                HW3D_EBI
 
+// how long a GPU allocation waits for a dying process's surfaces to go away
+#define GPU_ALLOC_TIMEOUT_MS                    5000
+
 
 
 static SimpleBestFitAllocator sAllocator;
 static SimpleBestFitAllocator sAllocatorGPU(ALLOCATORREGION_RESERVED_SIZE);
 
+// sGPUFreed is signaled every time GPU memory is released
+static pthread_mutex_t sGPULock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sGPUFreed = PTHREAD_COND_INITIALIZER;
+
+// the deadline is on CLOCK_MONOTONIC, so that setting the wall clock can't
+// cut the wait short or make it last for ever
+#ifdef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC
+static void gpu_init_cond() { }
+
+static int gpu_wait(const struct timespec* deadline)
+{
+    return pthread_cond_timedwait_monotonic_np(&sGPUFreed, &sGPULock,
+            deadline);
+}
+#else
+static pthread_once_t sGPUFreedOnce = PTHREAD_ONCE_INIT;
+
+static void gpu_init_cond_once()
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sGPUFreed, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void gpu_init_cond()
+{
+    pthread_once(&sGPUFreedOnce, gpu_init_cond_once);
+}
+
+static int gpu_wait(const struct timespec* deadline)
+{
+    return pthread_cond_timedwait(&sGPUFreed, &sGPULock, deadline);
+}
+#endif
+
+static ssize_t gpu_allocate(size_t size)
+{
+    ssize_t offset;
+    if (size > sAllocatorGPU.size()) {
+        // this will never fit, don't bother waiting
+        return -ENOMEM;
+    }
+
+    gpu_init_cond();
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += GPU_ALLOC_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (GPU_ALLOC_TIMEOUT_MS % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&sGPULock);
+    while ((offset = sAllocatorGPU.allocate(size)) < 0) {
+        LOGW("%d KiB allocation failed in GPU memory, waiting...",
+                size/1024);
+        if (gpu_wait(&deadline) == ETIMEDOUT) {
+            // one last try, in case we timed out as memory came back
+            offset = sAllocatorGPU.allocate(size);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sGPULock);
+    return offset;
+}
+
+static void gpu_deallocate(size_t offset)
+{
+    gpu_init_cond();
+    pthread_mutex_lock(&sGPULock);
+    sAllocatorGPU.deallocate(offset);
+    pthread_cond_broadcast(&sGPUFreed);
+    pthread_mutex_unlock(&sGPULock);
+}
+
 /*****************************************************************************/
 
 struct gralloc_context_t {
@@ -402,26 +484,20 @@ try_ashmem:
 
             // When a process holding GPU surfaces gets killed, it may take
             // up to a few seconds until SurfaceFlinger is notified and can
-            // release the memory. So it's useful to wait a little bit here.
-            long sleeptime = 0;
-            int retry = 8; // roughly 5 seconds
-            do {
-                offset = sAllocatorGPU.allocate(size);
-                if (offset < 0) {
-                    // no more pmem memory
-                    LOGW("%d KiB allocation failed in GPU memory, retrying...",
-                            size/1024);
-                    err = -ENOMEM;
-                    sleeptime += 250000;
-                    usleep(sleeptime);
-                } else {
-                    LOGD("allocating GPU size=%d, offset=%d", size, offset);
-                    fd = open("/dev/null", O_RDONLY); // just so marshalling doesn't fail
-                    gpu_fd = m->gpu;
-                    memset((char*)base + offset, 0, size);
-                    err = 0;
-                }
-            } while ((err == -ENOMEM) && (retry-- > 0));
+            // release the memory. So we wait for memory to be freed, up to
+            // GPU_ALLOC_TIMEOUT_MS.
+            offset = gpu_allocate(size);
+            if (offset < 0) {
+                // no more pmem memory
+                LOGE("%d KiB allocation failed in GPU memory", size/1024);
+                err = -ENOMEM;
+            } else {
+                LOGD("allocating GPU size=%d, offset=%d", size, offset);
+                fd = open("/dev/null", O_RDONLY); // just so marshalling doesn't fail
+                gpu_fd = m->gpu;
+                memset((char*)base + offset, 0, size);
+                err = 0;
+            }
 
         } else {
             // not enough memory, try ashmem
@@ -546,7 +622,7 @@ static int gralloc_free(alloc_device_t* dev,
             }
         } else if (hnd->flags & private_handle_t::PRIV_FLAGS_USES_GPU) {
             LOGD("freeing GPU buffer at %d", hnd->offset);
-            sAllocatorGPU.deallocate(hnd->offset);
+            gpu_deallocate(hnd->offset);
         }
 
         gralloc_module_t* module = reinterpret_cast<gralloc_module_t*>(
@@ -0,0 +1,23 @@
+LOCAL_PATH:= $(call my-dir)
+
+# One shared collector per process, so that every HAL loaded into it records
+# into the same rings.
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= haltrace.c
+LOCAL_CFLAGS:= -fno-short-enums
+LOCAL_COPY_HEADERS_TO:= libhaltrace
+LOCAL_COPY_HEADERS:= haltrace.h
+LOCAL_SHARED_LIBRARIES:= liblog libcutils
+LOCAL_MODULE:= libhaltrace
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_SHARED_LIBRARY)
+
+# For the host builds of librpc and gralloc and their tests.
+ifeq ($(HOST_OS),linux)
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= haltrace.c
+LOCAL_CFLAGS:= -fno-short-enums
+LOCAL_MODULE:= libhaltrace_host
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_STATIC_LIBRARY)
+endif
@@ -0,0 +1,446 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "haltrace"
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "haltrace.h"
+
+#define HALTRACE_RING_MASK (HALTRACE_RING_EVENTS - 1)
+
+enum haltrace_type {
+    HALTRACE_TYPE_BEGIN,
+    HALTRACE_TYPE_END,
+    HALTRACE_TYPE_ASYNC_BEGIN,
+    HALTRACE_TYPE_ASYNC_END,
+    HALTRACE_TYPE_INSTANT,
+};
+
+/* The trace event format phase of each type. */
+static const char haltrace_phase[] = { 'B', 'E', 'b', 'e', 'i' };
+
+struct haltrace_event {
+    uint64_t ts_ns;
+    const char *cat;
+    const char *name;
+    uint32_t id;
+    uint32_t args[2];
+    uint16_t type;
+    uint16_t nargs;
+};
+
+/* Only the owning thread writes events and head; head counts every event
+   ever recorded, and the event at head is published by the release store
+   that moves head past it.  A dump copies the events without a lock and then
+   drops any that the owner may have overwritten while they were copied.
+   Events before base were dropped by a reset.  The other fields are
+   changed only under the registry lock. */
+struct haltrace_ring {
+    volatile int32_t head;
+    int32_t base;
+    pid_t tid;
+    char name[16];
+    int exited;         /* free to be taken over by a new thread */
+    struct haltrace_event events[HALTRACE_RING_EVENTS];
+};
+
+volatile int haltrace_enabled;
+
+/* The registry lock is taken when a thread records its first event, when a
+   thread exits and by dumps, never while an event is recorded. */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct haltrace_ring *rings[HALTRACE_MAX_THREADS];
+static int num_rings;
+static int dropped_threads;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static pid_t haltrace_gettid(void)
+{
+    return (pid_t)syscall(__NR_gettid);
+}
+
+int haltrace_update(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("debug.haltrace.enable", value, "0");
+    haltrace_enabled = atoi(value) != 0;
+    return haltrace_enabled;
+}
+
+static void __attribute__((constructor)) haltrace_init(void)
+{
+    haltrace_update();
+    if (haltrace_enabled)
+        LOGI("tracing enabled in %d", getpid());
+}
+
+static void ring_release(void *arg)
+{
+    struct haltrace_ring *ring = (struct haltrace_ring *)arg;
+
+    /* The events stay until a new thread takes the ring over. */
+    pthread_mutex_lock(&registry_lock);
+    ring->exited = 1;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void ring_key_create(void)
+{
+    pthread_key_create(&ring_key, ring_release);
+}
+
+static struct haltrace_ring *ring_get(void)
+{
+    struct haltrace_ring *ring;
+    int i;
+
+    pthread_once(&ring_key_once, ring_key_create);
+    ring = (struct haltrace_ring *)pthread_getspecific(ring_key);
+    if (ring)
+        return ring;
+
+    /* The events of exited threads are kept for as long as there is room
+       for new rings. */
+    pthread_mutex_lock(&registry_lock);
+    if (num_rings < HALTRACE_MAX_THREADS) {
+        ring = (struct haltrace_ring *)calloc(1, sizeof(*ring));
+        if (ring)
+            rings[num_rings++] = ring;
+    }
+    for (i = 0; !ring && i < num_rings; i++) {
+        if (rings[i]->exited) {
+            ring = rings[i];
+            ring->head = 0;
+            ring->base = 0;
+        }
+    }
+    if (ring) {
+        ring->tid = haltrace_gettid();
+        ring->exited = 0;
+        memset(ring->name, 0, sizeof(ring->name));
+        prctl(PR_GET_NAME, (unsigned long)ring->name, 0, 0, 0);
+        ring->name[sizeof(ring->name) - 1] = '\0';
+    } else if (dropped_threads++ == 0) {
+        LOGW("more than %d threads traced, dropping events",
+             HALTRACE_MAX_THREADS);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (ring)
+        pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+static void haltrace_record(enum haltrace_type type, const char *cat,
+                            const char *name, uint32_t id, int nargs,
+                            uint32_t arg0, uint32_t arg1)
+{
+    struct haltrace_ring *ring = ring_get();
+    struct haltrace_event *event;
+    struct timespec ts;
+    int32_t head;
+
+    if (!ring)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    head = ring->head;
+    event = &ring->events[head & HALTRACE_RING_MASK];
+    event->ts_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    event->cat = cat;
+    event->name = name;
+    event->id = id;
+    event->args[0] = arg0;
+    event->args[1] = arg1;
+    event->type = type;
+    event->nargs = nargs;
+    android_atomic_release_store(head + 1, &ring->head);
+}
+
+void haltrace_begin(const char *cat, const char *name)
+{
+    haltrace_record(HALTRACE_TYPE_BEGIN, cat, name, 0, 0, 0, 0);
+}
+
+void haltrace_begin_args(const char *cat, const char *name,
+                         uint32_t arg0, uint32_t arg1)
+{
+    haltrace_record(HALTRACE_TYPE_BEGIN, cat, name, 0, 2, arg0, arg1);
+}
+
+void haltrace_end(const char *cat, const char *name)
+{
+    haltrace_record(HALTRACE_TYPE_END, cat, name, 0, 0, 0, 0);
+}
+
+void haltrace_async_begin(const char *cat, const char *name, uint32_t id)
+{
+    haltrace_record(HALTRACE_TYPE_ASYNC_BEGIN, cat, name, id, 0, 0, 0);
+}
+
+void haltrace_async_end(const char *cat, const char *name, uint32_t id)
+{
+    haltrace_record(HALTRACE_TYPE_ASYNC_END, cat, name, id, 0, 0, 0);
+}
+
+void haltrace_instant(const char *cat, const char *name)
+{
+    haltrace_record(HALTRACE_TYPE_INSTANT, cat, name, 0, 0, 0, 0);
+}
+
+/* Output is gathered in a buffer and written out a block at a time. */
+struct dump_buf {
+    int fd;
+    int error;
+    int first;
+    size_t len;
+    char data[4096];
+};
+
+static void dump_flush(struct dump_buf *buf)
+{
+    size_t off = 0;
+
+    while (off < buf->len && !buf->error) {
+        ssize_t n = write(buf->fd, buf->data + off, buf->len - off);
+        if (n < 0) {
+            if (errno != EINTR)
+                buf->error = -errno;
+            continue;
+        }
+        off += n;
+    }
+    buf->len = 0;
+}
+
+static void dump_printf(struct dump_buf *buf, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void dump_printf(struct dump_buf *buf, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (buf->len > sizeof(buf->data) - 512)
+        dump_flush(buf);
+    va_start(ap, fmt);
+    n = vsnprintf(buf->data + buf->len, sizeof(buf->data) - buf->len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        buf->len += (size_t)n < sizeof(buf->data) - buf->len ?
+                    (size_t)n : sizeof(buf->data) - buf->len - 1;
+}
+
+/* Names are literals from our own code, but keep the output valid JSON
+   whatever they hold. */
+static void dump_string(struct dump_buf *buf, const char *s)
+{
+    char out[128];
+    size_t n = 0;
+
+    for (; s && *s && n < sizeof(out) - 2; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = c;
+        } else if (c >= 0x20 && c < 0x7f) {
+            out[n++] = c;
+        }
+    }
+    out[n] = '\0';
+    dump_printf(buf, "\"%s\"", out);
+}
+
+static void dump_separator(struct dump_buf *buf)
+{
+    dump_printf(buf, buf->first ? "\n" : ",\n");
+    buf->first = 0;
+}
+
+static void dump_ring(struct dump_buf *buf, pid_t pid,
+                      struct haltrace_ring *ring,
+                      struct haltrace_event *copy)
+{
+    int32_t head, start, end, i;
+
+    head = android_atomic_acquire_load(&ring->head);
+    start = head - HALTRACE_RING_EVENTS;
+    if (start < ring->base)
+        start = ring->base;
+    for (i = start; i < head; i++)
+        copy[i & HALTRACE_RING_MASK] = ring->events[i & HALTRACE_RING_MASK];
+
+    /* While we copied, the owner may have gone on to write the events up to
+       and including the one at the new head, over the slots of the oldest
+       ones; only the events after those can be trusted. */
+    __sync_synchronize();
+    end = android_atomic_acquire_load(&ring->head);
+    if (end - HALTRACE_RING_EVENTS + 1 > start)
+        start = end - HALTRACE_RING_EVENTS + 1;
+
+    dump_separator(buf);
+    dump_printf(buf, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":", (int)pid, (int)ring->tid);
+    dump_string(buf, ring->name);
+    dump_printf(buf, "}}");
+
+    for (i = start; i < head; i++) {
+        struct haltrace_event *event = &copy[i & HALTRACE_RING_MASK];
+
+        dump_separator(buf);
+        dump_printf(buf, "{\"ph\":\"%c\",\"cat\":",
+                    haltrace_phase[event->type]);
+        dump_string(buf, event->cat);
+        dump_printf(buf, ",\"name\":");
+        dump_string(buf, event->name);
+        dump_printf(buf, ",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d",
+                    (unsigned long long)(event->ts_ns / 1000),
+                    (unsigned)(event->ts_ns % 1000), (int)pid,
+                    (int)ring->tid);
+        if (event->type == HALTRACE_TYPE_ASYNC_BEGIN ||
+            event->type == HALTRACE_TYPE_ASYNC_END)
+            dump_printf(buf, ",\"id\":\"0x%x\"", event->id);
+        else if (event->type == HALTRACE_TYPE_INSTANT)
+            dump_printf(buf, ",\"s\":\"t\"");
+        if (event->nargs)
+            dump_printf(buf, ",\"args\":{\"arg0\":\"0x%x\",\"arg1\":\"0x%x\"}",
+                        event->args[0], event->args[1]);
+        dump_printf(buf, "}");
+    }
+}
+
+int haltrace_dump(int fd)
+{
+    struct dump_buf *buf;
+    struct haltrace_event *copy;
+    pid_t pid = getpid();
+    char cmdline[64];
+    int cfd, i, ret;
+
+    buf = (struct dump_buf *)malloc(sizeof(*buf));
+    copy = (struct haltrace_event *)malloc(sizeof(*copy) *
+                                           HALTRACE_RING_EVENTS);
+    if (!buf || !copy) {
+        free(buf);
+        free(copy);
+        return -ENOMEM;
+    }
+    buf->fd = fd;
+    buf->error = 0;
+    buf->first = 1;
+    buf->len = 0;
+
+    memset(cmdline, 0, sizeof(cmdline));
+    cfd = open("/proc/self/cmdline", O_RDONLY);
+    if (cfd >= 0) {
+        if (read(cfd, cmdline, sizeof(cmdline) - 1) < 0)
+            cmdline[0] = '\0';
+        close(cfd);
+    }
+
+    dump_printf(buf, "{\"traceEvents\":[");
+    dump_separator(buf);
+    dump_printf(buf, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+                "\"args\":{\"name\":", (int)pid);
+    dump_string(buf, cmdline);
+    dump_printf(buf, "}}");
+
+    pthread_mutex_lock(&registry_lock);
+    for (i = 0; i < num_rings; i++)
+        dump_ring(buf, pid, rings[i], copy);
+    pthread_mutex_unlock(&registry_lock);
+
+    dump_printf(buf, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    dump_flush(buf);
+    ret = buf->error;
+
+    free(buf);
+    free(copy);
+    return ret;
+}
+
+int haltrace_dump_file(char *path, size_t len)
+{
+    char dir[PROPERTY_VALUE_MAX];
+    char name[PROPERTY_VALUE_MAX + 32];
+    int fd, ret;
+
+    if (property_get("debug.haltrace.dir", dir, NULL) <= 0)
+        return -ENOENT;
+    snprintf(name, sizeof(name), "%s/haltrace-%d.json", dir, (int)getpid());
+    if (path && len) {
+        strncpy(path, name, len - 1);
+        path[len - 1] = '\0';
+    }
+
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ret = -errno;
+        LOGE("cannot open %s: %s", name, strerror(errno));
+        return ret;
+    }
+    ret = haltrace_dump(fd);
+    close(fd);
+    if (ret < 0)
+        LOGE("cannot write %s: %s", name, strerror(-ret));
+    return ret;
+}
+
+void haltrace_dumpsys(int fd)
+{
+    static const char header[] = "haltrace:\n";
+    char line[PROPERTY_VALUE_MAX + 64];
+    char path[PROPERTY_VALUE_MAX + 32];
+    int n;
+
+    if (!haltrace_update())
+        return;
+    if (haltrace_dump_file(path, sizeof(path)) == 0) {
+        n = snprintf(line, sizeof(line), "trace written to %s\n", path);
+        write(fd, line, n);
+        return;
+    }
+    write(fd, header, sizeof(header) - 1);
+    haltrace_dump(fd);
+}
+
+void haltrace_reset(void)
+{
+    int i;
+
+    pthread_mutex_lock(&registry_lock);
+    for (i = 0; i < num_rings; i++)
+        rings[i]->base = android_atomic_acquire_load(&rings[i]->head);
+    pthread_mutex_unlock(&registry_lock);
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * haltrace.h - Begin/end trace points shared by the MSM HALs.
+ *
+ * The audio HALs, the camera, gralloc, copybit and librpc record into the
+ * same collector, so one camera capture can be followed across camera, RPC,
+ * pmem and blit in a single timeline.  Tracing is on while the
+ * debug.haltrace.enable property is 1; it is read when the library is loaded
+ * and again by haltrace_update(), which the HALs call from their dump hooks.
+ * While off, a trace point costs one load and one branch.
+ *
+ * Every thread records into a ring of its own, so recording takes no lock;
+ * when a ring is full its oldest events are overwritten.  Timestamps come
+ * from CLOCK_MONOTONIC, and traces dumped from different processes can be
+ * merged.  A dump is a JSON object in the trace event format read by
+ * chrome://tracing and systrace.
+ *
+ * The category and name of an event are kept as pointers until the event is
+ * dumped: they must be string literals or otherwise never freed.
+ */
+
+#ifndef _LIBHALTRACE_HALTRACE_H
+#define _LIBHALTRACE_HALTRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Events kept per thread; this must be a power of two. */
+#define HALTRACE_RING_EVENTS 2048
+
+/* Most threads traced at once; the rings of threads that exited are reused. */
+#define HALTRACE_MAX_THREADS 64
+
+/* Nonzero while tracing is on; test it through HALTRACE_ENABLED(). */
+extern volatile int haltrace_enabled;
+
+#define HALTRACE_ENABLED() (haltrace_enabled != 0)
+
+/* A span that begins and ends on the calling thread. */
+extern void haltrace_begin(const char *cat, const char *name);
+extern void haltrace_end(const char *cat, const char *name);
+
+/* haltrace_begin(), with two numbers shown as the arguments of the span:
+   the program and procedure of an RPC call, the size of a buffer... */
+extern void haltrace_begin_args(const char *cat, const char *name,
+                                uint32_t arg0, uint32_t arg1);
+
+/* A span that may begin and end on different threads; the begin and end of
+   one span are paired by cat, name and id. */
+extern void haltrace_async_begin(const char *cat, const char *name,
+                                 uint32_t id);
+extern void haltrace_async_end(const char *cat, const char *name,
+                               uint32_t id);
+
+/* A point event on the calling thread. */
+extern void haltrace_instant(const char *cat, const char *name);
+
+/* Re-read debug.haltrace.enable; returns nonzero if tracing is now on. */
+extern int haltrace_update(void);
+
+/* Write every event still held to fd.  Returns 0, or a negative errno if
+   writing failed. */
+extern int haltrace_dump(int fd);
+
+/* Like haltrace_dump(), into haltrace-<pid>.json in debug.haltrace.dir.  If
+   path is not NULL the name of the file is copied into it.  Returns -ENOENT
+   if the property is not set.  The directory must be writable by the
+   calling process: mediaserver runs as media, surfaceflinger as system. */
+extern int haltrace_dump_file(char *path, size_t len);
+
+/* For the dump() hooks that get the dumpsys fd: re-reads the enable
+   property and, if tracing is on, writes the trace to debug.haltrace.dir
+   when it is set and to fd, after a "haltrace:" line, otherwise. */
+extern void haltrace_dumpsys(int fd);
+
+/* Drop every event held. */
+extern void haltrace_reset(void);
+
+/* A span in C. Tracing may be switched on or off between the begin and the
+   end, so the begin latches whether it was recorded into traced, an int
+   of the caller's, and the end is recorded only if it was:
+
+       int traced;
+       HALTRACE_BEGIN_LATCH(traced, "rpc", "call");
+       ...
+       HALTRACE_END_IF(traced, "rpc", "call");
+
+   C++ uses HALTRACE_SCOPE() instead. */
+#define HALTRACE_BEGIN_LATCH(traced, cat, name) do { \
+        (traced) = HALTRACE_ENABLED(); \
+        if (traced) haltrace_begin(cat, name); \
+    } while (0)
+
+#define HALTRACE_BEGIN_ARGS_LATCH(traced, cat, name, arg0, arg1) do { \
+        (traced) = HALTRACE_ENABLED(); \
+        if (traced) haltrace_begin_args(cat, name, arg0, arg1); \
+    } while (0)
+
+#define HALTRACE_END_IF(traced, cat, name) do { \
+        if (traced) haltrace_end(cat, name); \
+    } while (0)
+
+#define HALTRACE_ASYNC_BEGIN(cat, name, id) do { \
+        if (HALTRACE_ENABLED()) haltrace_async_begin(cat, name, id); \
+    } while (0)
+
+#define HALTRACE_ASYNC_END(cat, name, id) do { \
+        if (HALTRACE_ENABLED()) haltrace_async_end(cat, name, id); \
+    } while (0)
+
+#define HALTRACE_INSTANT(cat, name) do { \
+        if (HALTRACE_ENABLED()) haltrace_instant(cat, name); \
+    } while (0)
+
+#ifdef __cplusplus
+}
+
+/* Traces the enclosing scope; the end is recorded only if the begin was. */
+class HalTraceScope {
+public:
+    HalTraceScope(const char *cat, const char *name)
+        : mCat(cat), mName(name), mTraced(HALTRACE_ENABLED()) {
+        if (mTraced)
+            haltrace_begin(mCat, mName);
+    }
+    HalTraceScope(const char *cat, const char *name,
+                  uint32_t arg0, uint32_t arg1)
+        : mCat(cat), mName(name), mTraced(HALTRACE_ENABLED()) {
+        if (mTraced)
+            haltrace_begin_args(mCat, mName, arg0, arg1);
+    }
+    ~HalTraceScope() {
+        if (mTraced)
+            haltrace_end(mCat, mName);
+    }
+private:
+    HalTraceScope(const HalTraceScope&);
+    HalTraceScope& operator=(const HalTraceScope&);
+
+    const char *mCat;
+    const char *mName;
+    bool mTraced;
+};
+
+#define HALTRACE_SCOPE_CONCAT2(a, b) a##b
+#define HALTRACE_SCOPE_CONCAT(a, b) HALTRACE_SCOPE_CONCAT2(a, b)
+#define HALTRACE_SCOPE(cat, name) \
+    HalTraceScope HALTRACE_SCOPE_CONCAT(_haltrace_scope_, __LINE__)(cat, name)
+#define HALTRACE_SCOPE_ARGS(cat, name, arg0, arg1) \
+    HalTraceScope HALTRACE_SCOPE_CONCAT(_haltrace_scope_, __LINE__)( \
+            cat, name, arg0, arg1)
+#endif
+
+#endif /* _LIBHALTRACE_HALTRACE_H */
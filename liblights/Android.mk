@@ -20,6 +20,8 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := lights.c
 
+LOCAL_COPY_HEADERS_TO := liblights
+LOCAL_COPY_HEADERS := lights_msm.h
 
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 
@@ -26,12 +26,15 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
 
 #include <hardware/lights.h>
 
+#include "lights_msm.h"
+
 /******************************************************************************/
 
 static pthread_once_t g_init = PTHREAD_ONCE_INIT;
@@ -45,6 +48,42 @@ static int g_buttons = 0;
 static int g_attention = 0;
 static int g_haveAmberLed = 0;
 
+/*
+ * The sysfs files we write stay open. Brightness-only lights are written
+ * by g_writer, which applies only the latest value of each light, at most
+ * once every MIN_WRITE_INTERVAL_MS, and skips values that are already set:
+ * the framework sends dozens of backlight updates per second during
+ * auto-brightness ramps. The LED files are still written synchronously
+ * and every time, since some drivers reset blinking when the brightness
+ * is written.
+ */
+#define MAX_SYSFS_FILES         16
+#define MIN_WRITE_INTERVAL_MS   20
+
+struct sysfs_file {
+    char const* path;
+    int fd;         // -1 if not open (yet)
+    int value;      // last value written, -1 if unknown
+    int pending;    // value waiting for g_writer, -1 if none
+    int deferred;   // only written by g_writer
+
+    // software ramp run by g_writer, if rampEnd isn't 0
+    int rampFrom;
+    int rampTo;
+    int64_t rampStart;
+    int64_t rampEnd;
+};
+
+// protected by g_lock, except for the fd and value of deferred files
+// which only g_writer touches
+static struct sysfs_file g_files[MAX_SYSFS_FILES];
+static int g_numFiles = 0;
+static int g_numPending = 0;
+static pthread_cond_t g_pendingCond = PTHREAD_COND_INITIALIZER;
+static pthread_t g_writer;
+static int g_haveWriter = 0;
+static int g_backlightRampFd = -1;
+
 char const*const TRACKBALL_FILE
         = "/sys/class/leds/jogball-backlight/brightness";
 
@@ -63,6 +102,10 @@ char const*const AMBER_LED_FILE
 char const*const LCD_FILE
         = "/sys/class/leds/lcd-backlight/brightness";
 
+/* takes "<brightness> <ms>" and fades in the PWM controller */
+char const*const LCD_RAMP_FILE
+        = "/sys/class/leds/lcd-backlight/brightness_ramp";
+
 char const*const RED_FREQ_FILE
         = "/sys/class/leds/red/device/grpfreq";
 
@@ -85,6 +128,8 @@ char const*const BUTTON_FILE
  * device methods
  */
 
+static void* writer_thread(void* arg);
+
 void init_globals(void)
 {
     // init the mutex
@@ -96,28 +141,270 @@ void init_globals(void)
     /* figure out if we have the amber LED or not.
        If yes, just support green and amber.         */
     g_haveAmberLed = (access(AMBER_LED_FILE, W_OK) == 0) ? 1 : 0;
+
+    // the kernel can fade the backlight by itself; without it g_writer
+    // steps the brightness instead
+    g_backlightRampFd = open(LCD_RAMP_FILE, O_WRONLY);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&g_writer, &attr, writer_thread, NULL) == 0) {
+        g_haveWriter = 1;
+    } else {
+        LOGE("cannot start the lights writer, writing synchronously");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static struct sysfs_file*
+get_file_locked(char const* path)
+{
+    int i;
+    for (i = 0; i < g_numFiles; i++) {
+        if (g_files[i].path == path || !strcmp(g_files[i].path, path)) {
+            return &g_files[i];
+        }
+    }
+    if (g_numFiles == MAX_SYSFS_FILES) {
+        return NULL;
+    }
+    struct sysfs_file* file = &g_files[g_numFiles++];
+    file->path = path;
+    file->fd = -1;
+    file->value = -1;
+    file->pending = -1;
+    file->deferred = 0;
+    file->rampEnd = 0;
+    return file;
 }
 
 static int
-write_int(char const* path, int value)
+write_file(struct sysfs_file* file, int value)
 {
-    int fd;
     static int already_warned = 0;
 
-    fd = open(path, O_RDWR);
-    if (fd >= 0) {
-        char buffer[20];
-        int bytes = sprintf(buffer, "%d\n", value);
-        int amt = write(fd, buffer, bytes);
-        close(fd);
-        return amt == -1 ? -errno : 0;
-    } else {
-        if (already_warned == 0) {
-            LOGE("write_int failed to open %s\n", path);
-            already_warned = 1;
+    if (file->deferred && file->fd >= 0 && file->value == value) {
+        return 0;
+    }
+    if (file->fd < 0) {
+        file->fd = open(file->path, O_RDWR);
+        if (file->fd < 0) {
+            if (already_warned == 0) {
+                LOGE("write_int failed to open %s\n", file->path);
+                already_warned = 1;
+            }
+            return -errno;
+        }
+    }
+
+    char buffer[20];
+    int bytes = sprintf(buffer, "%d\n", value);
+    int amt = pwrite(file->fd, buffer, bytes, 0);
+    if (amt == -1) {
+        int err = -errno;
+        // start over with a fresh fd next time
+        close(file->fd);
+        file->fd = -1;
+        file->value = -1;
+        return err;
+    }
+    file->value = value;
+    return 0;
+}
+
+static int
+write_int(char const* path, int value)
+{
+    struct sysfs_file* file = get_file_locked(path);
+    if (file == NULL) {
+        LOGE("too many sysfs files, can't write %s", path);
+        return -ENOMEM;
+    }
+    return write_file(file, value);
+}
+
+static void
+queue_locked(struct sysfs_file* file, int value)
+{
+    file->deferred = 1;
+    if (file->pending < 0) {
+        g_numPending++;
+        pthread_cond_signal(&g_pendingCond);
+    }
+    file->pending = value;
+}
+
+/** queue value for g_writer, only the latest value queued is written */
+static int
+write_int_deferred(char const* path, int value)
+{
+    if (!g_haveWriter) {
+        return write_int(path, value);
+    }
+    struct sysfs_file* file = get_file_locked(path);
+    if (file == NULL) {
+        LOGE("too many sysfs files, can't write %s", path);
+        return -ENOMEM;
+    }
+    // a new value overrides any fade in progress
+    file->rampEnd = 0;
+    queue_locked(file, value);
+    return 0;
+}
+
+static int64_t
+now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/** fade path from its current value to value over durationMs */
+static int
+ramp_int_deferred(char const* path, int value, int durationMs)
+{
+    if (!g_haveWriter || durationMs <= 0) {
+        return write_int_deferred(path, value);
+    }
+    struct sysfs_file* file = get_file_locked(path);
+    if (file == NULL) {
+        LOGE("too many sysfs files, can't write %s", path);
+        return -ENOMEM;
+    }
+    int from = (file->pending >= 0) ? file->pending : file->value;
+    if (file->rampEnd) {
+        // start from wherever the current fade got to
+        from = file->rampFrom + (int)((int64_t)(file->rampTo - file->rampFrom) *
+                (now_ms() - file->rampStart) /
+                (file->rampEnd - file->rampStart));
+    }
+    if (from < 0 || from == value) {
+        return write_int_deferred(path, value);
+    }
+    file->deferred = 1;
+    file->rampFrom = from;
+    file->rampTo = value;
+    file->rampStart = now_ms();
+    file->rampEnd = file->rampStart + durationMs;
+    pthread_cond_signal(&g_pendingCond);
+    return 0;
+}
+
+/**
+ * Queue the current value of every fade and return when the next one
+ * changes by a step, -1 if no fade is running. Fades never step more
+ * often than MIN_WRITE_INTERVAL_MS.
+ */
+static int64_t
+step_ramps_locked(int64_t now)
+{
+    int64_t next = -1;
+    int i;
+    for (i = 0; i < g_numFiles; i++) {
+        struct sysfs_file* file = &g_files[i];
+        if (!file->rampEnd) {
+            continue;
+        }
+        int value;
+        if (now >= file->rampEnd) {
+            value = file->rampTo;
+            file->rampEnd = 0;
+        } else {
+            int64_t duration = file->rampEnd - file->rampStart;
+            int delta = file->rampTo - file->rampFrom;
+            value = file->rampFrom +
+                    (int)((int64_t)delta * (now - file->rampStart) / duration);
+            int64_t step = duration / (delta < 0 ? -delta : delta);
+            if (step < MIN_WRITE_INTERVAL_MS) {
+                step = MIN_WRITE_INTERVAL_MS;
+            }
+            int64_t when = now + step;
+            if (when > file->rampEnd) {
+                when = file->rampEnd;
+            }
+            if (next < 0 || when < next) {
+                next = when;
+            }
+        }
+        if (value != file->value) {
+            queue_locked(file, value);
         }
-        return -errno;
     }
+    return next;
+}
+
+/** wait on g_pendingCond until now_ms() reaches when, at the latest */
+static void
+wait_until_locked(int64_t when)
+{
+#ifdef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC
+    struct timespec ts;
+    ts.tv_sec = when / 1000;
+    ts.tv_nsec = (when % 1000) * 1000000;
+    pthread_cond_timedwait_monotonic_np(&g_pendingCond, &g_lock, &ts);
+#else
+    // the condition uses CLOCK_REALTIME
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t ns = ts.tv_nsec + (when - now_ms()) * 1000000;
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    pthread_cond_timedwait(&g_pendingCond, &g_lock, &ts);
+#endif
+}
+
+static void*
+writer_thread(void* arg)
+{
+    struct sysfs_file* files[MAX_SYSFS_FILES];
+    int values[MAX_SYSFS_FILES];
+    int64_t last = 0;
+    int i, count;
+
+    pthread_mutex_lock(&g_lock);
+    for (;;) {
+        int64_t next = step_ramps_locked(now_ms());
+        if (g_numPending == 0) {
+            if (next < 0) {
+                pthread_cond_wait(&g_pendingCond, &g_lock);
+            } else {
+                wait_until_locked(next);
+            }
+            continue;
+        }
+
+        int64_t wait = last + MIN_WRITE_INTERVAL_MS - now_ms();
+        if (wait > 0) {
+            // let more updates pile up, only the last one is written
+            pthread_mutex_unlock(&g_lock);
+            usleep(wait * 1000);
+            pthread_mutex_lock(&g_lock);
+        }
+
+        count = 0;
+        for (i = 0; i < g_numFiles; i++) {
+            if (g_files[i].pending >= 0) {
+                files[count] = &g_files[i];
+                values[count] = g_files[i].pending;
+                g_files[i].pending = -1;
+                count++;
+            }
+        }
+        g_numPending = 0;
+
+        pthread_mutex_unlock(&g_lock);
+        for (i = 0; i < count; i++) {
+            int err = write_file(files[i], values[i]);
+            LOGE_IF(err, "cannot write %d to %s (%s)", values[i],
+                    files[i]->path, strerror(-err));
+        }
+        last = now_ms();
+        pthread_mutex_lock(&g_lock);
+    }
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
 }
 
 static int
@@ -162,7 +449,40 @@ set_light_backlight(struct light_device_t* dev,
     int brightness = rgb_to_brightness(state);
     pthread_mutex_lock(&g_lock);
     g_backlight = brightness;
-    err = write_int(LCD_FILE, brightness);
+    err = write_int_deferred(LCD_FILE, brightness);
+    if (g_haveTrackballLight) {
+        handle_trackball_light_locked(dev);
+    }
+    pthread_mutex_unlock(&g_lock);
+    return err;
+}
+
+static int
+set_light_backlight_ramp(struct light_device_t* dev,
+        struct light_state_t const* state, int durationMs)
+{
+    int err = 0;
+    int brightness = rgb_to_brightness(state);
+    pthread_mutex_lock(&g_lock);
+    g_backlight = brightness;
+    if (g_backlightRampFd >= 0 && durationMs > 0) {
+        struct sysfs_file* file = get_file_locked(LCD_FILE);
+        if (file) {
+            // cancel our own fade, and forget the value the kernel is
+            // about to change
+            file->rampEnd = 0;
+            file->pending = -1;
+            file->value = -1;
+        }
+        char buffer[32];
+        int bytes = sprintf(buffer, "%d %d\n", brightness, durationMs);
+        if (pwrite(g_backlightRampFd, buffer, bytes, 0) == -1) {
+            LOGE("cannot ramp the backlight (%s)", strerror(errno));
+            err = ramp_int_deferred(LCD_FILE, brightness, durationMs);
+        }
+    } else {
+        err = ramp_int_deferred(LCD_FILE, brightness, durationMs);
+    }
     if (g_haveTrackballLight) {
         handle_trackball_light_locked(dev);
     }
@@ -177,7 +497,7 @@ set_light_keyboard(struct light_device_t* dev,
     int err = 0;
     int on = is_lit(state);
     pthread_mutex_lock(&g_lock);
-    err = write_int(KEYBOARD_FILE, on?255:0);
+    err = write_int_deferred(KEYBOARD_FILE, on?255:0);
     pthread_mutex_unlock(&g_lock);
     return err;
 }
@@ -190,7 +510,7 @@ set_light_buttons(struct light_device_t* dev,
     int on = is_lit(state);
     pthread_mutex_lock(&g_lock);
     g_buttons = on;
-    err = write_int(BUTTON_FILE, on?255:0);
+    err = write_int_deferred(BUTTON_FILE, on?255:0);
     pthread_mutex_unlock(&g_lock);
     return err;
 }
@@ -389,14 +709,19 @@ static int open_lights(const struct hw_module_t* module, char const* name,
 
     pthread_once(&g_init, init_globals);
 
-    struct light_device_t *dev = malloc(sizeof(struct light_device_t));
-    memset(dev, 0, sizeof(*dev));
+    struct msm_light_device_t *msm = malloc(sizeof(struct msm_light_device_t));
+    memset(msm, 0, sizeof(*msm));
+    struct light_device_t *dev = &msm->device;
 
     dev->common.tag = HARDWARE_DEVICE_TAG;
     dev->common.version = 0;
     dev->common.module = (struct hw_module_t*)module;
     dev->common.close = (int (*)(struct hw_device_t*))close_lights;
     dev->set_light = set_light;
+    if (set_light == set_light_backlight) {
+        dev->common.version = LIGHTS_DEVICE_API_RAMP;
+        msm->set_light_ramp = set_light_backlight_ramp;
+    }
 
     *device = (struct hw_device_t*)dev;
     return 0;
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_LIGHTS_MSM_H
+#define ANDROID_LIGHTS_MSM_H
+
+#include <hardware/lights.h>
+
+__BEGIN_DECLS
+
+/**
+ * Exported as <liblights/lights_msm.h>. A device opened from this module
+ * is an msm_light_device_t when its common.version is
+ * LIGHTS_DEVICE_API_RAMP; that is only the backlight. Every other device
+ * keeps version 0 and is a plain light_device_t.
+ */
+#define LIGHTS_DEVICE_API_RAMP  1
+
+struct msm_light_device_t {
+    struct light_device_t device;
+
+    /*
+     * Fade to the brightness of state over durationMs, instead of calling
+     * set_light() for every step. The kernel does the fade through the
+     * LED's brightness_ramp file where it has one; otherwise, or if
+     * writing it fails, the HAL steps the brightness itself.
+     */
+    int (*set_light_ramp)(struct light_device_t* dev,
+            struct light_state_t const* state, int durationMs);
+};
+
+__END_DECLS
+
+#endif // ANDROID_LIGHTS_MSM_H
@@ -2,9 +2,10 @@ LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES:= xdr.c rpc.c svc.c clnt.c ops.c svc_clnt_common.c
+LOCAL_SRC_FILES:= xdr.c rpc.c svc.c clnt.c ops.c svc_clnt_common.c stats.c \
+	loopback.c
 
-LOCAL_C_INCLUDES:=$(LOCAL_PATH)
+LOCAL_C_INCLUDES:=$(LOCAL_PATH) $(LOCAL_PATH)/../libhaltrace
 
 LOCAL_CFLAGS:= -fno-short-enums 
 
@@ -16,7 +17,9 @@ LOCAL_COPY_HEADERS:= \
 	rpc/clnt.h \
 	rpc/pmap_clnt.h \
 	rpc/rpc.h \
+	rpc/rpc_router.h \
 	rpc/rpc_router_ioctl.h \
+	rpc/rpc_stats.h \
 	rpc/svc.h \
 	rpc/types.h \
 	rpc/xdr.h
@@ -28,7 +31,19 @@ include $(BUILD_STATIC_LIBRARY)
 include $(CLEAR_VARS)
 LOCAL_MODULE := librpc
 LOCAL_MODULE_TAGS := optional
-LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhaltrace
 LOCAL_STATIC_LIBRARIES := libpower
 LOCAL_WHOLE_STATIC_LIBRARIES := librpc
 include $(BUILD_SHARED_LIBRARY)
+
+# A host build for the loopback benchmark in tests/; it has no wake locks.
+ifeq ($(HOST_OS),linux)
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= xdr.c rpc.c svc.c clnt.c ops.c svc_clnt_common.c stats.c \
+	loopback.c
+LOCAL_C_INCLUDES:=$(LOCAL_PATH) $(LOCAL_PATH)/../libhaltrace
+LOCAL_CFLAGS:= -fno-short-enums -DRPC_OFFSET=0 -DLIBRPC_HOST
+LOCAL_MODULE:= librpc_host
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_STATIC_LIBRARY)
+endif
@@ -12,38 +12,159 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
-
+#include <time.h>
+#include <unistd.h>
+
+#ifdef LIBRPC_HOST
+/* There are no wake locks on a host build. */
+#define acquire_wake_lock(lock, id) do { } while (0)
+#define release_wake_lock(id) do { } while (0)
+#else
 #include <hardware_legacy/power.h>
-#include <poll.h>
+#endif
+#include <sys/epoll.h>
+
+#include "haltrace.h"
+#include "stats.h"
 
 #define ANDROID_WAKE_LOCK_NAME "rpc-interface"
 
+/* The wake lock is reference counted across the RX, callback and server
+   threads, and is only dropped once no message has been in progress for
+   WAKE_LOCK_HOLD_MS.  A burst of messages thus costs one pair of writes to
+   the sysfs wake lock files instead of a pair per message.
+*/
+#define WAKE_LOCK_HOLD_MS 100
+
+static pthread_mutex_t wake_lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_lock_cond = PTHREAD_COND_INITIALIZER;
+static int wake_lock_refs;
+static int wake_lock_held;
+static int wake_lock_thread_started;
+#ifndef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC
+static int wake_lock_cond_ready;
+#endif
+static struct timespec wake_lock_deadline;  /* CLOCK_MONOTONIC */
+
+/* The deadline is kept on the monotonic clock so that setting the wall
+   clock neither holds the wake lock for ever nor drops it early. */
+static int wake_lock_wait(void)
+{
+#ifdef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC
+    return pthread_cond_timedwait_monotonic_np(&wake_lock_cond,
+                                               &wake_lock_mutex,
+                                               &wake_lock_deadline);
+#else
+    /* wake_lock_cond was set up on CLOCK_MONOTONIC in grabPartialWakeLock() */
+    return pthread_cond_timedwait(&wake_lock_cond, &wake_lock_mutex,
+                                  &wake_lock_deadline);
+#endif
+}
+
+static void *wake_lock_context(void *__u __attribute__((unused)))
+{
+    pthread_mutex_lock(&wake_lock_mutex);
+    for (;;) {
+        if (wake_lock_refs || !wake_lock_held) {
+            pthread_cond_wait(&wake_lock_cond, &wake_lock_mutex);
+            continue;
+        }
+        /* the deadline moves out every time the last reference goes away */
+        if (wake_lock_wait() == ETIMEDOUT &&
+            !wake_lock_refs && wake_lock_held) {
+            release_wake_lock(ANDROID_WAKE_LOCK_NAME);
+            wake_lock_held = 0;
+        }
+    }
+    pthread_mutex_unlock(&wake_lock_mutex);
+    return NULL;
+}
+
 void
 grabPartialWakeLock() {
-    acquire_wake_lock(PARTIAL_WAKE_LOCK, ANDROID_WAKE_LOCK_NAME);
+    pthread_mutex_lock(&wake_lock_mutex);
+    wake_lock_refs++;
+    if (!wake_lock_held) {
+        acquire_wake_lock(PARTIAL_WAKE_LOCK, ANDROID_WAKE_LOCK_NAME);
+        wake_lock_held = 1;
+    }
+    if (!wake_lock_thread_started) {
+        pthread_t thread;
+        pthread_attr_t attr;
+#ifndef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC
+        /* nobody waits on or signals the condition before the thread runs */
+        if (!wake_lock_cond_ready) {
+            pthread_condattr_t cattr;
+            pthread_condattr_init(&cattr);
+            pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+            pthread_cond_init(&wake_lock_cond, &cattr);
+            pthread_condattr_destroy(&cattr);
+            wake_lock_cond_ready = 1;
+        }
+#endif
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, wake_lock_context, NULL) == 0)
+            wake_lock_thread_started = 1;
+        else
+            E("cannot create wake lock thread: %s\n", strerror(errno));
+        pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_unlock(&wake_lock_mutex);
 }
 
 void
 releaseWakeLock() {
-    release_wake_lock(ANDROID_WAKE_LOCK_NAME);
+    pthread_mutex_lock(&wake_lock_mutex);
+    if (wake_lock_refs > 0)
+        wake_lock_refs--;
+    if (!wake_lock_refs && wake_lock_held) {
+        if (wake_lock_thread_started) {
+            clock_gettime(CLOCK_MONOTONIC, &wake_lock_deadline);
+            wake_lock_deadline.tv_nsec += WAKE_LOCK_HOLD_MS * 1000000L;
+            if (wake_lock_deadline.tv_nsec >= 1000000000L) {
+                wake_lock_deadline.tv_sec++;
+                wake_lock_deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_signal(&wake_lock_cond);
+        } else {
+            /* no thread to release it later: do it now */
+            release_wake_lock(ANDROID_WAKE_LOCK_NAME);
+            wake_lock_held = 0;
+        }
+    }
+    pthread_mutex_unlock(&wake_lock_mutex);
 }
 
+/* Number of idle per-call XDRs a client keeps around for reuse. */
+#define MAX_FREE_CALLS 4
+
+/* One outstanding call on a client.  Each call encodes into, and receives
+   its reply in, its own XDR so that several threads can have calls in flight
+   on the same client at once.  The RX thread matches replies to calls by the
+   XID in the outgoing message.
+*/
+struct rpc_call {
+    xdr_s_type *xdr;
+    int done;
+    pthread_cond_t wait;
+    struct rpc_call *next;
+};
+
 struct CLIENT {
     xdr_s_type *xdr;
     struct CLIENT *next;
     /* common attribute struct for setting up recursive mutexes */
     pthread_mutexattr_t lock_attr;
 
-    /* We insist that there is only one outstanding call for a client at any
-       time, and we use this mutex to enforce the rule.  When we start
-       supporting multiple outstanding RPCs on a client, we will have to
-       maintain a queue of them, and match incoming replies (by the XID of the
-       incoming packet).  For now, we just block until we get that reply.
-    */
+    /* Protects the reset callback and the client teardown. */
     pthread_mutex_t lock;
 
+    /* Protects the XID counter, the in_reset flag and both call lists. */
     pthread_mutex_t wait_reply_lock;
-    pthread_cond_t wait_reply;
+    struct rpc_call *pending_calls;
+    struct rpc_call *free_calls;
+    int num_free_calls;
 
     pthread_mutex_t input_xdr_lock;
     pthread_cond_t input_xdr_wait;
@@ -52,6 +173,8 @@ struct CLIENT {
     pthread_mutex_t wait_cb_lock;
     pthread_cond_t wait_cb;
     pthread_t cb_thread;
+    /* server XDR reused for every callback dispatched by cb_thread */
+    xdr_s_type *cb_xdr;
     volatile int got_cb;
     volatile int cb_stop;
 
@@ -65,6 +188,9 @@ extern int  r_open(const char *name);
 extern void r_close(int handle);
 extern xdr_s_type *xdr_init_common(const char *name, int is_client);
 extern xdr_s_type *xdr_clone(xdr_s_type *);
+extern xdr_s_type *xdr_clone_call(xdr_s_type *);
+extern void xdr_destroy_call(xdr_s_type *xdr);
+extern void xdr_swap_in_msg(xdr_s_type *to, xdr_s_type *from);
 extern void xdr_destroy_common(xdr_s_type *xdr);
 extern bool_t xdr_recv_reply_header (xdr_s_type *xdr, rpc_reply_header *reply);
 extern void *the_xprt;
@@ -72,15 +198,37 @@ extern int svc_is_in_reset(void* xprt);
 extern void svc_set_in_reset(void* xprt, int val);
 extern void svc_reset_cb(void* xprt, enum rpc_reset_event event);
 
+/* Max number of events the RX thread handles per wakeup. */
+#define RX_MAX_EVENTS 16
+
 static pthread_mutex_t rx_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_t rx_thread;
 static volatile unsigned int num_clients;
 static volatile struct CLIENT *clients;
 static int router_fd;
 
+/* epoll set of all client fds, the event data is the CLIENT itself */
+static int rx_epoll_fd = -1;
+/* bumped under rx_mutex whenever a client leaves the epoll set */
+static volatile unsigned int rx_generation;
+
 /* pipe used to unblock receive thread using self-pipe method */
 static int wakeup_pipe[2];
 
+/* Add a client to the epoll set, or update the events watched for it after
+   entering or leaving reset.  Must be called with rx_mutex held. */
+static int rx_watch_client(CLIENT *client, int op)
+{
+    struct epoll_event ev;
+    ev.events = client->in_reset ? EPOLLOUT : (EPOLLIN | EPOLLRDHUP);
+    ev.data.ptr = client;
+    if (epoll_ctl(rx_epoll_fd, op, client->xdr->fd, &ev) < 0) {
+        E("epoll_ctl(%d) error %s (%d)\n", op, strerror(errno), errno);
+        return -1;
+    }
+    return 0;
+}
+
 /* There's one of these for each RPC client which has received an RPC call. */
 static void *cb_context(void *__u)
 {
@@ -139,13 +287,13 @@ static void *cb_context(void *__u)
                   ntohl(((uint32 *)(client->xdr->in_msg))[RPC_OFFSET]),
                   client->xdr,
                   (uint32_t)prog, (int)vers);
-                /* We transplant the xdr of the client into the entry 
-                   representing the callback client in the list of servers.
-                   Note that since we hold the wait_cb_lock for this client,
-                   if another call for this callback client arrives before
-                   we've finished processing this call, that will block until
-                   we're done with this one.  If this happens, it would be
-                   most likely a bug in the arm9 rpc router.
+                /* We hand the input buffer of the client to the XDR of the
+                   entry representing the callback client in the list of
+                   servers.  Note that since we hold the wait_cb_lock for this
+                   client, if another call for this callback client arrives
+                   before we've finished processing this call, that will block
+                   until we're done with this one.  If this happens, it would
+                   be most likely a bug in the arm9 rpc router.
                 */
                 if (*svc_xdr) {
                     D("%08x:%08x expecting XDR == NULL"
@@ -153,41 +301,47 @@ static void *cb_context(void *__u)
                       client->xdr->x_prog,
                       client->xdr->x_vers,
                       (uint32_t)prog, (int)vers);
-                    xdr_destroy_common(*svc_xdr);
+                    if (*svc_xdr != client->cb_xdr)
+                        xdr_destroy_common(*svc_xdr);
+                    *svc_xdr = NULL;
                 }
-                
 
-                /* Do these checks before the clone */
+                /* Do these checks before the handoff */
                 if (client->xdr->in_len < 0) {
                     E("%08x:%08x xdr->in_len = %i error %s (%d)",
                         client->xdr->in_len,
                         client->xdr->x_prog, client->xdr->x_vers,
                         strerror(errno), errno);
+                    releaseWakeLock();
                     continue;
                 }
-                if (client->xdr->out_next < 0) {
-                    E("%08x:%08x xdr->out_next = %i error %s (%d)",
-                        client->xdr->out_next,
-                        client->xdr->x_prog, client->xdr->x_vers,
-                    strerror(errno), errno);
-                    continue;
+
+                /* The server XDR is made once and then reused, and the
+                   message changes hands instead of being copied. */
+                if (!client->cb_xdr) {
+                    D("%08x:%08x cloning XDR for "
+                      "callback client %08x:%08x.\n",
+                      client->xdr->x_prog,
+                      client->xdr->x_vers,
+                      (uint32_t)prog, (int)vers);
+                    client->cb_xdr = xdr_clone(client->xdr);
+                    if (!client->cb_xdr) {
+                        E("%08x:%08x cannot clone XDR for callback\n",
+                          client->xdr->x_prog, client->xdr->x_vers);
+                        /* drop the call */
+                        pthread_mutex_lock(&client->input_xdr_lock);
+                        client->input_xdr_busy = 0;
+                        pthread_cond_signal(&client->input_xdr_wait);
+                        pthread_mutex_unlock(&client->input_xdr_lock);
+                        releaseWakeLock();
+                        continue;
+                    }
                 }
+                *svc_xdr = client->cb_xdr;
 
-                D("%08x:%08x cloning XDR for "
-                  "callback client %08x:%08x.\n",
-                  client->xdr->x_prog,
-                  client->xdr->x_vers,
-                  (uint32_t)prog, (int)vers);
-                *svc_xdr = xdr_clone(client->xdr);
-                
                 (*svc_xdr)->x_prog = prog;
                 (*svc_xdr)->x_vers = vers;
-                memcpy((*svc_xdr)->in_msg,
-                       client->xdr->in_msg, client->xdr->in_len);
-                memcpy((*svc_xdr)->out_msg,
-                       client->xdr->out_msg, client->xdr->out_next);
-                (*svc_xdr)->in_len = client->xdr->in_len;
-                (*svc_xdr)->out_next = client->xdr->out_next;
+                xdr_swap_in_msg(*svc_xdr, client->xdr);
 
                 pthread_mutex_lock(&client->input_xdr_lock);
                 D("%08x:%08x marking input buffer as free.\n",
@@ -197,7 +351,6 @@ static void *cb_context(void *__u)
                 pthread_mutex_unlock(&client->input_xdr_lock);
 
                 svc_dispatch(svc, the_xprt);
-                xdr_destroy_common(*svc_xdr);
                 *svc_xdr = NULL;
             }
             else E("%08x:%08x call packet arrived, but there's no "
@@ -224,81 +377,70 @@ static void *cb_context(void *__u)
 
 static void *rx_context(void *__u __attribute__((unused)))
 {
-    int n;
+    int n, i;
     int ret;
-    struct pollfd *pbits = NULL;
-    unsigned int num_clients_cached = 0;
+    struct epoll_event events[RX_MAX_EVENTS];
     CLIENT *client;
 
     while(num_clients) {
-        /* setup file poll structure */
-        pthread_mutex_lock(&rx_mutex);
-        if (pbits == NULL || num_clients_cached != num_clients) {
-            if (pbits != NULL)
-                free(pbits);
-
-            num_clients_cached = num_clients;
-            pbits = calloc(num_clients_cached + 1, sizeof(struct pollfd));
-
-            /* add wakeup pipe */
-            pbits[0].fd = wakeup_pipe[0];
-            pbits[0].events = POLL_IN;
-        }
-
-        client = (CLIENT *)clients;
-        for (n=1; client; client = client->next, n++) {
-            pbits[n].fd = client->xdr->fd;
-            if (client->in_reset)
-                pbits[n].events = POLLOUT;
-            else
-                pbits[n].events = POLLIN | POLLRDHUP;
-        }
-        pthread_mutex_unlock(&rx_mutex);
+        /* Clients are added to and removed from the epoll set as they are
+           created and destroyed, so there is nothing to set up here. */
+        unsigned int generation = rx_generation;
+        int stale;
 
         /* wait for event */
-        n = poll(pbits, num_clients_cached + 1, -1);
-
-        /* clear wakeup pipe */
-        if (pbits[0].revents) {
-            char ch;
-            read(wakeup_pipe[0], &ch, 1);
-            LIBRPC_DEBUG("wakeup[0]=%x\n", pbits[0].revents);
-        }
+        n = epoll_wait(rx_epoll_fd, events, RX_MAX_EVENTS, -1);
 
         if (!num_clients)
             break;
 
         if (n < 0) {
-            E("poll() error %s (%d)\n", strerror(errno), errno);
+            if (errno != EINTR)
+                E("epoll_wait() error %s (%d)\n", strerror(errno), errno);
             continue;
         }
 
         pthread_mutex_lock(&rx_mutex);
-        if (num_clients_cached != num_clients) {
-            LIBRPC_DEBUG("Number of clients changed from %d to %d\n",
-                num_clients_cached, num_clients);
-            pthread_mutex_unlock(&rx_mutex);
-            continue;
-        }
+        /* A client destroyed since epoll_wait() returned may still be in
+           events[]; skip this batch, level-triggered events come back. */
+        stale = generation != rx_generation;
+        if (stale)
+            LIBRPC_DEBUG("client destroyed while polling, skipping events\n");
+
+        for (i = 0; i < n; i++) {
+            uint32_t revents = events[i].events;
+
+            client = (CLIENT *)events[i].data.ptr;
+            if (!client) {
+                /* clear wakeup pipe */
+                char ch;
+                read(wakeup_pipe[0], &ch, 1);
+                LIBRPC_DEBUG("wakeup[0]=%x\n", revents);
+                continue;
+            }
+            if (stale)
+                continue;
 
-        client = (CLIENT *)clients;
-        for (n=1; client; client = client->next, n++) {
             D("poll events IN=%d, OUT=%d, RDHUP=%d, in_reset=%d\n",
-                    pbits[n].revents & POLLIN ? 1 : 0,
-                    pbits[n].revents & POLLOUT ? 1 : 0,
-                    pbits[n].revents & POLLRDHUP ? 1 : 0,
+                    revents & EPOLLIN ? 1 : 0,
+                    revents & EPOLLOUT ? 1 : 0,
+                    revents & EPOLLRDHUP ? 1 : 0,
                     client->in_reset
              );
 
             if (!client->in_reset) {
-                if (pbits[n].revents & POLLRDHUP) {
+                if (revents & EPOLLRDHUP) {
                     LIBRPC_DEBUG("modem entered reset for client %p, cb=%p\n",
                             client, client->reset_cb);
 
                     /* unblock any pending calls */
                     pthread_mutex_lock(&client->wait_reply_lock);
                     client->in_reset = 1;
-                    pthread_cond_signal(&client->wait_reply);
+                    {
+                        struct rpc_call *call = client->pending_calls;
+                        for (; call; call = call->next)
+                            pthread_cond_signal(&call->wait);
+                    }
                     pthread_mutex_unlock(&client->wait_reply_lock);
 
                     /* wakeup any callback threads */
@@ -309,11 +451,14 @@ static void *rx_context(void *__u __attribute__((unused)))
                     if (client->reset_cb)
                         client->reset_cb(client, RPC_SUBSYSTEM_RESTART_BEGIN);
 
+                    /* poll for the end of the reset from now on */
+                    rx_watch_client(client, EPOLL_CTL_MOD);
+
                     /* prevent processing of POLLIN and unblock xdr */
-                    pbits[n].revents = 0;
+                    revents = 0;
                     client->input_xdr_busy = 0;
                 }
-            } else if (pbits[n].revents & POLLOUT) {
+            } else if (revents & EPOLLOUT) {
                 LIBRPC_DEBUG("modem exited reset for client %p, cb=%p\n",
                         client, client->reset_cb);
 
@@ -323,6 +468,7 @@ static void *rx_context(void *__u __attribute__((unused)))
                         RPC_ROUTER_IOCTL_CLEAR_NETRESET, NULL);
                 client->in_reset = 0;
                 pthread_mutex_unlock(&client->wait_reply_lock);
+                rx_watch_client(client, EPOLL_CTL_MOD);
 
                 /* wakeup any callback threads */
                 pthread_mutex_lock(&client->wait_cb_lock);
@@ -333,7 +479,7 @@ static void *rx_context(void *__u __attribute__((unused)))
                     client->reset_cb(client, RPC_SUBSYSTEM_RESTART_END);
             }
 
-            if (!(pbits[n].revents & POLLIN))
+            if (!(revents & EPOLLIN))
                 continue;
 
             /* We need to make sure that the XDR's in_buf is not in
@@ -371,18 +517,39 @@ static void *rx_context(void *__u __attribute__((unused)))
 
             if (((uint32 *)(client->xdr->in_msg))[RPC_OFFSET+1] ==
                 htonl(RPC_MSG_REPLY)) {
-                /* Wake up the RPC client to receive its data. */
+                uint32 xid = ((uint32 *)client->xdr->in_msg)[RPC_OFFSET];
+                struct rpc_call *call;
+
+                /* Hand the reply to the call waiting for this XID. */
                 LIBRPC_DEBUG("%08x:%08x received REPLY (XID %d), "
                   "grabbing mutex to wake up client.\n",
                   client->xdr->x_prog,
                   client->xdr->x_vers,
-                  ntohl(((uint32 *)client->xdr->in_msg)[RPC_OFFSET]));
+                  ntohl(xid));
                 pthread_mutex_lock(&client->wait_reply_lock);
-                D("%08x:%08x got mutex, waking up client.\n",
-                  client->xdr->x_prog,
-                  client->xdr->x_vers);
-                pthread_cond_signal(&client->wait_reply);
+                for (call = client->pending_calls; call; call = call->next)
+                    if (((uint32 *)call->xdr->out_msg)[RPC_OFFSET] == xid)
+                        break;
+                if (call && !call->done) {
+                    D("%08x:%08x got mutex, waking up client.\n",
+                      client->xdr->x_prog,
+                      client->xdr->x_vers);
+                    xdr_swap_in_msg(call->xdr, client->xdr);
+                    call->done = 1;
+                    pthread_cond_signal(&call->wait);
+                }
+                else E("%08x:%08x reply for XID %d arrived, but no such "
+                       "call is outstanding.\n",
+                       client->xdr->x_prog,
+                       client->xdr->x_vers,
+                       ntohl(xid));
                 pthread_mutex_unlock(&client->wait_reply_lock);
+
+                /* The reply was handed off, so the input buffer is free. */
+                pthread_mutex_lock(&client->input_xdr_lock);
+                client->input_xdr_busy = 0;
+                pthread_cond_signal(&client->input_xdr_wait);
+                pthread_mutex_unlock(&client->input_xdr_lock);
                 releaseWakeLock();
             }
             else {
@@ -410,13 +577,75 @@ static void *rx_context(void *__u __attribute__((unused)))
         pthread_mutex_unlock(&rx_mutex);
     }
 
-    if (pbits != NULL)
-        free(pbits);
-
     E("RPC-client RX thread exiting!\n");
     return NULL;
 }
 
+/* Take an idle per-call XDR from the client, or make a new one. */
+static struct rpc_call *clnt_get_call(CLIENT *client)
+{
+    struct rpc_call *call;
+
+    pthread_mutex_lock(&client->wait_reply_lock);
+    call = client->free_calls;
+    if (call) {
+        client->free_calls = call->next;
+        client->num_free_calls--;
+    }
+    pthread_mutex_unlock(&client->wait_reply_lock);
+
+    if (!call) {
+        call = calloc(1, sizeof(struct rpc_call));
+        if (!call)
+            return NULL;
+        call->xdr = xdr_clone_call(client->xdr);
+        if (!call->xdr) {
+            free(call);
+            return NULL;
+        }
+        pthread_cond_init(&call->wait, NULL);
+    }
+    call->done = 0;
+    call->next = NULL;
+    return call;
+}
+
+static void clnt_free_call(struct rpc_call *call)
+{
+    pthread_cond_destroy(&call->wait);
+    xdr_destroy_call(call->xdr);
+    free(call);
+}
+
+/* Give a per-call XDR back to the client once its call is complete. */
+static void clnt_put_call(CLIENT *client, struct rpc_call *call)
+{
+    pthread_mutex_lock(&client->wait_reply_lock);
+    if (client->num_free_calls < MAX_FREE_CALLS) {
+        call->next = client->free_calls;
+        client->free_calls = call;
+        client->num_free_calls++;
+        call = NULL;
+    }
+    pthread_mutex_unlock(&client->wait_reply_lock);
+
+    if (call)
+        clnt_free_call(call);
+}
+
+/* Must be called with wait_reply_lock held. */
+static void clnt_remove_pending_call(CLIENT *client, struct rpc_call *call)
+{
+    struct rpc_call **trav = &client->pending_calls;
+    for (; *trav; trav = &(*trav)->next) {
+        if (*trav == call) {
+            *trav = call->next;
+            break;
+        }
+    }
+    call->next = NULL;
+}
+
 enum clnt_stat
 clnt_call(
     CLIENT       * client,
@@ -431,14 +660,36 @@ clnt_call(
     opaque_auth verf;
     rpc_reply_header reply_header;
     enum clnt_stat ret = RPC_SUCCESS;
+    struct rpc_call *call;
+    xdr_s_type *xdr;
+    uint64 start_us = rpc_stats_now_us();
+    int traced;
+
+    rpc_stats_begin(client->xdr->x_prog, client->xdr->x_vers, proc, 0);
+    HALTRACE_BEGIN_ARGS_LATCH(traced, "rpc", "clnt_call",
+                              client->xdr->x_prog, proc);
+    call = clnt_get_call(client);
+    if (!call) {
+        E("%08x:%08x cannot allocate call\n",
+          client->xdr->x_prog,
+          client->xdr->x_vers);
+        rpc_stats_end(client->xdr->x_prog, client->xdr->x_vers, proc, 0,
+                      start_us, 0);
+        HALTRACE_END_IF(traced, "rpc", "clnt_call");
+        return RPC_SYSTEMERROR;
+    }
+    xdr = call->xdr;
 
-    xdr_s_type *xdr = client->xdr;
-
-    pthread_mutex_lock(&client->lock);
+    pthread_mutex_lock(&client->wait_reply_lock);
     if (client->in_reset) {
+        pthread_mutex_unlock(&client->wait_reply_lock);
         ret = RPC_SUBSYSTEM_RESTART;
         goto out;
     }
+    /* XDR_MSG_START() increments the XID before writing it out, so this
+       hands every call on the client a distinct XID. */
+    xdr->xid = client->xdr->xid++;
+    pthread_mutex_unlock(&client->wait_reply_lock);
 
     cred.oa_flavor = AUTH_NONE;
     cred.oa_length = 0;
@@ -449,7 +700,7 @@ clnt_call(
 
     /* Send message header */
 
-    if (!xdr_call_msg_start (xdr, xdr->x_prog, xdr->x_vers,
+    if (!xdr_call_msg_start (xdr, client->xdr->x_prog, client->xdr->x_vers,
                              proc, &cred, &verf)) {
         XDR_MSG_ABORT (xdr);
         ret = RPC_CANTENCODEARGS; 
@@ -477,8 +728,12 @@ clnt_call(
         goto out_unlock;
     }
 
+    /* Make the call visible to the RX thread before its reply can arrive. */
+    call->next = client->pending_calls;
+    client->pending_calls = call;
+
     LIBRPC_DEBUG("%08x:%08x sending call (XID %d).\n",
-      client->xdr->x_prog, client->xdr->x_vers, client->xdr->xid);
+      client->xdr->x_prog, client->xdr->x_vers, xdr->xid);
     if (!XDR_MSG_SEND(xdr)) {
         E("error %d in XDR_MSG_SEND\n", xdr->xdr_err);
         ret = RPC_CANTSEND;
@@ -486,16 +741,20 @@ clnt_call(
             client->in_reset = 1;
             ret = RPC_SUBSYSTEM_RESTART;
         }
+        clnt_remove_pending_call(client, call);
         goto out_unlock;
     }
 
     D("%08x:%08x waiting for reply.\n",
       client->xdr->x_prog, client->xdr->x_vers);
-    pthread_cond_wait(&client->wait_reply, &client->wait_reply_lock);
-    if (client->in_reset) {
+    while (!call->done && !client->in_reset)
+        pthread_cond_wait(&call->wait, &client->wait_reply_lock);
+    clnt_remove_pending_call(client, call);
+    if (!call->done) {
         ret = RPC_SUBSYSTEM_RESTART;
         goto out_unlock;
     }
+    pthread_mutex_unlock(&client->wait_reply_lock);
 
     D("%08x:%08x received reply.\n", client->xdr->x_prog, client->xdr->x_vers);
 
@@ -506,16 +765,16 @@ clnt_call(
           ntohl(((uint32 *)xdr->in_msg)[RPC_OFFSET]),
           ntohl(((uint32 *)xdr->out_msg)[RPC_OFFSET]));
         ret = RPC_CANTRECV;
-        goto out_unlock;
+        goto out;
     }
 
     D("%08x:%08x decoding reply header.\n",
       client->xdr->x_prog, client->xdr->x_vers);
-    if (!xdr_recv_reply_header (client->xdr, &reply_header)) {
+    if (!xdr_recv_reply_header (xdr, &reply_header)) {
         E("%08x:%08x error reading reply header.\n",
           client->xdr->x_prog, client->xdr->x_vers);
         ret = RPC_CANTRECV;
-        goto out_unlock;
+        goto out;
     }
 
     /* Check that other side accepted and responded */
@@ -524,13 +783,13 @@ clnt_call(
         ret = reply_header.u.dr.stat + RPC_VERSMISMATCH;
         E("%08x:%08x call was not accepted.\n",
           (uint32_t)client->xdr->x_prog, client->xdr->x_vers);
-        goto out_unlock;
+        goto out;
     } else if (reply_header.u.ar.stat != RPC_ACCEPT_SUCCESS) {
         /* Offset to map returned error into clnt_stat */
         ret = reply_header.u.ar.stat + RPC_AUTHERROR;
         E("%08x:%08x call failed with an authentication error.\n",
           (uint32_t)client->xdr->x_prog, client->xdr->x_vers);
-        goto out_unlock;
+        goto out;
     }
 
     xdr->x_op = XDR_DECODE;
@@ -539,23 +798,20 @@ clnt_call(
         ret = RPC_CANTDECODERES;
         E("%08x:%08x error decoding results.\n",
           client->xdr->x_prog, client->xdr->x_vers);
-        goto out_unlock;
+        goto out;
     }
 
     LIBRPC_DEBUG("%08x:%08x call success.\n",
       client->xdr->x_prog, client->xdr->x_vers);
+    goto out;
 
   out_unlock:
-    pthread_mutex_lock(&client->input_xdr_lock);
-    D("%08x:%08x marking input buffer as free.\n",
-      client->xdr->x_prog, client->xdr->x_vers);
-    client->input_xdr_busy = 0;
-    pthread_cond_signal(&client->input_xdr_wait);
-    pthread_mutex_unlock(&client->input_xdr_lock);
-
     pthread_mutex_unlock(&client->wait_reply_lock);
   out:
-    pthread_mutex_unlock(&client->lock);
+    clnt_put_call(client, call);
+    rpc_stats_end(client->xdr->x_prog, client->xdr->x_vers, proc, 0,
+                  start_us, ret == RPC_SUCCESS);
+    HALTRACE_END_IF(traced, "rpc", "clnt_call");
     return ret;
 } /* clnt_call */
 
@@ -718,6 +974,8 @@ CLIENT *clnt_create(
         client->cb_stop = -1; /* callback thread has not been started */
 
         if (!num_clients) {
+            struct epoll_event ev;
+
             if (pipe(wakeup_pipe) == -1) {
                E("failed to create pipe\n");
 	       r_close(router_fd);
@@ -725,6 +983,39 @@ CLIENT *clnt_create(
                pthread_mutex_unlock(&rx_mutex);
                return NULL;
             }
+
+            rx_epoll_fd = epoll_create(RX_MAX_EVENTS);
+            ev.events = EPOLLIN;
+            ev.data.ptr = NULL; /* the wakeup pipe */
+            if (rx_epoll_fd < 0 ||
+                epoll_ctl(rx_epoll_fd, EPOLL_CTL_ADD, wakeup_pipe[0], &ev) < 0) {
+               E("failed to create epoll set: %s\n", strerror(errno));
+               if (rx_epoll_fd >= 0)
+                   close(rx_epoll_fd);
+               rx_epoll_fd = -1;
+               close(wakeup_pipe[0]);
+               close(wakeup_pipe[1]);
+	       r_close(router_fd);
+               xdr_destroy_common(client->xdr);
+               free(client);
+               pthread_mutex_unlock(&rx_mutex);
+               return NULL;
+            }
+        }
+
+        /* The RX thread picks up the new fd without being woken up. */
+        if (rx_watch_client(client, EPOLL_CTL_ADD) < 0) {
+            if (!num_clients) {
+                close(rx_epoll_fd);
+                rx_epoll_fd = -1;
+                close(wakeup_pipe[0]);
+                close(wakeup_pipe[1]);
+                r_close(router_fd);
+            }
+            xdr_destroy_common(client->xdr);
+            free(client);
+            pthread_mutex_unlock(&rx_mutex);
+            return NULL;
         }
 
         client->next = (CLIENT *)clients;
@@ -732,17 +1023,12 @@ CLIENT *clnt_create(
         if (!num_clients++) {
             D("launching RX thread.\n");
             pthread_create(&rx_thread, NULL, rx_context, NULL);
-        } else {
-            /* client added, wake up rx_thread */
-            if (write(wakeup_pipe[1], "a", 1) < 0)
-	        E("error writing to pipe\n");
-	}
+        }
 
         pthread_mutexattr_init(&client->lock_attr);
 //      pthread_mutexattr_settype(&client->lock_attr, PTHREAD_MUTEX_RECURSIVE);
         pthread_mutex_init(&client->lock, &client->lock_attr);
         pthread_mutex_init(&client->wait_reply_lock, &client->lock_attr);
-        pthread_cond_init(&client->wait_reply, NULL);
         pthread_mutex_init(&client->wait_cb_lock, &client->lock_attr);
         pthread_cond_init(&client->wait_cb, NULL);
         pthread_mutex_init(&client->input_xdr_lock, &client->lock_attr);
@@ -803,6 +1089,8 @@ void clnt_destroy(CLIENT *client) {
         }
 
         pthread_mutex_lock(&rx_mutex); /* sync access to the client list */
+        epoll_ctl(rx_epoll_fd, EPOLL_CTL_DEL, client->xdr->fd, NULL);
+        rx_generation++;
         {
             CLIENT *trav = (CLIENT *)clients, *prev = NULL;
             for(; trav; trav = trav->next) {
@@ -829,6 +1117,8 @@ void clnt_destroy(CLIENT *client) {
             pthread_join(rx_thread, NULL);
             D("stopped rx thread\n");
 
+            close(rx_epoll_fd);
+            rx_epoll_fd = -1;
             close(wakeup_pipe[0]);
             close(wakeup_pipe[1]);
 	    r_close(router_fd);
@@ -838,8 +1128,14 @@ void clnt_destroy(CLIENT *client) {
         pthread_mutex_destroy(&client->input_xdr_lock);
         pthread_cond_destroy(&client->input_xdr_wait);
 
+        if (client->cb_xdr)
+            xdr_destroy_common(client->cb_xdr);
+        while (client->free_calls) {
+            struct rpc_call *call = client->free_calls;
+            client->free_calls = call->next;
+            clnt_free_call(call);
+        }
         pthread_mutex_destroy(&client->wait_reply_lock);
-        pthread_cond_destroy(&client->wait_reply);
         xdr_destroy_common(client->xdr);
 
         // FIXME: what happens when we lock the client while destroying it,
@@ -0,0 +1,371 @@
+/* Copyright (c) 2011, Code Aurora Forum. */
+
+/*
+ * An in-process stand-in for the rpcrouter driver, see rpc/rpc_router.h.
+ *
+ * Every channel librpc opens is one end of a SOCK_SEQPACKET socketpair, so
+ * that it can be polled and dup()ed like a driver channel and every read()
+ * returns exactly one message.  A router thread owns the other ends.  It
+ * forwards calls to the channel their program is served on and routes the
+ * replies back.  Each forwarded call gets an XID of the router's own, since
+ * every client numbers its calls from zero; the caller's XID is put back
+ * into the reply.
+ */
+
+#include <rpc/rpc.h>
+#include <rpc/rpc_router.h>
+#include <rpc/rpc_router_ioctl.h>
+#include <debug.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LB_MAX_CHANNELS 64
+/* A power of two; at most this many calls can be in flight at once. */
+#define LB_MAX_PENDING 256
+#define LB_MAX_EVENTS 16
+
+#define LB_CALLBACK_BIT 0x01000000
+
+struct lb_channel {
+    int in_use;
+    int fd;             /* the router's end */
+    ino_t ino;          /* of the socket, shared by dup()s of librpc's end */
+    int is_server;      /* opened as 00000000:0 */
+    uint32 prog, vers;  /* of a client channel */
+    int registered;
+    uint32 reg_prog, reg_vers;
+};
+
+struct lb_pending {
+    int in_use;
+    uint32 xid;         /* the router's XID */
+    uint32 caller_xid;  /* network byte order */
+    int caller, callee;
+};
+
+static pthread_mutex_t lb_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lb_channel lb_channels[LB_MAX_CHANNELS];
+static struct lb_pending lb_pending[LB_MAX_PENDING];
+static uint32 lb_next_xid;
+static int lb_epoll_fd = -1;
+static pthread_t lb_thread;
+static uint8 lb_msg[RPCROUTER_MSGSIZE_MAX];
+
+/* Must be called with lb_lock held. */
+static int lb_find_fd(int handle)
+{
+    struct stat st;
+    int i;
+
+    if (fstat(handle, &st) < 0)
+        return -1;
+    for (i = 0; i < LB_MAX_CHANNELS; i++)
+        if (lb_channels[i].in_use && lb_channels[i].ino == st.st_ino)
+            return i;
+    return -1;
+}
+
+/* Must be called with lb_lock held. */
+static int lb_find_callee(uint32 prog, uint32 vers)
+{
+    int i, found = -1;
+
+    for (i = 0; i < LB_MAX_CHANNELS; i++) {
+        struct lb_channel *ch = &lb_channels[i];
+        if (!ch->in_use)
+            continue;
+        if (prog & LB_CALLBACK_BIT) {
+            /* callbacks arrive on the channel of the client */
+            if (ch->is_server || ch->prog != (prog & ~LB_CALLBACK_BIT))
+                continue;
+            if (ch->vers == vers)
+                return i;
+        } else {
+            if (!ch->registered || ch->reg_prog != prog)
+                continue;
+            if (ch->reg_vers == vers)
+                return i;
+        }
+        if (found < 0)
+            found = i;
+    }
+    return found;
+}
+
+/* Must be called with lb_lock held. */
+static void lb_drop_channel(int idx)
+{
+    int i;
+
+    epoll_ctl(lb_epoll_fd, EPOLL_CTL_DEL, lb_channels[idx].fd, NULL);
+    close(lb_channels[idx].fd);
+    memset(&lb_channels[idx], 0, sizeof(lb_channels[idx]));
+    for (i = 0; i < LB_MAX_PENDING; i++)
+        if (lb_pending[i].in_use &&
+            (lb_pending[i].caller == idx || lb_pending[i].callee == idx))
+            lb_pending[i].in_use = 0;
+}
+
+static void lb_send(int idx, const uint8 *msg, int len)
+{
+    if (write(lb_channels[idx].fd, msg, len) != len)
+        E("loopback: cannot deliver to channel %d: %s\n", idx,
+          strerror(errno));
+}
+
+/* Must be called with lb_lock held. */
+static void lb_route_call(int from, uint8 *msg, int len)
+{
+    uint32 *words = (uint32 *)msg;
+    uint32 prog = ntohl(words[RPC_OFFSET+3]);
+    uint32 vers = ntohl(words[RPC_OFFSET+4]);
+    int to = lb_find_callee(prog, vers);
+    unsigned slot;
+
+    if (to >= 0) {
+        for (slot = 0; slot < LB_MAX_PENDING; slot++)
+            if (!lb_pending[(lb_next_xid + slot) % LB_MAX_PENDING].in_use)
+                break;
+        if (slot == LB_MAX_PENDING) {
+            E("loopback: too many calls in flight, dropping one to "
+              "%08x:%08x\n", prog, vers);
+            return;
+        }
+        /* the router's XIDs map to their slot, so replies need no search */
+        lb_next_xid += slot;
+        slot = lb_next_xid % LB_MAX_PENDING;
+        lb_pending[slot].in_use = 1;
+        lb_pending[slot].xid = lb_next_xid;
+        lb_pending[slot].caller_xid = words[RPC_OFFSET];
+        lb_pending[slot].caller = from;
+        lb_pending[slot].callee = to;
+        words[RPC_OFFSET] = htonl(lb_next_xid++);
+        lb_send(to, msg, len);
+        return;
+    }
+
+    /* Answer for the missing server, the way the ARM9 would. */
+    {
+        uint32 reply[RPC_OFFSET+6];
+        memset(reply, 0, sizeof(reply));
+        reply[RPC_OFFSET] = words[RPC_OFFSET];
+        reply[RPC_OFFSET+1] = htonl(RPC_MSG_REPLY);
+        reply[RPC_OFFSET+2] = htonl(RPC_MSG_ACCEPTED);
+        /* verifier flavor and length stay zero */
+        reply[RPC_OFFSET+5] = htonl(RPC_PROG_UNAVAIL);
+        D("loopback: no server for %08x:%08x\n", prog, vers);
+        lb_send(from, (uint8 *)reply, sizeof(reply));
+    }
+}
+
+/* Must be called with lb_lock held. */
+static void lb_route_reply(int from, uint8 *msg, int len)
+{
+    uint32 *words = (uint32 *)msg;
+    uint32 xid = ntohl(words[RPC_OFFSET]);
+    struct lb_pending *p = &lb_pending[xid % LB_MAX_PENDING];
+
+    if (!p->in_use || p->xid != xid || p->callee != from) {
+        E("loopback: reply for unknown XID %u from channel %d\n", xid, from);
+        return;
+    }
+    p->in_use = 0;
+    words[RPC_OFFSET] = p->caller_xid;
+    lb_send(p->caller, msg, len);
+}
+
+static void *lb_context(void *__u __attribute__((unused)))
+{
+    struct epoll_event events[LB_MAX_EVENTS];
+    int n, i, len;
+
+    for (;;) {
+        n = epoll_wait(lb_epoll_fd, events, LB_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                E("loopback: epoll_wait() error %s (%d)\n",
+                  strerror(errno), errno);
+            continue;
+        }
+
+        pthread_mutex_lock(&lb_lock);
+        for (i = 0; i < n; i++) {
+            int idx = events[i].data.u32;
+            struct lb_channel *ch = &lb_channels[idx];
+
+            if (!ch->in_use)
+                continue;   /* dropped earlier in this batch */
+
+            len = read(ch->fd, lb_msg, sizeof(lb_msg));
+            if (len <= 0) {
+                /* every copy of librpc's end has been closed */
+                D("loopback: channel %d closed\n", idx);
+                lb_drop_channel(idx);
+                continue;
+            }
+            if (len < (RPC_OFFSET+6) * 4) {
+                E("loopback: short message (%d bytes) on channel %d\n",
+                  len, idx);
+                continue;
+            }
+            if (((uint32 *)lb_msg)[RPC_OFFSET+1] == htonl(RPC_MSG_CALL))
+                lb_route_call(idx, lb_msg, len);
+            else
+                lb_route_reply(idx, lb_msg, len);
+        }
+        pthread_mutex_unlock(&lb_lock);
+    }
+    return NULL;
+}
+
+static int lb_open(const char *router)
+{
+    int sv[2], idx;
+    unsigned prog = 0, vers = 0;
+    struct stat st;
+    struct epoll_event ev;
+
+    if (sscanf(router, "%x:%x", &prog, &vers) != 2) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    pthread_mutex_lock(&lb_lock);
+    if (lb_epoll_fd < 0) {
+        lb_epoll_fd = epoll_create(LB_MAX_EVENTS);
+        if (lb_epoll_fd < 0 ||
+            pthread_create(&lb_thread, NULL, lb_context, NULL)) {
+            E("loopback: cannot start the router: %s\n", strerror(errno));
+            if (lb_epoll_fd >= 0)
+                close(lb_epoll_fd);
+            lb_epoll_fd = -1;
+            pthread_mutex_unlock(&lb_lock);
+            return -1;
+        }
+        pthread_detach(lb_thread);
+    }
+
+    for (idx = 0; idx < LB_MAX_CHANNELS; idx++)
+        if (!lb_channels[idx].in_use)
+            break;
+    if (idx == LB_MAX_CHANNELS) {
+        pthread_mutex_unlock(&lb_lock);
+        errno = ENFILE;
+        return -1;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        pthread_mutex_unlock(&lb_lock);
+        return -1;
+    }
+    fstat(sv[0], &st);
+    {
+        /* a channel closed by librpc, but not yet by the router thread,
+           may have left its inode number for this one */
+        int stale = lb_find_fd(sv[0]);
+        if (stale >= 0)
+            lb_drop_channel(stale);
+    }
+
+    lb_channels[idx].in_use = 1;
+    lb_channels[idx].fd = sv[1];
+    lb_channels[idx].ino = st.st_ino;
+    lb_channels[idx].is_server = !prog;
+    lb_channels[idx].prog = prog;
+    lb_channels[idx].vers = vers;
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = idx;
+    if (epoll_ctl(lb_epoll_fd, EPOLL_CTL_ADD, sv[1], &ev) < 0) {
+        E("loopback: epoll_ctl() error %s (%d)\n", strerror(errno), errno);
+        memset(&lb_channels[idx], 0, sizeof(lb_channels[idx]));
+        close(sv[0]);
+        close(sv[1]);
+        pthread_mutex_unlock(&lb_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&lb_lock);
+
+    D("loopback: opened [%s] as channel %d\n", router, idx);
+    return sv[0];
+}
+
+static void lb_close(int handle)
+{
+    /* The router notices when the last copy of this end goes away. */
+    if (close(handle) < 0)
+        E("error: %s\n", strerror(errno));
+}
+
+static int lb_read(int handle, char *buf, uint32 size)
+{
+    int rc = read(handle, buf, size);
+    if (rc < 0)
+        E("error reading RPC packet: %d (%s)\n", errno, strerror(errno));
+    return rc;
+}
+
+static int lb_write(int handle, const char *buf, uint32 size)
+{
+    int rc = write(handle, buf, size);
+    if (rc < 0)
+        E("error writing RPC packet: %d (%s)\n", errno, strerror(errno));
+    return rc;
+}
+
+static int lb_control(int handle, const uint32 cmd, void *arg)
+{
+    struct rpcrouter_ioctl_server_args *args =
+        (struct rpcrouter_ioctl_server_args *)arg;
+    int idx, ret = 0;
+
+    pthread_mutex_lock(&lb_lock);
+    idx = lb_find_fd(handle);
+    if (idx < 0) {
+        pthread_mutex_unlock(&lb_lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    switch (cmd) {
+    case RPC_ROUTER_IOCTL_REGISTER_SERVER:
+        lb_channels[idx].registered = 1;
+        lb_channels[idx].reg_prog = args->prog;
+        lb_channels[idx].reg_vers = args->vers;
+        break;
+    case RPC_ROUTER_IOCTL_UNREGISTER_SERVER:
+        lb_channels[idx].registered = 0;
+        break;
+    case RPC_ROUTER_IOCTL_GET_VERSION:
+        *(unsigned int *)arg = 0;
+        break;
+    case RPC_ROUTER_IOCTL_GET_MTU:
+        *(unsigned int *)arg = RPCROUTER_MSGSIZE_MAX;
+        break;
+    case RPC_ROUTER_IOCTL_CLEAR_NETRESET:
+        /* the loopback router never restarts */
+        break;
+    default:
+        errno = EINVAL;
+        ret = -1;
+        break;
+    }
+    pthread_mutex_unlock(&lb_lock);
+    return ret;
+}
+
+const struct rpc_router_ops rpc_router_loopback_ops = {
+    lb_open,
+    lb_close,
+    lb_read,
+    lb_write,
+    lb_control,
+};
@@ -2,6 +2,7 @@
 
 #include <rpc/rpc.h>
 #include <rpc/rpc_router_ioctl.h>
+#include <rpc/rpc_router.h>
 #include <debug.h>
 
 #include <sys/types.h>   
@@ -16,7 +17,7 @@
 #define SERVER_WAIT_DURATION 15
 #define POLL_INTERVAL_MS 500
 
-int r_open(const char *router)
+static int dev_open(const char *router)
 {
   char name[32];
   struct stat statbuf;
@@ -46,12 +47,12 @@ int r_open(const char *router)
   return handle;
 }
 
-void r_close(int handle)
+static void dev_close(int handle)
 {
     if(close(handle) < 0) E("error: %s\n", strerror(errno));
 }
 
-int r_read(int handle, char *buf, uint32 size)
+static int dev_read(int handle, char *buf, uint32 size)
 {
 	int rc = read((int) handle, (void *)buf, size);
 	if (rc < 0)
@@ -69,7 +70,7 @@ int r_read(int handle, char *buf, uint32 size)
 	return rc;
 }
 
-int r_write (int handle, const char *buf, uint32 size)
+static int dev_write(int handle, const char *buf, uint32 size)
 {
 	int rc = write(handle, (void *)buf, size);
 	if (rc < 0)
@@ -87,10 +88,53 @@ int r_write (int handle, const char *buf, uint32 size)
 	return rc;
 }
 
-int r_control(int handle, const uint32 cmd, void *arg)
+static int dev_control(int handle, const uint32 cmd, void *arg)
 {
   return ioctl(handle, cmd, arg);
 }
 
+static const struct rpc_router_ops dev_ops = {
+    dev_open,
+    dev_close,
+    dev_read,
+    dev_write,
+    dev_control,
+};
+
+/* The transport everything below goes through; see rpc/rpc_router.h. */
+static const struct rpc_router_ops *router_ops = &dev_ops;
+
+const struct rpc_router_ops *rpc_router_set_ops(const struct rpc_router_ops *ops)
+{
+    const struct rpc_router_ops *old = router_ops;
+    router_ops = ops ? ops : &dev_ops;
+    return old;
+}
+
+int r_open(const char *router)
+{
+    return router_ops->open(router);
+}
+
+void r_close(int handle)
+{
+    router_ops->close(handle);
+}
+
+int r_read(int handle, char *buf, uint32 size)
+{
+    return router_ops->read(handle, buf, size);
+}
+
+int r_write(int handle, const char *buf, uint32 size)
+{
+    return router_ops->write(handle, buf, size);
+}
+
+int r_control(int handle, const uint32 cmd, void *arg)
+{
+    return router_ops->control(handle, cmd, arg);
+}
+
 
 
@@ -45,6 +45,7 @@ extern "C" {
 #include <rpc/xdr.h>
 #include <rpc/clnt.h>
 #include <rpc/svc.h>
+#include <rpc/rpc_stats.h>
 
 #ifdef __cplusplus
 }
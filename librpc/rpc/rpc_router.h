@@ -0,0 +1,53 @@
+/* Copyright (c) 2011, Code Aurora Forum. */
+
+/*
+ * rpc_router.h - The transport between librpc and the RPC router.
+ *
+ * By default librpc talks to the ARM9 through the rpcrouter driver, one
+ * /dev/oncrpc/<prog>:<vers> channel per client and one 00000000:0 channel
+ * per server.  Another transport can be put in its place, for example the
+ * in-process loopback router below, as long as it hands out real file
+ * descriptors that can be polled and dup()ed, one message per read().
+ */
+
+#ifndef _RPC_RPC_ROUTER_H
+#define _RPC_RPC_ROUTER_H
+
+#include <rpc/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rpc_router_ops {
+    /* Open the channel for "<prog>:<vers>", or "00000000:0" for a server.
+       Returns a file descriptor, or -1 with errno set. */
+    int  (*open)(const char *router);
+    void (*close)(int handle);
+    /* Read one message into buf; returns its length, or -1. */
+    int  (*read)(int handle, char *buf, uint32 size);
+    /* Send the size bytes of buf as one message; returns size, or -1. */
+    int  (*write)(int handle, const char *buf, uint32 size);
+    /* One of the RPC_ROUTER_IOCTL_* requests of rpc_router_ioctl.h. */
+    int  (*control)(int handle, const uint32 cmd, void *arg);
+};
+
+/* Make librpc use ops, or the rpcrouter driver if ops is NULL, and return
+   the transport in use before.  This must be done before any client or
+   server is created and not while any exists, since their channels belong
+   to the transport that opened them. */
+extern const struct rpc_router_ops *
+rpc_router_set_ops(const struct rpc_router_ops *ops);
+
+/* An in-process router connecting the clients and servers of this process
+   to each other, for testing and benchmarking librpc without a modem.
+   Calls to a program registered with svc_register() go to that server;
+   calls to the callback program (prog | 0x01000000) of a client go to that
+   client; calls to anything else are answered with RPC_PROG_UNAVAIL. */
+extern const struct rpc_router_ops rpc_router_loopback_ops;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RPC_RPC_ROUTER_H */
@@ -0,0 +1,64 @@
+/* Copyright (c) 2011, Code Aurora Forum. */
+
+/*
+ * rpc_stats.h - Per-procedure call counters and latency histograms.
+ *
+ * librpc keeps one entry for every (program, version, procedure) that has
+ * been called through clnt_call() or dispatched through svc_dispatch().
+ * Latencies are measured in microseconds: for a client, from the start of
+ * clnt_call() to the decoded reply; for a server, the time spent in the
+ * dispatch routine.
+ */
+
+#ifndef _RPC_RPC_STATS_H
+#define _RPC_RPC_STATS_H
+
+#include <rpc/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bucket i counts calls that took [2^i, 2^(i+1)) microseconds; the first
+   bucket also counts calls under one microsecond and the last one counts
+   everything from 2^(RPC_STATS_BUCKETS-1) microseconds up. */
+#define RPC_STATS_BUCKETS 24
+
+/* Most entries kept; calls to further procedures are not counted. */
+#define RPC_STATS_MAX_ENTRIES 256
+
+struct rpc_stats_entry {
+    uint32 prog;
+    uint32 vers;
+    uint32 proc;
+    int    is_server;   /* dispatched to a local server, not a client call */
+
+    uint32 calls;       /* completed calls */
+    uint32 errors;      /* completed calls that did not succeed */
+    int32  in_flight;   /* calls started but not completed */
+    uint64 total_us;
+    uint32 min_us;
+    uint32 max_us;
+    uint32 hist[RPC_STATS_BUCKETS];
+};
+
+/* Copy up to max entries into entries; returns the number copied. */
+extern int rpc_stats_get(struct rpc_stats_entry *entries, int max);
+
+/* Upper bound, in microseconds, of the latency below which pct percent of
+   the calls of an entry completed, as resolved by its histogram. */
+extern uint32 rpc_stats_percentile(const struct rpc_stats_entry *entry,
+                                   int pct);
+
+/* Write all entries as text to fd, or to the log if fd is negative. */
+extern void rpc_stats_dump(int fd);
+
+/* Zero the counters of every entry; entries left without calls are no
+   longer reported. */
+extern void rpc_stats_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RPC_RPC_STATS_H */
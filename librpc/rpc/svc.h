@@ -269,6 +269,15 @@ extern svc_reset_notif_cb svc_unregister_reset_notification_cb(SVCXPRT *xprt);
  */
 extern SVCXPRT *svcrtr_create (void);
 
+/*
+ * Router based rpc with a pool of num_workers threads running the server
+ * routines, so that a slow server does not hold up the others.  Calls to
+ * one program/version are still handled one at a time, in order.  With
+ * num_workers == 0 this is the same as svcrtr_create().  The pool size is
+ * fixed by whichever call creates the transport first.
+ */
+extern SVCXPRT *svcrtr_create_pool (int num_workers);
+
 extern void svcerr_decode (SVCXPRT *);
 extern void svcerr_weakauth (SVCXPRT *);
 extern void svcerr_noproc (SVCXPRT *);
@@ -374,6 +374,13 @@ struct xdr_ops_struct {
   bool_t (*recv_int32)  (xdr_s_type *xdr, int32 *value);
   bool_t (*recv_uint32) (xdr_s_type *xdr, uint32 *value);
   bool_t (*recv_bytes)  (xdr_s_type *xdr, uint8 *buf, uint32 len);
+
+  /* Bulk data functions: count 32-bit words, each converted to or from
+     network byte order */
+  bool_t (*send_uint32_array) (xdr_s_type *xdr, const uint32 *value,
+                               uint32 count);
+  bool_t (*recv_uint32_array) (xdr_s_type *xdr, uint32 *value,
+                               uint32 count);
 };
 
 typedef struct xdr_ops_struct xdr_ops_s_type;
@@ -386,6 +393,9 @@ typedef struct xdr_ops_struct xdr_ops_s_type;
 
 #define RPCROUTER_MSGSIZE_MAX (18432)
 
+/* Message buffers start on a cache line, see svc_clnt_common.c. */
+#define RPCROUTER_MSG_ALIGN   (64)
+
 struct xdr_struct {
   const xdr_ops_s_type      *xops;
   enum xdr_op                x_op;           /* used for ENCODE and DECODE */
@@ -401,15 +411,18 @@ struct xdr_struct {
   /* RPC-call message (if XDR is a client) or RPC-reply message (if
      XDR is a server). */
 
-  uint8                      out_msg[RPCROUTER_MSGSIZE_MAX];
+  uint8                      out_msg[RPCROUTER_MSGSIZE_MAX]
+                             __attribute__((aligned(RPCROUTER_MSG_ALIGN)));
   int                        out_next;
 
   /* Reply message or incoming-call message.  For a client XDR, this
      buffer always contains the reply received in response to an RPC
      call.  For a server XDR, this buffer always contains an incoming
-     RPC call.
+     RPC call.  It holds RPCROUTER_MSGSIZE_MAX bytes and is allocated
+     separately, so that a received message can be handed to another
+     XDR by swapping buffers instead of copying it.
   */
-  uint8                      in_msg[RPCROUTER_MSGSIZE_MAX];
+  uint8                     *in_msg;
   int                        in_next;
   int                        in_len;
   int                        xdr_err;
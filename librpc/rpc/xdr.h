@@ -56,6 +56,10 @@ extern "C" {
 #define XDR_SEND_INT8(XDR, VALUE)     (XDR)->xops->send_int8(XDR, VALUE)
 #define XDR_SEND_UINT(XDR, VALUE)     (XDR)->xops->send_uint32(XDR, (uint32 *)(VALUE))
 #define XDR_SEND_UINT32(XDR, VALUE)   (XDR)->xops->send_uint32(XDR, VALUE)
+#define XDR_RECV_UINT32_ARRAY(XDR, VALUE, COUNT) \
+    (XDR)->xops->recv_uint32_array(XDR, VALUE, COUNT)
+#define XDR_SEND_UINT32_ARRAY(XDR, VALUE, COUNT) \
+    (XDR)->xops->send_uint32_array(XDR, VALUE, COUNT)
 
 /*===========================================================================
   Macros for sending and receiving an RPC message through the transport
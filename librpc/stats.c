@@ -0,0 +1,269 @@
+/* Copyright (c) 2011, Code Aurora Forum. */
+
+#include <rpc/rpc.h>
+#include <debug.h>
+#include <cutils/atomic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/* Entries are kept in an open-addressed hash table with linear probing.  The
+   table is twice the size of the maximum number of entries so that probe
+   sequences stay short.  A slot once claimed keeps its key for the life of
+   the process, so the table can be searched and updated without a lock:
+   slots are claimed with a compare-and-swap and every counter is bumped with
+   the cutils atomics. */
+#define STATS_TABLE_SIZE (RPC_STATS_MAX_ENTRIES * 2)
+
+#define SLOT_EMPTY      0
+#define SLOT_FILLING    1   /* claimed, key not yet written */
+#define SLOT_READY      2
+
+struct stats_slot {
+    volatile int32_t state;
+    uint32 prog;
+    uint32 vers;
+    uint32 proc;
+    int    is_server;
+
+    volatile int32_t calls;
+    volatile int32_t errors;
+    volatile int32_t in_flight;
+    /* total_us in two halves; a reader racing a carry may see the low half
+       wrapped before the high half is bumped. */
+    volatile int32_t total_lo;
+    volatile int32_t total_hi;
+    volatile int32_t min_us;
+    volatile int32_t max_us;
+    volatile int32_t hist[RPC_STATS_BUCKETS];
+};
+
+static struct stats_slot stats_table[STATS_TABLE_SIZE];
+static volatile int32_t stats_count;
+
+uint64 rpc_stats_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned stats_hash(uint32 prog, uint32 vers, uint32 proc,
+                           int is_server)
+{
+    uint32 h = prog * 2654435761u;
+    h ^= vers * 40503u;
+    h ^= proc * 2246822519u;
+    h ^= is_server;
+    return (h ^ (h >> 15)) % STATS_TABLE_SIZE;
+}
+
+static struct stats_slot *stats_lookup(uint32 prog, uint32 vers,
+                                       uint32 proc, int is_server)
+{
+    unsigned i = stats_hash(prog, vers, proc, is_server);
+    struct stats_slot *s;
+    int32_t state;
+
+    for (;;) {
+        s = &stats_table[i];
+        state = android_atomic_acquire_load(&s->state);
+        if (state == SLOT_READY) {
+            if (s->prog == prog && s->vers == vers && s->proc == proc &&
+                s->is_server == is_server)
+                return s;
+            i = (i + 1) % STATS_TABLE_SIZE;
+            continue;
+        }
+        if (state == SLOT_FILLING)
+            continue;       /* another thread is writing this key */
+
+        if (android_atomic_inc(&stats_count) >= RPC_STATS_MAX_ENTRIES) {
+            android_atomic_dec(&stats_count);
+            return NULL;
+        }
+        if (android_atomic_cmpxchg(SLOT_EMPTY, SLOT_FILLING, &s->state)) {
+            /* lost the slot; it may now hold our key, so look again */
+            android_atomic_dec(&stats_count);
+            continue;
+        }
+        s->prog = prog;
+        s->vers = vers;
+        s->proc = proc;
+        s->is_server = is_server;
+        s->min_us = -1;
+        android_atomic_release_store(SLOT_READY, &s->state);
+        return s;
+    }
+}
+
+static void stats_min(volatile int32_t *p, uint32 us)
+{
+    int32_t old;
+
+    do {
+        old = *p;
+        if ((uint32)old <= us)
+            return;
+    } while (android_atomic_cmpxchg(old, (int32_t)us, p));
+}
+
+static void stats_max(volatile int32_t *p, uint32 us)
+{
+    int32_t old;
+
+    do {
+        old = *p;
+        if ((uint32)old >= us)
+            return;
+    } while (android_atomic_cmpxchg(old, (int32_t)us, p));
+}
+
+void rpc_stats_begin(uint32 prog, uint32 vers, uint32 proc, int is_server)
+{
+    struct stats_slot *s = stats_lookup(prog, vers, proc, is_server);
+
+    if (s)
+        android_atomic_inc(&s->in_flight);
+}
+
+void rpc_stats_end(uint32 prog, uint32 vers, uint32 proc, int is_server,
+                   uint64 start_us, int ok)
+{
+    struct stats_slot *s;
+    uint64 elapsed = rpc_stats_now_us() - start_us;
+    uint32 us = elapsed > (uint32)-1 ? (uint32)-1 : (uint32)elapsed;
+    uint32 lo;
+    int bucket = 0;
+
+    while (bucket < RPC_STATS_BUCKETS - 1 && (us >> (bucket + 1)))
+        bucket++;
+
+    s = stats_lookup(prog, vers, proc, is_server);
+    if (!s)
+        return;
+
+    android_atomic_dec(&s->in_flight);
+    android_atomic_inc(&s->calls);
+    if (!ok)
+        android_atomic_inc(&s->errors);
+    lo = (uint32)android_atomic_add((int32_t)us, &s->total_lo);
+    if (lo + us < lo)
+        android_atomic_inc(&s->total_hi);
+    stats_min(&s->min_us, us);
+    stats_max(&s->max_us, us);
+    android_atomic_inc(&s->hist[bucket]);
+}
+
+int rpc_stats_get(struct rpc_stats_entry *entries, int max)
+{
+    int i, j, n = 0;
+
+    for (i = 0; i < STATS_TABLE_SIZE && n < max; i++) {
+        struct stats_slot *s = &stats_table[i];
+        struct rpc_stats_entry *e = &entries[n];
+
+        if (android_atomic_acquire_load(&s->state) != SLOT_READY)
+            continue;
+        e->prog = s->prog;
+        e->vers = s->vers;
+        e->proc = s->proc;
+        e->is_server = s->is_server;
+        e->calls = s->calls;
+        e->errors = s->errors;
+        e->in_flight = s->in_flight;
+        /* skip entries that saw no calls since the last reset */
+        if (!e->calls && e->in_flight <= 0)
+            continue;
+        e->total_us = (uint64)(uint32)s->total_hi << 32 | (uint32)s->total_lo;
+        e->min_us = s->min_us;
+        e->max_us = s->max_us;
+        for (j = 0; j < RPC_STATS_BUCKETS; j++)
+            e->hist[j] = s->hist[j];
+        n++;
+    }
+    return n;
+}
+
+uint32 rpc_stats_percentile(const struct rpc_stats_entry *entry, int pct)
+{
+    uint64 want, seen = 0;
+    int i;
+
+    if (!entry->calls)
+        return 0;
+    want = ((uint64)entry->calls * pct + 99) / 100;
+    for (i = 0; i < RPC_STATS_BUCKETS - 1; i++) {
+        seen += entry->hist[i];
+        if (seen >= want)
+            break;
+    }
+    if (i == RPC_STATS_BUCKETS - 1)
+        return entry->max_us;
+    /* the bucket's upper edge, but never more than was actually seen */
+    return (2u << i) < entry->max_us ? (2u << i) : entry->max_us;
+}
+
+void rpc_stats_reset(void)
+{
+    int i, j;
+
+    /* Keys stay put so that concurrent lookups keep working; in_flight is
+       left alone since those calls will still complete. */
+    for (i = 0; i < STATS_TABLE_SIZE; i++) {
+        struct stats_slot *s = &stats_table[i];
+
+        if (android_atomic_acquire_load(&s->state) != SLOT_READY)
+            continue;
+        android_atomic_release_store(0, &s->calls);
+        android_atomic_release_store(0, &s->errors);
+        android_atomic_release_store(0, &s->total_lo);
+        android_atomic_release_store(0, &s->total_hi);
+        android_atomic_release_store(-1, &s->min_us);
+        android_atomic_release_store(0, &s->max_us);
+        for (j = 0; j < RPC_STATS_BUCKETS; j++)
+            android_atomic_release_store(0, &s->hist[j]);
+    }
+}
+
+void rpc_stats_dump(int fd)
+{
+    static struct rpc_stats_entry entries[RPC_STATS_MAX_ENTRIES];
+    static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+    char line[160];
+    int i, n;
+
+    pthread_mutex_lock(&dump_lock);
+    n = rpc_stats_get(entries, RPC_STATS_MAX_ENTRIES);
+
+    snprintf(line, sizeof(line),
+             "librpc: %d entries\n"
+             "  side prog     vers     proc      calls  errs infl"
+             "   min_us  mean_us   p99_us   max_us\n", n);
+    if (fd < 0)
+        PRINT("%s", line);
+    else
+        write(fd, line, strlen(line));
+
+    for (i = 0; i < n; i++) {
+        struct rpc_stats_entry *e = &entries[i];
+        snprintf(line, sizeof(line),
+                 "  %s %08x %08x %8u %6u %5u %4d %8u %8u %8u %8u\n",
+                 e->is_server ? "svc " : "clnt",
+                 e->prog, e->vers, e->proc,
+                 e->calls, e->errors, e->in_flight,
+                 e->calls ? e->min_us : 0,
+                 e->calls ? (uint32)(e->total_us / e->calls) : 0,
+                 rpc_stats_percentile(e, 99),
+                 e->max_us);
+        if (fd < 0)
+            PRINT("%s", line);
+        else
+            write(fd, line, strlen(line));
+    }
+    pthread_mutex_unlock(&dump_lock);
+}
@@ -0,0 +1,17 @@
+/* Copyright (c) 2011, Code Aurora Forum. */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <rpc/rpc_stats.h>
+
+/* Internal hooks used by clnt_call() and svc_dispatch() to feed
+   rpc_stats.h. */
+
+extern uint64 rpc_stats_now_us(void);
+extern void rpc_stats_begin(uint32 prog, uint32 vers, uint32 proc,
+                            int is_server);
+extern void rpc_stats_end(uint32 prog, uint32 vers, uint32 proc,
+                          int is_server, uint64 start_us, int ok);
+
+#endif /* STATS_H */
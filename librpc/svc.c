@@ -50,6 +50,10 @@
 #include <debug.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <fcntl.h>
+
+#include "haltrace.h"
+#include "stats.h"
 
 extern XDR *xdr_init_common(const char *name, int is_client);
 extern void xdr_destroy_common(XDR *xdr);
@@ -78,6 +82,16 @@ typedef struct registered_server_struct {
     struct registered_server_struct *next;
     SVCXPRT *xprt;
     __dispatch_fn_t dispatch;
+
+    /* Worker-pool state, protected by xprt->work_lock.  While a server is
+       busy, its call is queued or being dispatched by a worker, and its fd is
+       left out of the select() set, so calls to the same program are always
+       handled one at a time and in order.
+    */
+    volatile int busy;
+    pthread_t worker;
+    int unregistered;
+    struct registered_server_struct *work_next;
 } registered_server;
 
 struct SVCXPRT {
@@ -85,6 +99,10 @@ struct SVCXPRT {
     int max_fd;
     pthread_attr_t thread_attr;
     pthread_t  svc_thread;
+    /* svc_thread has been created and not joined yet; it is running until
+       it sees num_servers at zero and clears svc_running, both under lock */
+    int svc_started;
+    int svc_running;
     pthread_mutexattr_t lock_attr;
     pthread_mutex_t lock;
     registered_server *servers;
@@ -93,8 +111,24 @@ struct SVCXPRT {
 
     volatile int in_reset;
     svc_reset_notif_cb reset_cb;
+
+    /* Optional pool of threads running svc_dispatch().  When num_workers is
+       zero, servers are dispatched inline on svc_thread.  The pool is
+       started by the first svc_thread and lives until xprt_unregister().
+    */
+    int num_workers;
+    pthread_t *workers;
+    pthread_mutex_t work_lock;
+    pthread_cond_t work_cond;
+    registered_server *work_head, *work_tail;
+    int work_stop;
+    /* written by a worker to make svc_thread select() on a server again */
+    int wake_pipe[2];
 };
 
+/* Upper bound on the size of the worker pool. */
+#define SVC_MAX_WORKERS 8
+
 static pthread_mutex_t xprt_lock = PTHREAD_MUTEX_INITIALIZER;
 int xprt_refcount;
 SVCXPRT *the_xprt; /* FIXME: have a list or something */
@@ -131,20 +165,164 @@ void svc_reset_cb(void* xprt, enum rpc_reset_event event) {
     pthread_mutex_unlock(&xprt_lock);
 }
 
+/* Free a server that was unregistered by its own dispatch routine, once that
+   routine has returned. */
+static void svc_free_server(registered_server *svc)
+{
+    if (svc->xdr)
+        xdr_destroy_common(svc->xdr);
+    free(svc);
+}
+
+static void* svc_worker(void *__u)
+{
+    SVCXPRT *xprt = (SVCXPRT *)__u;
+    registered_server *svc;
+    char c = 0;
+
+    pthread_mutex_lock(&xprt->work_lock);
+    for (;;) {
+        while (!xprt->work_head && !xprt->work_stop)
+            pthread_cond_wait(&xprt->work_cond, &xprt->work_lock);
+        svc = xprt->work_head;
+        if (!svc)
+            break; /* stopped, and nothing left to dispatch */
+        xprt->work_head = svc->work_next;
+        if (!xprt->work_head)
+            xprt->work_tail = NULL;
+        svc->worker = pthread_self();
+        pthread_mutex_unlock(&xprt->work_lock);
+
+        grabPartialWakeLock();
+        svc_dispatch(svc, xprt);
+        releaseWakeLock();
+
+        pthread_mutex_lock(&xprt->work_lock);
+        svc->busy = 0;
+        if (svc->unregistered)
+            svc_free_server(svc);
+        /* wake up svc_unregister() waiting for this server to go idle */
+        pthread_cond_broadcast(&xprt->work_cond);
+        pthread_mutex_unlock(&xprt->work_lock);
+
+        if (write(xprt->wake_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+            E("wake pipe write error %s (%d)\n", strerror(errno), errno);
+
+        pthread_mutex_lock(&xprt->work_lock);
+    }
+    pthread_mutex_unlock(&xprt->work_lock);
+    return NULL;
+}
+
+static void svc_start_workers(SVCXPRT *xprt)
+{
+    int i;
+
+    if (xprt->workers)
+        return; /* started by an earlier svc_thread */
+    xprt->work_stop = 0;
+    xprt->workers = calloc(xprt->num_workers, sizeof(pthread_t));
+    if (!xprt->workers) {
+        E("cannot allocate RPC worker pool, dispatching inline\n");
+        xprt->num_workers = 0;
+        return;
+    }
+    for (i = 0; i < xprt->num_workers; i++) {
+        if (pthread_create(&xprt->workers[i], NULL, svc_worker, xprt)) {
+            E("cannot create RPC worker %d: %s\n", i, strerror(errno));
+            break;
+        }
+    }
+    if (!i) {
+        free(xprt->workers);
+        xprt->workers = NULL;
+    }
+    xprt->num_workers = i;
+    D("started %d RPC worker threads\n", i);
+}
+
+static void svc_stop_workers(SVCXPRT *xprt)
+{
+    int i;
+
+    pthread_mutex_lock(&xprt->work_lock);
+    xprt->work_stop = 1;
+    pthread_cond_broadcast(&xprt->work_cond);
+    pthread_mutex_unlock(&xprt->work_lock);
+
+    if (xprt->workers) {
+        for (i = 0; i < xprt->num_workers; i++)
+            pthread_join(xprt->workers[i], NULL);
+        free(xprt->workers);
+        xprt->workers = NULL;
+    }
+}
+
+/* Hand a server whose call has been read to the worker pool. */
+static void svc_queue_dispatch(SVCXPRT *xprt, registered_server *svc)
+{
+    pthread_mutex_lock(&xprt->work_lock);
+    svc->busy = 1;
+    svc->work_next = NULL;
+    if (xprt->work_tail)
+        xprt->work_tail->work_next = svc;
+    else
+        xprt->work_head = svc;
+    xprt->work_tail = svc;
+    pthread_cond_signal(&xprt->work_cond);
+    pthread_mutex_unlock(&xprt->work_lock);
+}
+
 static void* svc_context(void *__u)
 {
     SVCXPRT *xprt = (SVCXPRT *)__u;
-    int n;
+    int n, max_fd;
     struct timeval tv;
     volatile fd_set rfds;
-    while(xprt->num_servers) {
+
+    if (xprt->num_workers)
+        svc_start_workers(xprt);
+
+    for (;;) {
+        pthread_mutex_lock(&xprt->lock);
+        if (!xprt->num_servers) {
+            /* svc_register() starts a new thread from here on */
+            xprt->svc_running = 0;
+            pthread_mutex_unlock(&xprt->lock);
+            break;
+        }
+        pthread_mutex_unlock(&xprt->lock);
+
         rfds = xprt->fdset;
+        max_fd = xprt->max_fd;
+        if (xprt->num_workers) {
+            /* Servers that are still being dispatched cannot take another
+               call yet; their input buffer is in use. */
+            registered_server *trav;
+            pthread_mutex_lock(&xprt->lock);
+            pthread_mutex_lock(&xprt->work_lock); /* protects busy */
+            for (trav = xprt->servers; trav; trav = trav->next)
+                if (trav->xdr && trav->busy)
+                    FD_CLR(trav->xdr->fd, (fd_set *)&rfds);
+            pthread_mutex_unlock(&xprt->work_lock);
+            pthread_mutex_unlock(&xprt->lock);
+            FD_SET(xprt->wake_pipe[0], (fd_set *)&rfds);
+            if (xprt->wake_pipe[0] > max_fd)
+                max_fd = xprt->wake_pipe[0];
+        }
         tv.tv_sec = 1; tv.tv_usec = 0;
-        n = select(xprt->max_fd + 1, (fd_set *)&rfds, NULL, NULL, &tv);
+        n = select(max_fd + 1, (fd_set *)&rfds, NULL, NULL, &tv);
         if (n < 0) {
             E("select() error %s (%d)\n", strerror(errno), errno);
             continue;
         }
+        if (n && xprt->num_workers &&
+            FD_ISSET(xprt->wake_pipe[0], (fd_set *)&rfds)) {
+            char buf[16];
+            while (read(xprt->wake_pipe[0], buf, sizeof(buf)) > 0);
+            FD_CLR(xprt->wake_pipe[0], (fd_set *)&rfds);
+            n--;
+        }
         if (n) {
             grabPartialWakeLock();
             for (n = 0; n <= xprt->max_fd; n++) {
@@ -162,7 +340,10 @@ static void* svc_context(void *__u)
                                   trav->xdr->x_prog, trav->xdr->x_vers);
                                 abort();
                             }
-                            svc_dispatch(trav, xprt);
+                            if (xprt->num_workers)
+                                svc_queue_dispatch(xprt, trav);
+                            else
+                                svc_dispatch(trav, xprt);
                             break;
                         }
                 } /* if fd is set */
@@ -170,29 +351,59 @@ static void* svc_context(void *__u)
             releaseWakeLock();
         }
     }
+
+    /* The workers are stopped by xprt_unregister(), which joins this
+       thread first; nothing here may touch xprt any more. */
     D("RPC-server thread exiting!\n");
     return NULL;
 }
 
 SVCXPRT *svcrtr_create (void)
+{
+    return svcrtr_create_pool(0);
+}
+
+SVCXPRT *svcrtr_create_pool (int num_workers)
 {
     SVCXPRT *xprt;
+
+    if (num_workers < 0)
+        num_workers = 0;
+    if (num_workers > SVC_MAX_WORKERS)
+        num_workers = SVC_MAX_WORKERS;
+
     pthread_mutex_lock(&xprt_lock);
     if (the_xprt) {
         D("The RPC transport has already been created.\n");
         xprt = the_xprt;
+        if (num_workers != xprt->num_workers)
+            E("RPC transport already has %d workers, ignoring request "
+              "for %d\n", xprt->num_workers, num_workers);
     } else {
         xprt = calloc(1, sizeof(SVCXPRT));
         if (xprt) {
             FD_ZERO(&xprt->fdset);
             xprt->max_fd = 0;
             pthread_attr_init(&xprt->thread_attr);
-            pthread_attr_setdetachstate(&xprt->thread_attr,
-                                        PTHREAD_CREATE_DETACHED);
             pthread_mutexattr_init(&xprt->lock_attr);
 //          pthread_mutexattr_settype(&xprt->lock_attr,
 //                                    PTHREAD_MUTEX_RECURSIVE);
             pthread_mutex_init(&xprt->lock, &xprt->lock_attr);
+            pthread_mutex_init(&xprt->work_lock, NULL);
+            pthread_cond_init(&xprt->work_cond, NULL);
+            xprt->wake_pipe[0] = xprt->wake_pipe[1] = -1;
+            if (num_workers) {
+                if (pipe(xprt->wake_pipe) < 0) {
+                    E("pipe() error %s (%d), dispatching inline\n",
+                      strerror(errno), errno);
+                    xprt->wake_pipe[0] = xprt->wake_pipe[1] = -1;
+                    num_workers = 0;
+                } else {
+                    fcntl(xprt->wake_pipe[0], F_SETFL, O_NONBLOCK);
+                    fcntl(xprt->wake_pipe[1], F_SETFL, O_NONBLOCK);
+                }
+            }
+            xprt->num_workers = num_workers;
         }
     }    
     pthread_mutex_unlock(&xprt_lock);
@@ -248,7 +459,7 @@ bool_t svc_register (SVCXPRT *xprt, rpcprog_t prog, rpcvers_t vers,
         return svc->dispatch == dispatch;
     }
 
-    svc = malloc(sizeof(registered_server));
+    svc = calloc(1, sizeof(registered_server));
 
     /* If the program number of the RPC server ANDs with 0x01000000, then it is
        not a true RPC server, but a callback client for an existing RPC client.
@@ -307,11 +518,17 @@ bool_t svc_register (SVCXPRT *xprt, rpcprog_t prog, rpcvers_t vers,
       "total %d servers, %d cb servers.\n",
       (uint32_t)prog, (int)vers, xprt->num_servers, xprt->num_cb_servers);
     svc->xprt = xprt;
-    if (xprt->num_servers == 1) {
-        D("creating RPC-server thread (detached)!\n");
-        pthread_create(&xprt->svc_thread,
-                       &xprt->thread_attr,
-                       svc_context, xprt);
+    /* Only a real server starts the thread, and only if none is running;
+       callback clients do not change num_servers.  A thread that saw the
+       servers go away has already let go of the lock for good, so joining
+       it here cannot deadlock. */
+    if (svc->xdr && !xprt->svc_running) {
+        if (xprt->svc_started)
+            pthread_join(xprt->svc_thread, NULL);
+        D("creating RPC-server thread!\n");
+        xprt->svc_started = xprt->svc_running =
+            pthread_create(&xprt->svc_thread, &xprt->thread_attr,
+                           svc_context, xprt) == 0;
     }
     pthread_mutex_unlock(&xprt->lock);
     return TRUE;
@@ -341,8 +558,28 @@ svc_reset_notif_cb svc_unregister_reset_notification_cb(SVCXPRT *xprt) {
     return cb;
 }
 
+/* Wait until a worker is done with a server that is being unregistered.
+   Returns 0 if the server was unregistered from its own dispatch routine, in
+   which case the worker frees it after the routine returns.
+*/
+static int svc_wait_idle(SVCXPRT *xprt, registered_server *svc)
+{
+    int idle = 1;
+
+    pthread_mutex_lock(&xprt->work_lock);
+    while (svc->busy && !pthread_equal(svc->worker, pthread_self()))
+        pthread_cond_wait(&xprt->work_cond, &xprt->work_lock);
+    if (svc->busy) {
+        svc->unregistered = 1;
+        idle = 0;
+    }
+    pthread_mutex_unlock(&xprt->work_lock);
+    return idle;
+}
+
 void svc_unregister (SVCXPRT *xprt, rpcprog_t prog, rpcvers_t vers) {
     registered_server *prev, *found;
+    int idle = 1;
     pthread_mutex_lock(&xprt->lock);
     found = svc_find_nosync(xprt, prog, vers, &prev);
     D("unregistering RPC server %08x:%d\n", (unsigned)prog, (unsigned)vers);
@@ -377,22 +614,33 @@ void svc_unregister (SVCXPRT *xprt, rpcprog_t prog, rpcvers_t vers) {
                 }                
                 FD_CLR(found->xdr->fd, &xprt->fdset);
             }
-            V("RPC server %08x:%d: destroying XDR\n",
-                   (unsigned)prog, (unsigned)vers);
-            xdr_destroy_common(found->xdr);
+            /* A worker may still be dispatching a call to this server; it
+               must finish before the XDR goes away.  Drop xprt->lock while
+               waiting, since the server routine may take it. */
+            if (xprt->num_workers) {
+                pthread_mutex_unlock(&xprt->lock);
+                idle = svc_wait_idle(xprt, found);
+                pthread_mutex_lock(&xprt->lock);
+            }
+            if (idle) {
+                V("RPC server %08x:%d: destroying XDR\n",
+                       (unsigned)prog, (unsigned)vers);
+                xdr_destroy_common(found->xdr);
+            }
         }
         else V("RPC server %08x:%d does not have an associated XDR\n", 
                (unsigned)prog, (unsigned)vers);
 
-        /* When this goes to zero, the RPC-server thread will exit.  We do not
-         * need to wait for the thread to exit, because it is detached.
+        /* When this goes to zero, the RPC-server thread will exit; it is
+         * joined by the next svc_register() or by xprt_unregister().
          */
         if (found->xdr)
             xprt->num_servers--;
         else
             xprt->num_cb_servers--;
 
-        free(found);
+        if (idle)
+            free(found);
         V("RPC server %08x:%d: after unregistering,"
 	  "%d servers, %d cb servers left.\n",
           (unsigned)prog, (unsigned)vers,
@@ -423,6 +671,8 @@ c  00000000
 void svc_dispatch(registered_server *svc, SVCXPRT *xprt)
 {
     struct svc_req req;
+    uint64 start_us;
+    int traced;
 
     /* Read enough of the packet to be able to find the program number, the
        program-version number, and the procedure call.  Notice that anything
@@ -467,10 +717,15 @@ void svc_dispatch(registered_server *svc, SVCXPRT *xprt)
     */
     svc->xdr->in_next = (RPC_OFFSET + 6 + 4)*sizeof(uint32); 
 
+    start_us = rpc_stats_now_us();
+    rpc_stats_begin(prog, vers, proc, 1);
+    HALTRACE_BEGIN_ARGS_LATCH(traced, "rpc", "svc_dispatch", prog, proc);
     svc->active = getpid();
     svc->xdr->x_op = XDR_DECODE;
     svc->dispatch(&req, (SVCXPRT *)svc);
     svc->active = 0;
+    HALTRACE_END_IF(traced, "rpc", "svc_dispatch");
+    rpc_stats_end(prog, vers, proc, 1, start_us, 1);
     D("DONE: SVC DISPATCH %08x:%08x --> %08x\n",
       (uint32_t)prog, (int)vers, proc);
 }
@@ -496,15 +751,22 @@ void xprt_unregister (SVCXPRT *xprt)
             D("Destroying RPC transport (servers %d, cb servers %d)\n",
               the_xprt->num_servers, the_xprt->num_cb_servers);
 
+            /* Make sure the thread has exited, and then the workers it
+               handed calls to, before the xprt structure they use goes
+               away.
+            */
+            if (xprt->svc_started)
+                pthread_join(xprt->svc_thread, NULL);
+            svc_stop_workers(xprt);
             pthread_attr_destroy(&xprt->thread_attr);
             pthread_mutexattr_destroy(&xprt->lock_attr);
             pthread_mutex_destroy(&xprt->lock);
-            /* Make sure the thread has existed before we free the xprt
-               structure.  The thread is created as detached, so we do not wait
-               for it after we set the terminate flag in svc_unregister, but we
-               do have to wait for it to exit when we call svc_destroy.
-            */
-            pthread_join(xprt->svc_thread, NULL);
+            pthread_mutex_destroy(&xprt->work_lock);
+            pthread_cond_destroy(&xprt->work_cond);
+            if (xprt->wake_pipe[0] >= 0) {
+                close(xprt->wake_pipe[0]);
+                close(xprt->wake_pipe[1]);
+            }
             free(xprt);
             the_xprt = NULL;
         }
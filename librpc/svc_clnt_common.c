@@ -1,8 +1,15 @@
 #include <rpc/rpc.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <debug.h>
 
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 extern int r_open(const char *router);
 extern void r_close(int handle);
 extern int r_read(int handle, char *buf, uint32 size);
@@ -30,29 +37,15 @@ static bool_t xdr_std_msg_start(xdr_s_type *xdr,
                                  rpc_msg_e_type rpc_msg_type)
 {
 
-    /* xid is does not matter under our set of assumptions: that for a single
-     * program/version channel, communication is synchronous.  If several
-     * processes attempt to call functions on a program, then the rpcrouter
-     * driver will ensure that the calls are properly muxed, because the
-     * processes will have separate PIDs, and the rpcrouter driver uses PIDs to
-     * keep track of RPC transactions.  For multiple threads in the same
-     * process accessing the same program, we serialize access in clnt_call()
-     * by locking a mutex around the RPC call.  If threads in the same process
-     * call into different programs, then there is no issue, again because of
-     * the use of a mutex in clnt_call().
-     * 
+    /* Each client opens its own program/version channel, and clnt_call()
+     * gives every call on a client its own XDR with a distinct xid before
+     * starting the message, so that the RX thread can route replies of
+     * concurrent calls by xid.  If several processes call into the same
+     * program, the rpcrouter driver keeps their transactions apart by PID.
+     *
      * NOTE: This comment assumes that the only way we talk to the RPC router
      *       from a client is by using clnt_call(), which is the case for all
      *       client code generated by rpcgen().
-     *
-     * NOTE: The RPC router driver will soon be able to open a separate device
-     *       file for each program/version channel.  This will allow for
-     *       natural multiplexing among clients, as we won't have to rely on
-     *       the mutex for the case where different programs are being called
-     *       into by separate threads in the same process.  When this happens,
-     *       we'll need to optimize the RPC library to add a separate mutex for
-     *       each program/version channel, which will require some sort of
-     *       registry.
      */
 
     if (rpc_msg_type == RPC_MSG_CALL) xdr->xid++;
@@ -152,11 +145,37 @@ static bool_t xdr_std_send_int32(xdr_s_type *xdr, const int32 *value)
 static bool_t xdr_std_send_bytes(xdr_s_type *xdr, const uint8 *buf, 
                                    uint32 len)
 {
-    if (xdr->out_next + len > RPCROUTER_MSGSIZE_MAX) return FALSE; 
-    while(len--)
-        xdr->out_msg[xdr->out_next++] = *buf++;
-    while(xdr->out_next % 4)
-        xdr->out_msg[xdr->out_next++] = 0;
+    uint32 pad = (4 - (len & 3)) & 3;
+    if (xdr->out_next + len + pad > RPCROUTER_MSGSIZE_MAX) return FALSE;
+    memcpy(xdr->out_msg + xdr->out_next, buf, len);
+    xdr->out_next += len;
+    memset(xdr->out_msg + xdr->out_next, 0, pad);
+    xdr->out_next += pad;
+    return TRUE;
+}
+
+/* Copy count 32-bit words from src to dst, reversing the byte order of each
+   one.  Byte swapping is its own inverse, so this serves both directions. */
+static void xdr_std_swap_words(uint32 *dst, const uint32 *src, uint32 count)
+{
+#if defined(__ARM_NEON__)
+    while (count >= 4) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)src);
+        vst1q_u8((uint8_t *)dst, vrev32q_u8(v));
+        src += 4; dst += 4; count -= 4;
+    }
+#endif
+    while (count--)
+        *dst++ = htonl(*src++);
+}
+
+static bool_t xdr_std_send_uint32_array(xdr_s_type *xdr, const uint32 *value,
+                                        uint32 count)
+{
+    if (count > (uint32)(RPCROUTER_MSGSIZE_MAX - xdr->out_next) / 4)
+        return FALSE;
+    xdr_std_swap_words((uint32 *)(xdr->out_msg + xdr->out_next), value, count);
+    xdr->out_next += count * 4;
     return TRUE;
 }
 
@@ -244,6 +263,20 @@ static bool_t xdr_std_recv_int32(xdr_s_type *xdr, int32 *value)
     return xdr_std_recv_uint32(xdr, (uint32 * )value);
 }
 
+static bool_t xdr_std_recv_uint32_array(xdr_s_type *xdr, uint32 *value,
+                                        uint32 count)
+{
+    if (xdr->in_next > xdr->in_len ||
+        count > (uint32)(xdr->in_len - xdr->in_next) / 4)
+        return FALSE;
+    if (value)
+        xdr_std_swap_words(value,
+                           (const uint32 *)(xdr->in_msg + xdr->in_next),
+                           count);
+    xdr->in_next += count * 4;
+    return TRUE;
+}
+
 static bool_t xdr_std_recv_bytes(xdr_s_type *xdr, uint8 *buf, uint32 len)
 {
     if (xdr->in_next + (int)len > xdr->in_len) return FALSE;     
@@ -277,18 +310,176 @@ const xdr_ops_s_type xdr_std_xops = {
     xdr_std_recv_int32,
     xdr_std_recv_uint32,
     xdr_std_recv_bytes,
+
+    xdr_std_send_uint32_array,
+    xdr_std_recv_uint32_array,
 };
 
+/* XDRs and input buffers are recycled instead of being freed, so that
+   creating servers and clients, and the per-call XDRs of clnt_call(), do
+   not go to malloc once the process has warmed up.  Each thread keeps
+   one of each in a cache of its own, and the rest go on a process-wide
+   free list of at most XDR_ARENA_MAX_FREE entries.  The two are kept
+   apart because xdr_swap_in_msg() moves input buffers between XDRs.
+
+   Both are allocated on a cache line, so that the byte-swapping loops
+   over the message buffers do not straddle lines at the start. */
+
+#define XDR_ARENA_MAX_FREE 4
+
+struct xdr_arena_node {
+    struct xdr_arena_node *next;
+};
+
+struct xdr_arena_list {
+    struct xdr_arena_node *head;
+    int count;
+};
+
+struct xdr_arena_cache {
+    xdr_s_type *xdr;
+    uint8 *in_msg;
+};
+
+static pthread_mutex_t xdr_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xdr_arena_list xdr_arena_xdrs;
+static struct xdr_arena_list xdr_arena_bufs;
+static pthread_once_t xdr_arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t xdr_arena_key;
+static int xdr_arena_key_ok;
+
+static void *xdr_arena_get(struct xdr_arena_list *list, size_t size)
+{
+    struct xdr_arena_node *node;
+
+    pthread_mutex_lock(&xdr_arena_lock);
+    node = list->head;
+    if (node) {
+        list->head = node->next;
+        list->count--;
+    }
+    pthread_mutex_unlock(&xdr_arena_lock);
+
+    if (!node)
+        node = (struct xdr_arena_node *)memalign(RPCROUTER_MSG_ALIGN, size);
+    return node;
+}
+
+static void xdr_arena_put(struct xdr_arena_list *list, void *ptr)
+{
+    struct xdr_arena_node *node = (struct xdr_arena_node *)ptr;
+
+    if (!node)
+        return;
+
+    pthread_mutex_lock(&xdr_arena_lock);
+    if (list->count < XDR_ARENA_MAX_FREE) {
+        node->next = list->head;
+        list->head = node;
+        list->count++;
+        node = NULL;
+    }
+    pthread_mutex_unlock(&xdr_arena_lock);
+
+    free(node);
+}
+
+static void xdr_arena_thread_exit(void *arg)
+{
+    struct xdr_arena_cache *cache = (struct xdr_arena_cache *)arg;
+    xdr_arena_put(&xdr_arena_xdrs, cache->xdr);
+    xdr_arena_put(&xdr_arena_bufs, cache->in_msg);
+    free(cache);
+}
+
+static void xdr_arena_init(void)
+{
+    xdr_arena_key_ok =
+        !pthread_key_create(&xdr_arena_key, xdr_arena_thread_exit);
+}
+
+static struct xdr_arena_cache *xdr_arena_cache(void)
+{
+    struct xdr_arena_cache *cache;
+
+    pthread_once(&xdr_arena_once, xdr_arena_init);
+    if (!xdr_arena_key_ok)
+        return NULL;
+
+    cache = (struct xdr_arena_cache *)pthread_getspecific(xdr_arena_key);
+    if (!cache) {
+        cache = (struct xdr_arena_cache *)calloc(1, sizeof(*cache));
+        if (cache && pthread_setspecific(xdr_arena_key, cache)) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+/* Allocate an XDR along with its input buffer. */
+static xdr_s_type *xdr_alloc(void)
+{
+    struct xdr_arena_cache *cache = xdr_arena_cache();
+    xdr_s_type *xdr = NULL;
+    uint8 *in_msg = NULL;
+
+    if (cache) {
+        xdr = cache->xdr;
+        in_msg = cache->in_msg;
+        cache->xdr = NULL;
+        cache->in_msg = NULL;
+    }
+    if (!xdr)
+        xdr = (xdr_s_type *)xdr_arena_get(&xdr_arena_xdrs, sizeof(xdr_s_type));
+    if (!in_msg)
+        in_msg = (uint8 *)xdr_arena_get(&xdr_arena_bufs, RPCROUTER_MSGSIZE_MAX);
+    if (!xdr || !in_msg) {
+        xdr_arena_put(&xdr_arena_xdrs, xdr);
+        xdr_arena_put(&xdr_arena_bufs, in_msg);
+        return NULL;
+    }
+
+    /* Only the bookkeeping needs clearing; the message buffers are always
+       written before they are read. */
+    memset(xdr, 0, offsetof(xdr_s_type, out_msg));
+    xdr->out_next = 0;
+    xdr->in_msg = in_msg;
+    xdr->in_next = 0;
+    xdr->in_len = 0;
+    xdr->xdr_err = 0;
+    return xdr;
+}
+
+static void xdr_free_buffers(xdr_s_type *xdr)
+{
+    struct xdr_arena_cache *cache = xdr_arena_cache();
+    uint8 *in_msg = xdr->in_msg;
+
+    if (cache && !cache->xdr) {
+        cache->xdr = xdr;
+        xdr = NULL;
+    }
+    if (cache && !cache->in_msg) {
+        cache->in_msg = in_msg;
+        in_msg = NULL;
+    }
+    xdr_arena_put(&xdr_arena_xdrs, xdr);
+    xdr_arena_put(&xdr_arena_bufs, in_msg);
+}
+
 xdr_s_type *xdr_init_common(const char *router, int is_client)
 {
-    xdr_s_type *xdr = (xdr_s_type *)calloc(1, sizeof(xdr_s_type)); 
+    xdr_s_type *xdr = xdr_alloc();
+    if (!xdr)
+        return NULL;
 
     xdr->xops = &xdr_std_xops;
 
     xdr->fd = r_open(router);
     if (xdr->fd < 0) {
         E("ERROR OPENING [%s]: %s\n", router, strerror(errno));
-        free(xdr);
+        xdr_free_buffers(xdr);
         return NULL;
     }
     xdr->is_client = is_client;
@@ -299,14 +490,16 @@ xdr_s_type *xdr_init_common(const char *router, int is_client)
 
 xdr_s_type *xdr_clone(xdr_s_type *other)
 {
-    xdr_s_type *xdr = (xdr_s_type *)calloc(1, sizeof(xdr_s_type)); 
+    xdr_s_type *xdr = xdr_alloc();
+    if (!xdr)
+        return NULL;
 
     xdr->xops = &xdr_std_xops;
 
     xdr->fd = dup(other->fd);
     if (xdr->fd < 0) {
         E("ERROR DUPLICATING FD %d: %s\n", other->fd, strerror(errno));
-        free(xdr);
+        xdr_free_buffers(xdr);
         return NULL;
     }
 
@@ -319,9 +512,42 @@ xdr_s_type *xdr_clone(xdr_s_type *other)
     return xdr;
 }
 
+/* Make an XDR for a single outstanding client call.  It shares the fd of
+   the client XDR it was made from, so it must not outlive it. */
+xdr_s_type *xdr_clone_call(xdr_s_type *other)
+{
+    xdr_s_type *xdr = xdr_alloc();
+    if (!xdr)
+        return NULL;
+
+    xdr->xops = other->xops;
+    xdr->fd = other->fd;
+    xdr->x_prog = other->x_prog;
+    xdr->x_vers = other->x_vers;
+    xdr->is_client = other->is_client;
+    return xdr;
+}
+
+void xdr_destroy_call(xdr_s_type *xdr)
+{
+    /* the fd belongs to the client XDR */
+    xdr_free_buffers(xdr);
+}
+
+/* Hand the received message of 'from' to 'to' by swapping input buffers. */
+void xdr_swap_in_msg(xdr_s_type *to, xdr_s_type *from)
+{
+    uint8 *in_msg = to->in_msg;
+    to->in_msg = from->in_msg;
+    from->in_msg = in_msg;
+
+    to->in_len = from->in_len;
+    to->in_next = from->in_next;
+}
+
 void xdr_destroy_common(xdr_s_type *xdr)
 {
     D("CLOSING fd %d\n", xdr->fd);
     r_close(xdr->fd);
-    free(xdr);
+    xdr_free_buffers(xdr);
 }
@@ -0,0 +1,39 @@
+# Copyright (C) 2008 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+LOCAL_PATH := $(call my-dir)
+
+# clnt_call(), svc_dispatch() and callback throughput over the loopback
+# router, on a device and on the host.
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := rpc_benchmark.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_CFLAGS := -fno-short-enums -DRPC_OFFSET=0
+LOCAL_SHARED_LIBRARIES := librpc libcutils liblog
+LOCAL_MODULE := rpc_benchmark
+LOCAL_MODULE_TAGS := eng tests
+include $(BUILD_EXECUTABLE)
+
+ifeq ($(HOST_OS),linux)
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := rpc_benchmark.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_CFLAGS := -fno-short-enums -DRPC_OFFSET=0
+LOCAL_STATIC_LIBRARIES := librpc_host libhaltrace_host libcutils liblog
+LOCAL_LDLIBS += -lpthread -lrt
+LOCAL_MODULE := rpc_benchmark_host
+LOCAL_MODULE_TAGS := eng tests
+include $(BUILD_HOST_EXECUTABLE)
+endif
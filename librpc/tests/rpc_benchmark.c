@@ -0,0 +1,270 @@
+/* Copyright (c) 2011, Code Aurora Forum. */
+
+/*
+ * Throughput and latency of clnt_call(), svc_dispatch() and callback
+ * dispatch over the in-process loopback router, with no modem involved.
+ *
+ * A server and a callback client of a made-up program are registered in
+ * this process.  For every thread count from 1 up to -t, each thread makes
+ * -n calls of each kind:
+ *
+ *   null      a call with no arguments or results
+ *   echo      a call with -w words of arguments, echoed back as results
+ *   callback  a call to the callback program of a client, which librpc
+ *             dispatches through its RX and callback threads
+ *
+ * and the calls per second and round-trip latency percentiles are printed.
+ */
+
+#include <rpc/rpc.h>
+#include <rpc/rpc_router.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PROG      0x3000fe00
+#define BENCH_CB_PROG   (BENCH_PROG | 0x01000000)
+#define BENCH_VERS      0x00010000
+
+#define BENCH_PROC_NULL 0
+#define BENCH_PROC_ECHO 1
+
+#define BENCH_MAX_WORDS 1024
+#define BENCH_MAX_THREADS 32
+
+struct bench_payload {
+    u_int count;
+    uint32 words[BENCH_MAX_WORDS];
+};
+
+static bool_t xdr_bench_payload(XDR *xdr, struct bench_payload *p)
+{
+    if (!xdr_u_int(xdr, &p->count) || p->count > BENCH_MAX_WORDS)
+        return FALSE;
+    if (xdr->x_op == XDR_ENCODE)
+        return XDR_SEND_UINT32_ARRAY(xdr, p->words, p->count);
+    if (xdr->x_op == XDR_DECODE)
+        return XDR_RECV_UINT32_ARRAY(xdr, p->words, p->count);
+    return TRUE;
+}
+
+static void bench_dispatch(struct svc_req *req, SVCXPRT *xprt)
+{
+    struct bench_payload payload;
+
+    switch (req->rq_proc) {
+    case BENCH_PROC_NULL:
+        svc_getargs(xprt, (xdrproc_t)xdr_void, NULL);
+        svc_sendreply(xprt, (xdrproc_t)xdr_void, NULL);
+        break;
+    case BENCH_PROC_ECHO:
+        if (!svc_getargs(xprt, (xdrproc_t)xdr_bench_payload,
+                         (caddr_t)&payload)) {
+            svcerr_decode(xprt);
+            break;
+        }
+        svc_sendreply(xprt, (xdrproc_t)xdr_bench_payload, (caddr_t)&payload);
+        break;
+    default:
+        svcerr_noproc(xprt);
+        break;
+    }
+}
+
+enum bench_kind { BENCH_NULL, BENCH_ECHO, BENCH_CALLBACK };
+
+static const char *bench_names[] = { "null", "echo", "callback" };
+
+static CLIENT *bench_client;    /* of BENCH_PROG */
+static CLIENT *bench_caller;    /* of BENCH_CB_PROG, calls bench_client */
+static int bench_calls = 10000;
+static int bench_words = 64;
+
+struct bench_thread {
+    pthread_t thread;
+    enum bench_kind kind;
+    uint32 *latency_us;
+    int errors;
+};
+
+static uint64 bench_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *bench_thread_main(void *arg)
+{
+    struct bench_thread *t = (struct bench_thread *)arg;
+    struct timeval timeout = { 25, 0 };
+    struct bench_payload *in = calloc(1, sizeof(*in));
+    struct bench_payload *out = calloc(1, sizeof(*out));
+    int i, j;
+
+    if (!in || !out) {
+        t->errors = bench_calls;
+        free(in);
+        free(out);
+        return NULL;
+    }
+    in->count = bench_words;
+    for (j = 0; j < bench_words; j++)
+        in->words[j] = j * 2654435761u;
+
+    for (i = 0; i < bench_calls; i++) {
+        uint64 start = bench_now_us();
+        enum clnt_stat ret;
+
+        switch (t->kind) {
+        case BENCH_ECHO:
+            ret = clnt_call(bench_client, BENCH_PROC_ECHO,
+                            (xdrproc_t)xdr_bench_payload, (caddr_t)in,
+                            (xdrproc_t)xdr_bench_payload, (caddr_t)out,
+                            timeout);
+            if (ret == RPC_SUCCESS &&
+                (out->count != in->count ||
+                 memcmp(out->words, in->words, in->count * 4)))
+                ret = RPC_CANTDECODERES;
+            break;
+        case BENCH_CALLBACK:
+            ret = clnt_call(bench_caller, BENCH_PROC_NULL,
+                            (xdrproc_t)xdr_void, NULL,
+                            (xdrproc_t)xdr_void, NULL, timeout);
+            break;
+        default:
+            ret = clnt_call(bench_client, BENCH_PROC_NULL,
+                            (xdrproc_t)xdr_void, NULL,
+                            (xdrproc_t)xdr_void, NULL, timeout);
+            break;
+        }
+        t->latency_us[i] = bench_now_us() - start;
+        if (ret != RPC_SUCCESS)
+            t->errors++;
+    }
+
+    free(in);
+    free(out);
+    return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    uint32 x = *(const uint32 *)a, y = *(const uint32 *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int bench_run(enum bench_kind kind, int threads)
+{
+    struct bench_thread t[BENCH_MAX_THREADS];
+    int total = threads * bench_calls;
+    uint32 *latency = malloc(total * sizeof(uint32));
+    int i, errors = 0;
+    uint64 start, elapsed;
+
+    if (!latency)
+        return -1;
+
+    start = bench_now_us();
+    for (i = 0; i < threads; i++) {
+        t[i].kind = kind;
+        t[i].latency_us = latency + i * bench_calls;
+        t[i].errors = 0;
+        if (pthread_create(&t[i].thread, NULL, bench_thread_main, &t[i])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(t[i].thread, NULL);
+        errors += t[i].errors;
+    }
+    elapsed = bench_now_us() - start;
+
+    qsort(latency, total, sizeof(uint32), bench_cmp);
+    printf("%-8s %3d %10.0f %8u %8u %8u %8u %6d\n",
+           bench_names[kind], threads,
+           elapsed ? total * 1e6 / elapsed : 0.0,
+           latency[total / 2],
+           latency[(int)(total * 0.90)],
+           latency[(int)(total * 0.99)],
+           latency[total - 1],
+           errors);
+    free(latency);
+    return errors;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-t max_threads] [-n calls_per_thread] "
+            "[-w echo_words] [-p server_workers] [-s]\n"
+            "  -s  also dump the librpc call statistics at the end\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int max_threads = 4, workers = 0, dump_stats = 0;
+    int threads, kind, errors = 0, c;
+    SVCXPRT *xprt;
+
+    while ((c = getopt(argc, argv, "t:n:w:p:s")) != -1) {
+        switch (c) {
+        case 't': max_threads = atoi(optarg); break;
+        case 'n': bench_calls = atoi(optarg); break;
+        case 'w': bench_words = atoi(optarg); break;
+        case 'p': workers = atoi(optarg); break;
+        case 's': dump_stats = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (max_threads < 1 || max_threads > BENCH_MAX_THREADS ||
+        bench_calls < 1 || bench_words < 0 || bench_words > BENCH_MAX_WORDS)
+        usage(argv[0]);
+
+    rpc_router_set_ops(&rpc_router_loopback_ops);
+
+    xprt = svcrtr_create_pool(workers);
+    if (!xprt) {
+        fprintf(stderr, "cannot create the RPC transport\n");
+        return 1;
+    }
+    xprt_register(xprt);
+    if (!svc_register(xprt, BENCH_PROG, BENCH_VERS, bench_dispatch, 0) ||
+        !svc_register(xprt, BENCH_CB_PROG, BENCH_VERS, bench_dispatch, 0)) {
+        fprintf(stderr, "cannot register the benchmark servers\n");
+        return 1;
+    }
+
+    bench_client = clnt_create(NULL, BENCH_PROG, BENCH_VERS, NULL);
+    bench_caller = clnt_create(NULL, BENCH_CB_PROG, BENCH_VERS, NULL);
+    if (!bench_client || !bench_caller) {
+        fprintf(stderr, "cannot create the benchmark clients\n");
+        return 1;
+    }
+
+    printf("%d calls per thread, %d echo words, %d server workers\n",
+           bench_calls, bench_words, workers);
+    printf("%-8s %3s %10s %8s %8s %8s %8s %6s\n",
+           "kind", "thr", "calls/s", "p50 us", "p90 us", "p99 us",
+           "max us", "errors");
+    for (kind = BENCH_NULL; kind <= BENCH_CALLBACK; kind++)
+        for (threads = 1; threads <= max_threads; threads *= 2)
+            errors += bench_run(kind, threads);
+
+    if (dump_stats)
+        rpc_stats_dump(1);
+
+    clnt_destroy(bench_caller);
+    clnt_destroy(bench_client);
+    svc_unregister(xprt, BENCH_CB_PROG, BENCH_VERS);
+    svc_unregister(xprt, BENCH_PROG, BENCH_VERS);
+    xprt_unregister(xprt);
+    return errors ? 1 : 0;
+}
@@ -3,6 +3,33 @@
 
 #define LASTUNSIGNED    ((u_int)((int)0-1))
 
+/* 
+ * Arrays of 32-bit integers are common in generated stubs; rather than going
+ * through the element routine once per entry, move them in one bulk
+ * operation.
+ */
+static bool_t xdr_is_word_proc (xdrproc_t proc, u_int elsize)
+{
+    return elsize == sizeof(uint32) &&
+        (proc == (xdrproc_t) xdr_int || proc == (xdrproc_t) xdr_u_int ||
+         proc == (xdrproc_t) xdr_long || proc == (xdrproc_t) xdr_u_long);
+}
+
+static bool_t xdr_words (XDR *xdr, char *basep, u_int nelem)
+{
+    switch (xdr->x_op) {
+    case XDR_ENCODE:
+        return XDR_SEND_UINT32_ARRAY(xdr, (const uint32 *) basep, nelem);
+    case XDR_DECODE:
+        return XDR_RECV_UINT32_ARRAY(xdr, (uint32 *) basep, nelem);
+    case XDR_FREE:
+        return TRUE;
+    default:
+        break;
+    }
+    return FALSE;
+}
+
 /* 
  * Primitives for stuffing data into and retrieving data from an XDR 
  */
@@ -209,6 +236,9 @@ xdr_vector (XDR *xdrs,
 {
     u_int i;
     char *elptr;
+
+    if (xdr_is_word_proc(xdr_elem, elemsize))
+        return xdr_words(xdrs, basep, nelem);
     
     elptr = basep;
     for (i = 0; i < nelem; i++) {
@@ -377,10 +407,13 @@ xdr_array (XDR *xdrs,
     /*
      * now we xdr each element of array
      */
-    for (i = 0; (i < c) && stat; i++) {
-        stat = (*elproc) (xdrs, target, LASTUNSIGNED);
-        target += elsize;
-    }
+    if (xdr_is_word_proc(elproc, elsize))
+        stat = xdr_words(xdrs, target, c);
+    else
+        for (i = 0; (i < c) && stat; i++) {
+            stat = (*elproc) (xdrs, target, LASTUNSIGNED);
+            target += elsize;
+        }
 
     /*
      * the array may need freeing
@@ -14,47 +14,82 @@
  * limitations under the License.
  */
 
+#define LOG_TAG "QComOMXPlugin"
+#include <utils/Log.h>
+
 #include "QComOMXPlugin.h"
 
 #include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <cutils/properties.h>
 #include <media/stagefright/HardwareAPI.h>
 #include <media/stagefright/MediaDebug.h>
 
 namespace android {
 
+// Pooled instances get these until they're handed out again, so events
+// raised after the owner let go of them go nowhere.
+static OMX_ERRORTYPE idleEventHandler(
+        OMX_HANDLETYPE, OMX_PTR, OMX_EVENTTYPE, OMX_U32, OMX_U32, OMX_PTR) {
+    return OMX_ErrorNone;
+}
+
+static OMX_ERRORTYPE idleBufferDone(
+        OMX_HANDLETYPE, OMX_PTR, OMX_BUFFERHEADERTYPE *) {
+    return OMX_ErrorNone;
+}
+
+static OMX_CALLBACKTYPE sIdleCallbacks = {
+    idleEventHandler, idleBufferDone, idleBufferDone
+};
+
 OMXPluginBase *createOMXPlugin() {
     return new QComOMXPlugin;
 }
 
 QComOMXPlugin::QComOMXPlugin()
-    : mLibHandle(dlopen("libOmxCore.so", RTLD_NOW)),
+    : mInitialized(false),
+      mLibHandle(NULL),
       mInit(NULL),
       mDeinit(NULL),
       mComponentNameEnum(NULL),
       mGetHandle(NULL),
       mFreeHandle(NULL),
-      mGetRolesOfComponentHandle(NULL) {
-    if (mLibHandle != NULL) {
-        mInit = (InitFunc)dlsym(mLibHandle, "OMX_Init");
-        mDeinit = (DeinitFunc)dlsym(mLibHandle, "OMX_DeInit");
-
-        mComponentNameEnum =
-            (ComponentNameEnumFunc)dlsym(mLibHandle, "OMX_ComponentNameEnum");
-
-        mGetHandle = (GetHandleFunc)dlsym(mLibHandle, "OMX_GetHandle");
-        mFreeHandle = (FreeHandleFunc)dlsym(mLibHandle, "OMX_FreeHandle");
-
-        mGetRolesOfComponentHandle =
-            (GetRolesOfComponentFunc)dlsym(
-                    mLibHandle, "OMX_GetRolesOfComponent");
+      mGetRolesOfComponentHandle(NULL),
+      mHaveComponentNames(false),
+      mPoolSize(0),
+      mPoolIdleMs(0) {
+    char value[PROPERTY_VALUE_MAX];
 
-        (*mInit)();
-    }
+    // off unless asked for, idle decoders hold on to codec resources
+    property_get("media.qcom.omx.pool", value, "0");
+    int poolSize = atoi(value);
+    mPoolSize = poolSize > 0 ? poolSize : 0;
+    property_get("media.qcom.omx.pool_idle_ms", value, "5000");
+    mPoolIdleMs = atoi(value);
 }
 
 QComOMXPlugin::~QComOMXPlugin() {
+    if (mReaper != NULL) {
+        {
+            // under the lock so the reaper can't miss the wakeup
+            Mutex::Autolock autoLock(mLock);
+            mReaper->requestExit();
+            mPoolChanged.signal();
+        }
+        mReaper->requestExitAndWait();
+        mReaper.clear();
+    }
+
     if (mLibHandle != NULL) {
+        for (size_t i = 0; i < mPool.size(); ++i) {
+            (*mFreeHandle)(
+                    reinterpret_cast<OMX_HANDLETYPE *>(mPool[i].mComponent));
+        }
+        mPool.clear();
+
         (*mDeinit)();
 
         dlclose(mLibHandle);
@@ -62,27 +97,197 @@ QComOMXPlugin::~QComOMXPlugin() {
     }
 }
 
+bool QComOMXPlugin::ensureInitialized() {
+    if (mInitialized) {
+        return mLibHandle != NULL;
+    }
+    mInitialized = true;
+
+    mLibHandle = dlopen("libOmxCore.so", RTLD_NOW);
+    if (mLibHandle == NULL) {
+        LOGE("unable to load libOmxCore.so (%s)", dlerror());
+        return false;
+    }
+
+    mInit = (InitFunc)dlsym(mLibHandle, "OMX_Init");
+    mDeinit = (DeinitFunc)dlsym(mLibHandle, "OMX_DeInit");
+
+    mComponentNameEnum =
+        (ComponentNameEnumFunc)dlsym(mLibHandle, "OMX_ComponentNameEnum");
+
+    mGetHandle = (GetHandleFunc)dlsym(mLibHandle, "OMX_GetHandle");
+    mFreeHandle = (FreeHandleFunc)dlsym(mLibHandle, "OMX_FreeHandle");
+
+    mGetRolesOfComponentHandle =
+        (GetRolesOfComponentFunc)dlsym(
+                mLibHandle, "OMX_GetRolesOfComponent");
+
+    (*mInit)();
+
+    return true;
+}
+
+void QComOMXPlugin::loadComponentNames() {
+    if (mHaveComponentNames) {
+        return;
+    }
+    mHaveComponentNames = true;
+
+    char name[OMX_MAX_STRINGNAME_SIZE];
+    for (OMX_U32 index = 0;
+            (*mComponentNameEnum)(name, sizeof(name), index) == OMX_ErrorNone;
+            ++index) {
+        mComponentNames.push(String8(name));
+    }
+}
+
+OMX_COMPONENTTYPE *QComOMXPlugin::takePooledInstance(
+        const char *name,
+        const OMX_CALLBACKTYPE *callbacks,
+        OMX_PTR appData) {
+    // newest first, it has been idle for the least time
+    for (size_t i = mPool.size(); i-- > 0;) {
+        if (strcmp(mPool[i].mName.string(), name)) {
+            continue;
+        }
+        OMX_COMPONENTTYPE *component = mPool[i].mComponent;
+        mPool.removeAt(i);
+
+        OMX_ERRORTYPE err = component->SetCallbacks(
+                component, const_cast<OMX_CALLBACKTYPE *>(callbacks), appData);
+        if (err != OMX_ErrorNone) {
+            LOGE("cannot reuse %s (%d)", name, err);
+            (*mFreeHandle)(reinterpret_cast<OMX_HANDLETYPE *>(component));
+            return NULL;
+        }
+        LOGV("reusing pooled %s", name);
+        return component;
+    }
+    return NULL;
+}
+
+bool QComOMXPlugin::poolInstance(OMX_COMPONENTTYPE *component) {
+    ssize_t index = mInstanceNames.indexOfKey(component);
+    if (index < 0) {
+        return false;
+    }
+    String8 name = mInstanceNames.valueAt(index);
+    mInstanceNames.removeItemsAt(index);
+
+    // only decoders are worth keeping, and only if nobody has to wait on
+    // a state change before the next owner can configure them
+    if (mPoolSize == 0 || strstr(name.string(), ".decoder.") == NULL) {
+        return false;
+    }
+
+    OMX_STATETYPE state;
+    if (component->GetState(component, &state) != OMX_ErrorNone
+            || state != OMX_StateLoaded) {
+        return false;
+    }
+
+    if (component->SetCallbacks(component, &sIdleCallbacks, NULL)
+            != OMX_ErrorNone) {
+        return false;
+    }
+
+    if (mPool.size() >= mPoolSize) {
+        // make room by dropping the one idle the longest
+        (*mFreeHandle)(reinterpret_cast<OMX_HANDLETYPE *>(mPool[0].mComponent));
+        mPool.removeAt(0);
+    }
+
+    PooledInstance instance;
+    instance.mName = name;
+    instance.mComponent = component;
+    instance.mReleasedAt = systemTime();
+    mPool.push(instance);
+
+    if (mReaper == NULL) {
+        mReaper = new Reaper(this);
+        if (mReaper->run("OMXPoolReaper", PRIORITY_BACKGROUND) != OK) {
+            // freed by the next make or destroy after their time instead
+            LOGW("cannot start the pool reaper");
+            mReaper.clear();
+        }
+    }
+    mPoolChanged.signal();
+
+    LOGV("pooled %s, %d idle", name.string(), (int)mPool.size());
+    return true;
+}
+
+void QComOMXPlugin::expirePooledInstances(nsecs_t now) {
+    // mPool is in release order, so expired ones are at the front
+    while (!mPool.isEmpty()
+            && now - mPool[0].mReleasedAt >= milliseconds(mPoolIdleMs)) {
+        LOGV("freeing idle %s", mPool[0].mName.string());
+        (*mFreeHandle)(reinterpret_cast<OMX_HANDLETYPE *>(mPool[0].mComponent));
+        mPool.removeAt(0);
+    }
+}
+
+bool QComOMXPlugin::Reaper::threadLoop() {
+    Mutex::Autolock autoLock(mPlugin->mLock);
+    if (exitPending()) {
+        return false;
+    }
+
+    nsecs_t now = systemTime();
+    mPlugin->expirePooledInstances(now);
+    if (mPlugin->mPool.isEmpty()) {
+        mPlugin->mPoolChanged.wait(mPlugin->mLock);
+    } else {
+        // the front of the pool is the next one to expire
+        mPlugin->mPoolChanged.waitRelative(mPlugin->mLock,
+                mPlugin->mPool[0].mReleasedAt
+                + milliseconds(mPlugin->mPoolIdleMs) - now);
+    }
+    return true;
+}
+
 OMX_ERRORTYPE QComOMXPlugin::makeComponentInstance(
         const char *name,
         const OMX_CALLBACKTYPE *callbacks,
         OMX_PTR appData,
         OMX_COMPONENTTYPE **component) {
-    if (mLibHandle == NULL) {
+    Mutex::Autolock autoLock(mLock);
+    if (!ensureInitialized()) {
         return OMX_ErrorUndefined;
     }
 
-    return (*mGetHandle)(
-            reinterpret_cast<OMX_HANDLETYPE *>(component),
-            const_cast<char *>(name),
-            appData, const_cast<OMX_CALLBACKTYPE *>(callbacks));
+    expirePooledInstances(systemTime());
+
+    *component = takePooledInstance(name, callbacks, appData);
+    if (*component == NULL) {
+        OMX_ERRORTYPE err = (*mGetHandle)(
+                reinterpret_cast<OMX_HANDLETYPE *>(component),
+                const_cast<char *>(name),
+                appData, const_cast<OMX_CALLBACKTYPE *>(callbacks));
+        if (err != OMX_ErrorNone) {
+            return err;
+        }
+    }
+
+    if (mPoolSize > 0) {
+        mInstanceNames.add(*component, String8(name));
+    }
+
+    return OMX_ErrorNone;
 }
 
 OMX_ERRORTYPE QComOMXPlugin::destroyComponentInstance(
         OMX_COMPONENTTYPE *component) {
-    if (mLibHandle == NULL) {
+    Mutex::Autolock autoLock(mLock);
+    if (!ensureInitialized()) {
         return OMX_ErrorUndefined;
     }
 
+    if (poolInstance(component)) {
+        expirePooledInstances(systemTime());
+        return OMX_ErrorNone;
+    }
+
     return (*mFreeHandle)(reinterpret_cast<OMX_HANDLETYPE *>(component));
 }
 
@@ -90,11 +295,24 @@ OMX_ERRORTYPE QComOMXPlugin::enumerateComponents(
         OMX_STRING name,
         size_t size,
         OMX_U32 index) {
-    if (mLibHandle == NULL) {
+    Mutex::Autolock autoLock(mLock);
+    if (!ensureInitialized()) {
         return OMX_ErrorUndefined;
     }
 
-    return (*mComponentNameEnum)(name, size, index);
+    loadComponentNames();
+
+    if (index >= mComponentNames.size()) {
+        return OMX_ErrorNoMore;
+    }
+
+    const String8 &component = mComponentNames.itemAt(index);
+    if (component.length() >= size) {
+        return OMX_ErrorBadParameter;
+    }
+    strcpy(name, component.string());
+
+    return OMX_ErrorNone;
 }
 
 OMX_ERRORTYPE QComOMXPlugin::getRolesOfComponent(
@@ -102,10 +320,17 @@ OMX_ERRORTYPE QComOMXPlugin::getRolesOfComponent(
         Vector<String8> *roles) {
     roles->clear();
 
-    if (mLibHandle == NULL) {
+    Mutex::Autolock autoLock(mLock);
+    if (!ensureInitialized()) {
         return OMX_ErrorUndefined;
     }
 
+    ssize_t cached = mRoles.indexOfKey(String8(name));
+    if (cached >= 0) {
+        *roles = mRoles.valueAt(cached);
+        return OMX_ErrorNone;
+    }
+
     OMX_U32 numRoles;
     OMX_ERRORTYPE err = (*mGetRolesOfComponentHandle)(
             const_cast<OMX_STRING>(name), &numRoles, NULL);
@@ -115,9 +340,11 @@ OMX_ERRORTYPE QComOMXPlugin::getRolesOfComponent(
     }
 
     if (numRoles > 0) {
+        // one block for all the names, only needed until they're copied
         OMX_U8 **array = new OMX_U8 *[numRoles];
+        OMX_U8 *names = new OMX_U8[numRoles * OMX_MAX_STRINGNAME_SIZE];
         for (OMX_U32 i = 0; i < numRoles; ++i) {
-            array[i] = new OMX_U8[OMX_MAX_STRINGNAME_SIZE];
+            array[i] = names + i * OMX_MAX_STRINGNAME_SIZE;
         }
 
         OMX_U32 numRoles2;
@@ -130,15 +357,17 @@ OMX_ERRORTYPE QComOMXPlugin::getRolesOfComponent(
         for (OMX_U32 i = 0; i < numRoles; ++i) {
             String8 s((const char *)array[i]);
             roles->push(s);
-
-            delete[] array[i];
-            array[i] = NULL;
         }
 
+        delete[] names;
+        names = NULL;
+
         delete[] array;
         array = NULL;
     }
 
+    mRoles.add(String8(name), *roles);
+
     return OMX_ErrorNone;
 }
 
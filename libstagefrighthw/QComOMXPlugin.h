@@ -19,6 +19,9 @@
 #define QCOM_OMX_PLUGIN_H_
 
 #include <media/stagefright/OMXPluginBase.h>
+#include <utils/KeyedVector.h>
+#include <utils/threads.h>
+#include <utils/Timers.h>
 
 namespace android {
 
@@ -45,6 +48,40 @@ struct QComOMXPlugin : public OMXPluginBase {
             Vector<String8> *roles);
 
 private:
+    // Loads libOmxCore.so and calls OMX_Init the first time a component
+    // is needed, so mediaserver does not pay for it at startup.
+    bool ensureInitialized();
+    void loadComponentNames();
+
+    // Idle decoders kept in Loaded state for the next request with the
+    // same name, up to mPoolSize of them and for mPoolIdleMs each.  The
+    // reaper frees them when their time is up, even if no other component
+    // is made or destroyed in the meantime.
+    struct PooledInstance {
+        String8 mName;
+        OMX_COMPONENTTYPE *mComponent;
+        nsecs_t mReleasedAt;
+    };
+
+    OMX_COMPONENTTYPE *takePooledInstance(
+            const char *name,
+            const OMX_CALLBACKTYPE *callbacks,
+            OMX_PTR appData);
+    bool poolInstance(OMX_COMPONENTTYPE *component);
+    void expirePooledInstances(nsecs_t now);
+
+    struct Reaper : public Thread {
+        Reaper(QComOMXPlugin *plugin) : Thread(false), mPlugin(plugin) {}
+
+    private:
+        virtual bool threadLoop();
+
+        QComOMXPlugin *mPlugin;
+    };
+    friend struct Reaper;
+
+    Mutex mLock;
+    bool mInitialized;
     void *mLibHandle;
 
     typedef OMX_ERRORTYPE (*InitFunc)();
@@ -67,6 +104,18 @@ private:
     FreeHandleFunc mFreeHandle;
     GetRolesOfComponentFunc mGetRolesOfComponentHandle;
 
+    // Names and roles don't change once the core is loaded.
+    bool mHaveComponentNames;
+    Vector<String8> mComponentNames;
+    KeyedVector<String8, Vector<String8> > mRoles;
+
+    size_t mPoolSize;
+    int mPoolIdleMs;
+    Vector<PooledInstance> mPool;
+    sp<Reaper> mReaper;
+    Condition mPoolChanged;
+    KeyedVector<OMX_COMPONENTTYPE *, String8> mInstanceNames;
+
     QComOMXPlugin(const QComOMXPlugin &);
     QComOMXPlugin &operator=(const QComOMXPlugin &);
 };